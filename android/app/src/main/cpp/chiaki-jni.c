@@ -265,7 +265,7 @@ JNIEXPORT void JNICALL JNI_FCN(sessionCreate)(JNIEnv *env, jobject obj, jobject
 	err = android_chiaki_video_decoder_init(&session->video_decoder, log, connect_info.video_profile.width, connect_info.video_profile.height);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(session);
+		chiaki_free(session);
 		session = NULL;
 		goto beach;
 	}
@@ -274,7 +274,7 @@ JNIEXPORT void JNICALL JNI_FCN(sessionCreate)(JNIEnv *env, jobject obj, jobject
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		android_chiaki_video_decoder_fini(&session->video_decoder);
-		free(session);
+		chiaki_free(session);
 		session = NULL;
 		goto beach;
 	}
@@ -290,7 +290,7 @@ JNIEXPORT void JNICALL JNI_FCN(sessionCreate)(JNIEnv *env, jobject obj, jobject
 		android_chiaki_video_decoder_fini(&session->video_decoder);
 		android_chiaki_audio_decoder_fini(&session->audio_decoder);
 		android_chiaki_audio_output_free(session->audio_output);
-		free(session);
+		chiaki_free(session);
 		session = NULL;
 		goto beach;
 	}
@@ -344,7 +344,7 @@ JNIEXPORT void JNICALL JNI_FCN(sessionFree)(JNIEnv *env, jobject obj, jlong ptr)
 	CHIAKI_LOGI(session->log, "JNI Session has quit");
 	android_chiaki_file_log_fini(session->log);
 	free(session->log);
-	free(session);
+	chiaki_free(session);
 }
 
 JNIEXPORT jint JNICALL JNI_FCN(sessionStart)(JNIEnv *env, jobject obj, jlong ptr)
@@ -565,12 +565,12 @@ JNIEXPORT void JNICALL JNI_FCN(discoveryServiceCreate)(JNIEnv *env, jobject obj,
 		E->DeleteGlobalRef(env, service->host_state_standby);
 		E->DeleteGlobalRef(env, service->host_state_ready);
 		E->DeleteGlobalRef(env, service->host_class);
-		free(service);
+		chiaki_free(service);
 		goto beach;
 	}
 
 beach:
-	free(options.send_addr);
+	chiaki_free(options.send_addr);
 	E->SetIntField(env, result, E->GetFieldID(env, result_class, "errorCode", "I"), (jint)err);
 	E->SetLongField(env, result, E->GetFieldID(env, result_class, "ptr", "J"), (jlong)service);
 }
@@ -586,7 +586,7 @@ JNIEXPORT void JNICALL JNI_FCN(discoveryServiceFree)(JNIEnv *env, jobject obj, j
 	E->DeleteGlobalRef(env, service->host_state_standby);
 	E->DeleteGlobalRef(env, service->host_state_ready);
 	E->DeleteGlobalRef(env, service->host_class);
-	free(service);
+	chiaki_free(service);
 }
 
 JNIEXPORT jint JNICALL JNI_FCN(discoveryServiceWakeup)(JNIEnv *env, jobject obj, jlong ptr, jstring host_string, jlong user_credential)
@@ -726,7 +726,7 @@ JNIEXPORT void JNICALL JNI_FCN(registStart)(JNIEnv *env, jobject obj, jobject re
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		android_chiaki_regist_fini_partial(env, regist);
-		free(regist);
+		chiaki_free(regist);
 		regist = NULL;
 	}
 
@@ -746,5 +746,5 @@ JNIEXPORT void JNICALL JNI_FCN(registFree)(JNIEnv *env, jobject obj, jlong ptr)
 	AndroidChiakiRegist *regist = (AndroidChiakiRegist *)ptr;
 	chiaki_regist_fini(&regist->regist);
 	android_chiaki_regist_fini_partial(env, regist);
-	free(regist);
+	chiaki_free(regist);
 }
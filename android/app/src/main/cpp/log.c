@@ -135,9 +135,8 @@ void android_chiaki_jni_log_init(AndroidChiakiJNILog *log, JNIEnv *env, jobject
 	log->java_log = E->NewGlobalRef(env, java_log);
 	jclass log_class = E->GetObjectClass(env, log->java_log);
 	log->java_log_meth = E->GetMethodID(env, log_class, "log", "(ILjava/lang/String;)V");
-	log->log.level_mask = (uint32_t)E->GetIntField(env, log->java_log, E->GetFieldID(env, log_class, "levelMask", "I"));
-	log->log.cb = android_chiaki_log_cb;
-	log->log.user = log;
+	uint32_t level_mask = (uint32_t)E->GetIntField(env, log->java_log, E->GetFieldID(env, log_class, "levelMask", "I"));
+	chiaki_log_init(&log->log, level_mask, android_chiaki_log_cb, log);
 }
 
 void android_chiaki_jni_log_fini(AndroidChiakiJNILog *log, JNIEnv *env)
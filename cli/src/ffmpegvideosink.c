@@ -0,0 +1,130 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "streamsink.h"
+
+#if CHIAKI_CLI_ENABLE_FFMPEG
+
+#include <libavcodec/avcodec.h>
+
+#include <stdlib.h>
+
+typedef struct video_sink_ffmpeg_t
+{
+	ChiakiCliVideoSink *sink;
+	ChiakiLog *log;
+	AVCodecContext *codec_context;
+	AVPacket *packet;
+	AVFrame *frame;
+} VideoSinkFFmpeg;
+
+static void video_sink_ffmpeg_receive_frames(VideoSinkFFmpeg *ffmpeg)
+{
+	while(true)
+	{
+		int r = avcodec_receive_frame(ffmpeg->codec_context, ffmpeg->frame);
+		if(r != 0)
+		{
+			if(r != AVERROR(EAGAIN))
+				CHIAKI_LOGE(ffmpeg->log, "CLI FFmpeg Video Sink decoding failed");
+			return;
+		}
+		ffmpeg->sink->frames_output++;
+		av_frame_unref(ffmpeg->frame);
+	}
+}
+
+static bool video_sink_ffmpeg_sample(uint8_t *buf, size_t buf_size, void *user)
+{
+	VideoSinkFFmpeg *ffmpeg = user;
+	ffmpeg->packet->data = buf;
+	ffmpeg->packet->size = (int)buf_size;
+	int r = avcodec_send_packet(ffmpeg->codec_context, ffmpeg->packet);
+	if(r == AVERROR(EAGAIN))
+	{
+		// decoded frames must be taken out before the packet fits
+		video_sink_ffmpeg_receive_frames(ffmpeg);
+		r = avcodec_send_packet(ffmpeg->codec_context, ffmpeg->packet);
+	}
+	if(r != 0)
+	{
+		char errbuf[128];
+		av_make_error_string(errbuf, sizeof(errbuf), r);
+		CHIAKI_LOGE(ffmpeg->log, "CLI FFmpeg Video Sink failed to push frame: %s", errbuf);
+		return false;
+	}
+	video_sink_ffmpeg_receive_frames(ffmpeg);
+	return true;
+}
+
+static void video_sink_ffmpeg_fini(void *user)
+{
+	VideoSinkFFmpeg *ffmpeg = user;
+	av_frame_free(&ffmpeg->frame);
+	av_packet_free(&ffmpeg->packet);
+	avcodec_free_context(&ffmpeg->codec_context);
+	free(ffmpeg);
+}
+
+ChiakiErrorCode chiaki_cli_video_sink_init_ffmpeg(ChiakiCliVideoSink *sink, ChiakiLog *log)
+{
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 10, 100)
+	avcodec_register_all();
+#endif
+	const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if(!codec)
+	{
+		CHIAKI_LOGE(log, "CLI FFmpeg Video Sink: H264 Codec not available");
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	VideoSinkFFmpeg *ffmpeg = calloc(1, sizeof(VideoSinkFFmpeg));
+	if(!ffmpeg)
+		return CHIAKI_ERR_MEMORY;
+	ffmpeg->sink = sink;
+	ffmpeg->log = log;
+
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
+	ffmpeg->codec_context = avcodec_alloc_context3(codec);
+	if(!ffmpeg->codec_context)
+		goto error;
+	ffmpeg->packet = av_packet_alloc();
+	if(!ffmpeg->packet)
+		goto error;
+	ffmpeg->frame = av_frame_alloc();
+	if(!ffmpeg->frame)
+		goto error;
+
+	if(avcodec_open2(ffmpeg->codec_context, codec, NULL) < 0)
+	{
+		CHIAKI_LOGE(log, "CLI FFmpeg Video Sink failed to open codec context");
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error;
+	}
+
+	sink->user = ffmpeg;
+	sink->sample_cb = video_sink_ffmpeg_sample;
+	sink->fini_cb = video_sink_ffmpeg_fini;
+	sink->frames_output = 0;
+	return CHIAKI_ERR_SUCCESS;
+
+error:
+	video_sink_ffmpeg_fini(ffmpeg);
+	return err;
+}
+
+#endif
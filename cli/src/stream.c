@@ -0,0 +1,718 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki-cli.h>
+
+#include "streamsink.h"
+
+#include <chiaki/session.h>
+#include <chiaki/base64.h>
+#include <chiaki/time.h>
+#include <chiaki/allocator.h>
+
+#include <argp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char doc[] =
+	"Run a headless stream session for soak tests and profiling."
+	"\v"
+	"Video sinks:\n"
+	"  null      Drop all frames (default)\n"
+#if CHIAKI_CLI_ENABLE_FFMPEG
+	"  ffmpeg    Decode in software with FFmpeg, then drop the decoded frames\n"
+#endif
+	"  dump      Write the H.264 stream to --video-out\n"
+	"Audio sinks:\n"
+	"  none      Don't decode audio (default)\n"
+#if CHIAKI_LIB_ENABLE_OPUS
+	"  null      Decode, then drop the samples\n"
+	"  wav       Decode and write to --audio-out\n"
+#endif
+	"Thread roles for --thread, sinks run on the network thread:\n"
+	"  network   Takion receive and send threads\n"
+	"  crypto    Key stream generation\n"
+	"  input     Feedback sender\n"
+	"Thread attributes are given as PRIORITY[=REALTIME_PRIORITY][:CPUS],\n"
+	"with PRIORITY one of default, low, high or realtime, e.g. realtime=20:2,3\n"
+	;
+
+#define ARG_KEY_HOST 'h'
+#define ARG_KEY_REGISTKEY 'r'
+#define ARG_KEY_MORNING 'm'
+#define ARG_KEY_PIN 'p'
+#define ARG_KEY_RESOLUTION 'R'
+#define ARG_KEY_FPS 'f'
+#define ARG_KEY_DURATION 'd'
+#define ARG_KEY_VIDEO 'V'
+#define ARG_KEY_VIDEO_OUT 'o'
+#define ARG_KEY_AUDIO 'A'
+#define ARG_KEY_AUDIO_OUT 'w'
+#define ARG_KEY_STATS_INTERVAL 's'
+#define ARG_KEY_RECORD 0x100
+#define ARG_KEY_SENKUSHA_CACHE 0x101
+#define ARG_KEY_MTU_LADDER 0x102
+#define ARG_KEY_ACK_DELAY 0x103
+#define ARG_KEY_SEND_BATCH 0x104
+#define ARG_KEY_THREAD 0x105
+#define ARG_KEY_ALLOC_STATS 0x106
+#define ARG_KEY_MUTEX_PROFILE 0x107
+
+static struct argp_option options[] = {
+	{ "host", ARG_KEY_HOST, "Host", 0, "Host to connect to", 0 },
+	{ "registkey", ARG_KEY_REGISTKEY, "RegistKey", 0, "PS4 registration key", 0 },
+	{ "morning", ARG_KEY_MORNING, "Morning", 0, "Morning from the registration, base64 encoded", 0 },
+	{ "pin", ARG_KEY_PIN, "PIN", 0, "Login PIN, if the console requests one", 0 },
+	{ "resolution", ARG_KEY_RESOLUTION, "Resolution", 0, "360, 540, 720 (default) or 1080", 0 },
+	{ "fps", ARG_KEY_FPS, "FPS", 0, "30 or 60 (default)", 0 },
+	{ "duration", ARG_KEY_DURATION, "Seconds", 0, "Stop after this time, 0 (default) to run until interrupted", 0 },
+	{ "video", ARG_KEY_VIDEO, "Sink", 0, "Video sink, see below", 0 },
+	{ "video-out", ARG_KEY_VIDEO_OUT, "File", 0, "Output file of the dump video sink", 0 },
+	{ "audio", ARG_KEY_AUDIO, "Sink", 0, "Audio sink, see below", 0 },
+	{ "audio-out", ARG_KEY_AUDIO_OUT, "File", 0, "Output file of the wav audio sink", 0 },
+	{ "record", ARG_KEY_RECORD, "File", 0, "Record the stream to a Matroska file without re-encoding", 0 },
+	{ "senkusha-cache", ARG_KEY_SENKUSHA_CACHE, "File", 0, "Load and save Senkusha results to connect faster next time", 0 },
+	{ "mtu-ladder", ARG_KEY_MTU_LADDER, NULL, 0, "Probe many MTUs at once instead of a binary search", 0 },
+	{ "send-batch", ARG_KEY_SEND_BATCH, "Milliseconds", 0, "Send datagrams in batches, collected for up to this time (0 to only batch while sending is busy)", 0 },
+	{ "thread", ARG_KEY_THREAD, "Role=Attributes", 0, "Set priority and CPU affinity of the threads with a role, see below", 0 },
+	{ "ack-delay", ARG_KEY_ACK_DELAY, "Milliseconds", 0, "Acknowledge stream data cumulatively after at most this delay, 0 (default) to ack every chunk", 0 },
+	{ "alloc-stats", ARG_KEY_ALLOC_STATS, "Seconds", 0, "Count heap allocations per call site, starting this long after the first frame, and log them at the end", 0 },
+	{ "mutex-profile", ARG_KEY_MUTEX_PROFILE, NULL, 0, "Log the contention of every mutex at the end, needs a build with CHIAKI_LIB_ENABLE_MUTEX_PROFILING", 0 },
+	{ "stats-interval", ARG_KEY_STATS_INTERVAL, "Seconds", 0, "Print stats periodically, 0 to only print them at the end (default 1)", 0 },
+	{ 0 }
+};
+
+typedef enum {
+	VIDEO_SINK_NULL,
+	VIDEO_SINK_FFMPEG,
+	VIDEO_SINK_DUMP
+} VideoSinkType;
+
+typedef enum {
+	AUDIO_SINK_NONE,
+	AUDIO_SINK_NULL,
+	AUDIO_SINK_WAV
+} AudioSinkType;
+
+typedef struct arguments
+{
+	const char *host;
+	const char *registkey;
+	const char *morning;
+	const char *pin;
+	ChiakiVideoResolutionPreset resolution;
+	ChiakiVideoFPSPreset fps;
+	unsigned long duration_s;
+	VideoSinkType video_sink;
+	const char *video_out;
+	AudioSinkType audio_sink;
+	const char *audio_out;
+	const char *record;
+	const char *senkusha_cache;
+	bool mtu_ladder;
+	unsigned long ack_delay_ms;
+	bool send_batch;
+	unsigned long send_batch_window_ms;
+	ChiakiThreadAttr thread_attrs[CHIAKI_THREAD_ROLE_COUNT];
+	bool alloc_stats;
+	unsigned long alloc_stats_warmup_s;
+	bool mutex_profile;
+	unsigned long stats_interval_s;
+} Arguments;
+
+static bool parse_ulong(const char *arg, unsigned long *out)
+{
+	char *end;
+	unsigned long v = strtoul(arg, &end, 10);
+	if(!*arg || *end)
+		return false;
+	*out = v;
+	return true;
+}
+
+static bool parse_thread_attr(const char *arg, Arguments *arguments)
+{
+	const char *attr_str = strchr(arg, '=');
+	if(!attr_str)
+		return false;
+	static const ChiakiThreadRole roles[] = { CHIAKI_THREAD_ROLE_NETWORK, CHIAKI_THREAD_ROLE_CRYPTO, CHIAKI_THREAD_ROLE_INPUT };
+	for(size_t i=0; i<sizeof(roles) / sizeof(roles[0]); i++)
+	{
+		const char *name = chiaki_thread_role_string(roles[i]);
+		if(strlen(name) != (size_t)(attr_str - arg) || strncmp(arg, name, attr_str - arg))
+			continue;
+		return chiaki_thread_attr_parse(&arguments->thread_attrs[roles[i]], attr_str + 1) == CHIAKI_ERR_SUCCESS;
+	}
+	return false;
+}
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+
+	switch(key)
+	{
+		case ARG_KEY_HOST:
+			arguments->host = arg;
+			break;
+		case ARG_KEY_REGISTKEY:
+			arguments->registkey = arg;
+			break;
+		case ARG_KEY_MORNING:
+			arguments->morning = arg;
+			break;
+		case ARG_KEY_PIN:
+			arguments->pin = arg;
+			break;
+		case ARG_KEY_RESOLUTION:
+			if(strcmp(arg, "360") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+			else if(strcmp(arg, "540") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+			else if(strcmp(arg, "720") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+			else if(strcmp(arg, "1080") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_1080p;
+			else
+				argp_usage(state);
+			break;
+		case ARG_KEY_FPS:
+			if(strcmp(arg, "30") == 0)
+				arguments->fps = CHIAKI_VIDEO_FPS_PRESET_30;
+			else if(strcmp(arg, "60") == 0)
+				arguments->fps = CHIAKI_VIDEO_FPS_PRESET_60;
+			else
+				argp_usage(state);
+			break;
+		case ARG_KEY_DURATION:
+			if(!parse_ulong(arg, &arguments->duration_s))
+				argp_usage(state);
+			break;
+		case ARG_KEY_VIDEO:
+			if(strcmp(arg, "null") == 0)
+				arguments->video_sink = VIDEO_SINK_NULL;
+#if CHIAKI_CLI_ENABLE_FFMPEG
+			else if(strcmp(arg, "ffmpeg") == 0)
+				arguments->video_sink = VIDEO_SINK_FFMPEG;
+#endif
+			else if(strcmp(arg, "dump") == 0)
+				arguments->video_sink = VIDEO_SINK_DUMP;
+			else
+				argp_usage(state);
+			break;
+		case ARG_KEY_VIDEO_OUT:
+			arguments->video_out = arg;
+			break;
+		case ARG_KEY_AUDIO:
+			if(strcmp(arg, "none") == 0)
+				arguments->audio_sink = AUDIO_SINK_NONE;
+#if CHIAKI_LIB_ENABLE_OPUS
+			else if(strcmp(arg, "null") == 0)
+				arguments->audio_sink = AUDIO_SINK_NULL;
+			else if(strcmp(arg, "wav") == 0)
+				arguments->audio_sink = AUDIO_SINK_WAV;
+#endif
+			else
+				argp_usage(state);
+			break;
+		case ARG_KEY_AUDIO_OUT:
+			arguments->audio_out = arg;
+			break;
+		case ARG_KEY_RECORD:
+			arguments->record = arg;
+			break;
+		case ARG_KEY_SENKUSHA_CACHE:
+			arguments->senkusha_cache = arg;
+			break;
+		case ARG_KEY_MTU_LADDER:
+			arguments->mtu_ladder = true;
+			break;
+		case ARG_KEY_ACK_DELAY:
+			if(!parse_ulong(arg, &arguments->ack_delay_ms))
+				argp_usage(state);
+			break;
+		case ARG_KEY_SEND_BATCH:
+			if(!parse_ulong(arg, &arguments->send_batch_window_ms))
+				argp_usage(state);
+			arguments->send_batch = true;
+			break;
+		case ARG_KEY_THREAD:
+			if(!parse_thread_attr(arg, arguments))
+				argp_usage(state);
+			break;
+		case ARG_KEY_ALLOC_STATS:
+			if(!parse_ulong(arg, &arguments->alloc_stats_warmup_s))
+				argp_usage(state);
+			arguments->alloc_stats = true;
+			break;
+		case ARG_KEY_MUTEX_PROFILE:
+			arguments->mutex_profile = true;
+			break;
+		case ARG_KEY_STATS_INTERVAL:
+			if(!parse_ulong(arg, &arguments->stats_interval_s))
+				argp_usage(state);
+			break;
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, 0, doc, 0, 0, 0 };
+
+typedef struct stream_stats_t
+{
+	uint64_t samples; // video samples received from the session
+	uint64_t bytes;
+	uint64_t frames_output; // frames decoded or written by the video sink
+	uint64_t audio_samples;
+} StreamStats;
+
+typedef struct stream_t
+{
+	ChiakiLog *log;
+	ChiakiCliVideoSink video_sink;
+#if CHIAKI_LIB_ENABLE_OPUS
+	ChiakiCliAudioOutput audio_output;
+	ChiakiAudioSink audio_output_sink;
+#endif
+	bool recording;
+	ChiakiRecorder recorder;
+	ChiakiSenkushaCache senkusha_cache;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool quit;
+	ChiakiQuitReason quit_reason;
+	bool login_pin_requested;
+	bool login_pin_incorrect;
+	uint64_t start_us;
+	uint64_t connected_us;
+	ChiakiSessionStartupTimings startup;
+	uint64_t first_frame_us;
+	StreamStats stats;
+} Stream;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void sig_handler(int sig)
+{
+	interrupted = 1;
+}
+
+static void stream_event_cb(ChiakiEvent *event, void *user)
+{
+	Stream *stream = user;
+	chiaki_mutex_lock(&stream->mutex);
+	switch(event->type)
+	{
+		case CHIAKI_EVENT_CONNECTED:
+			stream->connected_us = chiaki_time_now_monotonic_us();
+			stream->startup = event->connected.startup_timings;
+			CHIAKI_LOGI(stream->log, "CLI Stream connected");
+			break;
+		case CHIAKI_EVENT_LOGIN_PIN_REQUEST:
+			// the session's state mutex is held here, so the pin is set from the main loop
+			stream->login_pin_requested = true;
+			stream->login_pin_incorrect = event->login_pin_request.pin_incorrect;
+			break;
+		case CHIAKI_EVENT_QUIT:
+			stream->quit = true;
+			stream->quit_reason = event->quit.reason;
+			CHIAKI_LOGI(stream->log, "CLI Stream quit: %s%s%s", chiaki_quit_reason_string(event->quit.reason),
+					event->quit.reason_str ? ", " : "", event->quit.reason_str ? event->quit.reason_str : "");
+			break;
+	}
+	chiaki_cond_signal(&stream->cond);
+	chiaki_mutex_unlock(&stream->mutex);
+}
+
+static bool stream_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	Stream *stream = user;
+	// the sink is only ever called from the session's stream thread
+	bool r = stream->video_sink.sample_cb(buf, buf_size, stream->video_sink.user);
+
+	chiaki_mutex_lock(&stream->mutex);
+	if(!stream->stats.samples)
+		stream->first_frame_us = chiaki_time_now_monotonic_us();
+	stream->stats.samples++;
+	stream->stats.bytes += buf_size;
+	stream->stats.frames_output = stream->video_sink.frames_output;
+	chiaki_mutex_unlock(&stream->mutex);
+	return r;
+}
+
+#if CHIAKI_LIB_ENABLE_OPUS
+static void stream_audio_header_cb(ChiakiAudioHeader *header, void *user)
+{
+	Stream *stream = user;
+	stream->audio_output_sink.header_cb(header, stream->audio_output_sink.user);
+}
+
+static void stream_audio_frame_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	Stream *stream = user;
+	stream->audio_output_sink.frame_cb(buf, buf_size, stream->audio_output_sink.user);
+
+	chiaki_mutex_lock(&stream->mutex);
+	stream->stats.audio_samples = stream->audio_output.samples;
+	chiaki_mutex_unlock(&stream->mutex);
+}
+#endif
+
+static void print_stats(const StreamStats *stats, const StreamStats *prev, uint64_t interval_us)
+{
+	double interval_s = (double)interval_us / 1000000.0;
+	if(interval_s <= 0.0)
+		return;
+	printf("samples: %llu (%.2f/s), decoded: %llu (%.2f/s), %.2f Mbit/s, audio samples: %llu\n",
+			(unsigned long long)stats->samples,
+			(double)(stats->samples - prev->samples) / interval_s,
+			(unsigned long long)stats->frames_output,
+			(double)(stats->frames_output - prev->frames_output) / interval_s,
+			(double)(stats->bytes - prev->bytes) * 8.0 / interval_s / 1000000.0,
+			(unsigned long long)stats->audio_samples);
+	fflush(stdout);
+}
+
+static ChiakiErrorCode stream_init_sinks(Stream *stream, Arguments *arguments)
+{
+	ChiakiErrorCode err;
+	switch(arguments->video_sink)
+	{
+#if CHIAKI_CLI_ENABLE_FFMPEG
+		case VIDEO_SINK_FFMPEG:
+			err = chiaki_cli_video_sink_init_ffmpeg(&stream->video_sink, stream->log);
+			break;
+#endif
+		case VIDEO_SINK_DUMP:
+			err = chiaki_cli_video_sink_init_dump(&stream->video_sink, stream->log, arguments->video_out);
+			break;
+		default:
+			err = chiaki_cli_video_sink_init_null(&stream->video_sink);
+			break;
+	}
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+#if CHIAKI_LIB_ENABLE_OPUS
+	if(arguments->audio_sink != AUDIO_SINK_NONE)
+	{
+		err = chiaki_cli_audio_output_init(&stream->audio_output, stream->log,
+				arguments->audio_sink == AUDIO_SINK_WAV ? arguments->audio_out : NULL);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			chiaki_cli_video_sink_fini(&stream->video_sink);
+			return err;
+		}
+		chiaki_cli_audio_output_get_sink(&stream->audio_output, &stream->audio_output_sink);
+	}
+#endif
+
+	if(arguments->record)
+	{
+		err = chiaki_recorder_init(&stream->recorder, stream->log, arguments->record);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+#if CHIAKI_LIB_ENABLE_OPUS
+			if(arguments->audio_sink != AUDIO_SINK_NONE)
+				chiaki_cli_audio_output_fini(&stream->audio_output);
+#endif
+			chiaki_cli_video_sink_fini(&stream->video_sink);
+			return err;
+		}
+		stream->recording = true;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void stream_fini_sinks(Stream *stream, Arguments *arguments)
+{
+	if(stream->recording)
+		chiaki_recorder_fini(&stream->recorder);
+#if CHIAKI_LIB_ENABLE_OPUS
+	if(arguments->audio_sink != AUDIO_SINK_NONE)
+		chiaki_cli_audio_output_fini(&stream->audio_output);
+#endif
+	chiaki_cli_video_sink_fini(&stream->video_sink);
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_stream(ChiakiLog *log, int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	arguments.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+	arguments.fps = CHIAKI_VIDEO_FPS_PRESET_60;
+	arguments.stats_interval_s = 1;
+	error_t argp_r = argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+
+	if(!arguments.host)
+	{
+		fprintf(stderr, "No host specified, see --help.\n");
+		return 1;
+	}
+	if(!arguments.registkey)
+	{
+		fprintf(stderr, "No registration key specified, see --help.\n");
+		return 1;
+	}
+	if(!arguments.morning)
+	{
+		fprintf(stderr, "No morning specified, see --help.\n");
+		return 1;
+	}
+	if(arguments.video_sink == VIDEO_SINK_DUMP && !arguments.video_out)
+	{
+		fprintf(stderr, "The dump video sink requires --video-out.\n");
+		return 1;
+	}
+	if(arguments.audio_sink == AUDIO_SINK_WAV && !arguments.audio_out)
+	{
+		fprintf(stderr, "The wav audio sink requires --audio-out.\n");
+		return 1;
+	}
+
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.host = arguments.host;
+	if(strlen(arguments.registkey) > sizeof(connect_info.regist_key))
+	{
+		fprintf(stderr, "Given registkey is too long.\n");
+		return 1;
+	}
+	memcpy(connect_info.regist_key, arguments.registkey, strlen(arguments.registkey));
+	size_t morning_size = sizeof(connect_info.morning);
+	if(chiaki_base64_decode(arguments.morning, strlen(arguments.morning), connect_info.morning, &morning_size) != CHIAKI_ERR_SUCCESS
+			|| morning_size != sizeof(connect_info.morning))
+	{
+		fprintf(stderr, "Given morning is invalid.\n");
+		return 1;
+	}
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, arguments.resolution, arguments.fps);
+
+	// must be set before anything is allocated and only restored after everything is freed
+	ChiakiInstrumentedAllocator alloc_stats;
+	ChiakiAllocator allocator_prev;
+	if(arguments.alloc_stats)
+	{
+		if(chiaki_instrumented_allocator_init(&alloc_stats, NULL) != CHIAKI_ERR_SUCCESS)
+			return 1;
+		chiaki_get_allocator(&allocator_prev);
+		ChiakiAllocator allocator;
+		chiaki_instrumented_allocator_get(&alloc_stats, &allocator);
+		chiaki_set_allocator(&allocator);
+	}
+	bool alloc_stats_counting = false;
+
+	Stream stream = { 0 };
+	stream.log = log;
+	ChiakiErrorCode err = chiaki_mutex_init(&stream.mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_alloc_stats;
+	err = chiaki_cond_init(&stream.cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = stream_init_sinks(&stream, &arguments);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	err = chiaki_senkusha_cache_init(&stream.senkusha_cache);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_sinks;
+	if(arguments.senkusha_cache && chiaki_senkusha_cache_load(&stream.senkusha_cache, arguments.senkusha_cache) != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGW(log, "CLI Stream failed to load Senkusha cache from %s, starting with an empty one", arguments.senkusha_cache);
+
+	ChiakiSession session;
+	err = chiaki_session_init(&session, &connect_info, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "CLI Stream failed to init session: %s", chiaki_error_string(err));
+		goto error_senkusha_cache;
+	}
+	if(arguments.senkusha_cache)
+		chiaki_session_set_senkusha_cache(&session, &stream.senkusha_cache);
+	chiaki_session_set_senkusha_mtu_ladder(&session, arguments.mtu_ladder);
+	chiaki_session_set_data_ack_delay(&session, arguments.ack_delay_ms, 0);
+	chiaki_session_set_send_batch(&session, arguments.send_batch, arguments.send_batch_window_ms);
+	for(ChiakiThreadRole role=0; role<CHIAKI_THREAD_ROLE_COUNT; role++)
+		chiaki_session_set_thread_attr(&session, role, &arguments.thread_attrs[role]);
+	chiaki_session_set_event_cb(&session, stream_event_cb, &stream);
+	chiaki_session_set_video_sample_cb(&session, stream_video_sample_cb, &stream);
+	if(stream.recording)
+		chiaki_session_set_recorder(&session, &stream.recorder);
+#if CHIAKI_LIB_ENABLE_OPUS
+	if(arguments.audio_sink != AUDIO_SINK_NONE)
+	{
+		ChiakiAudioSink audio_sink;
+		audio_sink.user = &stream;
+		audio_sink.header_cb = stream_audio_header_cb;
+		audio_sink.frame_cb = stream_audio_frame_cb;
+		chiaki_session_set_audio_sink(&session, &audio_sink);
+	}
+#endif
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	stream.start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_session_start(&session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "CLI Stream failed to start session: %s", chiaki_error_string(err));
+		goto error_session;
+	}
+
+	uint64_t end_us = arguments.duration_s ? stream.start_us + (uint64_t)arguments.duration_s * 1000000 : UINT64_MAX;
+	uint64_t stats_interval_us = (uint64_t)arguments.stats_interval_s * 1000000;
+	uint64_t stats_next_us = stream.start_us + stats_interval_us;
+	uint64_t stats_prev_us = stream.start_us;
+	StreamStats stats_prev = { 0 };
+
+	chiaki_mutex_lock(&stream.mutex);
+	while(!stream.quit && !interrupted)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(now_us >= end_us)
+			break;
+
+		if(stats_interval_us && now_us >= stats_next_us)
+		{
+			StreamStats stats = stream.stats;
+			print_stats(&stats, &stats_prev, now_us - stats_prev_us);
+			stats_prev = stats;
+			stats_prev_us = now_us;
+			stats_next_us += stats_interval_us;
+			if(stats_next_us <= now_us)
+				stats_next_us = now_us + stats_interval_us;
+		}
+
+		if(arguments.alloc_stats && !alloc_stats_counting && stream.first_frame_us
+				&& now_us >= stream.first_frame_us + (uint64_t)arguments.alloc_stats_warmup_s * 1000000)
+		{
+			chiaki_instrumented_allocator_reset(&alloc_stats);
+			alloc_stats_counting = true;
+			CHIAKI_LOGI(log, "CLI Stream: counting allocations from now on");
+		}
+
+		if(stream.login_pin_requested)
+		{
+			stream.login_pin_requested = false;
+			if(!arguments.pin || stream.login_pin_incorrect)
+			{
+				CHIAKI_LOGE(log, "CLI Stream: console requested %s login PIN, specify it with --pin",
+						stream.login_pin_incorrect ? "the correct" : "a");
+				break;
+			}
+			chiaki_mutex_unlock(&stream.mutex);
+			chiaki_session_set_login_pin(&session, (const uint8_t *)arguments.pin, strlen(arguments.pin));
+			chiaki_mutex_lock(&stream.mutex);
+			continue;
+		}
+
+		// signals can't wake the cond, so wait in short steps
+		uint64_t wait_until_us = now_us + 100000;
+		if(stats_interval_us && stats_next_us < wait_until_us)
+			wait_until_us = stats_next_us;
+		if(end_us < wait_until_us)
+			wait_until_us = end_us;
+		chiaki_cond_timedwait(&stream.cond, &stream.mutex, (wait_until_us - now_us + 999) / 1000);
+	}
+	chiaki_mutex_unlock(&stream.mutex);
+
+	if(alloc_stats_counting)
+		chiaki_instrumented_allocator_log(&alloc_stats, log, CHIAKI_LOG_INFO);
+	else if(arguments.alloc_stats)
+		CHIAKI_LOGW(log, "CLI Stream: stream ended before allocations were counted");
+
+	chiaki_session_stop(&session);
+	chiaki_session_join(&session);
+
+	if(arguments.mutex_profile)
+		chiaki_mutex_profile_log(log, CHIAKI_LOG_INFO);
+
+	if(arguments.senkusha_cache && chiaki_senkusha_cache_save(&stream.senkusha_cache, arguments.senkusha_cache) != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(log, "CLI Stream failed to save Senkusha cache to %s", arguments.senkusha_cache);
+
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	printf("Total:\n");
+	print_stats(&stream.stats, &(StreamStats){ 0 }, now_us - stream.start_us);
+	if(stream.connected_us)
+	{
+		printf("connect: %.3f ms (session request %.3f, ctrl %.3f, senkusha %.3f, stream connection %.3f)\n",
+				(double)(stream.connected_us - stream.start_us) / 1000.0,
+				(double)stream.startup.session_request_us / 1000.0,
+				(double)stream.startup.ctrl_us / 1000.0,
+				(double)stream.startup.senkusha_us / 1000.0,
+				(double)stream.startup.stream_connection_us / 1000.0);
+	}
+	if(stream.first_frame_us)
+		printf("first frame: %.3f ms\n", (double)(stream.first_frame_us - stream.start_us) / 1000.0);
+	printf("frames complete: %llu, recovered: %llu, lost: %llu\n",
+			(unsigned long long)session.video_receiver_stats.frames,
+			(unsigned long long)session.video_receiver_stats.frames_fec_recovered,
+			(unsigned long long)session.video_receiver_stats.frames_lost);
+	if(session.stream_recv_stats.kernel_drops_supported)
+		printf("kernel drops: %llu, receive buffer: %d bytes\n",
+				(unsigned long long)session.stream_recv_stats.kernel_drops,
+				session.stream_recv_stats.rcvbuf_size);
+	if(arguments.send_batch)
+		printf("sent %llu datagrams in %llu batches, %llu directly\n",
+				(unsigned long long)session.stream_send_stats.datagrams_batched,
+				(unsigned long long)session.stream_send_stats.batches,
+				(unsigned long long)session.stream_send_stats.datagrams_direct);
+	if(stream.quit && stream.quit_reason != CHIAKI_QUIT_REASON_STOPPED)
+		printf("quit reason: %s\n", chiaki_quit_reason_string(stream.quit_reason));
+
+	bool failed = stream.quit && stream.quit_reason != CHIAKI_QUIT_REASON_STOPPED;
+	chiaki_session_fini(&session);
+	chiaki_senkusha_cache_fini(&stream.senkusha_cache);
+	stream_fini_sinks(&stream, &arguments);
+	chiaki_cond_fini(&stream.cond);
+	chiaki_mutex_fini(&stream.mutex);
+	if(arguments.alloc_stats)
+	{
+		chiaki_set_allocator(&allocator_prev);
+		chiaki_instrumented_allocator_fini(&alloc_stats);
+	}
+	return failed ? 1 : 0;
+
+error_session:
+	chiaki_session_fini(&session);
+error_senkusha_cache:
+	chiaki_senkusha_cache_fini(&stream.senkusha_cache);
+error_sinks:
+	stream_fini_sinks(&stream, &arguments);
+error_cond:
+	chiaki_cond_fini(&stream.cond);
+error_mutex:
+	chiaki_mutex_fini(&stream.mutex);
+error_alloc_stats:
+	if(arguments.alloc_stats)
+	{
+		chiaki_set_allocator(&allocator_prev);
+		chiaki_instrumented_allocator_fini(&alloc_stats);
+	}
+	return 1;
+}
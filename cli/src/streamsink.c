@@ -0,0 +1,217 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "streamsink.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static bool video_sink_null_sample(uint8_t *buf, size_t buf_size, void *user)
+{
+	ChiakiCliVideoSink *sink = user;
+	sink->frames_output++;
+	return true;
+}
+
+ChiakiErrorCode chiaki_cli_video_sink_init_null(ChiakiCliVideoSink *sink)
+{
+	sink->user = sink;
+	sink->sample_cb = video_sink_null_sample;
+	sink->fini_cb = NULL;
+	sink->frames_output = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+typedef struct video_sink_dump_t
+{
+	ChiakiCliVideoSink *sink;
+	ChiakiLog *log;
+	FILE *file;
+	bool failed;
+} VideoSinkDump;
+
+static bool video_sink_dump_sample(uint8_t *buf, size_t buf_size, void *user)
+{
+	VideoSinkDump *dump = user;
+	if(dump->failed)
+		return true;
+	if(fwrite(buf, 1, buf_size, dump->file) != buf_size)
+	{
+		CHIAKI_LOGE(dump->log, "CLI Video Sink failed to write to dump file, stopping dump");
+		dump->failed = true;
+		return true;
+	}
+	dump->sink->frames_output++;
+	return true;
+}
+
+static void video_sink_dump_fini(void *user)
+{
+	VideoSinkDump *dump = user;
+	fclose(dump->file);
+	chiaki_free(dump);
+}
+
+ChiakiErrorCode chiaki_cli_video_sink_init_dump(ChiakiCliVideoSink *sink, ChiakiLog *log, const char *filename)
+{
+	VideoSinkDump *dump = CHIAKI_NEW(VideoSinkDump);
+	if(!dump)
+		return CHIAKI_ERR_MEMORY;
+	dump->file = fopen(filename, "wb");
+	if(!dump->file)
+	{
+		CHIAKI_LOGE(log, "CLI Video Sink failed to open %s for writing", filename);
+		chiaki_free(dump);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	dump->sink = sink;
+	dump->log = log;
+	dump->failed = false;
+
+	sink->user = dump;
+	sink->sample_cb = video_sink_dump_sample;
+	sink->fini_cb = video_sink_dump_fini;
+	sink->frames_output = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+void chiaki_cli_video_sink_fini(ChiakiCliVideoSink *sink)
+{
+	if(sink->fini_cb)
+		sink->fini_cb(sink->user);
+}
+
+#if CHIAKI_LIB_ENABLE_OPUS
+
+#define WAV_HEADER_SIZE 44
+
+static void write_le16(uint8_t *buf, uint16_t v)
+{
+	buf[0] = (uint8_t)v;
+	buf[1] = (uint8_t)(v >> 8);
+}
+
+static void write_le32(uint8_t *buf, uint32_t v)
+{
+	write_le16(buf, (uint16_t)v);
+	write_le16(buf + 2, (uint16_t)(v >> 16));
+}
+
+static void wav_header(uint8_t *buf, uint32_t channels, uint32_t rate, uint32_t data_size)
+{
+	memcpy(buf, "RIFF", 4);
+	write_le32(buf + 4, 36 + data_size);
+	memcpy(buf + 8, "WAVE", 4);
+	memcpy(buf + 12, "fmt ", 4);
+	write_le32(buf + 16, 16); // fmt chunk size
+	write_le16(buf + 20, 1); // PCM
+	write_le16(buf + 22, (uint16_t)channels);
+	write_le32(buf + 24, rate);
+	write_le32(buf + 28, rate * channels * sizeof(int16_t)); // byte rate
+	write_le16(buf + 32, (uint16_t)(channels * sizeof(int16_t))); // block align
+	write_le16(buf + 34, 16); // bits per sample
+	memcpy(buf + 36, "data", 4);
+	write_le32(buf + 40, data_size);
+}
+
+static void audio_output_settings(uint32_t channels, uint32_t rate, void *user)
+{
+	ChiakiCliAudioOutput *output = user;
+	if(output->channels)
+	{
+		if(output->channels != channels || output->rate != rate)
+			CHIAKI_LOGW(output->log, "CLI Audio Output got new settings %u channels, %u Hz, ignoring", (unsigned int)channels, (unsigned int)rate);
+		return;
+	}
+	CHIAKI_LOGI(output->log, "CLI Audio Output got %u channels, %u Hz", (unsigned int)channels, (unsigned int)rate);
+	output->channels = channels;
+	output->rate = rate;
+}
+
+static void audio_output_frame(int16_t *buf, size_t samples_count, void *user)
+{
+	ChiakiCliAudioOutput *output = user;
+	output->samples += samples_count;
+	if(!output->wav_file || !output->channels)
+		return;
+
+	size_t size = samples_count * output->channels * sizeof(int16_t);
+	// the wav header can only hold 32 bit sizes
+	if(output->wav_data_size + size > UINT32_MAX - 36)
+		return;
+	// written as is, so this assumes a little endian host
+	if(fwrite(buf, 1, size, output->wav_file) != size)
+	{
+		CHIAKI_LOGE(output->log, "CLI Audio Output failed to write to WAV file, stopping");
+		fclose(output->wav_file);
+		output->wav_file = NULL;
+		return;
+	}
+	output->wav_data_size += size;
+}
+
+ChiakiErrorCode chiaki_cli_audio_output_init(ChiakiCliAudioOutput *output, ChiakiLog *log, const char *wav_filename)
+{
+	output->log = log;
+	output->channels = 0;
+	output->rate = 0;
+	output->wav_data_size = 0;
+	output->samples = 0;
+	output->wav_file = NULL;
+	if(wav_filename)
+	{
+		output->wav_file = fopen(wav_filename, "wb");
+		if(!output->wav_file)
+		{
+			CHIAKI_LOGE(log, "CLI Audio Output failed to open %s for writing", wav_filename);
+			return CHIAKI_ERR_UNKNOWN;
+		}
+		// placeholder, the real header is written in chiaki_cli_audio_output_fini()
+		uint8_t header[WAV_HEADER_SIZE] = { 0 };
+		if(fwrite(header, 1, sizeof(header), output->wav_file) != sizeof(header))
+		{
+			CHIAKI_LOGE(log, "CLI Audio Output failed to write to %s", wav_filename);
+			fclose(output->wav_file);
+			return CHIAKI_ERR_UNKNOWN;
+		}
+	}
+
+	chiaki_opus_decoder_init(&output->decoder, log);
+	chiaki_opus_decoder_set_cb(&output->decoder, audio_output_settings, audio_output_frame, output);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+void chiaki_cli_audio_output_fini(ChiakiCliAudioOutput *output)
+{
+	chiaki_opus_decoder_fini(&output->decoder);
+	if(!output->wav_file)
+		return;
+
+	uint8_t header[WAV_HEADER_SIZE];
+	// without any audio, still write a valid (empty) file
+	wav_header(header, output->channels ? output->channels : 2, output->rate ? output->rate : 48000, (uint32_t)output->wav_data_size);
+	if(fseek(output->wav_file, 0, SEEK_SET) != 0 || fwrite(header, 1, sizeof(header), output->wav_file) != sizeof(header))
+		CHIAKI_LOGE(output->log, "CLI Audio Output failed to write WAV header");
+	fclose(output->wav_file);
+}
+
+void chiaki_cli_audio_output_get_sink(ChiakiCliAudioOutput *output, ChiakiAudioSink *sink)
+{
+	chiaki_opus_decoder_get_sink(&output->decoder, sink);
+}
+
+#endif
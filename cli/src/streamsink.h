@@ -0,0 +1,92 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_CLI_STREAMSINK_H
+#define CHIAKI_CLI_STREAMSINK_H
+
+#include <chiaki/config.h>
+#include <chiaki/session.h>
+#if CHIAKI_LIB_ENABLE_OPUS
+#include <chiaki/opusdecoder.h>
+#endif
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*ChiakiCliVideoSinkFini)(void *user);
+
+/**
+ * Consumer of the video samples of a headless stream
+ */
+typedef struct chiaki_cli_video_sink_t
+{
+	void *user;
+	ChiakiVideoSampleCallback sample_cb;
+	ChiakiCliVideoSinkFini fini_cb;
+	uint64_t frames_output; // frames decoded or written, only updated from within sample_cb
+} ChiakiCliVideoSink;
+
+/**
+ * Discards all samples, so only the library itself is measured.
+ */
+ChiakiErrorCode chiaki_cli_video_sink_init_null(ChiakiCliVideoSink *sink);
+
+/**
+ * Writes all samples to filename as an H.264 Annex B elementary stream.
+ */
+ChiakiErrorCode chiaki_cli_video_sink_init_dump(ChiakiCliVideoSink *sink, ChiakiLog *log, const char *filename);
+
+#if CHIAKI_CLI_ENABLE_FFMPEG
+/**
+ * Decodes all samples in software with FFmpeg and drops the decoded frames.
+ */
+ChiakiErrorCode chiaki_cli_video_sink_init_ffmpeg(ChiakiCliVideoSink *sink, ChiakiLog *log);
+#endif
+
+void chiaki_cli_video_sink_fini(ChiakiCliVideoSink *sink);
+
+#if CHIAKI_LIB_ENABLE_OPUS
+/**
+ * Decodes audio with Opus and either drops it or writes it to a WAV file.
+ */
+typedef struct chiaki_cli_audio_output_t
+{
+	ChiakiLog *log;
+	ChiakiOpusDecoder decoder;
+	FILE *wav_file; // NULL to drop the decoded audio
+	uint32_t channels;
+	uint32_t rate;
+	uint64_t wav_data_size;
+	uint64_t samples; // decoded samples per channel, only updated from within the audio sink
+} ChiakiCliAudioOutput;
+
+/**
+ * @param wav_filename NULL to drop the decoded audio
+ */
+ChiakiErrorCode chiaki_cli_audio_output_init(ChiakiCliAudioOutput *output, ChiakiLog *log, const char *wav_filename);
+void chiaki_cli_audio_output_fini(ChiakiCliAudioOutput *output);
+void chiaki_cli_audio_output_get_sink(ChiakiCliAudioOutput *output, ChiakiAudioSink *sink);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CLI_STREAMSINK_H
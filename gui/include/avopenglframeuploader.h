@@ -18,10 +18,11 @@
 #ifndef CHIAKI_AVOPENGLFRAMEUPLOADER_H
 #define CHIAKI_AVOPENGLFRAMEUPLOADER_H
 
+#include <avopenglwidget.h>
+
 #include <QObject>
 #include <QOpenGLWidget>
 
-class AVOpenGLWidget;
 class VideoDecoder;
 class QSurface;
 
@@ -34,10 +35,18 @@ class AVOpenGLFrameUploader: public QObject
 		AVOpenGLWidget *widget;
 		QOpenGLContext *context;
 		QSurface *surface;
+		AVOpenGLPBORing pbo_ring;
+		bool finished;
 
 	private slots:
 		void UpdateFrame();
 
+	public slots:
+		/**
+		 * Delete all GL objects of the uploader and stop uploading, must be called in the uploader's thread.
+		 */
+		void Fini();
+
 	public:
 		AVOpenGLFrameUploader(VideoDecoder *decoder, AVOpenGLWidget *widget, QOpenGLContext *context, QSurface *surface);
 };
@@ -21,6 +21,7 @@
 #include <chiaki/log.h>
 
 #include <QOpenGLWidget>
+#include <QOpenGLFunctions>
 #include <QMutex>
 
 extern "C"
@@ -51,15 +52,56 @@ struct ConversionConfig
 	struct PlaneConfig plane_configs[MAX_PANES];
 };
 
+#define PBO_RING_SIZE 3
+
+typedef void (QOPENGLF_APIENTRYP BufferStorageFunc)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+struct AVOpenGLPBO
+{
+	GLuint pbo;
+	size_t size;
+	uint8_t *mapped; // persistently mapped, or nullptr if it must be mapped for each upload
+	GLsync fence; // signaled when the last upload from this PBO has finished
+};
+
+/**
+ * PBOs that frames are uploaded from in turn, so writing the next frame never waits
+ * for the GPU to finish reading the previous one.
+ * Only used from the context of the AVOpenGLFrameUploader.
+ */
+struct AVOpenGLPBORing
+{
+	AVOpenGLPBO slots[PBO_RING_SIZE];
+	unsigned int next;
+	BufferStorageFunc buffer_storage; // nullptr if persistent mapping is not supported
+	bool initialized;
+
+	void Init(QOpenGLContext *context, ChiakiLog *log);
+
+	/**
+	 * Wait until the next PBO is free, grow it to at least size and bind it to GL_PIXEL_UNPACK_BUFFER.
+	 */
+	AVOpenGLPBO *Acquire(size_t size, ChiakiLog *log);
+
+	/**
+	 * Unmap and delete all PBOs and their fences, the context of Init() must be current.
+	 */
+	void Fini();
+};
+
 struct AVOpenGLFrame
 {
-	GLuint pbo[MAX_PANES];
-	GLuint tex[MAX_PANES];
+	GLuint tex[MAX_PANES]; // allocated with width and height
 	unsigned int width;
 	unsigned int height;
+	GLsync upload_fence; // must be waited on before drawing the textures in another context
+	GLsync draw_fence; // must be waited on before uploading into the textures again
+	uint64_t ready_us; // when the upload was completed
+	uint64_t present_us; // when it was first drawn, 0 if not yet
 	ConversionConfig *conversion_config;
 
-	bool Update(AVFrame *frame, ChiakiLog *log);
+	bool Update(AVFrame *frame, AVOpenGLPBORing *pbo_ring, ChiakiLog *log);
+	void DeleteFences();
 };
 
 class AVOpenGLWidget: public QOpenGLWidget
@@ -73,9 +115,22 @@ class AVOpenGLWidget: public QOpenGLWidget
 		GLuint vbo;
 		GLuint vao;
 
-		AVOpenGLFrame frames[2];
-		int frame_fg;
+		// mailbox of three frames, so neither uploading nor painting ever has to wait for the other
+		AVOpenGLFrame frames[3];
 		QMutex frames_mutex;
+		int frame_fg; // drawn by paintGL
+		int frame_ready; // completely uploaded, to be drawn next if frame_ready_new
+		int frame_bg; // being uploaded to, only changed by the uploader thread
+		bool frame_ready_new;
+
+		// present on every vsync instead of only when a new frame arrives
+		bool pacing;
+
+		// protected by frames_mutex
+		uint64_t frames_presented;
+		uint64_t frames_dropped; // replaced by a newer frame before being drawn
+		uint64_t frames_repeated; // vsyncs without a new frame, only counted with pacing
+		uint64_t present_latency_us_sum; // from completing the upload until drawing
 		QOpenGLContext *frame_uploader_context;
 		AVOpenGLFrameUploader *frame_uploader;
 		QThread *frame_uploader_thread;
@@ -87,11 +142,20 @@ class AVOpenGLWidget: public QOpenGLWidget
 	public:
 		static QSurfaceFormat CreateSurfaceFormat();
 
-		explicit AVOpenGLWidget(VideoDecoder *decoder, QWidget *parent = nullptr);
+		explicit AVOpenGLWidget(VideoDecoder *decoder, bool pacing, QWidget *parent = nullptr);
 		~AVOpenGLWidget() override;
 
+		/**
+		 * Publish the background frame as the newest one to be drawn.
+		 * Called by the uploader thread after updating the background frame.
+		 */
 		void SwapFrames();
-		AVOpenGLFrame *GetBackgroundFrame()	{ return &frames[1 - frame_fg]; }
+		AVOpenGLFrame *GetBackgroundFrame()	{ return &frames[frame_bg]; }
+
+		/**
+		 * Delete the fences of all frames, called by the uploader thread when it is finished.
+		 */
+		void DeleteFrameFences();
 
 	protected:
 		void mouseMoveEvent(QMouseEvent *event) override;
@@ -23,6 +23,8 @@
 #include <QObject>
 #include <QSet>
 #include <QMap>
+#include <QMutex>
+#include <QAtomicInt>
 #include <QString>
 
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
@@ -30,25 +32,35 @@
 #endif
 
 class Controller;
+class ControllerInputThread;
 
+/**
+ * SDL events are handled on a dedicated input thread that blocks until the next event arrives,
+ * so controller input does not depend on the Qt event loop.
+ */
 class ControllerManager : public QObject
 {
 	Q_OBJECT
 
 	friend class Controller;
+	friend class ControllerInputThread;
 
 	private:
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 		QSet<SDL_JoystickID> available_controllers;
+		ControllerInputThread *input_thread;
+		QAtomicInt input_thread_stop;
+		Uint32 wakeup_event;
 #endif
+		QMutex open_controllers_mutex; // open_controllers is also accessed by the input thread
 		QMap<int, Controller *> open_controllers;
 
 		void ControllerClosed(Controller *controller);
+		void RunInputThread();
+		void ControllerEvent(int device_id, quint64 time_us);
 
 	private slots:
 		void UpdateAvailableControllers();
-		void HandleEvents();
-		void ControllerEvent(int device_id);
 
 	public:
 		static ControllerManager *GetInstance();
@@ -72,7 +84,7 @@ class Controller : public QObject
 	private:
 		Controller(int device_id, ControllerManager *manager);
 
-		void UpdateState();
+		void UpdateState(quint64 time_us);
 
 		ControllerManager *manager;
 		int id;
@@ -90,7 +102,13 @@ class Controller : public QObject
 		ChiakiControllerState GetState();
 
 	signals:
-		void StateChanged();
+		/**
+		 * Emitted on the input thread of the ControllerManager.
+		 * Connect with Qt::DirectConnection to pass the state on without going through an event loop.
+		 *
+		 * @param time_us time at which the event was received, as given by chiaki_time_now_monotonic_us()
+		 */
+		void StateChanged(const ChiakiControllerState &state, quint64 time_us);
 };
 
 #endif // CHIAKI_CONTROLLERMANAGER_H
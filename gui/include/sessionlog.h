@@ -19,25 +19,20 @@
 #define CHIAKI_SESSIONLOG_H
 
 #include <chiaki/log.h>
+#include <chiaki/asynclog.h>
 
 #include <QString>
 #include <QDir>
-#include <QMutex>
 
-class QFile;
 class StreamSession;
 
 class SessionLog
 {
-	friend class SessionLogPrivate;
-
 	private:
 		StreamSession *session;
 		ChiakiLog log;
-		QFile *file;
-		QMutex file_mutex;
-
-		void Log(ChiakiLogLevel level, const char *msg);
+		ChiakiAsyncLog async_log;
+		bool async_log_initialized;
 
 	public:
 		SessionLog(StreamSession *session, uint32_t level_mask, const QString &filename);
@@ -80,6 +80,15 @@ class Settings : public QObject
 		HardwareDecodeEngine GetHardwareDecodeEngine() const;
 		void SetHardwareDecodeEngine(HardwareDecodeEngine enabled);
 
+		SoftwareDecodeMode GetSoftwareDecodeMode() const;
+		void SetSoftwareDecodeMode(SoftwareDecodeMode mode);
+
+		bool GetVideoPacing() const				{ return settings.value("settings/video_pacing", false).toBool(); }
+		void SetVideoPacing(bool enabled)		{ settings.setValue("settings/video_pacing", enabled); }
+
+		unsigned int GetVideoQueueSize() const;
+		void SetVideoQueueSize(unsigned int size);
+
 		unsigned int GetAudioBufferSizeDefault() const;
 
 		/**
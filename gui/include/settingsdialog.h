@@ -40,6 +40,9 @@ class SettingsDialog : public QDialog
 		QLineEdit *bitrate_edit;
 		QLineEdit *audio_buffer_size_edit;
 		QComboBox *hardware_decode_combo_box;
+		QComboBox *software_decode_combo_box;
+		QCheckBox *video_pacing_check_box;
+		QComboBox *video_queue_size_combo_box;
 
 		QListWidget *registered_hosts_list_widget;
 		QPushButton *delete_registered_host_button;
@@ -54,6 +57,9 @@ class SettingsDialog : public QDialog
 		void BitrateEdited();
 		void AudioBufferSizeEdited();
 		void HardwareDecodeEngineSelected();
+		void SoftwareDecodeModeSelected();
+		void VideoPacingChanged();
+		void VideoQueueSizeSelected();
 
 		void UpdateRegisteredHosts();
 		void UpdateRegisteredHostsButtons();
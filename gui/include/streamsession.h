@@ -29,6 +29,7 @@
 #include <QObject>
 #include <QImage>
 #include <QMouseEvent>
+#include <QMutex>
 #include <QTimer>
 
 #if CHIAKI_GUI_ENABLE_QT_GAMEPAD
@@ -50,6 +51,9 @@ struct StreamSessionConnectInfo
 {
 	QMap<Qt::Key, int> key_map;
 	HardwareDecodeEngine hw_decode_engine;
+	SoftwareDecodeMode sw_decode_mode;
+	bool video_pacing;
+	unsigned int video_queue_size;
 	uint32_t log_level_mask;
 	QString log_file;
 	QString host;
@@ -71,12 +75,16 @@ class StreamSession : public QObject
 		SessionLog log;
 		ChiakiSession session;
 		ChiakiOpusDecoder opus_decoder;
+		ChiakiSenkushaCache senkusha_cache;
+		QString senkusha_cache_file;
 
 #if CHIAKI_GUI_ENABLE_QT_GAMEPAD
 		QGamepad *gamepad;
 #endif
 		Controller *controller;
 
+		QMutex input_mutex; // controller input arrives on the input thread of the ControllerManager
+		ChiakiControllerState controller_state;
 		ChiakiControllerState keyboard_state;
 
 		VideoDecoder video_decoder;
@@ -88,8 +96,10 @@ class StreamSession : public QObject
 		QMap<Qt::Key, int> key_map;
 
 		void PushAudioFrame(int16_t *buf, size_t samples_count);
-		void PushVideoSample(uint8_t *buf, size_t buf_size);
+		bool PushVideoSample(uint8_t *buf, size_t buf_size);
 		void Event(ChiakiEvent *event);
+		void SendFeedbackStateLocked(uint64_t input_time_us);
+		void ControllerStateChanged(const ChiakiControllerState &state, quint64 time_us);
 
 	private slots:
 		void InitAudio(unsigned int channels, unsigned int rate);
@@ -19,12 +19,17 @@
 #define CHIAKI_VIDEODECODER_H
 
 #include <chiaki/log.h>
+#include <chiaki/video.h>
 
 #include "exception.h"
 
+#include <QByteArray>
+#include <QList>
 #include <QMap>
 #include <QMutex>
 #include <QObject>
+#include <QQueue>
+#include <QWaitCondition>
 
 extern "C"
 {
@@ -47,23 +52,85 @@ static const QMap<HardwareDecodeEngine, const char *> hardware_decode_engine_nam
 	{ HW_DECODE_VDPAU, "vdpau"},
 };
 
+/**
+ * How FFmpeg's software H.264 decoder is configured, only used without hardware decode.
+ */
+typedef enum {
+	SW_DECODE_DEFAULT = 0, // FFmpeg's defaults, which may use frame threading and delay output by one frame per thread
+	SW_DECODE_LOW_DELAY = 1, // slice threading on all cores, low delay and fast flags
+} SoftwareDecodeMode;
+
 class VideoDecoderException: public Exception
 {
 	public:
 		explicit VideoDecoderException(const QString &msg) : Exception(msg) {};
 };
 
+#define VIDEO_DECODER_QUEUE_SIZE_MIN 1
+#define VIDEO_DECODER_QUEUE_SIZE_MAX 3
+
+// packets waiting to be decoded before the decoder falls back to the next IDR frame
+#define VIDEO_DECODER_INPUT_QUEUE_MAX 16
+
+struct VideoDecoderStats
+{
+	uint64_t frames_decoded;
+	uint64_t frames_pulled;
+	uint64_t frames_dropped; // replaced in the full output queue by a newer frame
+	uint64_t frames_skipped; // non-reference frames dropped before decoding because the output queue was full
+	uint64_t frames_before_idr; // frames of a new profile discarded while waiting for its first IDR frame
+	uint64_t frames_overflowed; // dropped until the next IDR frame because the input queue was full
+	uint64_t decode_us_last;
+	uint64_t decode_us_max;
+	uint64_t decode_us_sum;
+	uint64_t queue_us_last; // from being decoded until being pulled
+	uint64_t queue_us_max;
+	uint64_t queue_us_sum;
+};
+
+class VideoDecoderThread;
+
+/**
+ * Decodes on a dedicated thread, so pushing never blocks the Video Receiver.
+ * Decoded frames wait in an output queue of queue_size frames, of which the oldest is dropped when it is full.
+ * Frames are taken from a pool and must be given back with ReleaseFrame().
+ *
+ * If the profiles are known up front (SetProfiles()), a codec context is prepared for each of them
+ * and a switch only takes effect with the first IDR frame of the new profile, so switching never
+ * reconfigures a decoder mid-stream.
+ */
 class VideoDecoder: public QObject
 {
 	Q_OBJECT
 
+	friend class VideoDecoderThread;
+
 	public:
-		VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log);
+		VideoDecoder(HardwareDecodeEngine hw_decode_engine, SoftwareDecodeMode sw_decode_mode, unsigned int queue_size, ChiakiLog *log);
 		~VideoDecoder();
 
-		void PushFrame(uint8_t *buf, size_t buf_size);
+		/**
+		 * @return false if the frame was dropped because the decoder is behind, a new IDR frame should be requested then
+		 */
+		bool PushFrame(uint8_t *buf, size_t buf_size);
+
+		/**
+		 * Prepare a codec context for each profile. Headers are copied.
+		 */
+		void SetProfiles(ChiakiVideoProfile *profiles, size_t profiles_count);
+
+		/**
+		 * Frames pushed after this belong to the given profile.
+		 */
+		void SwitchProfile(size_t profile_index);
+
+		/**
+		 * @return the oldest decoded frame or nullptr, must be given back with ReleaseFrame()
+		 */
 		AVFrame *PullFrame();
-		AVFrame *GetFromHardware(AVFrame *hw_frame);
+		void ReleaseFrame(AVFrame *frame);
+
+		VideoDecoderStats GetStats();
 
 		ChiakiLog *GetChiakiLog()	{ return log; }
 
@@ -73,16 +140,56 @@ class VideoDecoder: public QObject
 		void FramesAvailable();
 
 	private:
+		struct QueuedFrame
+		{
+			AVFrame *frame;
+			uint64_t decoded_us;
+		};
+
+		struct Input
+		{
+			enum { Packet, Profiles, ProfileSwitch } type;
+			QByteArray packet;
+			QList<QByteArray> profile_headers;
+			int profile_index;
+		};
+
 		HardwareDecodeEngine hw_decode_engine;
+		SoftwareDecodeMode sw_decode_mode;
 
 		ChiakiLog *log;
-		QMutex mutex;
 
+		QMutex mutex;
+		QWaitCondition cond;
+		bool stop;
+		QQueue<Input> input_queue;
+		unsigned int input_packets; // Input::Packet entries in input_queue
+		bool input_overflowed; // dropping packets until the next IDR frame
+		QQueue<QueuedFrame> output_queue;
+		unsigned int queue_size;
+		QList<AVFrame *> frame_pool;
+		VideoDecoderStats stats;
+		VideoDecoderThread *decode_thread;
+
+		// only accessed by the decode thread after construction
 		AVCodec *codec;
-		AVCodecContext *codec_context;
+		AVCodecContext *codec_context; // currently decoding
+		AVCodecContext *initial_codec_context; // used until profiles are known
+		QList<AVCodecContext *> profile_codec_contexts; // nullptr for profiles that could not be prepared
+		QList<QByteArray> profile_headers;
+		int profile_pending; // switching to this profile with the next IDR frame, -1 if none
 
 		enum AVPixelFormat hw_pix_fmt;
 		AVBufferRef *hw_device_ctx;
+
+		void RunDecodeThread();
+		AVCodecContext *OpenCodecContext();
+		void PrepareProfiles(const QList<QByteArray> &headers);
+		bool SwitchPendingProfile(const QByteArray &packet_buf);
+		void Decode(const QByteArray &packet_buf);
+		void QueueFrame(AVFrame *frame, uint64_t start_us);
+		AVFrame *AcquireFrame();
+		AVFrame *GetFromHardware(AVFrame *hw_frame);
 };
 
 #endif // CHIAKI_VIDEODECODER_H
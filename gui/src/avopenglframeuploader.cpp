@@ -29,21 +29,46 @@ AVOpenGLFrameUploader::AVOpenGLFrameUploader(VideoDecoder *decoder, AVOpenGLWidg
 	context(context),
 	surface(surface)
 {
+	pbo_ring.initialized = false;
+	finished = false;
 	connect(decoder, SIGNAL(FramesAvailable()), this, SLOT(UpdateFrame()));
 }
 
 void AVOpenGLFrameUploader::UpdateFrame()
 {
+	// FramesAvailable may still have been queued before Fini()
+	if(finished)
+		return;
+
 	if(QOpenGLContext::currentContext() != context)
 		context->makeCurrent(surface);
 
+	if(!pbo_ring.initialized)
+		pbo_ring.Init(context, decoder->GetChiakiLog());
+
 	AVFrame *next_frame = decoder->PullFrame();
 	if(!next_frame)
 		return;
 
-	bool success = widget->GetBackgroundFrame()->Update(next_frame, decoder->GetChiakiLog());
-	av_frame_free(&next_frame);
+	bool success = widget->GetBackgroundFrame()->Update(next_frame, &pbo_ring, decoder->GetChiakiLog());
+	decoder->ReleaseFrame(next_frame);
 
 	if(success)
 		widget->SwapFrames();
-}
\ No newline at end of file
+}
+
+void AVOpenGLFrameUploader::Fini()
+{
+	disconnect(decoder, SIGNAL(FramesAvailable()), this, SLOT(UpdateFrame()));
+	finished = true;
+
+	if(QOpenGLContext::currentContext() != context && !context->makeCurrent(surface))
+	{
+		CHIAKI_LOGE(decoder->GetChiakiLog(), "AVOpenGLFrameUploader failed to make context current for cleanup");
+		return;
+	}
+	if(pbo_ring.initialized)
+		pbo_ring.Fini();
+	widget->DeleteFrameFences();
+	context->doneCurrent();
+}
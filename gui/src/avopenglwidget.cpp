@@ -19,6 +19,8 @@
 #include <videodecoder.h>
 #include <avopenglframeuploader.h>
 
+#include <chiaki/time.h>
+
 #include <QOpenGLContext>
 #include <QOpenGLExtraFunctions>
 #include <QOpenGLDebugLogger>
@@ -137,9 +139,10 @@ QSurfaceFormat AVOpenGLWidget::CreateSurfaceFormat()
 	return format;
 }
 
-AVOpenGLWidget::AVOpenGLWidget(VideoDecoder *decoder, QWidget *parent)
+AVOpenGLWidget::AVOpenGLWidget(VideoDecoder *decoder, bool pacing, QWidget *parent)
 	: QOpenGLWidget(parent),
-	decoder(decoder)
+	decoder(decoder),
+	pacing(pacing)
 {
 	conversion_config = nullptr;
 	for(auto &cc: conversion_configs)
@@ -160,6 +163,16 @@ AVOpenGLWidget::AVOpenGLWidget(VideoDecoder *decoder, QWidget *parent)
 	frame_uploader = nullptr;
 	frame_uploader_thread = nullptr;
 	frame_fg = 0;
+	frame_ready = 1;
+	frame_bg = 2;
+	frame_ready_new = false;
+	frames_presented = 0;
+	frames_dropped = 0;
+	frames_repeated = 0;
+	present_latency_us_sum = 0;
+
+	if(pacing)
+		connect(this, &QOpenGLWidget::frameSwapped, this, [this]() { update(); });
 
 	setMouseTracking(true);
 	mouse_timer = new QTimer(this);
@@ -171,12 +184,20 @@ AVOpenGLWidget::~AVOpenGLWidget()
 {
 	if(frame_uploader_thread)
 	{
+		// its GL objects must be deleted while its context is still alive and current in its thread
+		QMetaObject::invokeMethod(frame_uploader, "Fini", Qt::BlockingQueuedConnection);
 		frame_uploader_thread->quit();
 		frame_uploader_thread->wait();
 		delete frame_uploader_thread;
 	}
 	delete frame_uploader;
 	delete frame_uploader_context;
+
+	CHIAKI_LOGI(decoder->GetChiakiLog(), "AVOpenGLWidget presented %llu frames, dropped %llu, repeated %llu, average latency from upload %.3f ms",
+			(unsigned long long)frames_presented,
+			(unsigned long long)frames_dropped,
+			(unsigned long long)frames_repeated,
+			frames_presented ? (double)present_latency_us_sum / frames_presented / 1000.0 : 0.0);
 }
 
 void AVOpenGLWidget::mouseMoveEvent(QMouseEvent *event)
@@ -196,14 +217,154 @@ void AVOpenGLWidget::HideMouse()
 	setCursor(Qt::BlankCursor);
 }
 
+void AVOpenGLWidget::DeleteFrameFences()
+{
+	// sync objects are shared by all contexts of the share group
+	QMutexLocker lock(&frames_mutex);
+	for(auto &frame : frames)
+		frame.DeleteFences();
+}
+
 void AVOpenGLWidget::SwapFrames()
 {
 	QMutexLocker lock(&frames_mutex);
-	frame_fg = 1 - frame_fg;
-	QMetaObject::invokeMethod(this, "update");
+	frames[frame_bg].ready_us = chiaki_time_now_monotonic_us();
+	frames[frame_bg].present_us = 0;
+	std::swap(frame_bg, frame_ready);
+	if(frame_ready_new)
+		frames_dropped++;
+	frame_ready_new = true;
+	if(!pacing)
+		QMetaObject::invokeMethod(this, "update");
+}
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+#define PBO_FENCE_TIMEOUT_NS 1000000000
+#define PBO_PLANE_ALIGN 64
+
+void AVOpenGLPBORing::Init(QOpenGLContext *context, ChiakiLog *log)
+{
+	buffer_storage = nullptr;
+	if(context->format().version() >= qMakePair(4, 4) || context->hasExtension("GL_ARB_buffer_storage"))
+		buffer_storage = reinterpret_cast<BufferStorageFunc>(context->getProcAddress("glBufferStorage"));
+	CHIAKI_LOGI(log, "AVOpenGLFrame uploading %s", buffer_storage ? "from persistently mapped PBOs" : "by mapping PBOs for each frame");
+
+	for(auto &slot : slots)
+	{
+		slot.pbo = 0;
+		slot.size = 0;
+		slot.mapped = nullptr;
+		slot.fence = nullptr;
+	}
+	next = 0;
+	initialized = true;
+}
+
+AVOpenGLPBO *AVOpenGLPBORing::Acquire(size_t size, ChiakiLog *log)
+{
+	auto f = QOpenGLContext::currentContext()->extraFunctions();
+
+	AVOpenGLPBO *slot = &slots[next];
+	next = (next + 1) % PBO_RING_SIZE;
+
+	if(slot->fence)
+	{
+		GLenum r = f->glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT, PBO_FENCE_TIMEOUT_NS);
+		if(r == GL_TIMEOUT_EXPIRED || r == GL_WAIT_FAILED)
+			CHIAKI_LOGW(log, "AVOpenGLFrame failed to wait for PBO to become free");
+		f->glDeleteSync(slot->fence);
+		slot->fence = nullptr;
+	}
+
+	if(slot->size >= size)
+	{
+		f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+		return slot;
+	}
+
+	// buffers created with glBufferStorage are immutable, so growing always means recreating
+	if(slot->pbo)
+	{
+		if(slot->mapped)
+		{
+			f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+			f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			slot->mapped = nullptr;
+		}
+		f->glDeleteBuffers(1, &slot->pbo);
+		slot->pbo = 0;
+		slot->size = 0;
+	}
+
+	f->glGenBuffers(1, &slot->pbo);
+	f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+	if(buffer_storage)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		buffer_storage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+		slot->mapped = reinterpret_cast<uint8_t *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+		if(!slot->mapped)
+		{
+			CHIAKI_LOGE(log, "AVOpenGLFrame failed to persistently map PBO");
+			f->glDeleteBuffers(1, &slot->pbo);
+			slot->pbo = 0;
+			return nullptr;
+		}
+	}
+	else
+		f->glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	slot->size = size;
+	return slot;
+}
+
+void AVOpenGLPBORing::Fini()
+{
+	auto f = QOpenGLContext::currentContext()->extraFunctions();
+	for(auto &slot : slots)
+	{
+		if(slot.fence)
+		{
+			f->glDeleteSync(slot.fence);
+			slot.fence = nullptr;
+		}
+		if(!slot.pbo)
+			continue;
+		if(slot.mapped)
+		{
+			f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.pbo);
+			f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			slot.mapped = nullptr;
+		}
+		f->glDeleteBuffers(1, &slot.pbo);
+		slot.pbo = 0;
+		slot.size = 0;
+	}
+	f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	initialized = false;
 }
 
-bool AVOpenGLFrame::Update(AVFrame *frame, ChiakiLog *log)
+void AVOpenGLFrame::DeleteFences()
+{
+	auto f = QOpenGLContext::currentContext()->extraFunctions();
+	if(upload_fence)
+	{
+		f->glDeleteSync(upload_fence);
+		upload_fence = nullptr;
+	}
+	if(draw_fence)
+	{
+		f->glDeleteSync(draw_fence);
+		draw_fence = nullptr;
+	}
+}
+
+bool AVOpenGLFrame::Update(AVFrame *frame, AVOpenGLPBORing *pbo_ring, ChiakiLog *log)
 {
 	auto f = QOpenGLContext::currentContext()->extraFunctions();
 
@@ -213,42 +374,86 @@ bool AVOpenGLFrame::Update(AVFrame *frame, ChiakiLog *log)
 		return false;
 	}
 
-	width = frame->width;
-	height = frame->height;
-
+	// planes are copied including their padding and uploaded using GL_UNPACK_ROW_LENGTH
+	size_t offsets[MAX_PANES];
+	size_t size = 0;
 	for(int i=0; i<conversion_config->planes; i++)
 	{
-		int width = frame->width / conversion_config->plane_configs[i].width_divider;
-		int height = frame->height / conversion_config->plane_configs[i].height_divider;
-		int size = width * height * conversion_config->plane_configs[i].data_per_pixel;
+		if(frame->linesize[i] <= 0 || frame->linesize[i] % conversion_config->plane_configs[i].data_per_pixel)
+		{
+			CHIAKI_LOGE(log, "AVOpenGLFrame got AVFrame with unsupported linesize");
+			return false;
+		}
+		offsets[i] = size;
+		size += (size_t)frame->linesize[i] * (frame->height / conversion_config->plane_configs[i].height_divider);
+		size = (size + PBO_PLANE_ALIGN - 1) & ~((size_t)PBO_PLANE_ALIGN - 1);
+	}
 
-		f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[i]);
-		f->glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+	AVOpenGLPBO *pbo = pbo_ring->Acquire(size, log);
+	if(!pbo)
+		return false;
 
-		auto buf = reinterpret_cast<uint8_t *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+	uint8_t *buf = pbo->mapped;
+	if(!buf)
+	{
+		// Acquire() already waited for the PBO's last upload to finish
+		buf = reinterpret_cast<uint8_t *>(f->glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
 		if(!buf)
 		{
 			CHIAKI_LOGE(log, "AVOpenGLFrame failed to map PBO");
-			continue;
+			f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return false;
 		}
+	}
 
-		if(frame->linesize[i] == width)
-			memcpy(buf, frame->data[i], size);
-		else
-		{
-			for(int l=0; l<height; l++)
-				memcpy(buf + width * l * conversion_config->plane_configs[i].data_per_pixel, frame->data[i] + frame->linesize[i] * l, width * conversion_config->plane_configs[i].data_per_pixel);
-		}
+	// the textures might still be in use by the last paintGL that drew this frame
+	if(draw_fence)
+	{
+		f->glWaitSync(draw_fence, 0, GL_TIMEOUT_IGNORED);
+		f->glDeleteSync(draw_fence);
+		draw_fence = nullptr;
+	}
 
+	for(int i=0; i<conversion_config->planes; i++)
+	{
+		int height = frame->height / conversion_config->plane_configs[i].height_divider;
+		memcpy(buf + offsets[i], frame->data[i], (size_t)frame->linesize[i] * height);
+	}
+
+	if(!pbo->mapped)
 		f->glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
 
+	bool realloc = frame->width != width || frame->height != height;
+	width = frame->width;
+	height = frame->height;
+
+	f->glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for(int i=0; i<conversion_config->planes; i++)
+	{
+		int width = frame->width / conversion_config->plane_configs[i].width_divider;
+		int height = frame->height / conversion_config->plane_configs[i].height_divider;
+		const void *data = reinterpret_cast<const void *>(offsets[i]);
+
+		f->glPixelStorei(GL_UNPACK_ROW_LENGTH, frame->linesize[i] / conversion_config->plane_configs[i].data_per_pixel);
 		f->glBindTexture(GL_TEXTURE_2D, tex[i]);
-		f->glTexImage2D(GL_TEXTURE_2D, 0, conversion_config->plane_configs[i].internal_format, width, height, 0, conversion_config->plane_configs[i].format, GL_UNSIGNED_BYTE, nullptr);
+		if(realloc)
+			f->glTexImage2D(GL_TEXTURE_2D, 0, conversion_config->plane_configs[i].internal_format, width, height, 0, conversion_config->plane_configs[i].format, GL_UNSIGNED_BYTE, data);
+		else
+			f->glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, conversion_config->plane_configs[i].format, GL_UNSIGNED_BYTE, data);
 	}
+	f->glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
 	f->glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
-	f->glFinish();
+	pbo->fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	// not drawn since the last Update, so nobody is going to wait for the old one
+	if(upload_fence)
+		f->glDeleteSync(upload_fence);
+	upload_fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	// make the fences visible to the widget's context
+	f->glFlush();
 
 	return true;
 }
@@ -311,11 +516,10 @@ void AVOpenGLWidget::initializeGL()
 		return;
 	}
 
-	for(int i=0; i<2; i++)
+	for(int i=0; i<3; i++)
 	{
 		frames[i].conversion_config = conversion_config;
 		f->glGenTextures(conversion_config->planes, frames[i].tex);
-		f->glGenBuffers(conversion_config->planes, frames[i].pbo);
 		uint8_t uv_default[] = {0x7f, 0x7f};
 		for(int j=0; j<conversion_config->planes; j++)
 		{
@@ -328,6 +532,10 @@ void AVOpenGLWidget::initializeGL()
 		}
 		frames[i].width = 0;
 		frames[i].height = 0;
+		frames[i].upload_fence = nullptr;
+		frames[i].draw_fence = nullptr;
+		frames[i].ready_us = 0;
+		frames[i].present_us = 0;
 	}
 
 	f->glUseProgram(program);
@@ -383,7 +591,24 @@ void AVOpenGLWidget::paintGL()
 	int widget_height = (int)(height() * devicePixelRatioF());
 
 	QMutexLocker lock(&frames_mutex);
+	if(frame_ready_new)
+	{
+		// always present the newest frame, older ones have already been replaced in the mailbox
+		std::swap(frame_fg, frame_ready);
+		frame_ready_new = false;
+	}
 	AVOpenGLFrame *frame = &frames[frame_fg];
+	if(!frame->present_us)
+	{
+		if(frame->ready_us)
+		{
+			frame->present_us = chiaki_time_now_monotonic_us();
+			frames_presented++;
+			present_latency_us_sum += frame->present_us - frame->ready_us;
+		}
+	}
+	else if(pacing)
+		frames_repeated++;
 
 	GLsizei vp_width, vp_height;
 	if(!frame->width || !frame->height)
@@ -408,6 +633,13 @@ void AVOpenGLWidget::paintGL()
 
 	f->glViewport((widget_width - vp_width) / 2, (widget_height - vp_height) / 2, vp_width, vp_height);
 
+	if(frame->upload_fence)
+	{
+		f->glWaitSync(frame->upload_fence, 0, GL_TIMEOUT_IGNORED);
+		f->glDeleteSync(frame->upload_fence);
+		frame->upload_fence = nullptr;
+	}
+
 	for(int i=0; i<3; i++)
 	{
 		f->glActiveTexture(GL_TEXTURE0 + i);
@@ -416,5 +648,8 @@ void AVOpenGLWidget::paintGL()
 
 	f->glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 
-	f->glFinish();
+	if(frame->draw_fence)
+		f->glDeleteSync(frame->draw_fence);
+	frame->draw_fence = f->glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	f->glFlush();
 }
@@ -17,10 +17,12 @@
 
 #include <controllermanager.h>
 
+#include <chiaki/time.h>
+
 #include <QCoreApplication>
 #include <QMessageBox>
 #include <QByteArray>
-#include <QTimer>
+#include <QThread>
 
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 #include <SDL.h>
@@ -28,7 +30,20 @@
 
 static ControllerManager *instance = nullptr;
 
-#define UPDATE_INTERVAL_MS 4
+// only bounds how long stopping the input thread may take if the wakeup event can not be pushed
+#define INPUT_WAIT_TIMEOUT_MS 100
+
+class ControllerInputThread : public QThread
+{
+	private:
+		ControllerManager *manager;
+
+	protected:
+		void run() override	{ manager->RunInputThread(); }
+
+	public:
+		ControllerInputThread(ControllerManager *manager) : QThread(manager), manager(manager) {}
+};
 
 ControllerManager *ControllerManager::GetInstance()
 {
@@ -48,9 +63,9 @@ ControllerManager::ControllerManager(QObject *parent)
 		QMessageBox::critical(nullptr, "SDL Init", tr("Failed to initialized SDL Gamecontroller: %1").arg(err ? err : ""));
 	}
 
-	auto timer = new QTimer(this);
-	connect(timer, &QTimer::timeout, this, &ControllerManager::HandleEvents);
-	timer->start(UPDATE_INTERVAL_MS);
+	wakeup_event = SDL_RegisterEvents(1);
+	input_thread = new ControllerInputThread(this);
+	input_thread->start(QThread::HighestPriority);
 #endif
 
 	UpdateAvailableControllers();
@@ -59,6 +74,14 @@ ControllerManager::ControllerManager(QObject *parent)
 ControllerManager::~ControllerManager()
 {
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+	input_thread_stop.storeRelease(1);
+	if(wakeup_event != (Uint32)-1)
+	{
+		SDL_Event event = {};
+		event.type = wakeup_event;
+		SDL_PushEvent(&event);
+	}
+	input_thread->wait();
 	SDL_Quit();
 #endif
 }
@@ -82,35 +105,40 @@ void ControllerManager::UpdateAvailableControllers()
 #endif
 }
 
-void ControllerManager::HandleEvents()
+void ControllerManager::RunInputThread()
 {
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	SDL_Event event;
-	while(SDL_PollEvent(&event))
+	while(!input_thread_stop.loadAcquire())
 	{
+		SDL_Event event;
+		if(!SDL_WaitEventTimeout(&event, INPUT_WAIT_TIMEOUT_MS))
+			continue;
+		quint64 time_us = chiaki_time_now_monotonic_us();
 		switch(event.type)
 		{
 			case SDL_JOYDEVICEADDED:
 			case SDL_JOYDEVICEREMOVED:
-				UpdateAvailableControllers();
+				QMetaObject::invokeMethod(this, "UpdateAvailableControllers", Qt::QueuedConnection);
 				break;
 			case SDL_CONTROLLERBUTTONUP:
 			case SDL_CONTROLLERBUTTONDOWN:
-				ControllerEvent(event.cbutton.which);
+				ControllerEvent(event.cbutton.which, time_us);
 				break;
 			case SDL_CONTROLLERAXISMOTION:
-				ControllerEvent(event.caxis.which);
+				ControllerEvent(event.caxis.which, time_us);
 				break;
 		}
 	}
 #endif
 }
 
-void ControllerManager::ControllerEvent(int device_id)
+void ControllerManager::ControllerEvent(int device_id, quint64 time_us)
 {
+	// the lock keeps the controller from being closed while its state is passed on
+	QMutexLocker locker(&open_controllers_mutex);
 	if(!open_controllers.contains(device_id))
 		return;
-	open_controllers[device_id]->UpdateState();
+	open_controllers[device_id]->UpdateState(time_us);
 }
 
 QList<int> ControllerManager::GetAvailableControllers()
@@ -124,6 +152,7 @@ QList<int> ControllerManager::GetAvailableControllers()
 
 Controller *ControllerManager::OpenController(int device_id)
 {
+	QMutexLocker locker(&open_controllers_mutex);
 	if(open_controllers.contains(device_id))
 		return nullptr;
 	auto controller = new Controller(device_id, this);
@@ -133,6 +162,7 @@ Controller *ControllerManager::OpenController(int device_id)
 
 void ControllerManager::ControllerClosed(Controller *controller)
 {
+	QMutexLocker locker(&open_controllers_mutex);
 	open_controllers.remove(controller->GetDeviceID());
 }
 
@@ -156,16 +186,17 @@ Controller::Controller(int device_id, ControllerManager *manager) : QObject(mana
 
 Controller::~Controller()
 {
+	// after this, the input thread does not touch this controller anymore
+	manager->ControllerClosed(this);
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 	if(controller)
 		SDL_GameControllerClose(controller);
 #endif
-	manager->ControllerClosed(this);
 }
 
-void Controller::UpdateState()
+void Controller::UpdateState(quint64 time_us)
 {
-	emit StateChanged();
+	emit StateChanged(GetState(), time_us);
 }
 
 bool Controller::IsConnected()
@@ -22,76 +22,50 @@
 #include <QDir>
 #include <QRegularExpression>
 #include <QDateTime>
-#include <QFile>
 #include <QPair>
 #include <QVector>
 
 
-static void LogCb(ChiakiLogLevel level, const char *msg, void *user);
-
 SessionLog::SessionLog(StreamSession *session, uint32_t level_mask, const QString &filename)
 	: session(session)
 {
-	chiaki_log_init(&log, level_mask, LogCb, this);
+	// printing and writing the file happens on the async log thread,
+	// so the session threads are never stalled by log I/O
+	QByteArray filename_local = filename.toLocal8Bit();
+	bool file_failed = false;
+	ChiakiErrorCode err = chiaki_async_log_init(&async_log, chiaki_log_cb_print, nullptr,
+			filename.isEmpty() ? nullptr : filename_local.constData());
+	if(err != CHIAKI_ERR_SUCCESS && !filename.isEmpty())
+	{
+		file_failed = true;
+		err = chiaki_async_log_init(&async_log, chiaki_log_cb_print, nullptr, nullptr);
+	}
+	async_log_initialized = err == CHIAKI_ERR_SUCCESS;
+
+	if(async_log_initialized)
+		chiaki_log_init_async(&log, level_mask, &async_log);
+	else
+		chiaki_log_init(&log, level_mask, chiaki_log_cb_print, nullptr);
 
 	if(filename.isEmpty())
-	{
-		file = nullptr;
 		CHIAKI_LOGI(&log, "Logging to file disabled");
-	}
+	else if(file_failed || !async_log_initialized)
+		CHIAKI_LOGI(&log, "Failed to open file %s for logging", filename_local.constData());
 	else
-	{
-		file = new QFile(filename);
-		if(!file->open(QIODevice::ReadWrite))
-		{
-			delete file;
-			file = nullptr;
-			CHIAKI_LOGI(&log, "Failed to open file %s for logging", filename.toLocal8Bit().constData());
-		}
-		else
-		{
-			CHIAKI_LOGI(&log, "Logging to file %s", filename.toLocal8Bit().constData());
-		}
-	}
+		CHIAKI_LOGI(&log, "Logging to file %s", filename_local.constData());
 
 	CHIAKI_LOGI(&log, "Chiaki Version " CHIAKI_VERSION);
 }
 
 SessionLog::~SessionLog()
 {
-	delete file;
-}
-
-void SessionLog::Log(ChiakiLogLevel level, const char *msg)
-{
-	chiaki_log_cb_print(level, msg, nullptr);
-
-	if(file)
+	if(async_log_initialized)
 	{
-		static const QString date_format = "yyyy-MM-dd HH:mm:ss:zzzzzz";
-		QString str = QString("[%1] [%2] %3\n").arg(
-				QDateTime::currentDateTime().toString(date_format),
-				QString(chiaki_log_level_char(level)),
-				msg);
-
-		QMutexLocker lock(&file_mutex);
-		file->write(str.toLocal8Bit());
-		file->flush();
+		log.async = nullptr;
+		chiaki_async_log_fini(&async_log);
 	}
 }
 
-class SessionLogPrivate
-{
-	public:
-		static void Log(SessionLog *log, ChiakiLogLevel level, const char *msg) { log->Log(level, msg); }
-};
-
-static void LogCb(ChiakiLogLevel level, const char *msg, void *user)
-{
-	auto log = reinterpret_cast<SessionLog *>(user);
-	SessionLogPrivate::Log(log, level, msg);
-}
-
 #define KEEP_LOG_FILES_COUNT 5
 
 QString GetLogBaseDir()
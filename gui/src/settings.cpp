@@ -84,6 +84,17 @@ void Settings::SetBitrate(unsigned int bitrate)
 	settings.setValue("settings/bitrate", bitrate);
 }
 
+unsigned int Settings::GetVideoQueueSize() const
+{
+	unsigned int v = settings.value("settings/video_queue_size", VIDEO_DECODER_QUEUE_SIZE_MIN).toUInt();
+	return qBound((unsigned int)VIDEO_DECODER_QUEUE_SIZE_MIN, v, (unsigned int)VIDEO_DECODER_QUEUE_SIZE_MAX);
+}
+
+void Settings::SetVideoQueueSize(unsigned int size)
+{
+	settings.setValue("settings/video_queue_size", size);
+}
+
 unsigned int Settings::GetAudioBufferSizeDefault() const
 {
 	return 9600;
@@ -113,6 +124,24 @@ void Settings::SetHardwareDecodeEngine(HardwareDecodeEngine engine)
 	settings.setValue("settings/hw_decode_engine", hw_decode_engine_values[engine]);
 }
 
+static const QMap<SoftwareDecodeMode, QString> sw_decode_mode_values = {
+	{ SW_DECODE_DEFAULT, "default" },
+	{ SW_DECODE_LOW_DELAY, "low_delay" }
+};
+
+static const SoftwareDecodeMode sw_decode_mode_default = SW_DECODE_DEFAULT;
+
+SoftwareDecodeMode Settings::GetSoftwareDecodeMode() const
+{
+	auto v = settings.value("settings/sw_decode_mode", sw_decode_mode_values[sw_decode_mode_default]).toString();
+	return sw_decode_mode_values.key(v, sw_decode_mode_default);
+}
+
+void Settings::SetSoftwareDecodeMode(SoftwareDecodeMode mode)
+{
+	settings.setValue("settings/sw_decode_mode", sw_decode_mode_values[mode]);
+}
+
 unsigned int Settings::GetAudioBufferSize() const
 {
 	unsigned int v = GetAudioBufferSizeRaw();
@@ -170,6 +170,37 @@ SettingsDialog::SettingsDialog(Settings *settings, QWidget *parent) : QDialog(pa
 	connect(hardware_decode_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(HardwareDecodeEngineSelected()));
 	decode_settings_layout->addRow(tr("Hardware decode method:"), hardware_decode_combo_box);
 
+	software_decode_combo_box = new QComboBox(this);
+	static const QList<QPair<SoftwareDecodeMode, const char *>> software_decode_modes = {
+		{ SW_DECODE_DEFAULT, "default"},
+		{ SW_DECODE_LOW_DELAY, "low delay"}
+	};
+	auto current_software_decode_mode = settings->GetSoftwareDecodeMode();
+	for(const auto &p : software_decode_modes)
+	{
+		software_decode_combo_box->addItem(p.second, (int)p.first);
+		if(current_software_decode_mode == p.first)
+			software_decode_combo_box->setCurrentIndex(software_decode_combo_box->count() - 1);
+	}
+	connect(software_decode_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(SoftwareDecodeModeSelected()));
+	decode_settings_layout->addRow(tr("Software decode mode:"), software_decode_combo_box);
+
+	video_pacing_check_box = new QCheckBox(this);
+	decode_settings_layout->addRow(tr("Present on every vsync:"), video_pacing_check_box);
+	video_pacing_check_box->setChecked(settings->GetVideoPacing());
+	connect(video_pacing_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::VideoPacingChanged);
+
+	video_queue_size_combo_box = new QComboBox(this);
+	auto current_video_queue_size = settings->GetVideoQueueSize();
+	for(unsigned int size=VIDEO_DECODER_QUEUE_SIZE_MIN; size<=VIDEO_DECODER_QUEUE_SIZE_MAX; size++)
+	{
+		video_queue_size_combo_box->addItem(QString::number(size), size);
+		if(current_video_queue_size == size)
+			video_queue_size_combo_box->setCurrentIndex(video_queue_size_combo_box->count() - 1);
+	}
+	connect(video_queue_size_combo_box, SIGNAL(currentIndexChanged(int)), this, SLOT(VideoQueueSizeSelected()));
+	decode_settings_layout->addRow(tr("Decoded frames queue size:"), video_queue_size_combo_box);
+
 	// Registered Consoles
 
 	auto registered_hosts_group_box = new QGroupBox(tr("Registered Consoles"));
@@ -272,6 +303,21 @@ void SettingsDialog::HardwareDecodeEngineSelected()
 	settings->SetHardwareDecodeEngine((HardwareDecodeEngine)hardware_decode_combo_box->currentData().toInt());
 }
 
+void SettingsDialog::SoftwareDecodeModeSelected()
+{
+	settings->SetSoftwareDecodeMode((SoftwareDecodeMode)software_decode_combo_box->currentData().toInt());
+}
+
+void SettingsDialog::VideoPacingChanged()
+{
+	settings->SetVideoPacing(video_pacing_check_box->isChecked());
+}
+
+void SettingsDialog::VideoQueueSizeSelected()
+{
+	settings->SetVideoQueueSize(video_queue_size_combo_box->currentData().toUInt());
+}
+
 void SettingsDialog::UpdateBitratePlaceholder()
 {
 	bitrate_edit->setPlaceholderText(tr("Automatic (%1)").arg(settings->GetVideoProfile().bitrate));
@@ -28,14 +28,20 @@
 
 #include <QKeyEvent>
 #include <QAudioOutput>
+#include <QStandardPaths>
+#include <QDir>
 
 #include <cstring>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 StreamSessionConnectInfo::StreamSessionConnectInfo(Settings *settings, QString host, QByteArray regist_key, QByteArray morning)
 {
 	key_map = settings->GetControllerMappingForDecoding();
 	hw_decode_engine = settings->GetHardwareDecodeEngine();
+	sw_decode_mode = settings->GetSoftwareDecodeMode();
+	video_pacing = settings->GetVideoPacing();
+	video_queue_size = settings->GetVideoQueueSize();
 	log_level_mask = settings->GetLogLevelMask();
 	log_file = CreateLogFilename();
 	video_profile = settings->GetVideoProfile();
@@ -45,9 +51,24 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(Settings *settings, QString h
 	audio_buffer_size = settings->GetAudioBufferSize();
 }
 
+static QString GetSenkushaCacheFilename()
+{
+	auto base_dir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+	if(base_dir.isEmpty())
+		return QString();
+
+	QDir dir(base_dir);
+	if(!dir.mkpath("."))
+		return QString();
+
+	return dir.absoluteFilePath("senkusha_cache");
+}
+
 static void AudioSettingsCb(uint32_t channels, uint32_t rate, void *user);
 static void AudioFrameCb(int16_t *buf, size_t samples_count, void *user);
 static bool VideoSampleCb(uint8_t *buf, size_t buf_size, void *user);
+static void VideoProfilesCb(ChiakiVideoProfile *profiles, size_t profiles_count, void *user);
+static void VideoProfileSwitchCb(size_t profile_index, void *user);
 static void EventCb(ChiakiEvent *event, void *user);
 
 StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObject *parent)
@@ -57,13 +78,19 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	gamepad(nullptr),
 #endif
 	controller(nullptr),
-	video_decoder(connect_info.hw_decode_engine, log.GetChiakiLog()),
+	video_decoder(connect_info.hw_decode_engine, connect_info.sw_decode_mode, connect_info.video_queue_size, log.GetChiakiLog()),
 	audio_output(nullptr),
 	audio_io(nullptr)
 {
 	chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
 	audio_buffer_size = connect_info.audio_buffer_size;
 
+	if(chiaki_senkusha_cache_init(&senkusha_cache) != CHIAKI_ERR_SUCCESS)
+		throw ChiakiException("Senkusha Cache Init failed");
+	senkusha_cache_file = GetSenkushaCacheFilename();
+	if(!senkusha_cache_file.isEmpty())
+		chiaki_senkusha_cache_load(&senkusha_cache, senkusha_cache_file.toLocal8Bit().constData());
+
 	QByteArray host_str = connect_info.host.toUtf8();
 
 	ChiakiConnectInfo chiaki_connect_info;
@@ -78,6 +105,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 		throw ChiakiException("Morning invalid");
 	memcpy(chiaki_connect_info.morning, connect_info.morning.constData(), sizeof(chiaki_connect_info.morning));
 
+	memset(&controller_state, 0, sizeof(controller_state));
 	memset(&keyboard_state, 0, sizeof(keyboard_state));
 
 	ChiakiErrorCode err = chiaki_session_init(&session, &chiaki_connect_info, log.GetChiakiLog());
@@ -90,7 +118,9 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	chiaki_session_set_audio_sink(&session, &audio_sink);
 
 	chiaki_session_set_video_sample_cb(&session, VideoSampleCb, this);
+	chiaki_session_set_video_profiles_cb(&session, VideoProfilesCb, VideoProfileSwitchCb, this);
 	chiaki_session_set_event_cb(&session, EventCb, this);
+	chiaki_session_set_senkusha_cache(&session, &senkusha_cache);
 
 #if CHIAKI_GUI_ENABLE_QT_GAMEPAD
 	connect(QGamepadManager::instance(), &QGamepadManager::connectedGamepadsChanged, this, &StreamSession::UpdateGamepads);
@@ -105,15 +135,19 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 
 StreamSession::~StreamSession()
 {
-	chiaki_session_join(&session);
-	chiaki_session_fini(&session);
-	chiaki_opus_decoder_fini(&opus_decoder);
+	// controller input may come in from the input thread until the controller is closed
 #if CHIAKI_GUI_ENABLE_QT_GAMEPAD
 	delete gamepad;
 #endif
 #if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 	delete controller;
 #endif
+	chiaki_session_join(&session);
+	chiaki_session_fini(&session);
+	if(!senkusha_cache_file.isEmpty())
+		chiaki_senkusha_cache_save(&senkusha_cache, senkusha_cache_file.toLocal8Bit().constData());
+	chiaki_senkusha_cache_fini(&senkusha_cache);
+	chiaki_opus_decoder_fini(&opus_decoder);
 }
 
 void StreamSession::Start()
@@ -139,11 +173,12 @@ void StreamSession::SetLoginPIN(const QString &pin)
 
 void StreamSession::HandleMouseEvent(QMouseEvent *event)
 {
+	QMutexLocker locker(&input_mutex);
 	if(event->type() == QEvent::MouseButtonPress)
 		keyboard_state.buttons |= CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
 	else
 		keyboard_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
-	SendFeedbackState();
+	SendFeedbackStateLocked(chiaki_time_now_monotonic_us());
 }
 
 void StreamSession::HandleKeyboardEvent(QKeyEvent *event)
@@ -157,6 +192,7 @@ void StreamSession::HandleKeyboardEvent(QKeyEvent *event)
 	int button = key_map[Qt::Key(event->key())];
 	bool press_event = event->type() == QEvent::Type::KeyPress;
 
+	QMutexLocker locker(&input_mutex);
 	switch(button)
 	{
 		case CHIAKI_CONTROLLER_ANALOG_BUTTON_L2:
@@ -197,7 +233,7 @@ void StreamSession::HandleKeyboardEvent(QKeyEvent *event)
 			break;
 	}
 
-	SendFeedbackState();
+	SendFeedbackStateLocked(chiaki_time_now_monotonic_us());
 }
 
 void StreamSession::UpdateGamepads()
@@ -250,6 +286,8 @@ void StreamSession::UpdateGamepads()
 			CHIAKI_LOGI(log.GetChiakiLog(), "Controller %d disconnected", controller->GetDeviceID());
 			delete controller;
 			controller = nullptr;
+			QMutexLocker locker(&input_mutex);
+			memset(&controller_state, 0, sizeof(controller_state));
 		}
 		const auto available_controllers = ControllerManager::GetInstance()->GetAvailableControllers();
 		if(!available_controllers.isEmpty())
@@ -261,7 +299,9 @@ void StreamSession::UpdateGamepads()
 				return;
 			}
 			CHIAKI_LOGI(log.GetChiakiLog(), "Controller %d opened: \"%s\"", available_controllers[0], controller->GetName().toLocal8Bit().constData());
-			connect(controller, &Controller::StateChanged, this, &StreamSession::SendFeedbackState);
+			connect(controller, &Controller::StateChanged, this, &StreamSession::ControllerStateChanged, Qt::DirectConnection);
+			QMutexLocker locker(&input_mutex);
+			controller_state = controller->GetState();
 		}
 	}
 
@@ -269,7 +309,20 @@ void StreamSession::UpdateGamepads()
 #endif
 }
 
+void StreamSession::ControllerStateChanged(const ChiakiControllerState &state, quint64 time_us)
+{
+	QMutexLocker locker(&input_mutex);
+	controller_state = state;
+	SendFeedbackStateLocked(time_us);
+}
+
 void StreamSession::SendFeedbackState()
+{
+	QMutexLocker locker(&input_mutex);
+	SendFeedbackStateLocked(chiaki_time_now_monotonic_us());
+}
+
+void StreamSession::SendFeedbackStateLocked(uint64_t input_time_us)
 {
 	ChiakiControllerState state = {};
 
@@ -301,12 +354,12 @@ void StreamSession::SendFeedbackState()
 #endif
 
 #if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	if(controller)
-		state = controller->GetState();
+	// controller_state is idle while no controller is open
+	chiaki_controller_state_or(&state, &state, &controller_state);
 #endif
 
 	chiaki_controller_state_or(&state, &state, &keyboard_state);
-	chiaki_session_set_controller_state(&session, &state);
+	chiaki_session_set_controller_state_at(&session, &state, input_time_us);
 }
 
 void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
@@ -347,9 +400,9 @@ void StreamSession::PushAudioFrame(int16_t *buf, size_t samples_count)
 	audio_io->write((const char *)buf, static_cast<qint64>(samples_count * 2 * 2));
 }
 
-void StreamSession::PushVideoSample(uint8_t *buf, size_t buf_size)
+bool StreamSession::PushVideoSample(uint8_t *buf, size_t buf_size)
 {
-	video_decoder.PushFrame(buf, buf_size);
+	return video_decoder.PushFrame(buf, buf_size);
 }
 
 void StreamSession::Event(ChiakiEvent *event)
@@ -374,7 +427,7 @@ class StreamSessionPrivate
 		}
 
 		static void PushAudioFrame(StreamSession *session, int16_t *buf, size_t samples_count)	{ session->PushAudioFrame(buf, samples_count); }
-		static void PushVideoSample(StreamSession *session, uint8_t *buf, size_t buf_size)		{ session->PushVideoSample(buf, buf_size); }
+		static bool PushVideoSample(StreamSession *session, uint8_t *buf, size_t buf_size)		{ return session->PushVideoSample(buf, buf_size); }
 		static void Event(StreamSession *session, ChiakiEvent *event)							{ session->Event(event); }
 };
 
@@ -393,8 +446,19 @@ static void AudioFrameCb(int16_t *buf, size_t samples_count, void *user)
 static bool VideoSampleCb(uint8_t *buf, size_t buf_size, void *user)
 {
 	auto session = reinterpret_cast<StreamSession *>(user);
-	StreamSessionPrivate::PushVideoSample(session, buf, buf_size);
-	return true;
+	return StreamSessionPrivate::PushVideoSample(session, buf, buf_size);
+}
+
+static void VideoProfilesCb(ChiakiVideoProfile *profiles, size_t profiles_count, void *user)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	session->GetVideoDecoder()->SetProfiles(profiles, profiles_count);
+}
+
+static void VideoProfileSwitchCb(size_t profile_index, void *user)
+{
+	auto session = reinterpret_cast<StreamSession *>(user);
+	session->GetVideoDecoder()->SwitchProfile(profile_index);
 }
 
 static void EventCb(ChiakiEvent *event, void *user)
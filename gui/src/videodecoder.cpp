@@ -17,14 +17,50 @@
 
 #include <videodecoder.h>
 
+#include <chiaki/time.h>
+#include <chiaki/h264.h>
+
 #include <libavcodec/avcodec.h>
 
 #include <QImage>
+#include <QThread>
+
+#include <cstring>
+
+// frames beyond this are freed instead of being kept for reuse
+#define FRAME_POOL_MAX 8
+
+#define LOW_DELAY_THREADS_MAX 16
+
+static ChiakiH264FrameType InspectFrameType(const QByteArray &buf)
+{
+	ChiakiH264FrameInfo info;
+	chiaki_h264_frame_inspect(reinterpret_cast<const uint8_t *>(buf.constData()), (size_t)buf.size(), &info);
+	return info.type;
+}
+
+class VideoDecoderThread : public QThread
+{
+	private:
+		VideoDecoder *decoder;
+
+	protected:
+		void run() override	{ decoder->RunDecodeThread(); }
 
-VideoDecoder::VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log) : hw_decode_engine(hw_decode_engine), log(log)
+	public:
+		VideoDecoderThread(VideoDecoder *decoder) : QThread(decoder), decoder(decoder) {}
+};
+
+VideoDecoder::VideoDecoder(HardwareDecodeEngine hw_decode_engine, SoftwareDecodeMode sw_decode_mode, unsigned int queue_size, ChiakiLog *log) : hw_decode_engine(hw_decode_engine), sw_decode_mode(sw_decode_mode), log(log)
 {
 	enum AVHWDeviceType type;
 	hw_device_ctx = nullptr;
+	stop = false;
+	input_packets = 0;
+	input_overflowed = false;
+	profile_pending = -1;
+	memset(&stats, 0, sizeof(stats));
+	this->queue_size = qBound((unsigned int)VIDEO_DECODER_QUEUE_SIZE_MIN, queue_size, (unsigned int)VIDEO_DECODER_QUEUE_SIZE_MAX);
 
 	#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 10, 100)
 	avcodec_register_all();
@@ -33,10 +69,6 @@ VideoDecoder::VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log
 	if(!codec)
 		throw VideoDecoderException("H264 Codec not available");
 
-	codec_context = avcodec_alloc_context3(codec);
-	if(!codec_context)
-		throw VideoDecoderException("Failed to alloc codec context");
-
 	if(hw_decode_engine)
 	{
 		if(!hardware_decode_engine_names.contains(hw_decode_engine))
@@ -62,116 +94,401 @@ VideoDecoder::VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log
 
 		if(av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) < 0)
 			throw VideoDecoderException("Failed to create hwdevice context");
-		codec_context->hw_device_ctx = av_buffer_ref(hw_device_ctx);
 	}
+	else if(sw_decode_mode == SW_DECODE_LOW_DELAY)
+		CHIAKI_LOGI(log, "Using low delay software decode with %d slice threads", qBound(1, QThread::idealThreadCount(), LOW_DELAY_THREADS_MAX));
 
-	if(avcodec_open2(codec_context, codec, nullptr) < 0)
+	initial_codec_context = OpenCodecContext();
+	if(!initial_codec_context)
 	{
-		avcodec_free_context(&codec_context);
+		if(hw_device_ctx)
+			av_buffer_unref(&hw_device_ctx);
 		throw VideoDecoderException("Failed to open codec context");
 	}
+	codec_context = initial_codec_context;
+
+	decode_thread = new VideoDecoderThread(this);
+	decode_thread->setObjectName("Video Decoder");
+	decode_thread->start(QThread::HighPriority);
 }
 
 VideoDecoder::~VideoDecoder()
 {
-	avcodec_close(codec_context);
-	avcodec_free_context(&codec_context);
+	{
+		QMutexLocker locker(&mutex);
+		stop = true;
+		cond.wakeOne();
+	}
+	decode_thread->wait();
+	delete decode_thread;
+
+	CHIAKI_LOGI(log, "Video Decoder decoded %llu frames in %.3f ms on average, max %.3f ms, skipped %llu, dropped %llu, discarded %llu before IDR, %llu on overflow, waited %.3f ms on average in queue",
+			(unsigned long long)stats.frames_decoded,
+			stats.frames_decoded ? (double)stats.decode_us_sum / stats.frames_decoded / 1000.0 : 0.0,
+			(double)stats.decode_us_max / 1000.0,
+			(unsigned long long)stats.frames_skipped,
+			(unsigned long long)stats.frames_dropped,
+			(unsigned long long)stats.frames_before_idr,
+			(unsigned long long)stats.frames_overflowed,
+			stats.frames_pulled ? (double)stats.queue_us_sum / stats.frames_pulled / 1000.0 : 0.0);
+
+	for(auto &queued : output_queue)
+		av_frame_free(&queued.frame);
+	for(AVFrame *frame : frame_pool)
+		av_frame_free(&frame);
+
+	avcodec_free_context(&initial_codec_context);
+	for(AVCodecContext *context : profile_codec_contexts)
+		avcodec_free_context(&context);
 	if(hw_device_ctx)
 	{
 		av_buffer_unref(&hw_device_ctx);
 	}
 }
 
-void VideoDecoder::PushFrame(uint8_t *buf, size_t buf_size)
+bool VideoDecoder::PushFrame(uint8_t *buf, size_t buf_size)
 {
-	{
-		QMutexLocker locker(&mutex);
+	// FFmpeg may read beyond the end of the packet, so it needs zeroed padding
+	QByteArray packet_buf(buf_size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+	memcpy(packet_buf.data(), buf, buf_size);
+	packet_buf.resize(buf_size);
 
-		AVPacket packet;
-		av_init_packet(&packet);
-		packet.data = buf;
-		packet.size = buf_size;
-		int r;
-send_packet:
-		r = avcodec_send_packet(codec_context, &packet);
-		if(r != 0)
+	QMutexLocker locker(&mutex);
+	if(!input_overflowed && input_packets >= VIDEO_DECODER_INPUT_QUEUE_MAX)
+	{
+		// the decoder can't keep up, so skip everything queued and continue with the next IDR frame
+		CHIAKI_LOGW(log, "Video Decoder input queue overflowed, dropping frames until the next IDR frame");
+		for(auto it = input_queue.begin(); it != input_queue.end();)
 		{
-			if(r == AVERROR(EAGAIN))
-			{
-				CHIAKI_LOGE(log, "AVCodec internal buffer is full removing frames before pushing");
-				AVFrame *frame = av_frame_alloc();
-				if(!frame)
-				{
-					CHIAKI_LOGE(log, "Failed to alloc AVFrame");
-					return;
-				}
-				r = avcodec_receive_frame(codec_context, frame);
-				av_frame_free(&frame);
-				if(r != 0)
-				{
-					CHIAKI_LOGE(log, "Failed to pull frame");
-					return;
-				}
-				goto send_packet;
-			}
-			else
+			if(it->type != Input::Packet)
 			{
-				char errbuf[128];
-				av_make_error_string(errbuf, sizeof(errbuf), r);
-				CHIAKI_LOGE(log, "Failed to push frame: %s", errbuf);
-				return;
+				it++;
+				continue;
 			}
+			it = input_queue.erase(it);
+			stats.frames_overflowed++;
+		}
+		input_packets = 0;
+		input_overflowed = true;
+	}
+	if(input_overflowed)
+	{
+		if(InspectFrameType(packet_buf) != CHIAKI_H264_FRAME_TYPE_IDR)
+		{
+			stats.frames_overflowed++;
+			return false;
 		}
+		input_overflowed = false;
 	}
 
-	emit FramesAvailable();
+	Input input = {};
+	input.type = Input::Packet;
+	input.packet = packet_buf;
+	input_queue.enqueue(input);
+	input_packets++;
+	cond.wakeOne();
+	return true;
 }
 
-AVFrame *VideoDecoder::PullFrame()
+void VideoDecoder::SetProfiles(ChiakiVideoProfile *profiles, size_t profiles_count)
 {
+	Input input = {};
+	input.type = Input::Profiles;
+	for(size_t i=0; i<profiles_count; i++)
+	{
+		QByteArray header(profiles[i].header_sz + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+		memcpy(header.data(), profiles[i].header, profiles[i].header_sz);
+		header.resize(profiles[i].header_sz);
+		input.profile_headers.append(header);
+	}
+	QMutexLocker locker(&mutex);
+	input_queue.enqueue(input);
+	cond.wakeOne();
+}
+
+void VideoDecoder::SwitchProfile(size_t profile_index)
+{
+	Input input = {};
+	input.type = Input::ProfileSwitch;
+	input.profile_index = (int)profile_index;
 	QMutexLocker locker(&mutex);
+	input_queue.enqueue(input);
+	cond.wakeOne();
+}
+
+AVCodecContext *VideoDecoder::OpenCodecContext()
+{
+	AVCodecContext *context = avcodec_alloc_context3(codec);
+	if(!context)
+		return nullptr;
+
+	if(hw_device_ctx)
+		context->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+	else if(sw_decode_mode == SW_DECODE_LOW_DELAY)
+	{
+		// Slice threads decode parts of the same frame in parallel and add no latency,
+		// unlike frame threads, which each hold back one frame.
+		context->thread_type = FF_THREAD_SLICE;
+		context->thread_count = qBound(1, QThread::idealThreadCount(), LOW_DELAY_THREADS_MAX);
+		context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		context->flags2 |= AV_CODEC_FLAG2_FAST;
+	}
+
+	if(avcodec_open2(context, codec, nullptr) < 0)
+	{
+		avcodec_free_context(&context);
+		return nullptr;
+	}
+	return context;
+}
+
+/**
+ * Open a codec context for each profile and feed it the profile's SPS and PPS,
+ * so everything is ready when the stream switches to it.
+ */
+void VideoDecoder::PrepareProfiles(const QList<QByteArray> &headers)
+{
+	if(!profile_headers.isEmpty())
+	{
+		CHIAKI_LOGE(log, "Video Decoder profiles already set");
+		return;
+	}
+	profile_headers = headers;
+
+	AVCodecContext *current = codec_context;
+	for(const QByteArray &header : headers)
+	{
+		codec_context = OpenCodecContext();
+		if(!codec_context)
+			CHIAKI_LOGE(log, "Video Decoder failed to prepare codec context for profile %d, switching to it will reconfigure the current one",
+					profile_codec_contexts.size());
+		else
+			Decode(header);
+		profile_codec_contexts.append(codec_context);
+	}
+	codec_context = current;
+	CHIAKI_LOGI(log, "Video Decoder prepared codec contexts for %d profiles", headers.size());
+}
+
+/**
+ * @return whether packet_buf should be decoded, false if it must be dropped while waiting for an IDR frame
+ */
+bool VideoDecoder::SwitchPendingProfile(const QByteArray &packet_buf)
+{
+	AVCodecContext *next = profile_pending < profile_codec_contexts.size() ? profile_codec_contexts[profile_pending] : nullptr;
+	if(!next)
+	{
+		// not prepared, fall back to reconfiguring the current codec context
+		if(profile_pending < profile_headers.size())
+			Decode(profile_headers[profile_pending]);
+		profile_pending = -1;
+		return true;
+	}
+
+	if(next == codec_context)
+	{
+		profile_pending = -1;
+		return true;
+	}
+
+	// frames before the first IDR frame reference pictures the prepared codec context never saw
+	if(InspectFrameType(packet_buf) != CHIAKI_H264_FRAME_TYPE_IDR)
+		return false;
+
+	// the old context will start from an IDR frame again if the stream switches back
+	avcodec_flush_buffers(codec_context);
+	codec_context = next;
+	CHIAKI_LOGI(log, "Video Decoder switched to profile %d", profile_pending);
+	profile_pending = -1;
+	return true;
+}
 
-	// always try to pull as much as possible and return only the very last frame
-	AVFrame *frame_last = nullptr;
-	AVFrame *sw_frame = nullptr;
-	AVFrame *frame = nullptr; 
+void VideoDecoder::RunDecodeThread()
+{
+	QMutexLocker locker(&mutex);
 	while(true)
 	{
-		AVFrame *next_frame;
-		if(frame_last)
+		while(!stop && input_queue.isEmpty())
+			cond.wait(&mutex);
+		if(stop)
+			break;
+		Input input = input_queue.dequeue();
+		if(input.type == Input::Packet)
+			input_packets--;
+
+		// when the output queue is behind, only decode what later frames depend on
+		bool behind = (unsigned int)output_queue.size() >= queue_size;
+
+		locker.unlock();
+		switch(input.type)
 		{
-			av_frame_unref(frame_last);
-			next_frame = frame_last;
+			case Input::Profiles:
+				PrepareProfiles(input.profile_headers);
+				break;
+			case Input::ProfileSwitch:
+				profile_pending = input.profile_index;
+				break;
+			case Input::Packet:
+				if(profile_pending >= 0 && !SwitchPendingProfile(input.packet))
+				{
+					QMutexLocker stats_locker(&mutex);
+					stats.frames_before_idr++;
+					break;
+				}
+				if(behind && InspectFrameType(input.packet) == CHIAKI_H264_FRAME_TYPE_NONREF)
+				{
+					// nothing depends on it, so it is dropped without being decoded at all
+					QMutexLocker stats_locker(&mutex);
+					stats.frames_skipped++;
+					break;
+				}
+				Decode(input.packet);
+				break;
 		}
-		else
+		locker.relock();
+	}
+}
+
+void VideoDecoder::Decode(const QByteArray &packet_buf)
+{
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+
+	AVPacket packet;
+	av_init_packet(&packet);
+	packet.data = (uint8_t *)packet_buf.constData();
+	packet.size = packet_buf.size();
+	bool sent = false;
+	while(true)
+	{
+		if(!sent)
 		{
-			next_frame = av_frame_alloc();
-			if(!next_frame)
-				return frame;
+			int r = avcodec_send_packet(codec_context, &packet);
+			if(r == 0)
+				sent = true;
+			else if(r != AVERROR(EAGAIN))
+			{
+				char errbuf[128];
+				av_make_error_string(errbuf, sizeof(errbuf), r);
+				CHIAKI_LOGE(log, "Failed to push frame: %s", errbuf);
+				return;
+			}
+			// on EAGAIN, decoded frames must be received before the packet fits
 		}
-		frame_last = frame;
-		frame = next_frame;
-		int r = avcodec_receive_frame(codec_context, frame);
-		if(r == 0)
+
+		AVFrame *frame = AcquireFrame();
+		if(!frame)
 		{
-			frame = hw_decode_engine ? GetFromHardware(frame) : frame;
+			CHIAKI_LOGE(log, "Failed to alloc AVFrame");
+			return;
 		}
-		else
+		int r = avcodec_receive_frame(codec_context, frame);
+		if(r != 0)
 		{
+			ReleaseFrame(frame);
 			if(r != AVERROR(EAGAIN))
+			{
 				CHIAKI_LOGE(log, "Decoding with FFMPEG failed");
-			av_frame_free(&frame);
-			return frame_last;
+				return;
+			}
+			if(!sent)
+			{
+				CHIAKI_LOGE(log, "AVCodec neither accepts packets nor returns frames");
+				return;
+			}
+			break;
+		}
+
+		if(hw_decode_engine)
+		{
+			frame = GetFromHardware(frame);
+			if(!frame)
+				continue;
 		}
+
+		QueueFrame(frame, start_us);
 	}
+
 }
 
-AVFrame *VideoDecoder::GetFromHardware(AVFrame *hw_frame)
+void VideoDecoder::QueueFrame(AVFrame *frame, uint64_t start_us)
+{
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t decode_us = now_us - start_us;
+	{
+		QMutexLocker locker(&mutex);
+		stats.frames_decoded++;
+		stats.decode_us_last = decode_us;
+		stats.decode_us_sum += decode_us;
+		if(decode_us > stats.decode_us_max)
+			stats.decode_us_max = decode_us;
+
+		while((unsigned int)output_queue.size() >= queue_size)
+		{
+			AVFrame *dropped = output_queue.dequeue().frame;
+			av_frame_unref(dropped);
+			frame_pool.append(dropped);
+			stats.frames_dropped++;
+		}
+		output_queue.enqueue({ frame, now_us });
+	}
+
+	emit FramesAvailable();
+}
+
+AVFrame *VideoDecoder::AcquireFrame()
 {
-	AVFrame *frame;
-	AVFrame *sw_frame;
+	{
+		QMutexLocker locker(&mutex);
+		if(!frame_pool.isEmpty())
+			return frame_pool.takeLast();
+	}
+	return av_frame_alloc();
+}
 
-	sw_frame = av_frame_alloc();
+void VideoDecoder::ReleaseFrame(AVFrame *frame)
+{
+	if(!frame)
+		return;
+	av_frame_unref(frame);
+	QMutexLocker locker(&mutex);
+	if(frame_pool.size() >= FRAME_POOL_MAX)
+	{
+		av_frame_free(&frame);
+		return;
+	}
+	frame_pool.append(frame);
+}
+
+AVFrame *VideoDecoder::PullFrame()
+{
+	QMutexLocker locker(&mutex);
+	if(output_queue.isEmpty())
+		return nullptr;
+	QueuedFrame queued = output_queue.dequeue();
+	uint64_t queue_us = chiaki_time_now_monotonic_us() - queued.decoded_us;
+	stats.frames_pulled++;
+	stats.queue_us_last = queue_us;
+	stats.queue_us_sum += queue_us;
+	if(queue_us > stats.queue_us_max)
+		stats.queue_us_max = queue_us;
+	return queued.frame;
+}
+
+VideoDecoderStats VideoDecoder::GetStats()
+{
+	QMutexLocker locker(&mutex);
+	return stats;
+}
+
+AVFrame *VideoDecoder::GetFromHardware(AVFrame *hw_frame)
+{
+	AVFrame *sw_frame = AcquireFrame();
+	if(!sw_frame)
+	{
+		CHIAKI_LOGE(log, "Failed to alloc AVFrame");
+		ReleaseFrame(hw_frame);
+		return nullptr;
+	}
 
 	int ret = av_hwframe_transfer_data(sw_frame, hw_frame, 0);
 
@@ -180,11 +497,11 @@ AVFrame *VideoDecoder::GetFromHardware(AVFrame *hw_frame)
 		CHIAKI_LOGE(log, "Failed to transfer frame from hardware");
 	}
 
-	av_frame_unref(hw_frame);
+	ReleaseFrame(hw_frame);
 
 	if(sw_frame->width <= 0)
 	{
-		av_frame_unref(sw_frame);
+		ReleaseFrame(sw_frame);
 		return nullptr;
 	}
 
@@ -0,0 +1,93 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CHIAKI_ALLOCATOR_H
+#define CHIAKI_ALLOCATOR_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX 512
+
+typedef struct chiaki_alloc_site_stats_t
+{
+	const char *site; // see CHIAKI_ALLOC_SITE
+	uint64_t allocs; // including reallocs
+	uint64_t bytes;
+} ChiakiAllocSiteStats;
+
+/**
+ * ChiakiAllocator that counts allocations per call site and forwards them to another allocator.
+ *
+ * Typical use is to install it with chiaki_set_allocator() at startup, call
+ * chiaki_instrumented_allocator_reset() once a stream is running and check later that
+ * nothing was allocated in the meantime.
+ */
+typedef struct chiaki_instrumented_allocator_t
+{
+	ChiakiAllocator parent;
+	ChiakiMutex mutex;
+	ChiakiAllocSiteStats sites[CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX]; // hash table by site
+	size_t sites_count;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+	uint64_t allocs_untracked; // allocs whose site did not fit into sites anymore
+} ChiakiInstrumentedAllocator;
+
+/**
+ * @param parent allocator doing the actual work, NULL for the one currently set
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_instrumented_allocator_init(ChiakiInstrumentedAllocator *ia, const ChiakiAllocator *parent);
+CHIAKI_EXPORT void chiaki_instrumented_allocator_fini(ChiakiInstrumentedAllocator *ia);
+
+/**
+ * Get the allocator to pass to chiaki_set_allocator(). ia must outlive its use.
+ */
+CHIAKI_EXPORT void chiaki_instrumented_allocator_get(ChiakiInstrumentedAllocator *ia, ChiakiAllocator *allocator);
+
+/**
+ * Reset all counters, e.g. once the steady state of a stream has been reached.
+ */
+CHIAKI_EXPORT void chiaki_instrumented_allocator_reset(ChiakiInstrumentedAllocator *ia);
+
+/**
+ * @param sites filled with the stats of up to sites_max call sites, the ones with the most allocs first
+ * @return number of entries written to sites
+ */
+CHIAKI_EXPORT size_t chiaki_instrumented_allocator_get_sites(ChiakiInstrumentedAllocator *ia, ChiakiAllocSiteStats *sites, size_t sites_max);
+
+CHIAKI_EXPORT uint64_t chiaki_instrumented_allocator_get_allocs(ChiakiInstrumentedAllocator *ia);
+
+/**
+ * Log the totals and every call site that allocated since the last reset.
+ */
+CHIAKI_EXPORT void chiaki_instrumented_allocator_log(ChiakiInstrumentedAllocator *ia, ChiakiLog *log, ChiakiLogLevel level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_ALLOCATOR_H
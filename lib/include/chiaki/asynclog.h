@@ -0,0 +1,94 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_ASYNCLOG_H
+#define CHIAKI_ASYNCLOG_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_async_log_queue_t ChiakiAsyncLogQueue;
+
+/**
+ * Log backend that defers formatting and output to a background thread.
+ *
+ * The logging thread only copies the format string pointer and the raw arguments
+ * into a lock-free queue. Formatting, calling the sink callback and writing to the
+ * file (fully buffered, flushed only when idle) happen on the background thread.
+ * If the queue is full, messages are dropped instead of blocking the caller.
+ *
+ * Format strings passed to a ChiakiLog using this backend must stay valid for the
+ * lifetime of the ChiakiAsyncLog, which is always the case for string literals.
+ */
+typedef struct chiaki_async_log_t
+{
+	ChiakiLogCb cb;
+	void *cb_user;
+	FILE *file;
+	char *file_buf;
+
+	ChiakiAsyncLogQueue *queue;
+	uint64_t dropped_reported;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop;
+	ChiakiThread thread;
+} ChiakiAsyncLog;
+
+/**
+ * @param cb optional callback that is called on the background thread for every formatted message
+ * @param filename optional file to append all messages to
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_async_log_init(ChiakiAsyncLog *alog, ChiakiLogCb cb, void *cb_user, const char *filename);
+
+/**
+ * Write out all pending messages and stop the background thread.
+ * No ChiakiLog may reference alog anymore when calling this.
+ */
+CHIAKI_EXPORT void chiaki_async_log_fini(ChiakiAsyncLog *alog);
+
+/**
+ * Capture a message into the queue. Usually called through chiaki_log().
+ */
+CHIAKI_EXPORT void chiaki_async_log_push(ChiakiAsyncLog *alog, ChiakiLogLevel level, const char *fmt, va_list args);
+
+/**
+ * @return number of messages dropped so far because the queue was full
+ */
+CHIAKI_EXPORT uint64_t chiaki_async_log_dropped(ChiakiAsyncLog *alog);
+
+static inline void chiaki_log_init_async(ChiakiLog *log, uint32_t level_mask, ChiakiAsyncLog *alog)
+{
+	chiaki_log_init(log, level_mask, NULL, NULL);
+	log->async = alog;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_ASYNCLOG_H
@@ -63,7 +63,7 @@ static inline ChiakiAudioReceiver *chiaki_audio_receiver_new(struct chiaki_sessi
 	ChiakiErrorCode err = chiaki_audio_receiver_init(audio_receiver, session);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(audio_receiver);
+		chiaki_free(audio_receiver);
 		return NULL;
 	}
 	return audio_receiver;
@@ -74,7 +74,7 @@ static inline void chiaki_audio_receiver_free(ChiakiAudioReceiver *audio_receive
 	if(!audio_receiver)
 		return;
 	chiaki_audio_receiver_fini(audio_receiver);
-	free(audio_receiver);
+	chiaki_free(audio_receiver);
 }
 
 #ifdef __cplusplus
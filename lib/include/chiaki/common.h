@@ -41,7 +41,49 @@ typedef uint16_t chiaki_unaligned_uint16_t;
 
 #define CHIAKI_EXPORT
 
-#define CHIAKI_NEW(t) ((t*)malloc(sizeof(t)))
+#define CHIAKI_STRINGIFY_(x) #x
+#define CHIAKI_STRINGIFY(x) CHIAKI_STRINGIFY_(x)
+
+/**
+ * Identifies the place in the code that allocates, e.g. "lib/src/takion.c:853"
+ */
+#define CHIAKI_ALLOC_SITE (__FILE__ ":" CHIAKI_STRINGIFY(__LINE__))
+
+/**
+ * Allocation functions used for all heap memory of Chiaki.
+ * Memory of external libraries (FFmpeg, Opus, Jerasure, ...) is not covered.
+ *
+ * @param site string literal identifying the call site, see CHIAKI_ALLOC_SITE
+ */
+typedef struct chiaki_allocator_t
+{
+	void *(*alloc)(size_t size, const char *site, void *user);
+	void *(*realloc)(void *ptr, size_t size, const char *site, void *user); // ptr may be NULL
+	void (*free)(void *ptr, void *user); // ptr is never NULL
+	void *user;
+} ChiakiAllocator;
+
+/**
+ * Replace the allocator used by Chiaki, NULL to go back to malloc(), realloc() and free().
+ * Memory must always be freed by the allocator that allocated it, so this must only be called
+ * while no object of Chiaki exists, ideally before chiaki_lib_init().
+ * allocator is copied.
+ */
+CHIAKI_EXPORT void chiaki_set_allocator(const ChiakiAllocator *allocator);
+CHIAKI_EXPORT void chiaki_get_allocator(ChiakiAllocator *allocator);
+
+CHIAKI_EXPORT void *chiaki_malloc_at(size_t size, const char *site);
+CHIAKI_EXPORT void *chiaki_calloc_at(size_t nmemb, size_t size, const char *site);
+CHIAKI_EXPORT void *chiaki_realloc_at(void *ptr, size_t size, const char *site);
+CHIAKI_EXPORT char *chiaki_strdup_at(const char *str, const char *site);
+CHIAKI_EXPORT void chiaki_free(void *ptr);
+
+#define chiaki_malloc(size) chiaki_malloc_at(size, CHIAKI_ALLOC_SITE)
+#define chiaki_calloc(nmemb, size) chiaki_calloc_at(nmemb, size, CHIAKI_ALLOC_SITE)
+#define chiaki_realloc(ptr, size) chiaki_realloc_at(ptr, size, CHIAKI_ALLOC_SITE)
+#define chiaki_strdup(str) chiaki_strdup_at(str, CHIAKI_ALLOC_SITE)
+
+#define CHIAKI_NEW(t) ((t*)chiaki_malloc(sizeof(t)))
 
 typedef enum
 {
@@ -69,9 +111,14 @@ typedef enum
 
 CHIAKI_EXPORT const char *chiaki_error_string(ChiakiErrorCode code);
 
-CHIAKI_EXPORT void *chiaki_aligned_alloc(size_t alignment, size_t size);
+/**
+ * @param alignment power of two
+ */
+CHIAKI_EXPORT void *chiaki_aligned_alloc_at(size_t alignment, size_t size, const char *site);
 CHIAKI_EXPORT void chiaki_aligned_free(void *ptr);
 
+#define chiaki_aligned_alloc(alignment, size) chiaki_aligned_alloc_at(alignment, size, CHIAKI_ALLOC_SITE)
+
 /**
  * Perform initialization of global state needed for using the Chiaki lib
  */
@@ -0,0 +1,112 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CHIAKI_DATAGRAM_H
+#define CHIAKI_DATAGRAM_H
+
+#include "common.h"
+#include "sock.h"
+#include "stoppipe.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Send buf as a single datagram on the connected socket sock.
+ */
+typedef ChiakiErrorCode (*ChiakiDatagramSend)(void *user, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size);
+
+/**
+ * Send count datagrams at once on the connected socket sock, ideally with a single system call.
+ *
+ * @return the first error that occurred, datagrams after it may not have been sent
+ */
+typedef ChiakiErrorCode (*ChiakiDatagramSendBatch)(void *user, chiaki_socket_t sock, const uint8_t *const *bufs, const size_t *buf_sizes, size_t count);
+
+/**
+ * Wait up to timeout_ms for a datagram on sock and receive it into buf.
+ *
+ * @param buf_size size of buf, will receive the size of the datagram, 0 if recv() returned 0
+ * @return CHIAKI_ERR_CANCELED as soon as stop_pipe has been stopped, CHIAKI_ERR_TIMEOUT if nothing has been received in time
+ */
+typedef ChiakiErrorCode (*ChiakiDatagramRecv)(void *user, chiaki_socket_t sock, ChiakiStopPipe *stop_pipe, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+
+/**
+ * Datagram I/O used by Takion, can be replaced to intercept all packets, e.g. by ChiakiImpairment.
+ */
+typedef struct chiaki_datagram_io_t
+{
+	void *user;
+	ChiakiDatagramSend send_cb;
+	ChiakiDatagramSendBatch send_batch_cb; // may be NULL, then send_cb is called for every datagram
+	ChiakiDatagramRecv recv_cb;
+} ChiakiDatagramIO;
+
+/**
+ * Counters of the plain socket implementation, filled by chiaki_datagram_socket_recv() if passed as its user.
+ */
+typedef struct chiaki_datagram_socket_stats_t
+{
+	/**
+	 * Datagrams the kernel dropped on this socket so far because its receive buffer was full.
+	 * Only counted where SO_RXQ_OVFL is supported and after chiaki_datagram_socket_enable_drop_stats().
+	 */
+	uint32_t kernel_drops;
+} ChiakiDatagramSocketStats;
+
+/**
+ * Let the kernel report dropped datagrams to chiaki_datagram_socket_recv().
+ *
+ * @return CHIAKI_ERR_UNKNOWN if not supported on this platform
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_enable_drop_stats(chiaki_socket_t sock);
+
+/**
+ * Plain socket implementations of ChiakiDatagramSend and ChiakiDatagramRecv.
+ * user is ignored by send and may be NULL or a ChiakiDatagramSocketStats for recv.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_send(void *user, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size);
+
+/**
+ * Uses sendmmsg() where available and falls back to one send() per datagram otherwise.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_send_batch(void *user, chiaki_socket_t sock, const uint8_t *const *bufs, const size_t *buf_sizes, size_t count);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_recv(void *user, chiaki_socket_t sock, ChiakiStopPipe *stop_pipe, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+
+static inline void chiaki_datagram_io_init_socket(ChiakiDatagramIO *io)
+{
+	io->user = NULL;
+	io->send_cb = chiaki_datagram_socket_send;
+	io->send_batch_cb = chiaki_datagram_socket_send_batch;
+	io->recv_cb = chiaki_datagram_socket_recv;
+}
+
+/**
+ * Send count datagrams with io->send_batch_cb or, if it is NULL, one by one with io->send_cb.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_io_send_batch(ChiakiDatagramIO *io, chiaki_socket_t sock, const uint8_t *const *bufs, const size_t *buf_sizes, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_DATAGRAM_H
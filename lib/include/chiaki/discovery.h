@@ -98,6 +98,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_init(ChiakiDiscovery *discovery,
 CHIAKI_EXPORT void chiaki_discovery_fini(ChiakiDiscovery *discovery);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_send(ChiakiDiscovery *discovery, ChiakiDiscoveryPacket *packet, struct sockaddr *addr, size_t addr_size);
 
+/**
+ * Send the same packet to many unicast addresses, in batches with sendmmsg() where available.
+ * Addresses that fail are skipped, the others are still sent to.
+ *
+ * @param sent receives the number of packets sent successfully, may be NULL
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_send_multi(ChiakiDiscovery *discovery, ChiakiDiscoveryPacket *packet, const struct sockaddr_storage *addrs, size_t addrs_count, size_t *sent);
+
 typedef void (*ChiakiDiscoveryCb)(ChiakiDiscoveryHost *host, void *user);
 
 typedef struct chiaki_discovery_thread_t
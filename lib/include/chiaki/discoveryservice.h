@@ -27,22 +27,62 @@ extern "C" {
 
 typedef void (*ChiakiDiscoveryServiceCb)(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user);
 
+typedef enum chiaki_discovery_service_host_event_t
+{
+	CHIAKI_DISCOVERY_SERVICE_HOST_ADDED,
+	CHIAKI_DISCOVERY_SERVICE_HOST_UPDATED,
+	CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED
+} ChiakiDiscoveryServiceHostEvent;
+
+CHIAKI_EXPORT const char *chiaki_discovery_service_host_event_string(ChiakiDiscoveryServiceHostEvent event);
+
+/**
+ * Called for every single host that changed, host is only valid during the call.
+ */
+typedef void (*ChiakiDiscoveryServiceHostCb)(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user);
+
+/**
+ * Max number of addresses chiaki_discovery_probe_addrs_parse() expands to
+ */
+#define CHIAKI_DISCOVERY_PROBE_ADDRS_MAX 65536
+
 typedef struct chiaki_discovery_service_options_t
 {
 	size_t hosts_max;
 	uint64_t host_drop_pings;
 	uint64_t ping_ms;
-	struct sockaddr *send_addr;
+	struct sockaddr *send_addr; // usually the broadcast address, may be NULL if probe_addrs are given
 	size_t send_addr_size;
-	ChiakiDiscoveryServiceCb cb;
-	void *cb_user;
+
+	/**
+	 * Unicast addresses that are pinged individually in addition to send_addr,
+	 * e.g. consoles in other subnets that the broadcast does not reach.
+	 * All must have the same family as send_addr. Copied by chiaki_discovery_service_init().
+	 */
+	struct sockaddr_storage *probe_addrs;
+	size_t probe_addrs_count;
+
+	ChiakiDiscoveryServiceCb cb; // all hosts after any change, may be NULL
+	ChiakiDiscoveryServiceHostCb host_cb; // only the hosts that changed, may be NULL
+	void *cb_user; // passed to cb and host_cb
 } ChiakiDiscoveryServiceOptions;
 
 typedef struct chiaki_discovery_service_host_discovery_info_t
 {
 	uint64_t last_ping_index;
+	uint64_t host_id_hash;
 } ChiakiDiscoveryServiceHostDiscoveryInfo;
 
+typedef struct chiaki_discovery_service_stats_t
+{
+	uint64_t pings;
+	uint64_t probes_sent; // unicast pings to probe_addrs
+	uint64_t responses; // valid responses with a host id
+	uint64_t hosts_added;
+	uint64_t hosts_updated;
+	uint64_t hosts_removed;
+} ChiakiDiscoveryServiceStats;
+
 typedef struct chiaki_discovery_service_t
 {
 	ChiakiLog *log;
@@ -53,6 +93,9 @@ typedef struct chiaki_discovery_service_t
 	ChiakiDiscoveryHost *hosts;
 	ChiakiDiscoveryServiceHostDiscoveryInfo *host_discovery_infos;
 	size_t hosts_count;
+	size_t *host_table; // open addressing on host_id_hash, index in hosts + 1 or 0 if empty
+	size_t host_table_mask;
+	ChiakiDiscoveryServiceStats stats;
 	ChiakiMutex state_mutex;
 
 	ChiakiThread thread;
@@ -61,6 +104,17 @@ typedef struct chiaki_discovery_service_t
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log);
 CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service);
+CHIAKI_EXPORT void chiaki_discovery_service_get_stats(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceStats *stats);
+
+/**
+ * Parse a comma-separated list of IPv4 addresses and subnets like "10.0.1.7,10.0.2.0/24" into
+ * unicast addresses for ChiakiDiscoveryServiceOptions.probe_addrs, all with port CHIAKI_DISCOVERY_PORT.
+ * Subnets are expanded to all of their hosts, excluding the network and broadcast addresses.
+ *
+ * @param addrs receives the addresses, must be freed with chiaki_free()
+ * @return CHIAKI_ERR_INVALID_DATA if str is malformed or expands to more than CHIAKI_DISCOVERY_PROBE_ADDRS_MAX addresses
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_probe_addrs_parse(const char *str, struct sockaddr_storage **addrs, size_t *addrs_count);
 
 #ifdef __cplusplus
 }
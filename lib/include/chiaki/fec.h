@@ -33,6 +33,12 @@ extern "C" {
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 
+/**
+ * Calculate the m FEC units following the k source units in frame_buf.
+ * frame_buf must hold (k + m) * unit_size bytes, the source units being zero-padded to unit_size.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, unsigned int k, unsigned int m);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,6 +27,21 @@
 extern "C" {
 #endif
 
+#define CHIAKI_FEEDBACK_LATENCY_BUCKETS 16
+
+/**
+ * Histogram of the time from a controller state change until it has been sent.
+ * Bucket i counts latencies in [2^i, 2^(i+1)) us, except that the first one
+ * also contains everything below and the last one everything above.
+ */
+typedef struct chiaki_feedback_latency_stats_t
+{
+	uint64_t buckets[CHIAKI_FEEDBACK_LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t max_us;
+} ChiakiFeedbackLatencyStats;
+
 typedef struct chiaki_feedback_sender_t
 {
 	ChiakiLog *log;
@@ -37,18 +52,40 @@ typedef struct chiaki_feedback_sender_t
 
 	ChiakiSeqNum16 history_seq_num;
 	ChiakiFeedbackHistoryBuffer history_buf;
+	uint64_t history_updates; // state updates that changed buttons or triggers
+	uint64_t history_packets;
 
-	bool should_stop;
+	/**
+	 * latest controller state, written without locking so that input threads never wait for the sender
+	 */
+	struct chiaki_feedback_sender_slot_t *slot;
+
+	// only accessed by the sender thread
+	uint64_t slot_seq_taken;
 	ChiakiControllerState controller_state_prev;
 	ChiakiControllerState controller_state;
-	bool controller_state_changed;
-	ChiakiMutex state_mutex;
+
+	bool should_stop;
+	ChiakiFeedbackLatencyStats latency_stats;
+	ChiakiMutex state_mutex; // protects should_stop and latency_stats
 	ChiakiCond state_cond;
 } ChiakiFeedbackSender;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion);
+/**
+ * @param thread_attr attributes of the sender thread, may be NULL
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion, const ChiakiThreadAttr *thread_attr);
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender);
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state);
+
+/**
+ * Publish a new controller state to be sent.
+ * This never waits for the sender thread, so it can be called directly from an input thread.
+ *
+ * @param input_time_us time of the change as given by chiaki_time_now_monotonic_us(), used for the latency stats, 0 if unknown
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state, uint64_t input_time_us);
+
+CHIAKI_EXPORT void chiaki_feedback_sender_get_latency_stats(ChiakiFeedbackSender *feedback_sender, ChiakiFeedbackLatencyStats *stats);
 
 #ifdef __cplusplus
 }
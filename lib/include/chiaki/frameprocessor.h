@@ -43,6 +43,7 @@ typedef struct chiaki_frame_processor_t
 	unsigned int units_fec_received;
 	ChiakiFrameUnit *unit_slots;
 	size_t unit_slots_size;
+	size_t flush_intact_size; // after flushing, bytes of the frame before the first missing unit, the frame size if nothing is missing
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -61,6 +62,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 /**
  * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer into the internal buffer of frame_processor.
  * MUST NOT be used after the next call to this frame processor!
+ * On CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED, missing units are left out, so only the first
+ * flush_intact_size bytes are valid.
  */
 CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
 
@@ -61,8 +61,9 @@ struct chiaki_session_t;
 
 /**
  * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream
+ * @param key_buf_thread_attr attributes of that thread, may be NULL
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, const ChiakiThreadAttr *key_buf_thread_attr, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, size_t key_pos, uint8_t *buf, size_t buf_size);
@@ -74,15 +75,28 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint6
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
-static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+/**
+ * Like chiaki_gkcrypt_gmac(), but with gmac_key given instead of the one cached in gkcrypt.
+ * gkcrypt is not modified, so this may be called from multiple threads at once.
+ *
+ * @param gmac_key key for chiaki_gkcrypt_gmac_key_index(key_pos), e.g. from chiaki_gkcrypt_gen_tmp_gmac_key()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_with_key(const ChiakiGKCrypt *gkcrypt, const uint8_t *gmac_key, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
+
+static inline uint64_t chiaki_gkcrypt_gmac_key_index(size_t key_pos)
+{
+	return (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+}
+
+static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, const ChiakiThreadAttr *key_buf_thread_attr, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	ChiakiGKCrypt *gkcrypt = CHIAKI_NEW(ChiakiGKCrypt);
 	if(!gkcrypt)
 		return NULL;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(gkcrypt, log, key_buf_chunks, index, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(gkcrypt, log, key_buf_chunks, key_buf_thread_attr, index, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(gkcrypt);
+		chiaki_free(gkcrypt);
 		return NULL;
 	}
 	return gkcrypt;
@@ -93,7 +107,7 @@ static inline void chiaki_gkcrypt_free(ChiakiGKCrypt *gkcrypt)
 	if(!gkcrypt)
 		return;
 	chiaki_gkcrypt_fini(gkcrypt);
-	free(gkcrypt);
+	chiaki_free(gkcrypt);
 }
 
 #ifdef __cplusplus
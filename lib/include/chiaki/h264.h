@@ -0,0 +1,80 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_H264_H
+#define CHIAKI_H264_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum chiaki_h264_frame_type_t
+{
+	CHIAKI_H264_FRAME_TYPE_UNKNOWN = 0, // no slice found
+	CHIAKI_H264_FRAME_TYPE_IDR = 1,
+	CHIAKI_H264_FRAME_TYPE_REF = 2, // may be referenced by later frames
+	CHIAKI_H264_FRAME_TYPE_NONREF = 3 // can be dropped without affecting any other frame
+} ChiakiH264FrameType;
+
+typedef enum chiaki_h264_slice_type_t
+{
+	CHIAKI_H264_SLICE_TYPE_UNKNOWN = -1,
+	CHIAKI_H264_SLICE_TYPE_P = 0,
+	CHIAKI_H264_SLICE_TYPE_B = 1,
+	CHIAKI_H264_SLICE_TYPE_I = 2,
+	CHIAKI_H264_SLICE_TYPE_SP = 3,
+	CHIAKI_H264_SLICE_TYPE_SI = 4
+} ChiakiH264SliceType;
+
+typedef struct chiaki_h264_frame_info_t
+{
+	ChiakiH264FrameType type;
+	ChiakiH264SliceType slice_type; // of the first slice
+	unsigned int slices;
+	bool has_sps;
+	bool has_pps;
+} ChiakiH264FrameInfo;
+
+/**
+ * Classify an access unit in Annex B format by its NAL unit headers and the beginning of its first
+ * slice header, without decoding anything.
+ */
+CHIAKI_EXPORT void chiaki_h264_frame_inspect(const uint8_t *buf, size_t buf_size, ChiakiH264FrameInfo *info);
+
+/**
+ * Cut off the last NAL unit starting in the first intact_size bytes of buf, and everything after it,
+ * for when data is missing right after intact_size.
+ *
+ * That NAL unit is cut off even if a start code follows directly at intact_size: anything in buf
+ * after intact_size came after the missing data, so the unit may still continue in what is missing.
+ *
+ * @param intact_size bytes at the start of buf followed by missing data, intact_size >= buf_size if data is only missing at the end
+ * @return size of buf up to the start code of the first incomplete NAL unit
+ */
+CHIAKI_EXPORT size_t chiaki_h264_trim_incomplete(const uint8_t *buf, size_t buf_size, size_t intact_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_H264_H
@@ -0,0 +1,144 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CHIAKI_IMPAIRMENT_H
+#define CHIAKI_IMPAIRMENT_H
+
+#include "common.h"
+#include "thread.h"
+#include "datagram.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_IMPAIRMENT_REORDER_HOLD_MS_DEFAULT 50
+
+/**
+ * Network conditions to simulate for one direction. All zero means no impairment.
+ */
+typedef struct chiaki_impairment_config_t
+{
+	uint64_t seed;
+	double loss; // probability of a packet being lost independently of others
+	unsigned int loss_first; // number of packets at the start that are always lost, e.g. to exercise handshake retransmissions
+	double burst_loss_start; // probability of a loss burst starting at a packet
+	double burst_loss_end; // probability of a loss burst ending at a packet, the mean burst length is 1 / burst_loss_end
+	double duplicate; // probability of a packet being delivered twice
+	double reorder; // probability of a packet being held back
+	unsigned int reorder_depth; // number of subsequent packets that overtake a held back packet
+	uint32_t reorder_hold_ms; // max time a packet is held back if fewer packets follow, 0 for CHIAKI_IMPAIRMENT_REORDER_HOLD_MS_DEFAULT
+	uint32_t delay_ms; // constant delay
+	uint32_t jitter_ms; // additional uniformly distributed delay, reorders packets if larger than their spacing
+	uint32_t bandwidth_kbps; // link capacity or 0 for unlimited
+	uint32_t queue_ms; // max queueing delay at the bandwidth cap before packets are dropped or 0 for unlimited
+} ChiakiImpairmentConfig;
+
+typedef struct chiaki_impairment_stats_t
+{
+	uint64_t packets; // pushed packets
+	uint64_t delivered; // popped packets, including duplicates
+	uint64_t lost_first;
+	uint64_t lost_random;
+	uint64_t lost_burst;
+	uint64_t lost_queue; // dropped at the bandwidth cap
+	uint64_t duplicated;
+	uint64_t reordered;
+} ChiakiImpairmentStats;
+
+typedef struct chiaki_impairment_packet_t ChiakiImpairmentPacket;
+
+/**
+ * One direction of an impaired link, not thread-safe.
+ *
+ * Packets are pushed with their arrival time and can be popped once they are due.
+ * Which packets are lost, duplicated or reordered only depends on the seed and the sequence of pushed packets,
+ * so runs with the same seed are reproducible regardless of timing.
+ */
+typedef struct chiaki_impairment_t
+{
+	ChiakiImpairmentConfig config;
+	uint64_t rng_state;
+	bool burst;
+	ChiakiImpairmentPacket *queue; // sorted by due time
+	ChiakiImpairmentPacket *held; // held back for reordering
+	uint64_t link_free_us;
+	ChiakiImpairmentStats stats;
+} ChiakiImpairment;
+
+/**
+ * @param config may be NULL for no impairment
+ */
+CHIAKI_EXPORT void chiaki_impairment_init(ChiakiImpairment *impairment, const ChiakiImpairmentConfig *config);
+CHIAKI_EXPORT void chiaki_impairment_fini(ChiakiImpairment *impairment);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impairment_push(ChiakiImpairment *impairment, const uint8_t *buf, size_t buf_size, uint64_t now_us);
+
+/**
+ * @param buf_size size of buf, will receive the size of the packet. The packet is truncated if it does not fit.
+ * @return true if a packet was due at now_us and has been written to buf
+ */
+CHIAKI_EXPORT bool chiaki_impairment_pop(ChiakiImpairment *impairment, uint64_t now_us, uint8_t *buf, size_t *buf_size);
+
+/**
+ * @return due time of the next packet or the time a held back packet is released if that is earlier, UINT64_MAX if none is queued
+ */
+CHIAKI_EXPORT uint64_t chiaki_impairment_next_due_us(ChiakiImpairment *impairment);
+
+/**
+ * @return whether packets may be held for any amount of time
+ */
+CHIAKI_EXPORT bool chiaki_impairment_config_delays(const ChiakiImpairmentConfig *config);
+
+/**
+ * ChiakiDatagramIO that passes each direction through a ChiakiImpairment.
+ *
+ * Delayed outgoing packets are sent from within the receive callback, which Takion calls continuously.
+ * Set io as ChiakiTakionConnectInfo.io or with chiaki_session_set_stream_datagram_io().
+ */
+typedef struct chiaki_impairment_io_t
+{
+	ChiakiDatagramIO io;
+	ChiakiDatagramIO next; // underlying I/O, the socket by default
+	ChiakiMutex mutex;
+	ChiakiImpairment rx;
+	ChiakiImpairment tx;
+	bool tx_delays;
+} ChiakiImpairmentIO;
+
+/**
+ * @param rx_config impairment of received packets or NULL
+ * @param tx_config impairment of sent packets or NULL
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impairment_io_init(ChiakiImpairmentIO *io, const ChiakiImpairmentConfig *rx_config, const ChiakiImpairmentConfig *tx_config);
+CHIAKI_EXPORT void chiaki_impairment_io_fini(ChiakiImpairmentIO *io);
+
+/**
+ * @param rx_stats may be NULL
+ * @param tx_stats may be NULL
+ */
+CHIAKI_EXPORT void chiaki_impairment_io_get_stats(ChiakiImpairmentIO *io, ChiakiImpairmentStats *rx_stats, ChiakiImpairmentStats *tx_stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_IMPAIRMENT_H
@@ -41,11 +41,14 @@ CHIAKI_EXPORT char chiaki_log_level_char(ChiakiLogLevel level);
 
 typedef void (*ChiakiLogCb)(ChiakiLogLevel level, const char *msg, void *user);
 
+typedef struct chiaki_async_log_t ChiakiAsyncLog;
+
 typedef struct chiaki_log_t
 {
 	uint32_t level_mask;
 	ChiakiLogCb cb;
 	void *user;
+	ChiakiAsyncLog *async; // if set, messages are handed to this instead of cb, see asynclog.h
 } ChiakiLog;
 
 CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLogCb cb, void *user);
@@ -0,0 +1,126 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_RECORDER_H
+#define CHIAKI_RECORDER_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "video.h"
+#include "audio.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Muxed data waiting to be written is limited to this size, which is allocated up front.
+ * Beyond that, frames are dropped.
+ */
+#define CHIAKI_RECORDER_BACKLOG_MAX (64 * 1024 * 1024)
+
+typedef struct chiaki_recorder_buf_t
+{
+	uint8_t *data;
+	size_t size;
+	size_t alloc;
+} ChiakiRecorderBuf;
+
+typedef struct chiaki_recorder_stats_t
+{
+	uint64_t video_frames;
+	uint64_t audio_frames;
+	uint64_t frames_dropped; // because the writer could not keep up
+	uint64_t bytes_written;
+} ChiakiRecorderStats;
+
+/**
+ * Records the received stream into a Matroska file without re-encoding.
+ *
+ * H.264 access units and Opus packets are muxed as they are received and handed to
+ * a background thread that writes them in large chunks, so recording never blocks
+ * the receiving threads. Attach to a session with chiaki_session_set_recorder().
+ */
+typedef struct chiaki_recorder_t
+{
+	ChiakiLog *log;
+	FILE *file;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop;
+	bool failed; // writing failed, nothing more is recorded
+	ChiakiThread writer_thread;
+	ChiakiRecorderBuf buf; // muxed data, filled by the receiving threads
+	ChiakiRecorderBuf write_buf; // swapped with buf and written by the writer thread
+
+	// muxer state, protected by mutex
+	uint8_t *video_header; // SPS and PPS of the first profile, Annex B
+	size_t video_header_size;
+	unsigned int width;
+	unsigned int height;
+	uint8_t *video_header_pending; // of a later profile, written in-band with the next frame
+	size_t video_header_pending_size;
+	bool audio_header_set;
+	ChiakiAudioHeader audio_header;
+	bool tracks_written;
+	bool video_wait_keyframe;
+	bool dropping;
+	uint64_t start_ms;
+	bool cluster_open;
+	uint64_t cluster_ms;
+	ChiakiRecorderStats stats;
+} ChiakiRecorder;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recorder_init(ChiakiRecorder *recorder, ChiakiLog *log, const char *filename);
+
+/**
+ * Write out everything that has been recorded and close the file.
+ * Must not be called while the recorder is still attached to a running session.
+ */
+CHIAKI_EXPORT void chiaki_recorder_fini(ChiakiRecorder *recorder);
+
+/**
+ * Called by the Video Receiver when switching to a profile.
+ * The first profile determines the parameters of the video track.
+ */
+CHIAKI_EXPORT void chiaki_recorder_video_profile(ChiakiRecorder *recorder, ChiakiVideoProfile *profile);
+
+/**
+ * @param buf a complete H.264 access unit in Annex B format
+ */
+CHIAKI_EXPORT void chiaki_recorder_video_frame(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size);
+
+CHIAKI_EXPORT void chiaki_recorder_audio_header(ChiakiRecorder *recorder, ChiakiAudioHeader *header);
+
+/**
+ * @param buf a single Opus packet
+ */
+CHIAKI_EXPORT void chiaki_recorder_audio_frame(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size);
+
+CHIAKI_EXPORT void chiaki_recorder_get_stats(ChiakiRecorder *recorder, ChiakiRecorderStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_RECORDER_H
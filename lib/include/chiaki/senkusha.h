@@ -43,6 +43,11 @@ typedef struct senkusha_t
 	uint32_t ping_tag;
 	uint32_t mtu_id;
 
+	bool mtu_ladder; // probe many MTUs at once instead of a binary search
+	uint32_t mtu_probe_id_base; // id of the first probe of the current ladder round
+	size_t mtu_probes_count;
+	uint64_t mtu_probes_pending; // bit i is set while probe i of the current ladder round has not been answered
+
 	/**
 	 * signaled on change of state_finished or should_stop
 	 */
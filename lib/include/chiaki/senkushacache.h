@@ -0,0 +1,88 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_SENKUSHACACHE_H
+#define CHIAKI_SENKUSHACACHE_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_SENKUSHA_CACHE_ENTRIES_MAX 32
+#define CHIAKI_SENKUSHA_CACHE_ADDR_SIZE 64
+#define CHIAKI_SENKUSHA_CACHE_VALIDITY_SEC_DEFAULT (30 * 60)
+
+typedef struct chiaki_senkusha_cache_entry_t
+{
+	char host[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE]; // numeric address of the console, null terminated
+	char local[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE]; // numeric address of the local interface used to reach it
+	uint32_t mtu_in;
+	uint32_t mtu_out;
+	uint64_t rtt_us;
+	uint64_t timestamp; // seconds since the epoch of the last full test or successful confirmation
+} ChiakiSenkushaCacheEntry;
+
+/**
+ * Results of previous Senkusha runs per console and local interface.
+ *
+ * On a hit, Senkusha only confirms the cached MTUs with a single probe each instead of
+ * searching for them, and falls back to the full test if the confirmation fails.
+ * Attach to a session with chiaki_session_set_senkusha_cache().
+ */
+typedef struct chiaki_senkusha_cache_t
+{
+	ChiakiMutex mutex;
+	ChiakiSenkushaCacheEntry entries[CHIAKI_SENKUSHA_CACHE_ENTRIES_MAX];
+	size_t entries_count;
+	uint64_t validity_sec; // entries older than this are not used
+} ChiakiSenkushaCache;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_cache_init(ChiakiSenkushaCache *cache);
+CHIAKI_EXPORT void chiaki_senkusha_cache_fini(ChiakiSenkushaCache *cache);
+
+/**
+ * Add the entries from a file previously written by chiaki_senkusha_cache_save().
+ * @return CHIAKI_ERR_SUCCESS if the file does not exist yet
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_cache_load(ChiakiSenkushaCache *cache, const char *filename);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_cache_save(ChiakiSenkushaCache *cache, const char *filename);
+
+/**
+ * @param entry receives a copy of the entry
+ * @return whether an entry that has not expired exists for host and local
+ */
+CHIAKI_EXPORT bool chiaki_senkusha_cache_lookup(ChiakiSenkushaCache *cache, const char *host, const char *local, ChiakiSenkushaCacheEntry *entry);
+
+/**
+ * Insert or refresh the entry for host and local. If the cache is full, the oldest entry is replaced.
+ */
+CHIAKI_EXPORT void chiaki_senkusha_cache_store(ChiakiSenkushaCache *cache, const char *host, const char *local, uint32_t mtu_in, uint32_t mtu_out, uint64_t rtt_us);
+
+CHIAKI_EXPORT void chiaki_senkusha_cache_invalidate(ChiakiSenkushaCache *cache, const char *host, const char *local);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_SENKUSHACACHE_H
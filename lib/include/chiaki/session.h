@@ -25,6 +25,9 @@
 #include "ctrl.h"
 #include "rpcrypt.h"
 #include "takion.h"
+#include "datagram.h"
+#include "recorder.h"
+#include "senkushacache.h"
 #include "ecdh.h"
 #include "audio.h"
 #include "audioreceiver.h"
@@ -129,6 +132,22 @@ typedef struct chiaki_audio_stream_info_event_t
 } ChiakiAudioStreamInfoEvent;
 
 
+/**
+ * Breakdown of the time from chiaki_session_start() until the stream is connected.
+ * Preparation runs in parallel to the session request, ctrl and Senkusha.
+ */
+typedef struct chiaki_session_startup_timings_t
+{
+	uint64_t session_request_us;
+	uint64_t ctrl_us; // excluding the time waiting for the login pin to be entered
+	uint64_t login_pin_us;
+	uint64_t senkusha_us;
+	uint64_t prepare_us; // handshake key, ECDH keygen and receiver allocation
+	uint64_t prepare_wait_us; // time the stream connection had to wait for the preparation
+	uint64_t stream_connection_us; // until streaminfo has been received
+	uint64_t total_us;
+} ChiakiSessionStartupTimings;
+
 typedef enum {
 	CHIAKI_EVENT_CONNECTED,
 	CHIAKI_EVENT_LOGIN_PIN_REQUEST,
@@ -142,6 +161,10 @@ typedef struct chiaki_event_t
 	{
 		ChiakiQuitEvent quit;
 		struct
+		{
+			ChiakiSessionStartupTimings startup_timings;
+		} connected;
+		struct
 		{
 			bool pin_incorrect; // false on first request, true if the pin entered before was incorrect
 		} login_pin_request;
@@ -150,12 +173,38 @@ typedef struct chiaki_event_t
 
 typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
 
+/**
+ * Roles of the latency-critical threads of a session, see chiaki_session_set_thread_attr().
+ */
+typedef enum chiaki_thread_role_t
+{
+	CHIAKI_THREAD_ROLE_NETWORK = 0, // Takion receive and send threads of the stream connection, also run audio and video reassembly
+	CHIAKI_THREAD_ROLE_CRYPTO, // key stream generation of the stream connection
+	CHIAKI_THREAD_ROLE_DECODE, // not created by Chiaki, applied by the application to its video decode thread
+	CHIAKI_THREAD_ROLE_AUDIO, // not created by Chiaki, applied by the application to its audio output thread
+	CHIAKI_THREAD_ROLE_INPUT, // feedback sender, sending controller input
+	CHIAKI_THREAD_ROLE_COUNT
+} ChiakiThreadRole;
+
+CHIAKI_EXPORT const char *chiaki_thread_role_string(ChiakiThreadRole role);
+
 /**
  * buf will always have an allocated padding of at least CHIAKI_VIDEO_BUFFER_PADDING_SIZE after buf_size
  * @return whether the sample was successfully pushed into the decoder. On false, a corrupt frame will be reported to get a new keyframe.
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, void *user);
 
+/**
+ * Called once with all profiles of the stream as soon as they are known, before any sample.
+ * The headers (SPS and PPS) are only valid during the call.
+ */
+typedef void (*ChiakiVideoProfilesCallback)(ChiakiVideoProfile *profiles, size_t profiles_count, void *user);
+
+/**
+ * Called when the stream switches to another profile, before its first sample.
+ */
+typedef void (*ChiakiVideoProfileSwitchCallback)(size_t profile_index, void *user);
+
 
 
 typedef struct chiaki_session_t
@@ -181,6 +230,8 @@ typedef struct chiaki_session_t
 	uint32_t mtu_out;
 	uint64_t rtt_us;
 	ChiakiECDH ecdh;
+	uint64_t start_us;
+	ChiakiSessionStartupTimings startup_timings; // only accessed from the session thread
 
 	ChiakiQuitReason quit_reason;
 	char *quit_reason_str; // additional reason string from remote
@@ -189,7 +240,19 @@ typedef struct chiaki_session_t
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
 	void *video_sample_cb_user;
+	ChiakiVideoProfilesCallback video_profiles_cb;
+	ChiakiVideoProfileSwitchCallback video_profile_switch_cb;
+	void *video_profiles_cb_user;
 	ChiakiAudioSink audio_sink;
+	ChiakiDatagramIO *stream_datagram_io;
+	ChiakiRecorder *recorder;
+	ChiakiSenkushaCache *senkusha_cache;
+	bool senkusha_mtu_ladder;
+	uint64_t data_ack_delay_ms;
+	unsigned int data_ack_chunks;
+	bool send_batch;
+	uint64_t send_batch_window_ms;
+	ChiakiThreadAttr thread_attrs[CHIAKI_THREAD_ROLE_COUNT];
 
 	ChiakiThread session_thread;
 
@@ -211,6 +274,10 @@ typedef struct chiaki_session_t
 	ChiakiStreamConnection stream_connection;
 	ChiakiAudioReceiver *audio_receiver;
 	ChiakiVideoReceiver *video_receiver;
+	ChiakiVideoReceiverStats video_receiver_stats; // copied from video_receiver when the stream ends
+	ChiakiFeedbackLatencyStats input_latency_stats; // copied from the feedback sender when the stream ends
+	ChiakiTakionRecvStats stream_recv_stats; // copied from the stream connection's Takion when it is closed
+	ChiakiTakionSendStats stream_send_stats; // same, all 0 without send_batch
 
 	ChiakiControllerState controller_state;
 } ChiakiSession;
@@ -221,6 +288,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_stop(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_join(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state(ChiakiSession *session, ChiakiControllerState *state);
+
+/**
+ * Like chiaki_session_set_controller_state(), but with the time at which the input changed,
+ * e.g. when the event was received, for the input latency stats.
+ *
+ * @param input_time_us as given by chiaki_time_now_monotonic_us()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state_at(ChiakiSession *session, ChiakiControllerState *state, uint64_t input_time_us);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_login_pin(ChiakiSession *session, const uint8_t *pin, size_t pin_size);
 
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
@@ -235,6 +310,19 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+/**
+ * Get all video profiles up front and be told about profile switches, so a decoder can be
+ * prepared for each profile instead of reconfiguring a single one on every switch.
+ * If set, the profile headers are not passed to the video sample callback anymore.
+ * Must be called before chiaki_session_start().
+ */
+static inline void chiaki_session_set_video_profiles_cb(ChiakiSession *session, ChiakiVideoProfilesCallback profiles_cb, ChiakiVideoProfileSwitchCallback switch_cb, void *user)
+{
+	session->video_profiles_cb = profiles_cb;
+	session->video_profile_switch_cb = switch_cb;
+	session->video_profiles_cb_user = user;
+}
+
 /**
  * @param sink contents are copied
  */
@@ -243,6 +331,91 @@ static inline void chiaki_session_set_audio_sink(ChiakiSession *session, ChiakiA
 	session->audio_sink = *sink;
 }
 
+/**
+ * Replace the datagram I/O of the stream connection, e.g. to simulate a bad network.
+ * Must be called before chiaki_session_start().
+ *
+ * @param io not copied, must stay valid until the session has been joined
+ */
+static inline void chiaki_session_set_stream_datagram_io(ChiakiSession *session, ChiakiDatagramIO *io)
+{
+	session->stream_datagram_io = io;
+}
+
+/**
+ * Record the received video and audio in addition to passing it to the callbacks.
+ * Must be called before chiaki_session_start().
+ *
+ * @param recorder not copied, must stay valid until the session has been joined
+ */
+static inline void chiaki_session_set_recorder(ChiakiSession *session, ChiakiRecorder *recorder)
+{
+	session->recorder = recorder;
+}
+
+/**
+ * Use and update cached Senkusha results to speed up connecting to a console again.
+ * Must be called before chiaki_session_start().
+ *
+ * @param cache not copied, must stay valid until the session has been joined
+ */
+static inline void chiaki_session_set_senkusha_cache(ChiakiSession *session, ChiakiSenkushaCache *cache)
+{
+	session->senkusha_cache = cache;
+}
+
+/**
+ * Let Senkusha send many MTU probes of different sizes at once and determine the MTU from the
+ * ones that are answered, instead of a binary search with one probe at a time.
+ * This takes one or two round trips instead of about ten, each possibly waiting for a timeout.
+ * Must be called before chiaki_session_start().
+ */
+static inline void chiaki_session_set_senkusha_mtu_ladder(ChiakiSession *session, bool enabled)
+{
+	session->senkusha_mtu_ladder = enabled;
+}
+
+/**
+ * Acknowledge data from the console cumulatively after at most delay_ms or every chunks chunks
+ * instead of one ack per chunk. 0 for delay_ms (default) acks every chunk immediately.
+ * See ChiakiTakionConnectInfo.data_ack_delay_ms.
+ * Must be called before chiaki_session_start().
+ */
+static inline void chiaki_session_set_data_ack_delay(ChiakiSession *session, uint64_t delay_ms, unsigned int chunks)
+{
+	session->data_ack_delay_ms = delay_ms;
+	session->data_ack_chunks = chunks;
+}
+
+/**
+ * Send the datagrams of the stream connection in batches from a separate thread instead of
+ * one system call per datagram. See ChiakiTakionConnectInfo.send_batch.
+ * Must be called before chiaki_session_start().
+ */
+static inline void chiaki_session_set_send_batch(ChiakiSession *session, bool enabled, uint64_t window_ms)
+{
+	session->send_batch = enabled;
+	session->send_batch_window_ms = window_ms;
+}
+
+/**
+ * Set the priority and CPU affinity of the threads with the given role, e.g. to pin the
+ * network thread to an isolated core. All roles use the default attributes unless set.
+ * Must be called before chiaki_session_start().
+ */
+static inline void chiaki_session_set_thread_attr(ChiakiSession *session, ChiakiThreadRole role, const ChiakiThreadAttr *attr)
+{
+	session->thread_attrs[role] = *attr;
+}
+
+/**
+ * For the roles of threads that the application creates itself, apply the result with chiaki_thread_set_attr_current().
+ */
+static inline const ChiakiThreadAttr *chiaki_session_get_thread_attr(ChiakiSession *session, ChiakiThreadRole role)
+{
+	return &session->thread_attrs[role];
+}
+
 #ifdef __cplusplus
 }
 #endif
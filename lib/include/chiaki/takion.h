@@ -24,6 +24,7 @@
 #include "gkcrypt.h"
 #include "seqnum.h"
 #include "stoppipe.h"
+#include "datagram.h"
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
@@ -121,8 +122,60 @@ typedef struct chiaki_takion_connect_info_t
 	void *cb_user;
 	bool enable_crypt;
 	uint8_t protocol_version;
+	ChiakiDatagramIO *io; // if NULL (default), datagrams are sent and received on the socket directly
+	uint64_t rtt_us; // estimated round trip time, determines the retransmission timeout of the handshake, 0 if unknown
+
+	/**
+	 * If nonzero, received data is acknowledged with a single cumulative ack after at most this delay
+	 * or once data_ack_chunks chunks are pending, whichever comes first.
+	 * Gaps and duplicates are then reported immediately.
+	 * If 0 (default), every received chunk is acked right away.
+	 */
+	uint64_t data_ack_delay_ms;
+	unsigned int data_ack_chunks; // 0 for CHIAKI_TAKION_DATA_ACK_CHUNKS_DEFAULT
+
+	/**
+	 * If true, outgoing datagrams from all threads are queued and sent together by a separate thread,
+	 * with a single system call where possible.
+	 * The thread sends as soon as it wakes up and the queue is non-empty, after waiting up to
+	 * send_batch_window_ms for more datagrams if that is nonzero.
+	 * If send_batch_window_ms is 0, datagrams are sent directly by the calling thread while the queue is idle
+	 * and only queued while it is busy.
+	 */
+	bool send_batch;
+	uint64_t send_batch_window_ms;
+
+	const ChiakiThreadAttr *thread_attr; // applied to the receive and send threads, NULL for the default
 } ChiakiTakionConnectInfo;
 
+#define CHIAKI_TAKION_DATA_ACK_CHUNKS_DEFAULT 2
+
+#define CHIAKI_TAKION_RCVBUF_MAX (8 * 1024 * 1024)
+
+typedef struct chiaki_takion_recv_stats_t
+{
+	bool kernel_drops_supported; // false e.g. if a custom ChiakiDatagramIO is used
+	uint64_t kernel_drops; // datagrams the kernel dropped because the socket's receive buffer was full
+	int rcvbuf_size; // current SO_RCVBUF as reported by the kernel
+	unsigned int rcvbuf_grows; // times SO_RCVBUF has been increased because of kernel drops
+} ChiakiTakionRecvStats;
+
+typedef struct chiaki_takion_send_stats_t
+{
+	bool batch_supported; // the io sends a whole batch with a single call, e.g. sendmmsg()
+	uint64_t datagrams_batched; // sent by the send queue thread
+	uint64_t batches;
+	uint64_t datagrams_direct; // sent by the calling thread because the queue was idle or the datagram too large
+} ChiakiTakionSendStats;
+
+typedef struct chiaki_takion_data_ack_stats_t
+{
+	uint64_t chunks_received;
+	uint64_t duplicates_received;
+	uint64_t acks_sent;
+	uint64_t gap_acks_sent; // acks that included gap blocks
+} ChiakiTakionDataAckStats;
+
 
 typedef struct chiaki_takion_t
 {
@@ -148,24 +201,46 @@ typedef struct chiaki_takion_t
 	size_t postponed_packets_count;
 
 	ChiakiGKCrypt *gkcrypt_local; // if NULL (default), no gmac is calculated and nothing is encrypted
-	size_t key_pos_local;
-	ChiakiMutex gkcrypt_local_mutex;
+
+	/**
+	 * local seq num, key pos and gmac key, reserved and used without locking by all sending threads
+	 */
+	struct chiaki_takion_send_state_t *send_state;
+
+	struct chiaki_takion_send_queue_t *send_queue; // NULL if send_batch is disabled
+	ChiakiTakionSendStats send_stats; // copied from send_queue when it stops
 
 	ChiakiGKCrypt *gkcrypt_remote; // if NULL (default), remote gmacs are IGNORED (!) and everything is expected to be unencrypted
 
 	ChiakiReorderQueue data_queue;
 	ChiakiTakionSendBuffer send_buffer;
 
+	// delayed data acks, only accessed by the Takion thread
+	uint64_t data_ack_delay_ms;
+	unsigned int data_ack_chunks;
+	unsigned int data_ack_chunks_pending; // delivered, but not acked yet
+	uint64_t data_ack_deadline_ms;
+	ChiakiSeqNum32 data_ack_seq_num; // last seq num delivered in order
+	ChiakiTakionDataAckStats data_ack_stats;
+
+	// receive buffer monitoring, only accessed by the Takion thread while running
+	ChiakiDatagramSocketStats socket_stats; // filled by io if it is the plain socket
+	ChiakiTakionRecvStats recv_stats;
+	int rcvbuf_requested;
+	bool rcvbuf_limited; // reached TAKION_RCVBUF_MAX or the system's limit
+	uint32_t kernel_drops_last; // last raw value of socket_stats.kernel_drops
+	uint64_t kernel_drops_pending; // drops not reported yet because of the rate limit
+	uint64_t rcvbuf_check_last_ms;
+
 	ChiakiTakionCallback cb;
 	void *cb_user;
 	chiaki_socket_t sock;
+	ChiakiDatagramIO io;
 	ChiakiThread thread;
 	ChiakiStopPipe stop_pipe;
 	uint32_t tag_local;
 	uint32_t tag_remote;
-
-	ChiakiSeqNum32 seq_num_local;
-	ChiakiMutex seq_num_local_mutex;
+	uint64_t handshake_rto_ms; // initial retransmission timeout of INIT and COOKIE
 
 	/**
 	 * Advertised Receiver Window Credit
@@ -182,10 +257,7 @@ CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion);
 /**
  * Must be called from within the Takion thread, i.e. inside the callback!
  */
-static inline void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *gkcrypt_local, ChiakiGKCrypt *gkcrypt_remote) {
-	takion->gkcrypt_local = gkcrypt_local;
-	takion->gkcrypt_remote = gkcrypt_remote;
-}
+CHIAKI_EXPORT void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *gkcrypt_local, ChiakiGKCrypt *gkcrypt_remote);
 
 /**
  * Get a new key pos and advance by data_size.
@@ -210,6 +282,16 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
 
+/**
+ * Calculate the MAC for the packet in buf depending on the type derived from its first byte
+ * and assign it inside buf at the respective position.
+ *
+ * @param crypt if NULL, the MAC will be set to 0
+ * @param mac_old_out optional pointer to write the MAC to that was in buf before
+ * @param key_pos_out optional pointer to write the key pos of the packet to
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint8_t *mac_out, uint8_t *mac_old_out, ChiakiTakionPacketKeyPos *key_pos_out);
+
 /**
  * Thread-safe while Takion is running.
  *
@@ -232,11 +314,27 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *ta
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *payload, size_t payload_size);
 
+#define CHIAKI_TAKION_FEEDBACK_HEADER_SIZE 0xc
+
+/**
+ * Like chiaki_takion_send_feedback_history(), but the payload is not copied.
+ * Thread-safe while Takion is running.
+ *
+ * @param buf CHIAKI_TAKION_FEEDBACK_HEADER_SIZE bytes of space for the header, followed by the payload, which is encrypted in place
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history_buf(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *buf, size_t buf_size);
+
 #define CHIAKI_TAKION_V9_AV_HEADER_SIZE_VIDEO 0x17
 #define CHIAKI_TAKION_V9_AV_HEADER_SIZE_AUDIO 0x12
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPacket *packet, uint8_t *buf, size_t buf_size);
 
+/**
+ * Write the v9 header for packet into buf, so that the payload can be appended at buf + *header_size_out.
+ * The MAC is left as 0.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet);
+
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE					0x12
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_VIDEO_ADD				0x3
 #define CHIAKI_TAKION_V7_AV_HEADER_SIZE_NALU_INFO_STRUCTS_ADD	0x3
@@ -245,6 +343,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_format_header(uint8_t *
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_parse(ChiakiTakionAVPacket *packet, uint8_t *buf, size_t buf_size);
 
+/**
+ * Add the datagrams dropped since the last call to *total.
+ * raw is the kernel's 32-bit drop counter, which may wrap around.
+ *
+ * @param last raw value of the previous call, updated to raw
+ * @return number of new drops
+ */
+CHIAKI_EXPORT uint32_t chiaki_takion_kernel_drops_accumulate(uint64_t *total, uint32_t *last, uint32_t raw);
+
+/**
+ * Double *requested for SO_RCVBUF, but not beyond CHIAKI_TAKION_RCVBUF_MAX.
+ *
+ * @return false if *requested has reached CHIAKI_TAKION_RCVBUF_MAX and must not grow any further
+ */
+CHIAKI_EXPORT bool chiaki_takion_rcvbuf_grow(int *requested);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,9 @@
 #define CHIAKI_THREAD_H
 
 #include "common.h"
+#include "log.h"
+
+#include <chiaki/config.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -35,19 +38,69 @@ extern "C" {
 
 typedef void *(*ChiakiThreadFunc)(void *);
 
+typedef enum chiaki_thread_priority_t
+{
+	CHIAKI_THREAD_PRIORITY_DEFAULT = 0, // leave the scheduling of the thread as it is
+	CHIAKI_THREAD_PRIORITY_LOW,
+	CHIAKI_THREAD_PRIORITY_HIGH, // may need privileges, e.g. CAP_SYS_NICE or RLIMIT_NICE on Linux
+	CHIAKI_THREAD_PRIORITY_REALTIME // SCHED_FIFO where permitted, otherwise falls back to high
+} ChiakiThreadPriority;
+
+CHIAKI_EXPORT const char *chiaki_thread_priority_string(ChiakiThreadPriority priority);
+
+typedef struct chiaki_thread_attr_t
+{
+	ChiakiThreadPriority priority;
+	int realtime_priority; // SCHED_FIFO priority for CHIAKI_THREAD_PRIORITY_REALTIME, 0 for a default
+	uint64_t cpu_affinity; // bit n allows running on CPU n, 0 for no restriction
+} ChiakiThreadAttr;
+
+static inline bool chiaki_thread_attr_is_default(const ChiakiThreadAttr *attr)
+{
+	return !attr || (attr->priority == CHIAKI_THREAD_PRIORITY_DEFAULT && !attr->cpu_affinity);
+}
+
+/**
+ * Parse attributes given as "PRIORITY[=REALTIME_PRIORITY][:CPUS]", e.g. "realtime=20:2,3" or "high:4-7",
+ * where PRIORITY is one of the names returned by chiaki_thread_priority_string()
+ * and CPUS is a comma-separated list of CPUs or ranges.
+ *
+ * @return CHIAKI_ERR_INVALID_DATA if str is malformed
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_attr_parse(ChiakiThreadAttr *attr, const char *str);
+
 typedef struct chiaki_thread_t
 {
 #ifdef _WIN32
 	HANDLE thread;
-	ChiakiThreadFunc func;
-	void *arg;
-	void *ret;
 #else
 	pthread_t thread;
 #endif
+	ChiakiThreadFunc func;
+	void *arg;
+	void *ret;
+	ChiakiThreadAttr attr;
+	ChiakiLog *log;
 } ChiakiThread;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create(ChiakiThread *thread, ChiakiThreadFunc func, void *arg);
+
+/**
+ * Like chiaki_thread_create(), but the new thread applies attr to itself before running func.
+ * Attributes that can not be applied, e.g. because of missing privileges, are logged to log and skipped.
+ *
+ * @param attr may be NULL for the default attributes
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create_attr(ChiakiThread *thread, ChiakiThreadFunc func, void *arg, const ChiakiThreadAttr *attr, ChiakiLog *log);
+
+/**
+ * Apply attr to the calling thread, for threads that are not created by Chiaki,
+ * e.g. the decode or audio threads of an application.
+ *
+ * @return CHIAKI_ERR_THREAD if any of the attributes could not be applied, the others are still applied.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_attr_current(const ChiakiThreadAttr *attr, ChiakiLog *log);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_join(ChiakiThread *thread, void **retval);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const char *name);
 
@@ -59,6 +112,11 @@ typedef struct chiaki_mutex_t
 #else
 	pthread_mutex_t mutex;
 #endif
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	struct chiaki_mutex_profile_t *profile;
+	unsigned int depth; // protected by the mutex itself, > 1 only for recursive mutexes
+	uint64_t locked_ns;
+#endif
 } ChiakiMutex;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_init(ChiakiMutex *mutex, bool rec);
@@ -67,6 +125,38 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_lock(ChiakiMutex *mutex);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_trylock(ChiakiMutex *mutex);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_unlock(ChiakiMutex *mutex);
 
+/**
+ * Name the mutex for the contention profile. Call right after chiaki_mutex_init().
+ * Mutexes with the same name share their stats, mutexes without a name are counted as "unnamed".
+ * Does nothing unless built with CHIAKI_LIB_ENABLE_MUTEX_PROFILING.
+ *
+ * @param name must stay valid for as long as the profile is used, e.g. a string literal
+ */
+CHIAKI_EXPORT void chiaki_mutex_set_name(ChiakiMutex *mutex, const char *name);
+
+#define CHIAKI_MUTEX_PROFILE_NAMES_MAX 64
+
+typedef struct chiaki_mutex_profile_stats_t
+{
+	const char *name;
+	uint64_t acquisitions;
+	uint64_t contended; // acquisitions that had to wait because the mutex was already locked
+	uint64_t wait_ns; // total time spent waiting in contended acquisitions
+	uint64_t hold_ns; // total time the mutex was held, excluding condition waits
+	uint64_t hold_max_ns;
+} ChiakiMutexProfileStats;
+
+/**
+ * Get the contention profile of all named mutexes since the start or the last reset.
+ * Without CHIAKI_LIB_ENABLE_MUTEX_PROFILING, nothing is ever recorded.
+ *
+ * @param stats filled with up to stats_max entries, the ones with the most wait time first
+ * @return number of entries written to stats
+ */
+CHIAKI_EXPORT size_t chiaki_mutex_profile_get(ChiakiMutexProfileStats *stats, size_t stats_max);
+CHIAKI_EXPORT void chiaki_mutex_profile_reset();
+CHIAKI_EXPORT void chiaki_mutex_profile_log(ChiakiLog *log, ChiakiLogLevel level);
+
 
 typedef struct chiaki_cond_t
 {
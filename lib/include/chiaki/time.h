@@ -27,6 +27,7 @@ extern "C" {
 #endif
 
 CHIAKI_EXPORT uint64_t chiaki_time_now_monotonic_us();
+CHIAKI_EXPORT uint64_t chiaki_time_now_monotonic_ns();
 
 static inline uint64_t chiaki_time_now_monotonic_ms() { return chiaki_time_now_monotonic_us() / 1000; }
 
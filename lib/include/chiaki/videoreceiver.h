@@ -30,6 +30,14 @@ extern "C" {
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
 
+typedef struct chiaki_video_receiver_stats_t
+{
+	uint64_t frames; // frames that have been completed, with or without FEC
+	uint64_t frames_fec_recovered; // frames that could only be completed using FEC
+	uint64_t frames_lost; // frames that have been skipped entirely or could not be recovered
+	uint64_t frames_concealed; // lost frames that were passed on with only their intact slices
+} ChiakiVideoReceiverStats;
+
 typedef struct chiaki_video_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -42,6 +50,7 @@ typedef struct chiaki_video_receiver_t
 	int32_t frame_index_prev; // last frame that has been at least partially decoded
 	int32_t frame_index_prev_complete; // last frame that has been completely decoded
 	ChiakiFrameProcessor frame_processor;
+	ChiakiVideoReceiverStats stats; // only accessed from the Takion thread
 } ChiakiVideoReceiver;
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session);
@@ -72,7 +81,7 @@ static inline void chiaki_video_receiver_free(ChiakiVideoReceiver *video_receive
 	if(!video_receiver)
 		return;
 	chiaki_video_receiver_fini(video_receiver);
-	free(video_receiver);
+	chiaki_free(video_receiver);
 }
 
 #ifdef __cplusplus
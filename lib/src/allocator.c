@@ -0,0 +1,189 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chiaki/allocator.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t site_hash(const char *site)
+{
+	// FNV-1a, by content because identical literals are not necessarily merged
+	uint32_t h = 2166136261u;
+	for(; *site; site++)
+	{
+		h ^= (uint8_t)*site;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void site_count(ChiakiInstrumentedAllocator *ia, const char *site, size_t size)
+{
+	chiaki_mutex_lock(&ia->mutex);
+	ia->allocs++;
+	ia->bytes += size;
+	size_t i = site_hash(site) % CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX;
+	for(size_t probes=0; probes<CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX; probes++)
+	{
+		ChiakiAllocSiteStats *entry = &ia->sites[i];
+		if(!entry->site)
+		{
+			entry->site = site;
+			ia->sites_count++;
+		}
+		else if(entry->site != site && strcmp(entry->site, site) != 0)
+		{
+			i = (i + 1) % CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX;
+			continue;
+		}
+		entry->allocs++;
+		entry->bytes += size;
+		chiaki_mutex_unlock(&ia->mutex);
+		return;
+	}
+	ia->allocs_untracked++;
+	chiaki_mutex_unlock(&ia->mutex);
+}
+
+static void *instrumented_alloc(size_t size, const char *site, void *user)
+{
+	ChiakiInstrumentedAllocator *ia = user;
+	site_count(ia, site, size);
+	return ia->parent.alloc(size, site, ia->parent.user);
+}
+
+static void *instrumented_realloc(void *ptr, size_t size, const char *site, void *user)
+{
+	ChiakiInstrumentedAllocator *ia = user;
+	site_count(ia, site, size);
+	return ia->parent.realloc(ptr, size, site, ia->parent.user);
+}
+
+static void instrumented_free(void *ptr, void *user)
+{
+	ChiakiInstrumentedAllocator *ia = user;
+	chiaki_mutex_lock(&ia->mutex);
+	ia->frees++;
+	chiaki_mutex_unlock(&ia->mutex);
+	ia->parent.free(ptr, ia->parent.user);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_instrumented_allocator_init(ChiakiInstrumentedAllocator *ia, const ChiakiAllocator *parent)
+{
+	if(parent)
+		ia->parent = *parent;
+	else
+		chiaki_get_allocator(&ia->parent);
+	memset(ia->sites, 0, sizeof(ia->sites));
+	ia->sites_count = 0;
+	ia->allocs = 0;
+	ia->frees = 0;
+	ia->bytes = 0;
+	ia->allocs_untracked = 0;
+	ChiakiErrorCode err = chiaki_mutex_init(&ia->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_mutex_set_name(&ia->mutex, "instrumented_allocator");
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_instrumented_allocator_fini(ChiakiInstrumentedAllocator *ia)
+{
+	chiaki_mutex_fini(&ia->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_instrumented_allocator_get(ChiakiInstrumentedAllocator *ia, ChiakiAllocator *allocator)
+{
+	allocator->alloc = instrumented_alloc;
+	allocator->realloc = instrumented_realloc;
+	allocator->free = instrumented_free;
+	allocator->user = ia;
+}
+
+CHIAKI_EXPORT void chiaki_instrumented_allocator_reset(ChiakiInstrumentedAllocator *ia)
+{
+	chiaki_mutex_lock(&ia->mutex);
+	memset(ia->sites, 0, sizeof(ia->sites));
+	ia->sites_count = 0;
+	ia->allocs = 0;
+	ia->frees = 0;
+	ia->bytes = 0;
+	ia->allocs_untracked = 0;
+	chiaki_mutex_unlock(&ia->mutex);
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+	const ChiakiAllocSiteStats *sa = a;
+	const ChiakiAllocSiteStats *sb = b;
+	if(sa->allocs != sb->allocs)
+		return sa->allocs > sb->allocs ? -1 : 1;
+	return strcmp(sa->site, sb->site);
+}
+
+CHIAKI_EXPORT size_t chiaki_instrumented_allocator_get_sites(ChiakiInstrumentedAllocator *ia, ChiakiAllocSiteStats *sites, size_t sites_max)
+{
+	// copied to the stack first, sites may not be large enough for all of them
+	ChiakiAllocSiteStats all[CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX];
+	size_t count = 0;
+	chiaki_mutex_lock(&ia->mutex);
+	for(size_t i=0; i<CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX; i++)
+	{
+		if(ia->sites[i].site)
+			all[count++] = ia->sites[i];
+	}
+	chiaki_mutex_unlock(&ia->mutex);
+
+	qsort(all, count, sizeof(all[0]), site_cmp);
+	if(count > sites_max)
+		count = sites_max;
+	memcpy(sites, all, count * sizeof(all[0]));
+	return count;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_instrumented_allocator_get_allocs(ChiakiInstrumentedAllocator *ia)
+{
+	chiaki_mutex_lock(&ia->mutex);
+	uint64_t r = ia->allocs;
+	chiaki_mutex_unlock(&ia->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_instrumented_allocator_log(ChiakiInstrumentedAllocator *ia, ChiakiLog *log, ChiakiLogLevel level)
+{
+	// logging may allocate itself, so the mutex must not be held while doing so
+	ChiakiAllocSiteStats sites[CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX];
+	size_t count = chiaki_instrumented_allocator_get_sites(ia, sites, CHIAKI_INSTRUMENTED_ALLOCATOR_SITES_MAX);
+
+	chiaki_mutex_lock(&ia->mutex);
+	uint64_t allocs = ia->allocs;
+	uint64_t frees = ia->frees;
+	uint64_t bytes = ia->bytes;
+	uint64_t allocs_untracked = ia->allocs_untracked;
+	chiaki_mutex_unlock(&ia->mutex);
+
+	chiaki_log(log, level, "Allocator: %llu allocs (%llu bytes), %llu frees, %llu allocs at untracked sites",
+			(unsigned long long)allocs, (unsigned long long)bytes,
+			(unsigned long long)frees, (unsigned long long)allocs_untracked);
+	for(size_t i=0; i<count; i++)
+	{
+		chiaki_log(log, level, "Allocator: %8llu allocs %12llu bytes at %s",
+				(unsigned long long)sites[i].allocs, (unsigned long long)sites[i].bytes, sites[i].site);
+	}
+}
@@ -0,0 +1,758 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/asynclog.h>
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#define ASYNC_LOG_SLOTS_COUNT 0x400 // must be a power of 2
+#define ASYNC_LOG_SLOT_ARGS_SIZE 0xe0
+#define ASYNC_LOG_MSG_SIZE_MAX 0x400
+#define ASYNC_LOG_SPEC_SIZE_MAX 0x20
+#define ASYNC_LOG_FILE_BUF_SIZE 0x10000
+#define ASYNC_LOG_TRUNCATED_MARK "[...]"
+
+typedef enum async_log_arg_type_t
+{
+	ASYNC_LOG_ARG_NONE, // "%%"
+	ASYNC_LOG_ARG_INT,
+	ASYNC_LOG_ARG_LONG,
+	ASYNC_LOG_ARG_LONG_LONG,
+	ASYNC_LOG_ARG_SIZE,
+	ASYNC_LOG_ARG_INTMAX,
+	ASYNC_LOG_ARG_PTRDIFF,
+	ASYNC_LOG_ARG_DOUBLE,
+	ASYNC_LOG_ARG_LONG_DOUBLE,
+	ASYNC_LOG_ARG_STRING,
+	ASYNC_LOG_ARG_POINTER,
+	ASYNC_LOG_ARG_UNSUPPORTED
+} AsyncLogArgType;
+
+typedef struct async_log_spec_t
+{
+	const char *start;
+	size_t len;
+	unsigned int stars; // number of '*' for width/precision, each consuming an int argument
+	bool precision_star; // precision is given by the last '*' argument
+	int precision; // -1 if none
+	AsyncLogArgType type;
+} AsyncLogSpec;
+
+typedef struct async_log_slot_t
+{
+	atomic_size_t seq;
+	ChiakiLogLevel level;
+	bool preformatted; // args contains the final message instead of the raw arguments
+	char *heap_msg; // final message that did not fit into args, freed by the background thread
+	const char *fmt;
+	uint64_t timestamp_us; // wall clock
+	size_t args_size;
+	uint8_t args[ASYNC_LOG_SLOT_ARGS_SIZE];
+} AsyncLogSlot;
+
+/**
+ * Bounded multi-producer queue with per-slot sequence numbers,
+ * only a single CAS on head is needed to reserve a slot.
+ */
+struct chiaki_async_log_queue_t
+{
+	atomic_size_t head;
+	size_t tail; // only accessed by the background thread
+	atomic_uint_fast64_t dropped;
+	atomic_bool consumer_waiting; // the background thread must be signaled for new messages
+	AsyncLogSlot slots[ASYNC_LOG_SLOTS_COUNT];
+}; // ChiakiAsyncLogQueue
+
+static void *async_log_thread_func(void *user);
+
+static uint64_t async_log_now_realtime_us()
+{
+#ifdef _WIN32
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return t / 10 - 11644473600000000ULL; // 100ns since 1601 to us since 1970
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_REALTIME, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+#endif
+}
+
+/**
+ * @param c pointing to the character after '%'
+ * @return pointer to the character after the conversion specifier
+ */
+static const char *async_log_spec_parse(const char *c, AsyncLogSpec *spec)
+{
+	spec->start = c - 1;
+	spec->stars = 0;
+	spec->precision_star = false;
+	spec->precision = -1;
+	spec->type = ASYNC_LOG_ARG_UNSUPPORTED;
+
+	while(*c && strchr("-+ #0'", *c))
+		c++;
+
+	if(*c == '*')
+	{
+		spec->stars++;
+		c++;
+	}
+	else
+	{
+		while(*c >= '0' && *c <= '9')
+			c++;
+	}
+
+	if(*c == '.')
+	{
+		c++;
+		if(*c == '*')
+		{
+			spec->stars++;
+			spec->precision_star = true;
+			c++;
+		}
+		else
+		{
+			spec->precision = 0;
+			while(*c >= '0' && *c <= '9')
+			{
+				if(spec->precision < INT_MAX / 10)
+					spec->precision = spec->precision * 10 + (*c - '0');
+				c++;
+			}
+		}
+	}
+
+	AsyncLogArgType int_type = ASYNC_LOG_ARG_INT;
+	bool long_double = false;
+	switch(*c)
+	{
+		case 'h':
+			c++;
+			if(*c == 'h')
+				c++;
+			break;
+		case 'l':
+			c++;
+			int_type = ASYNC_LOG_ARG_LONG;
+			if(*c == 'l')
+			{
+				int_type = ASYNC_LOG_ARG_LONG_LONG;
+				c++;
+			}
+			break;
+		case 'z':
+			c++;
+			int_type = ASYNC_LOG_ARG_SIZE;
+			break;
+		case 'j':
+			c++;
+			int_type = ASYNC_LOG_ARG_INTMAX;
+			break;
+		case 't':
+			c++;
+			int_type = ASYNC_LOG_ARG_PTRDIFF;
+			break;
+		case 'L':
+			c++;
+			long_double = true;
+			break;
+		default:
+			break;
+	}
+
+	switch(*c)
+	{
+		case '%':
+			spec->type = ASYNC_LOG_ARG_NONE;
+			break;
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			spec->type = int_type;
+			break;
+		case 'c':
+			// %lc takes a wint_t
+			if(int_type == ASYNC_LOG_ARG_INT)
+				spec->type = ASYNC_LOG_ARG_INT;
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			spec->type = long_double ? ASYNC_LOG_ARG_LONG_DOUBLE : ASYNC_LOG_ARG_DOUBLE;
+			break;
+		case 's':
+			// %ls takes a wchar_t *
+			if(int_type == ASYNC_LOG_ARG_INT)
+				spec->type = ASYNC_LOG_ARG_STRING;
+			break;
+		case 'p':
+			spec->type = ASYNC_LOG_ARG_POINTER;
+			break;
+		default:
+			// includes %n
+			break;
+	}
+
+	if(*c)
+		c++;
+	spec->len = c - spec->start;
+	return c;
+}
+
+typedef struct async_log_args_writer_t
+{
+	uint8_t *buf;
+	size_t size;
+	size_t pos;
+} AsyncLogArgsWriter;
+
+static bool async_log_args_write(AsyncLogArgsWriter *writer, const void *v, size_t v_size)
+{
+	if(writer->size - writer->pos < v_size)
+		return false;
+	memcpy(writer->buf + writer->pos, v, v_size);
+	writer->pos += v_size;
+	return true;
+}
+
+#define ARGS_WRITE(type) do { \
+		type v = va_arg(args, type); \
+		if(!async_log_args_write(&writer, &v, sizeof(v))) \
+			return false; \
+	} while(0)
+
+/**
+ * Copy all arguments referenced by fmt from args into slot->args.
+ *
+ * @return false if fmt contains unsupported conversions or the arguments do not fit
+ */
+static bool async_log_capture(AsyncLogSlot *slot, const char *fmt, va_list args)
+{
+	AsyncLogArgsWriter writer = { slot->args, sizeof(slot->args), 0 };
+	const char *c = fmt;
+	while(*c)
+	{
+		if(*c++ != '%')
+			continue;
+		AsyncLogSpec spec;
+		c = async_log_spec_parse(c, &spec);
+		int precision = spec.precision;
+		for(unsigned int i=0; i<spec.stars; i++)
+		{
+			int v = va_arg(args, int);
+			if(!async_log_args_write(&writer, &v, sizeof(v)))
+				return false;
+			// a negative precision counts as omitted
+			if(spec.precision_star && i == spec.stars - 1)
+				precision = v < 0 ? -1 : v;
+		}
+		switch(spec.type)
+		{
+			case ASYNC_LOG_ARG_NONE:
+				break;
+			case ASYNC_LOG_ARG_INT:
+				ARGS_WRITE(int);
+				break;
+			case ASYNC_LOG_ARG_LONG:
+				ARGS_WRITE(long);
+				break;
+			case ASYNC_LOG_ARG_LONG_LONG:
+				ARGS_WRITE(long long);
+				break;
+			case ASYNC_LOG_ARG_SIZE:
+				ARGS_WRITE(size_t);
+				break;
+			case ASYNC_LOG_ARG_INTMAX:
+				ARGS_WRITE(intmax_t);
+				break;
+			case ASYNC_LOG_ARG_PTRDIFF:
+				ARGS_WRITE(ptrdiff_t);
+				break;
+			case ASYNC_LOG_ARG_DOUBLE:
+				ARGS_WRITE(double);
+				break;
+			case ASYNC_LOG_ARG_LONG_DOUBLE:
+				ARGS_WRITE(long double);
+				break;
+			case ASYNC_LOG_ARG_POINTER:
+				ARGS_WRITE(void *);
+				break;
+			case ASYNC_LOG_ARG_STRING:
+			{
+				const char *str = va_arg(args, const char *);
+				if(!str)
+					str = "(null)";
+				// stored as a NUL-terminated string in place,
+				// with a precision, str does not have to be NUL-terminated and must not be read beyond it
+				size_t len = 0;
+				if(precision < 0)
+					len = strlen(str);
+				else
+				{
+					while(len < (size_t)precision && str[len])
+						len++;
+				}
+				if(writer.size - writer.pos < len + 1)
+					return false;
+				memcpy(writer.buf + writer.pos, str, len);
+				writer.buf[writer.pos + len] = '\0';
+				writer.pos += len + 1;
+				break;
+			}
+			case ASYNC_LOG_ARG_UNSUPPORTED:
+				return false;
+		}
+	}
+	slot->args_size = writer.pos;
+	return true;
+}
+
+#undef ARGS_WRITE
+
+typedef struct async_log_args_reader_t
+{
+	const uint8_t *buf;
+	size_t size;
+	size_t pos;
+} AsyncLogArgsReader;
+
+static bool async_log_args_read(AsyncLogArgsReader *reader, void *v, size_t v_size)
+{
+	if(reader->size - reader->pos < v_size)
+		return false;
+	memcpy(v, reader->buf + reader->pos, v_size);
+	reader->pos += v_size;
+	return true;
+}
+
+#define ARGS_FORMAT(type) do { \
+		type v; \
+		if(!async_log_args_read(&reader, &v, sizeof(v))) \
+			goto end; \
+		ARGS_SNPRINTF(v); \
+	} while(0)
+
+#define ARGS_SNPRINTF(v) do { \
+		int r; \
+		switch(spec.stars) \
+		{ \
+			case 0: r = snprintf(out + pos, out_size - pos, spec_buf, v); break; \
+			case 1: r = snprintf(out + pos, out_size - pos, spec_buf, stars[0], v); break; \
+			default: r = snprintf(out + pos, out_size - pos, spec_buf, stars[0], stars[1], v); break; \
+		} \
+		if(r < 0) \
+			goto end; \
+		pos += (size_t)r; \
+		if(pos >= out_size) \
+		{ \
+			pos = out_size - 1; \
+			truncated = true; \
+			goto end; \
+		} \
+	} while(0)
+
+/**
+ * Reconstruct the message from a slot captured by async_log_capture()
+ * If it does not fit into out, the end is replaced by ASYNC_LOG_TRUNCATED_MARK.
+ */
+static void async_log_format(const AsyncLogSlot *slot, char *out, size_t out_size)
+{
+	if(slot->preformatted)
+	{
+		size_t len = slot->args_size < out_size ? slot->args_size : out_size;
+		memcpy(out, slot->args, len);
+		out[len - 1] = '\0';
+		return;
+	}
+
+	AsyncLogArgsReader reader = { slot->args, slot->args_size, 0 };
+	size_t pos = 0;
+	bool truncated = false;
+	const char *c = slot->fmt;
+	while(*c && pos < out_size - 1)
+	{
+		if(*c != '%')
+		{
+			out[pos++] = *c++;
+			continue;
+		}
+		c++;
+		AsyncLogSpec spec;
+		c = async_log_spec_parse(c, &spec);
+		if(spec.type == ASYNC_LOG_ARG_NONE)
+		{
+			out[pos++] = '%';
+			continue;
+		}
+		if(spec.len >= ASYNC_LOG_SPEC_SIZE_MAX)
+			goto end;
+		char spec_buf[ASYNC_LOG_SPEC_SIZE_MAX];
+		memcpy(spec_buf, spec.start, spec.len);
+		spec_buf[spec.len] = '\0';
+
+		int stars[2] = { 0, 0 };
+		for(unsigned int i=0; i<spec.stars; i++)
+		{
+			if(!async_log_args_read(&reader, &stars[i], sizeof(int)))
+				goto end;
+		}
+
+		switch(spec.type)
+		{
+			case ASYNC_LOG_ARG_INT:
+				ARGS_FORMAT(int);
+				break;
+			case ASYNC_LOG_ARG_LONG:
+				ARGS_FORMAT(long);
+				break;
+			case ASYNC_LOG_ARG_LONG_LONG:
+				ARGS_FORMAT(long long);
+				break;
+			case ASYNC_LOG_ARG_SIZE:
+				ARGS_FORMAT(size_t);
+				break;
+			case ASYNC_LOG_ARG_INTMAX:
+				ARGS_FORMAT(intmax_t);
+				break;
+			case ASYNC_LOG_ARG_PTRDIFF:
+				ARGS_FORMAT(ptrdiff_t);
+				break;
+			case ASYNC_LOG_ARG_DOUBLE:
+				ARGS_FORMAT(double);
+				break;
+			case ASYNC_LOG_ARG_LONG_DOUBLE:
+				ARGS_FORMAT(long double);
+				break;
+			case ASYNC_LOG_ARG_POINTER:
+				ARGS_FORMAT(void *);
+				break;
+			case ASYNC_LOG_ARG_STRING:
+			{
+				const char *str = (const char *)reader.buf + reader.pos;
+				size_t len = strnlen(str, reader.size - reader.pos);
+				if(len == reader.size - reader.pos)
+					goto end;
+				reader.pos += len + 1;
+				ARGS_SNPRINTF(str);
+				break;
+			}
+			default:
+				goto end;
+		}
+	}
+	if(*c)
+		truncated = true;
+end:
+	out[pos] = '\0';
+	if(truncated && out_size > sizeof(ASYNC_LOG_TRUNCATED_MARK))
+		memcpy(out + out_size - sizeof(ASYNC_LOG_TRUNCATED_MARK), ASYNC_LOG_TRUNCATED_MARK, sizeof(ASYNC_LOG_TRUNCATED_MARK));
+}
+
+#undef ARGS_FORMAT
+#undef ARGS_SNPRINTF
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_async_log_init(ChiakiAsyncLog *alog, ChiakiLogCb cb, void *cb_user, const char *filename)
+{
+	alog->cb = cb;
+	alog->cb_user = cb_user;
+	alog->file = NULL;
+	alog->file_buf = NULL;
+	alog->dropped_reported = 0;
+	alog->should_stop = false;
+
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
+	alog->queue = chiaki_malloc(sizeof(ChiakiAsyncLogQueue));
+	if(!alog->queue)
+		return CHIAKI_ERR_MEMORY;
+	atomic_init(&alog->queue->head, 0);
+	alog->queue->tail = 0;
+	atomic_init(&alog->queue->dropped, 0);
+	atomic_init(&alog->queue->consumer_waiting, false);
+	for(size_t i=0; i<ASYNC_LOG_SLOTS_COUNT; i++)
+		atomic_init(&alog->queue->slots[i].seq, i);
+
+	if(filename)
+	{
+		alog->file = fopen(filename, "a");
+		if(!alog->file)
+		{
+			err = CHIAKI_ERR_UNKNOWN;
+			goto error_queue;
+		}
+		// fully buffered, only flushed explicitly by the background thread when idle
+		alog->file_buf = chiaki_malloc(ASYNC_LOG_FILE_BUF_SIZE);
+		if(alog->file_buf)
+			setvbuf(alog->file, alog->file_buf, _IOFBF, ASYNC_LOG_FILE_BUF_SIZE);
+	}
+
+	err = chiaki_mutex_init(&alog->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_file;
+	chiaki_mutex_set_name(&alog->mutex, "async_log");
+
+	err = chiaki_cond_init(&alog->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&alog->thread, async_log_thread_func, alog);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	chiaki_thread_set_name(&alog->thread, "Chiaki Log");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&alog->cond);
+error_mutex:
+	chiaki_mutex_fini(&alog->mutex);
+error_file:
+	if(alog->file)
+		fclose(alog->file);
+	chiaki_free(alog->file_buf);
+error_queue:
+	chiaki_free(alog->queue);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_async_log_fini(ChiakiAsyncLog *alog)
+{
+	chiaki_mutex_lock(&alog->mutex);
+	alog->should_stop = true;
+	chiaki_cond_signal(&alog->cond);
+	chiaki_mutex_unlock(&alog->mutex);
+
+	chiaki_thread_join(&alog->thread, NULL);
+	chiaki_cond_fini(&alog->cond);
+	chiaki_mutex_fini(&alog->mutex);
+
+	if(alog->file)
+		fclose(alog->file);
+	chiaki_free(alog->file_buf);
+	chiaki_free(alog->queue);
+}
+
+CHIAKI_EXPORT void chiaki_async_log_push(ChiakiAsyncLog *alog, ChiakiLogLevel level, const char *fmt, va_list args)
+{
+	ChiakiAsyncLogQueue *queue = alog->queue;
+	AsyncLogSlot *slot;
+	size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	while(true)
+	{
+		slot = &queue->slots[pos & (ASYNC_LOG_SLOTS_COUNT - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0)
+		{
+			if(atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if(diff < 0)
+		{
+			atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+			pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	}
+
+	slot->level = level;
+	slot->fmt = fmt;
+	slot->timestamp_us = async_log_now_realtime_us();
+
+	va_list args_capture;
+	va_copy(args_capture, args);
+	bool captured = async_log_capture(slot, fmt, args_capture);
+	va_end(args_capture);
+
+	slot->preformatted = !captured;
+	slot->heap_msg = NULL;
+	if(!captured)
+	{
+		// fall back to formatting here, which is still cheaper than doing the output on this thread
+		va_list args_heap;
+		va_copy(args_heap, args);
+		int written = vsnprintf((char *)slot->args, sizeof(slot->args), fmt, args);
+		if(written < 0)
+			slot->args[0] = '\0';
+		else if((size_t)written >= sizeof(slot->args))
+		{
+			// too long for the slot, allocate like the synchronous path
+			slot->heap_msg = chiaki_malloc((size_t)written + 1);
+			if(slot->heap_msg)
+				vsnprintf(slot->heap_msg, (size_t)written + 1, fmt, args_heap);
+			else
+				memcpy(slot->args + sizeof(slot->args) - sizeof(ASYNC_LOG_TRUNCATED_MARK), ASYNC_LOG_TRUNCATED_MARK, sizeof(ASYNC_LOG_TRUNCATED_MARK));
+		}
+		va_end(args_heap);
+		slot->args_size = strlen((const char *)slot->args) + 1;
+	}
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+	// pairs with the fence in async_log_thread_func(), so either the message is seen there or the flag here
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&queue->consumer_waiting, memory_order_relaxed)
+			&& atomic_exchange(&queue->consumer_waiting, false))
+	{
+		chiaki_mutex_lock(&alog->mutex);
+		chiaki_cond_signal(&alog->cond);
+		chiaki_mutex_unlock(&alog->mutex);
+	}
+}
+
+CHIAKI_EXPORT uint64_t chiaki_async_log_dropped(ChiakiAsyncLog *alog)
+{
+	return atomic_load_explicit(&alog->queue->dropped, memory_order_relaxed);
+}
+
+static void async_log_output(ChiakiAsyncLog *alog, ChiakiLogLevel level, uint64_t timestamp_us, const char *msg)
+{
+	if(alog->cb)
+		alog->cb(level, msg, alog->cb_user);
+
+	if(!alog->file)
+		return;
+
+	time_t t = (time_t)(timestamp_us / 1000000);
+	struct tm tm;
+#ifdef _WIN32
+	localtime_s(&tm, &t);
+#else
+	localtime_r(&t, &tm);
+#endif
+	char date[0x20];
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(alog->file, "[%s:%06u] [%c] %s\n", date, (unsigned int)(timestamp_us % 1000000), chiaki_log_level_char(level), msg);
+}
+
+/**
+ * @return number of messages that have been written
+ */
+static size_t async_log_drain(ChiakiAsyncLog *alog)
+{
+	ChiakiAsyncLogQueue *queue = alog->queue;
+	char msg[ASYNC_LOG_MSG_SIZE_MAX];
+	size_t count = 0;
+
+	uint64_t dropped = atomic_load_explicit(&queue->dropped, memory_order_relaxed);
+	if(dropped != alog->dropped_reported)
+	{
+		snprintf(msg, sizeof(msg), "Async Log dropped %llu messages because the queue was full",
+				(unsigned long long)(dropped - alog->dropped_reported));
+		alog->dropped_reported = dropped;
+		async_log_output(alog, CHIAKI_LOG_WARNING, async_log_now_realtime_us(), msg);
+		count++;
+	}
+
+	while(true)
+	{
+		AsyncLogSlot *slot = &queue->slots[queue->tail & (ASYNC_LOG_SLOTS_COUNT - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if(seq != queue->tail + 1)
+			break;
+
+		if(slot->heap_msg)
+		{
+			async_log_output(alog, slot->level, slot->timestamp_us, slot->heap_msg);
+			chiaki_free(slot->heap_msg);
+			slot->heap_msg = NULL;
+		}
+		else
+		{
+			async_log_format(slot, msg, sizeof(msg));
+			async_log_output(alog, slot->level, slot->timestamp_us, msg);
+		}
+		count++;
+
+		atomic_store_explicit(&slot->seq, queue->tail + ASYNC_LOG_SLOTS_COUNT, memory_order_release);
+		queue->tail++;
+	}
+
+	return count;
+}
+
+static bool async_log_pending(ChiakiAsyncLogQueue *queue)
+{
+	AsyncLogSlot *slot = &queue->slots[queue->tail & (ASYNC_LOG_SLOTS_COUNT - 1)];
+	return atomic_load_explicit(&slot->seq, memory_order_acquire) == queue->tail + 1;
+}
+
+static void *async_log_thread_func(void *user)
+{
+	ChiakiAsyncLog *alog = user;
+	bool file_dirty = false;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&alog->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(true)
+	{
+		bool stop = alog->should_stop;
+		chiaki_mutex_unlock(&alog->mutex);
+
+		size_t count = async_log_drain(alog);
+		if(count)
+			file_dirty = true;
+		else if(file_dirty && alog->file)
+		{
+			fflush(alog->file);
+			file_dirty = false;
+		}
+
+		chiaki_mutex_lock(&alog->mutex);
+		if(stop)
+			break;
+		if(count)
+			continue;
+
+		// producers only take the mutex to signal if this flag is set, i.e. while idle
+		ChiakiAsyncLogQueue *queue = alog->queue;
+		atomic_store_explicit(&queue->consumer_waiting, true, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		if(!async_log_pending(queue) && atomic_load(&queue->dropped) == alog->dropped_reported)
+		{
+			while(!alog->should_stop && atomic_load_explicit(&queue->consumer_waiting, memory_order_relaxed))
+				chiaki_cond_wait(&alog->cond, &alog->mutex);
+		}
+		atomic_store_explicit(&queue->consumer_waiting, false, memory_order_relaxed);
+	}
+
+	chiaki_mutex_unlock(&alog->mutex);
+	return NULL;
+}
@@ -33,6 +33,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 	ChiakiErrorCode err = chiaki_mutex_init(&audio_receiver->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
+	chiaki_mutex_set_name(&audio_receiver->mutex, "audio_receiver");
 
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -40,9 +41,6 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *au
 
 CHIAKI_EXPORT void chiaki_audio_receiver_fini(ChiakiAudioReceiver *audio_receiver)
 {
-#ifdef CHIAKI_LIB_ENABLE_OPUS
-	opus_decoder_destroy(audio_receiver->opus_decoder);
-#endif
 	chiaki_mutex_fini(&audio_receiver->mutex);
 }
 
@@ -60,6 +58,8 @@ CHIAKI_EXPORT void chiaki_audio_receiver_stream_info(ChiakiAudioReceiver *audio_
 
 	if(audio_receiver->session->audio_sink.header_cb)
 		audio_receiver->session->audio_sink.header_cb(audio_header, audio_receiver->session->audio_sink.user);
+	if(audio_receiver->session->recorder)
+		chiaki_recorder_audio_header(audio_receiver->session->recorder, audio_header);
 
 	chiaki_mutex_unlock(&audio_receiver->mutex);
 }
@@ -130,6 +130,8 @@ static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, Chi
 
 	if(audio_receiver->session->audio_sink.frame_cb)
 		audio_receiver->session->audio_sink.frame_cb(buf, buf_size, audio_receiver->session->audio_sink.user);
+	if(audio_receiver->session->recorder)
+		chiaki_recorder_audio_frame(audio_receiver->session->recorder, buf, buf_size);
 
 beach:
 	chiaki_mutex_unlock(&audio_receiver->mutex);
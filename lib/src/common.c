@@ -22,6 +22,7 @@
 #include <galois.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <errno.h>
 
@@ -74,28 +75,102 @@ CHIAKI_EXPORT const char *chiaki_error_string(ChiakiErrorCode code)
 	}
 }
 
-CHIAKI_EXPORT void *chiaki_aligned_alloc(size_t alignment, size_t size)
+static void *allocator_default_alloc(size_t size, const char *site, void *user)
 {
-#if defined(_WIN32)
-	return _aligned_malloc(size, alignment);
-#elif __APPLE__ || __ANDROID__
-	void *r;
-	if(posix_memalign(&r, alignment, size) == 0)
-		return r;
-	else
+	(void)site; (void)user;
+	return malloc(size);
+}
+
+static void *allocator_default_realloc(void *ptr, size_t size, const char *site, void *user)
+{
+	(void)site; (void)user;
+	return realloc(ptr, size);
+}
+
+static void allocator_default_free(void *ptr, void *user)
+{
+	(void)user;
+	free(ptr);
+}
+
+static ChiakiAllocator allocator = {
+	allocator_default_alloc,
+	allocator_default_realloc,
+	allocator_default_free,
+	NULL
+};
+
+CHIAKI_EXPORT void chiaki_set_allocator(const ChiakiAllocator *allocator_new)
+{
+	if(allocator_new)
+	{
+		allocator = *allocator_new;
+		return;
+	}
+	allocator.alloc = allocator_default_alloc;
+	allocator.realloc = allocator_default_realloc;
+	allocator.free = allocator_default_free;
+	allocator.user = NULL;
+}
+
+CHIAKI_EXPORT void chiaki_get_allocator(ChiakiAllocator *allocator_out)
+{
+	*allocator_out = allocator;
+}
+
+CHIAKI_EXPORT void *chiaki_malloc_at(size_t size, const char *site)
+{
+	return allocator.alloc(size, site, allocator.user);
+}
+
+CHIAKI_EXPORT void *chiaki_calloc_at(size_t nmemb, size_t size, const char *site)
+{
+	if(size && nmemb > SIZE_MAX / size)
 		return NULL;
-#else
-	return aligned_alloc(alignment, size);
-#endif
+	void *r = allocator.alloc(nmemb * size, site, allocator.user);
+	if(r)
+		memset(r, 0, nmemb * size);
+	return r;
+}
+
+CHIAKI_EXPORT void *chiaki_realloc_at(void *ptr, size_t size, const char *site)
+{
+	return allocator.realloc(ptr, size, site, allocator.user);
+}
+
+CHIAKI_EXPORT char *chiaki_strdup_at(const char *str, const char *site)
+{
+	size_t size = strlen(str) + 1;
+	char *r = allocator.alloc(size, site, allocator.user);
+	if(r)
+		memcpy(r, str, size);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_free(void *ptr)
+{
+	if(ptr)
+		allocator.free(ptr, allocator.user);
+}
+
+CHIAKI_EXPORT void *chiaki_aligned_alloc_at(size_t alignment, size_t size, const char *site)
+{
+	// over-allocate from the allocator and keep the original pointer right before the aligned one
+	if(size > SIZE_MAX - alignment - sizeof(void *))
+		return NULL;
+	uint8_t *base = allocator.alloc(size + alignment - 1 + sizeof(void *), site, allocator.user);
+	if(!base)
+		return NULL;
+	uintptr_t aligned = ((uintptr_t)(base + sizeof(void *)) + alignment - 1) & ~((uintptr_t)alignment - 1);
+	((void **)aligned)[-1] = base;
+	return (void *)aligned;
 }
 
 CHIAKI_EXPORT void chiaki_aligned_free(void *ptr)
 {
-#ifdef _WIN32
-	_aligned_free(ptr);
-#else
-	free(ptr);
-#endif
+	if(!ptr)
+		return;
+	chiaki_free(((void **)ptr)[-1]);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_lib_init()
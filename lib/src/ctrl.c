@@ -83,6 +83,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_start(ChiakiCtrl *ctrl, ChiakiSession
 	err = chiaki_mutex_init(&ctrl->notif_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_notif_pipe;
+	chiaki_mutex_set_name(&ctrl->notif_mutex, "ctrl_notif");
 
 	err = chiaki_thread_create(&ctrl->thread, ctrl_thread_func, ctrl);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -112,20 +113,20 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_ctrl_join(ChiakiCtrl *ctrl)
 	ChiakiErrorCode err = chiaki_thread_join(&ctrl->thread, NULL);
 	chiaki_stop_pipe_fini(&ctrl->notif_pipe);
 	chiaki_mutex_fini(&ctrl->notif_mutex);
-	free(ctrl->login_pin);
+	chiaki_free(ctrl->login_pin);
 	return err;
 }
 
 CHIAKI_EXPORT void chiaki_ctrl_set_login_pin(ChiakiCtrl *ctrl, const uint8_t *pin, size_t pin_size)
 {
-	uint8_t *buf = malloc(pin_size);
+	uint8_t *buf = chiaki_malloc(pin_size);
 	if(!buf)
 		return;
 	memcpy(buf, pin, pin_size);
 	ChiakiErrorCode err = chiaki_mutex_lock(&ctrl->notif_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 	if(ctrl->login_pin_entered)
-		free(ctrl->login_pin);
+		chiaki_free(ctrl->login_pin);
 	ctrl->login_pin_entered = true;
 	ctrl->login_pin = buf;
 	ctrl->login_pin_size = pin_size;
@@ -213,7 +214,7 @@ static void *ctrl_thread_func(void *user)
 				CHIAKI_LOGI(ctrl->session->log, "Ctrl received entered Login PIN, sending to console");
 				ctrl_message_send(ctrl, CTRL_MESSAGE_TYPE_LOGIN_PIN_REP, ctrl->login_pin, ctrl->login_pin_size);
 				ctrl->login_pin_entered = false;
-				free(ctrl->login_pin);
+				chiaki_free(ctrl->login_pin);
 				ctrl->login_pin = NULL;
 				ctrl->login_pin_size = 0;
 				chiaki_stop_pipe_reset(&ctrl->notif_pipe);
@@ -259,14 +260,14 @@ static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, CtrlMessageType type,
 	uint8_t *enc = NULL;
 	if(payload && payload_size)
 	{
-		enc = malloc(payload_size);
+		enc = chiaki_malloc(payload_size);
 		if(!enc)
 			return CHIAKI_ERR_MEMORY;
 		ChiakiErrorCode err = chiaki_rpcrypt_encrypt(&ctrl->session->rpcrypt, ctrl->crypt_counter_local++, payload, enc, payload_size);
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
 			CHIAKI_LOGE(ctrl->session->log, "Ctrl failed to encrypt payload");
-			free(enc);
+			chiaki_free(enc);
 			return err;
 		}
 	}
@@ -289,7 +290,7 @@ static ChiakiErrorCode ctrl_message_send(ChiakiCtrl *ctrl, CtrlMessageType type,
 	if(enc)
 	{
 		sent = send(ctrl->sock, enc, payload_size, 0);
-		free(enc);
+		chiaki_free(enc);
 		if(sent < 0)
 		{
 			CHIAKI_LOGE(ctrl->session->log, "Failed to send Ctrl Message Payload");
@@ -490,7 +491,7 @@ static ChiakiErrorCode ctrl_connect(ChiakiCtrl *ctrl)
 
 	ChiakiSession *session = ctrl->session;
 	struct addrinfo *addr = session->connect_info.host_addrinfo_selected;
-	struct sockaddr *sa = malloc(addr->ai_addrlen);
+	struct sockaddr *sa = chiaki_malloc(addr->ai_addrlen);
 	if(!sa)
 	{
 		CHIAKI_LOGE(session->log, "Ctrl failed to alloc sockaddr");
@@ -524,7 +525,7 @@ static ChiakiErrorCode ctrl_connect(ChiakiCtrl *ctrl)
 	chiaki_mutex_unlock(&ctrl->notif_mutex);
 	err = chiaki_stop_pipe_connect(&ctrl->notif_pipe, sock, sa, addr->ai_addrlen);
 	chiaki_mutex_lock(&ctrl->notif_mutex);
-	free(sa);
+	chiaki_free(sa);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		if(err == CHIAKI_ERR_CANCELED)
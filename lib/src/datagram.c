@@ -0,0 +1,167 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <chiaki/datagram.h>
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#if defined(__linux__)
+#define DATAGRAM_HAVE_SENDMMSG
+#define DATAGRAM_SENDMMSG_MAX 32 // datagrams per system call
+#endif
+
+#if defined(SO_RXQ_OVFL)
+#define DATAGRAM_HAVE_RXQ_OVFL
+#endif
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_send(void *user, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	int r = send(sock, buf, buf_size, 0);
+	if(r < 0)
+		return CHIAKI_ERR_NETWORK;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_send_batch(void *user, chiaki_socket_t sock, const uint8_t *const *bufs, const size_t *buf_sizes, size_t count)
+{
+#ifdef DATAGRAM_HAVE_SENDMMSG
+	struct mmsghdr msgs[DATAGRAM_SENDMMSG_MAX];
+	struct iovec iovs[DATAGRAM_SENDMMSG_MAX];
+	size_t sent = 0;
+	while(sent < count)
+	{
+		size_t batch = count - sent;
+		if(batch > DATAGRAM_SENDMMSG_MAX)
+			batch = DATAGRAM_SENDMMSG_MAX;
+		memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+		for(size_t i=0; i<batch; i++)
+		{
+			iovs[i].iov_base = (void *)bufs[sent + i];
+			iovs[i].iov_len = buf_sizes[sent + i];
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int r = sendmmsg(sock, msgs, (unsigned int)batch, 0);
+		if(r <= 0)
+		{
+			if(r < 0 && errno == EINTR)
+				continue;
+			return CHIAKI_ERR_NETWORK;
+		}
+		sent += (size_t)r;
+	}
+	return CHIAKI_ERR_SUCCESS;
+#else
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiErrorCode err = chiaki_datagram_socket_send(user, sock, bufs[i], buf_sizes[i]);
+		if(err != CHIAKI_ERR_SUCCESS && ret == CHIAKI_ERR_SUCCESS)
+			ret = err;
+	}
+	return ret;
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_io_send_batch(ChiakiDatagramIO *io, chiaki_socket_t sock, const uint8_t *const *bufs, const size_t *buf_sizes, size_t count)
+{
+	if(io->send_batch_cb)
+		return io->send_batch_cb(io->user, sock, bufs, buf_sizes, count);
+
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiErrorCode err = io->send_cb(io->user, sock, bufs[i], buf_sizes[i]);
+		if(err != CHIAKI_ERR_SUCCESS && ret == CHIAKI_ERR_SUCCESS)
+			ret = err;
+	}
+	return ret;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_enable_drop_stats(chiaki_socket_t sock)
+{
+#ifdef DATAGRAM_HAVE_RXQ_OVFL
+	const int enable = 1;
+	if(setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
+#else
+	return CHIAKI_ERR_UNKNOWN;
+#endif
+}
+
+#ifdef DATAGRAM_HAVE_RXQ_OVFL
+static ChiakiErrorCode datagram_socket_recv_drop_stats(ChiakiDatagramSocketStats *stats, chiaki_socket_t sock, uint8_t *buf, size_t *buf_size)
+{
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = *buf_size;
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(uint32_t))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t received_sz = recvmsg(sock, &msg, 0);
+	if(received_sz < 0)
+		return CHIAKI_ERR_NETWORK;
+
+	// only present once the kernel has dropped anything at all
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&stats->kernel_drops, CMSG_DATA(cmsg), sizeof(stats->kernel_drops));
+	}
+
+	*buf_size = (size_t)received_sz;
+	return CHIAKI_ERR_SUCCESS;
+}
+#endif
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_datagram_socket_recv(void *user, chiaki_socket_t sock, ChiakiStopPipe *stop_pipe, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+{
+	ChiakiErrorCode err = chiaki_stop_pipe_select_single(stop_pipe, sock, false, timeout_ms);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+#ifdef DATAGRAM_HAVE_RXQ_OVFL
+	if(user)
+		return datagram_socket_recv_drop_stats(user, sock, buf, buf_size);
+#endif
+
+	int received_sz = recv(sock, buf, *buf_size, 0);
+	if(received_sz < 0)
+		return CHIAKI_ERR_NETWORK;
+	*buf_size = (size_t)received_sz;
+	return CHIAKI_ERR_SUCCESS;
+}
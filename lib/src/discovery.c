@@ -15,6 +15,8 @@
  * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include "utils.h"
 
 #include <chiaki/discovery.h>
@@ -34,6 +36,11 @@
 #include <arpa/inet.h>
 #endif
 
+#if defined(__linux__)
+#define DISCOVERY_HAVE_SENDMMSG
+#define DISCOVERY_SENDMMSG_MAX 64 // packets per system call
+#endif
+
 const char *chiaki_discovery_host_state_string(ChiakiDiscoveryHostState state)
 {
 	switch(state)
@@ -200,6 +207,75 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_send(ChiakiDiscovery *discovery,
 	return CHIAKI_ERR_SUCCESS;
 }
 
+static socklen_t discovery_sockaddr_size(const struct sockaddr_storage *addr)
+{
+	return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_send_multi(ChiakiDiscovery *discovery, ChiakiDiscoveryPacket *packet, const struct sockaddr_storage *addrs, size_t addrs_count, size_t *sent)
+{
+	char buf[512];
+	int len = chiaki_discovery_packet_fmt(buf, sizeof(buf), packet);
+	if(len < 0)
+		return CHIAKI_ERR_UNKNOWN;
+	if((size_t)len >= sizeof(buf))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	size_t sent_count = 0;
+	size_t i = 0;
+#ifdef DISCOVERY_HAVE_SENDMMSG
+	struct mmsghdr msgs[DISCOVERY_SENDMMSG_MAX];
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len = (size_t)len + 1;
+	while(i < addrs_count)
+	{
+		size_t batch = addrs_count - i;
+		if(batch > DISCOVERY_SENDMMSG_MAX)
+			batch = DISCOVERY_SENDMMSG_MAX;
+		memset(msgs, 0, sizeof(struct mmsghdr) * batch);
+		for(size_t j=0; j<batch; j++)
+		{
+			msgs[j].msg_hdr.msg_name = (void *)&addrs[i + j];
+			msgs[j].msg_hdr.msg_namelen = discovery_sockaddr_size(&addrs[i + j]);
+			msgs[j].msg_hdr.msg_iov = &iov;
+			msgs[j].msg_hdr.msg_iovlen = 1;
+		}
+		int r = sendmmsg(discovery->socket, msgs, (unsigned int)batch, 0);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+		{
+			// the packet to addrs[i] failed, e.g. because its subnet is unreachable
+			CHIAKI_LOGV(discovery->log, "Discovery failed to send: %s", strerror(errno));
+			ret = CHIAKI_ERR_NETWORK;
+			i++;
+			continue;
+		}
+		i += (size_t)r;
+		sent_count += (size_t)r;
+	}
+#else
+	for(; i<addrs_count; i++)
+	{
+		// Windows takes an int length and reports errors through WSAGetLastError()
+		int r = sendto(discovery->socket, buf, len + 1, 0, (const struct sockaddr *)&addrs[i], discovery_sockaddr_size(&addrs[i]));
+		if(r < 0)
+		{
+			CHIAKI_LOGV(discovery->log, "Discovery failed to send: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			ret = CHIAKI_ERR_NETWORK;
+			continue;
+		}
+		sent_count++;
+	}
+#endif
+
+	if(sent)
+		*sent = sent_count;
+	return ret;
+}
+
 static void *discovery_thread_func(void *user);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_thread_start(ChiakiDiscoveryThread *thread, ChiakiDiscovery *discovery, ChiakiDiscoveryCb cb, void *cb_user)
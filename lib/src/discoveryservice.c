@@ -18,26 +18,74 @@
 #include <chiaki/discoveryservice.h>
 
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+// responses of all hosts arrive in a burst right after each ping
+#define DISCOVERY_SERVICE_RCVBUF_PER_HOST 2048
+
+#define DISCOVERY_PROBE_PREFIX_MIN 16
+
 static void *discovery_service_thread_func(void *user);
 static void discovery_service_ping(ChiakiDiscoveryService *service);
 static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service);
 static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *user);
 static void discovery_service_report_state(ChiakiDiscoveryService *service);
 
+CHIAKI_EXPORT const char *chiaki_discovery_service_host_event_string(ChiakiDiscoveryServiceHostEvent event)
+{
+	switch(event)
+	{
+		case CHIAKI_DISCOVERY_SERVICE_HOST_ADDED:
+			return "added";
+		case CHIAKI_DISCOVERY_SERVICE_HOST_UPDATED:
+			return "updated";
+		case CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED:
+			return "removed";
+		default:
+			return "unknown";
+	}
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log)
 {
+	sa_family_t family;
+	if(options->send_addr)
+		family = options->send_addr->sa_family;
+	else if(options->probe_addrs_count)
+		family = options->probe_addrs[0].ss_family;
+	else
+	{
+		CHIAKI_LOGE(log, "Discovery Service has neither a send addr nor probe addrs");
+		return CHIAKI_ERR_INVALID_DATA;
+	}
+	for(size_t i=0; i<options->probe_addrs_count; i++)
+	{
+		if(options->probe_addrs[i].ss_family != family)
+		{
+			CHIAKI_LOGE(log, "Discovery Service probe addrs must all have the same family");
+			return CHIAKI_ERR_INVALID_DATA;
+		}
+	}
+
 	service->log = log;
 	service->options = *options;
 	service->ping_index = 0;
+	memset(&service->stats, 0, sizeof(service->stats));
 
-	service->hosts = calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryHost));
+	service->hosts = chiaki_calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryHost));
 	if(!service->hosts)
 		return CHIAKI_ERR_MEMORY;
 
 	ChiakiErrorCode err;
-	service->host_discovery_infos = calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryServiceHostDiscoveryInfo));
+	service->host_discovery_infos = chiaki_calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryServiceHostDiscoveryInfo));
 	if(!service->host_discovery_infos)
 	{
 		err = CHIAKI_ERR_MEMORY;
@@ -46,21 +94,58 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryServi
 
 	service->hosts_count = 0;
 
+	// at most half full, so probe sequences stay short and there is always an empty slot
+	size_t host_table_size = 8;
+	while(host_table_size < service->options.hosts_max * 2)
+		host_table_size <<= 1;
+	service->host_table = chiaki_calloc(host_table_size, sizeof(size_t));
+	if(!service->host_table)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_host_discovery_infos;
+	}
+	service->host_table_mask = host_table_size - 1;
+
 	err = chiaki_mutex_init(&service->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_host_discovery_infos;
+		goto error_host_table;
+	chiaki_mutex_set_name(&service->state_mutex, "discovery_service_state");
 
-	service->options.send_addr = malloc(service->options.send_addr_size);
-	if(!service->options.send_addr)
+	if(options->send_addr)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_state_mutex;
+		service->options.send_addr = chiaki_malloc(service->options.send_addr_size);
+		if(!service->options.send_addr)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_state_mutex;
+		}
+		memcpy(service->options.send_addr, options->send_addr, service->options.send_addr_size);
+	}
+
+	service->options.probe_addrs = NULL;
+	if(options->probe_addrs_count)
+	{
+		service->options.probe_addrs = chiaki_malloc(options->probe_addrs_count * sizeof(struct sockaddr_storage));
+		if(!service->options.probe_addrs)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_send_addr;
+		}
+		memcpy(service->options.probe_addrs, options->probe_addrs, options->probe_addrs_count * sizeof(struct sockaddr_storage));
 	}
-	memcpy(service->options.send_addr, options->send_addr, service->options.send_addr_size);
 
-	err = chiaki_discovery_init(&service->discovery, log, service->options.send_addr->sa_family);
+	err = chiaki_discovery_init(&service->discovery, log, family);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_send_addr;
+		goto error_probe_addrs;
+
+	int rcvbuf = 0;
+	socklen_t rcvbuf_size = sizeof(rcvbuf);
+	int rcvbuf_wanted = (int)(service->options.hosts_max * DISCOVERY_SERVICE_RCVBUF_PER_HOST);
+	if(getsockopt(service->discovery.socket, SOL_SOCKET, SO_RCVBUF, (void *)&rcvbuf, &rcvbuf_size) == 0 && rcvbuf < rcvbuf_wanted)
+	{
+		if(setsockopt(service->discovery.socket, SOL_SOCKET, SO_RCVBUF, (const void *)&rcvbuf_wanted, sizeof(rcvbuf_wanted)) < 0)
+			CHIAKI_LOGW(service->log, "Discovery Service failed to increase receive buffer to %d bytes", rcvbuf_wanted);
+	}
 
 	err = chiaki_bool_pred_cond_init(&service->stop_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -77,14 +162,19 @@ error_stop_cond:
 	chiaki_bool_pred_cond_fini(&service->stop_cond);
 error_discovery:
 	chiaki_discovery_fini(&service->discovery);
+error_probe_addrs:
+	chiaki_free(service->options.probe_addrs);
 error_send_addr:
-	free(service->options.send_addr);
+	if(options->send_addr)
+		chiaki_free(service->options.send_addr);
 error_state_mutex:
 	chiaki_mutex_fini(&service->state_mutex);
+error_host_table:
+	chiaki_free(service->host_table);
 error_host_discovery_infos:
-	free(service->host_discovery_infos);
+	chiaki_free(service->host_discovery_infos);
 error_hosts:
-	free(service->hosts);
+	chiaki_free(service->hosts);
 	return err;
 }
 
@@ -95,18 +185,27 @@ CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service
 	chiaki_bool_pred_cond_fini(&service->stop_cond);
 	chiaki_discovery_fini(&service->discovery);
 	chiaki_mutex_fini(&service->state_mutex);
-	free(service->options.send_addr);
+	chiaki_free(service->options.send_addr);
+	chiaki_free(service->options.probe_addrs);
 
 	for(size_t i=0; i<service->hosts_count; i++)
 	{
 		ChiakiDiscoveryHost *host = &service->hosts[i];
-#define FREE_STRING(name) free((char *)host->name);
+#define FREE_STRING(name) chiaki_free((char *)host->name);
 		CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
 #undef FREE_STRING
 	}
 
-	free(service->host_discovery_infos);
-	free(service->hosts);
+	chiaki_free(service->host_table);
+	chiaki_free(service->host_discovery_infos);
+	chiaki_free(service->hosts);
+}
+
+CHIAKI_EXPORT void chiaki_discovery_service_get_stats(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceStats *stats)
+{
+	chiaki_mutex_lock(&service->state_mutex);
+	*stats = service->stats;
+	chiaki_mutex_unlock(&service->state_mutex);
 }
 
 static void *discovery_service_thread_func(void *user)
@@ -143,6 +242,7 @@ static void discovery_service_ping(ChiakiDiscoveryService *service)
 	assert(err == CHIAKI_ERR_SUCCESS);
 
 	service->ping_index++;
+	service->stats.pings++;
 	discovery_service_drop_old_hosts(service);
 
 	chiaki_mutex_unlock(&service->state_mutex);
@@ -150,9 +250,112 @@ static void discovery_service_ping(ChiakiDiscoveryService *service)
 	CHIAKI_LOGV(service->log, "Discovery Service sending ping");
 	ChiakiDiscoveryPacket packet = { 0 };
 	packet.cmd = CHIAKI_DISCOVERY_CMD_SRCH;
-	err = chiaki_discovery_send(&service->discovery, &packet, service->options.send_addr, service->options.send_addr_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping");
+	if(service->options.send_addr)
+	{
+		err = chiaki_discovery_send(&service->discovery, &packet, service->options.send_addr, service->options.send_addr_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGE(service->log, "Discovery Service failed to send ping");
+	}
+
+	if(service->options.probe_addrs_count)
+	{
+		size_t sent = 0;
+		err = chiaki_discovery_send_multi(&service->discovery, &packet, service->options.probe_addrs, service->options.probe_addrs_count, &sent);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGW(service->log, "Discovery Service failed to send %llu of %llu probes",
+					(unsigned long long)(service->options.probe_addrs_count - sent),
+					(unsigned long long)service->options.probe_addrs_count);
+		chiaki_mutex_lock(&service->state_mutex);
+		service->stats.probes_sent += sent;
+		chiaki_mutex_unlock(&service->state_mutex);
+	}
+}
+
+static uint64_t discovery_service_hash(const char *host_id)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for(const char *c = host_id; *c; c++)
+	{
+		hash ^= (uint8_t)*c;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+/**
+ * @return the slot in the host table that refers to the host with host_id or the empty slot where it belongs
+ */
+static size_t discovery_service_host_table_find(ChiakiDiscoveryService *service, const char *host_id, uint64_t hash)
+{
+	// service->state_mutex must be locked
+	size_t slot = (size_t)hash & service->host_table_mask;
+	while(true)
+	{
+		size_t entry = service->host_table[slot];
+		if(!entry)
+			return slot;
+		size_t index = entry - 1;
+		if(service->host_discovery_infos[index].host_id_hash == hash && strcmp(service->hosts[index].host_id, host_id) == 0)
+			return slot;
+		slot = (slot + 1) & service->host_table_mask;
+	}
+}
+
+static size_t discovery_service_host_table_slot_of(ChiakiDiscoveryService *service, size_t index)
+{
+	// service->state_mutex must be locked
+	size_t slot = (size_t)service->host_discovery_infos[index].host_id_hash & service->host_table_mask;
+	while(service->host_table[slot] != index + 1)
+		slot = (slot + 1) & service->host_table_mask;
+	return slot;
+}
+
+static void discovery_service_host_table_clear_slot(ChiakiDiscoveryService *service, size_t slot)
+{
+	// service->state_mutex must be locked
+	// move back all following entries that would not be found anymore with slot empty, so no tombstones are needed
+	size_t mask = service->host_table_mask;
+	size_t hole = slot;
+	size_t cur = slot;
+	while(true)
+	{
+		cur = (cur + 1) & mask;
+		size_t entry = service->host_table[cur];
+		if(!entry)
+			break;
+		size_t home = (size_t)service->host_discovery_infos[entry - 1].host_id_hash & mask;
+		bool home_after_hole = hole <= cur
+				? (hole < home && home <= cur)
+				: (hole < home || home <= cur);
+		if(home_after_hole)
+			continue;
+		service->host_table[hole] = entry;
+		hole = cur;
+	}
+	service->host_table[hole] = 0;
+}
+
+static void discovery_service_remove_host(ChiakiDiscoveryService *service, size_t index)
+{
+	// service->state_mutex must be locked
+	discovery_service_host_table_clear_slot(service, discovery_service_host_table_slot_of(service, index));
+
+	ChiakiDiscoveryHost *host = &service->hosts[index];
+#define FREE_STRING(name) do { chiaki_free((char *)host->name); } while(0)
+	CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
+#undef FREE_STRING
+
+	// move the last host into the gap
+	size_t last = service->hosts_count - 1;
+	if(index != last)
+	{
+		size_t slot = discovery_service_host_table_slot_of(service, last);
+		service->hosts[index] = service->hosts[last];
+		service->host_discovery_infos[index] = service->host_discovery_infos[last];
+		service->host_table[slot] = index + 1;
+	}
+	service->hosts_count--;
 }
 
 static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
@@ -161,33 +364,24 @@ static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
 
 	bool change = false;
 
-	for(size_t i=0; i<service->hosts_count; i++)
+	for(size_t i=0; i<service->hosts_count;)
 	{
 		if(service->host_discovery_infos[i].last_ping_index + service->options.host_drop_pings >= service->ping_index)
+		{
+			i++;
 			continue;
+		}
 
 		ChiakiDiscoveryHost *host = &service->hosts[i];
 		CHIAKI_LOGI(service->log, "Discovery Service: Host with id %s is no longer available", host->host_id ? host->host_id : "");
 
-#define FREE_STRING(name) do { free((char *)host->name); } while(0)
-		CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
-#undef FREE_STRING
-
-		if(i < service->hosts_count - 1)
-		{
-			memmove(service->host_discovery_infos + i,
-					service->host_discovery_infos + i + 1,
-					sizeof(ChiakiDiscoveryServiceHostDiscoveryInfo) * (service->hosts_count - i - 1));
-
-			memmove(service->hosts + i,
-					service->hosts + i + 1,
-					sizeof(ChiakiDiscoveryHost) * (service->hosts_count - i - 1));
-		}
+		if(service->options.host_cb)
+			service->options.host_cb(CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED, host, service->options.cb_user);
+		service->stats.hosts_removed++;
 
+		// the last host is moved to i, so i is checked again
+		discovery_service_remove_host(service, i);
 		change = true;
-
-		i--;
-		service->hosts_count--;
 	}
 
 	if(change)
@@ -206,25 +400,19 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 
 	CHIAKI_LOGV(service->log, "Discovery Service Received host with id %s", host->host_id);
 
+	uint64_t hash = discovery_service_hash(host->host_id);
+
 	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
-	bool change = false;
-
-	size_t index = SIZE_MAX;
-	for(size_t i=0; i<service->hosts_count; i++)
-	{
-		if(!service->hosts[i].host_id)
-			continue;
+	service->stats.responses++;
 
-		if(strcmp(service->hosts[i].host_id, host->host_id) == 0)
-		{
-			index = i;
-			break;
-		}
-	}
+	bool change = false;
+	ChiakiDiscoveryServiceHostEvent event = CHIAKI_DISCOVERY_SERVICE_HOST_UPDATED;
 
-	if(index == SIZE_MAX)
+	size_t slot = discovery_service_host_table_find(service, host->host_id, hash);
+	size_t index;
+	if(!service->host_table[slot])
 	{
 		if(service->hosts_count == service->options.hosts_max)
 		{
@@ -235,9 +423,14 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 		CHIAKI_LOGI(service->log, "Discovery Service detected new host with id %s", host->host_id);
 
 		change = true;
+		event = CHIAKI_DISCOVERY_SERVICE_HOST_ADDED;
 		index = service->hosts_count++;
 		memset(&service->hosts[index], 0, sizeof(ChiakiDiscoveryHost));
+		service->host_discovery_infos[index].host_id_hash = hash;
+		service->host_table[slot] = index + 1;
 	}
+	else
+		index = service->host_table[slot] - 1;
 
 	service->host_discovery_infos[index].last_ping_index = service->ping_index;
 
@@ -251,14 +444,14 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 
 #define UPDATE_STRING(name) do { \
 		if(host_slot->name && host->name && strcmp(host_slot->name, host->name) == 0) \
-            break; \
+			break; \
 		if(!host_slot->name && !host->name) \
 			break; \
 		change = true; \
 		if(host_slot->name) \
-			free((char *)host_slot->name); \
+			chiaki_free((char *)host_slot->name); \
 		if(host->name) \
-			host_slot->name = strdup(host->name); \
+			host_slot->name = chiaki_strdup(host->name); \
 		else \
 			host_slot->name = NULL; \
 	} while(0)
@@ -268,7 +461,15 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 #undef UPDATE_STRING
 
 	if(change)
+	{
+		if(event == CHIAKI_DISCOVERY_SERVICE_HOST_ADDED)
+			service->stats.hosts_added++;
+		else
+			service->stats.hosts_updated++;
+		if(service->options.host_cb)
+			service->options.host_cb(event, host_slot, service->options.cb_user);
 		discovery_service_report_state(service);
+	}
 
 r2con:
 	chiaki_mutex_unlock(&service->state_mutex);
@@ -279,4 +480,118 @@ static void discovery_service_report_state(ChiakiDiscoveryService *service)
 	// service->state_mutex must be locked
 	if(service->options.cb)
 		service->options.cb(service->hosts, service->hosts_count, service->options.cb_user);
-}
\ No newline at end of file
+}
+
+/**
+ * Parse a single "ADDR[/PREFIX]" entry of chiaki_discovery_probe_addrs_parse()
+ *
+ * @param first receives the first host address in host byte order
+ * @param count receives the number of host addresses
+ */
+static ChiakiErrorCode discovery_probe_entry_parse(const char *entry, size_t entry_size, uint32_t *first, uint32_t *count)
+{
+	char buf[32];
+	if(!entry_size || entry_size >= sizeof(buf))
+		return CHIAKI_ERR_INVALID_DATA;
+	memcpy(buf, entry, entry_size);
+	buf[entry_size] = '\0';
+
+	unsigned long prefix = 32;
+	char *slash = strchr(buf, '/');
+	if(slash)
+	{
+		*slash = '\0';
+		char *end;
+		prefix = strtoul(slash + 1, &end, 10);
+		if(!slash[1] || *end || prefix > 32 || prefix < DISCOVERY_PROBE_PREFIX_MIN)
+			return CHIAKI_ERR_INVALID_DATA;
+	}
+
+	struct in_addr addr;
+	if(inet_pton(AF_INET, buf, &addr) != 1)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	uint32_t host_bits = 32 - (uint32_t)prefix;
+	uint32_t network = ntohl(addr.s_addr) & ~(uint32_t)((1ull << host_bits) - 1);
+	if(host_bits == 0)
+	{
+		*first = network;
+		*count = 1;
+	}
+	else if(host_bits == 1)
+	{
+		// point-to-point, both addresses are hosts
+		*first = network;
+		*count = 2;
+	}
+	else
+	{
+		*first = network + 1;
+		*count = (1u << host_bits) - 2;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_probe_addrs_parse(const char *str, struct sockaddr_storage **addrs, size_t *addrs_count)
+{
+	// first pass only counts, second pass fills
+	struct sockaddr_storage *r = NULL;
+	size_t total = 0;
+	for(int pass=0; pass<2; pass++)
+	{
+		size_t fill = 0;
+		const char *entry = str;
+		while(true)
+		{
+			while(*entry == ' ')
+				entry++;
+			const char *entry_end = strchr(entry, ',');
+			if(!entry_end)
+				entry_end = entry + strlen(entry);
+			size_t entry_size = entry_end - entry;
+			while(entry_size && entry[entry_size - 1] == ' ')
+				entry_size--;
+
+			uint32_t first, count;
+			ChiakiErrorCode err = discovery_probe_entry_parse(entry, entry_size, &first, &count);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				chiaki_free(r);
+				return err;
+			}
+
+			if(!r)
+			{
+				total += count;
+				if(total > CHIAKI_DISCOVERY_PROBE_ADDRS_MAX)
+					return CHIAKI_ERR_INVALID_DATA;
+			}
+			else
+			{
+				for(uint32_t i=0; i<count; i++)
+				{
+					struct sockaddr_in *addr = (struct sockaddr_in *)&r[fill++];
+					memset(addr, 0, sizeof(struct sockaddr_storage));
+					addr->sin_family = AF_INET;
+					addr->sin_port = htons(CHIAKI_DISCOVERY_PORT);
+					addr->sin_addr.s_addr = htonl(first + i);
+				}
+			}
+
+			if(!*entry_end)
+				break;
+			entry = entry_end + 1;
+		}
+
+		if(!r)
+		{
+			r = chiaki_calloc(total, sizeof(struct sockaddr_storage));
+			if(!r)
+				return CHIAKI_ERR_MEMORY;
+		}
+	}
+
+	*addrs = r;
+	*addrs_count = total;
+	return CHIAKI_ERR_SUCCESS;
+}
@@ -36,7 +36,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_
 
 	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
 
-	int *jerasures = calloc(erasures_count + 1, sizeof(int));
+	int *jerasures = chiaki_calloc(erasures_count + 1, sizeof(int));
 	if(!jerasures)
 	{
 		err = CHIAKI_ERR_MEMORY;
@@ -45,14 +45,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_
 	memcpy(jerasures, erasures, erasures_count * sizeof(int));
 	jerasures[erasures_count] = -1;
 
-	uint8_t **data_ptrs = calloc(k, sizeof(uint8_t *));
+	uint8_t **data_ptrs = chiaki_calloc(k, sizeof(uint8_t *));
 	if(!data_ptrs)
 	{
 		err = CHIAKI_ERR_MEMORY;
 		goto error_jerasures;
 	}
 
-	uint8_t **coding_ptrs = calloc(m, sizeof(uint8_t *));
+	uint8_t **coding_ptrs = chiaki_calloc(m, sizeof(uint8_t *));
 	if(!coding_ptrs)
 	{
 		err = CHIAKI_ERR_MEMORY;
@@ -76,12 +76,54 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_
 	else
 		err = CHIAKI_ERR_SUCCESS;
 
-	free(coding_ptrs);
+	chiaki_free(coding_ptrs);
 error_data_ptrs:
-	free(data_ptrs);
+	chiaki_free(data_ptrs);
 error_jerasures:
-	free(jerasures);
+	chiaki_free(jerasures);
 error_matrix:
-	free(matrix);
+	free(matrix); // allocated by Jerasure
 	return err;
-}
\ No newline at end of file
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_encode(uint8_t *frame_buf, size_t unit_size, unsigned int k, unsigned int m)
+{
+	int *matrix = create_matrix(k, m);
+	if(!matrix)
+		return CHIAKI_ERR_MEMORY;
+
+	ChiakiErrorCode err = CHIAKI_ERR_SUCCESS;
+
+	uint8_t **data_ptrs = chiaki_calloc(k, sizeof(uint8_t *));
+	if(!data_ptrs)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_matrix;
+	}
+
+	uint8_t **coding_ptrs = chiaki_calloc(m, sizeof(uint8_t *));
+	if(!coding_ptrs)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_data_ptrs;
+	}
+
+	for(size_t i=0; i<k+m; i++)
+	{
+		uint8_t *buf_ptr = frame_buf + unit_size * i;
+		if(i < k)
+			data_ptrs[i] = buf_ptr;
+		else
+			coding_ptrs[i - k] = buf_ptr;
+	}
+
+	jerasure_matrix_encode(k, m, CHIAKI_FEC_WORDSIZE, matrix,
+						   (char **)data_ptrs, (char **)coding_ptrs, unit_size);
+
+	chiaki_free(coding_ptrs);
+error_data_ptrs:
+	chiaki_free(data_ptrs);
+error_matrix:
+	free(matrix); // allocated by Jerasure
+	return err;
+}
@@ -121,7 +121,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_history_event_set_button(ChiakiFee
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_history_buffer_init(ChiakiFeedbackHistoryBuffer *feedback_history_buffer, size_t size)
 {
-	feedback_history_buffer->events = calloc(size, sizeof(ChiakiFeedbackHistoryEvent));
+	feedback_history_buffer->events = chiaki_calloc(size, sizeof(ChiakiFeedbackHistoryEvent));
 	if(!feedback_history_buffer->events)
 		return CHIAKI_ERR_MEMORY;
 	feedback_history_buffer->size = size;
@@ -132,7 +132,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_history_buffer_init(ChiakiFeedback
 
 CHIAKI_EXPORT void chiaki_feedback_history_buffer_fini(ChiakiFeedbackHistoryBuffer *feedback_history_buffer)
 {
-	free(feedback_history_buffer->events);
+	chiaki_free(feedback_history_buffer->events);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_history_buffer_format(ChiakiFeedbackHistoryBuffer *feedback_history_buffer, uint8_t *buf, size_t *buf_size)
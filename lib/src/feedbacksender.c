@@ -16,15 +16,123 @@
  */
 
 #include <chiaki/feedbacksender.h>
+#include <chiaki/time.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define FEEDBACK_STATE_TIMEOUT_MIN_MS 8 // minimum time to wait between sending 2 packets
 #define FEEDBACK_STATE_TIMEOUT_MAX_MS 200 // maximum time to wait between sending 2 packets
 
 #define FEEDBACK_HISTORY_BUFFER_SIZE 0x10
 
+/**
+ * Seqlock holding the latest controller state.
+ * Any thread may write, only the sender thread reads.
+ */
+struct chiaki_feedback_sender_slot_t
+{
+	atomic_uint_fast64_t seq; // odd while a writer is active
+	atomic_uint_fast64_t buttons; // buttons | l2_state << 32 | r2_state << 40
+	atomic_uint_fast64_t sticks; // left_x | left_y << 16 | right_x << 32 | right_y << 48
+	atomic_uint_fast64_t input_time_us; // time of the oldest change not taken by the sender thread yet, 0 if none
+	atomic_bool sender_waiting;
+};
+
 static void *feedback_sender_thread_func(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion)
+static void slot_pack(ChiakiControllerState *state, uint64_t *buttons, uint64_t *sticks)
+{
+	*buttons = (uint64_t)state->buttons
+		| ((uint64_t)state->l2_state << 32)
+		| ((uint64_t)state->r2_state << 40);
+	*sticks = (uint64_t)(uint16_t)state->left_x
+		| ((uint64_t)(uint16_t)state->left_y << 16)
+		| ((uint64_t)(uint16_t)state->right_x << 32)
+		| ((uint64_t)(uint16_t)state->right_y << 48);
+}
+
+static void slot_unpack(ChiakiControllerState *state, uint64_t buttons, uint64_t sticks)
+{
+	state->buttons = (uint32_t)buttons;
+	state->l2_state = (uint8_t)(buttons >> 32);
+	state->r2_state = (uint8_t)(buttons >> 40);
+	state->left_x = (int16_t)(uint16_t)sticks;
+	state->left_y = (int16_t)(uint16_t)(sticks >> 16);
+	state->right_x = (int16_t)(uint16_t)(sticks >> 32);
+	state->right_y = (int16_t)(uint16_t)(sticks >> 48);
+}
+
+/**
+ * @return whether the state differs from the one in the slot and was written
+ */
+static bool slot_write(struct chiaki_feedback_sender_slot_t *slot, ChiakiControllerState *state, uint64_t input_time_us)
+{
+	uint64_t buttons, sticks;
+	slot_pack(state, &buttons, &sticks);
+
+	// writers are rare and short, so concurrent ones simply spin
+	uint_fast64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	while((seq & 1) || !atomic_compare_exchange_weak_explicit(&slot->seq, &seq, seq + 1, memory_order_acquire, memory_order_relaxed))
+		seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	if(atomic_load_explicit(&slot->buttons, memory_order_relaxed) == buttons
+		&& atomic_load_explicit(&slot->sticks, memory_order_relaxed) == sticks)
+	{
+		atomic_store_explicit(&slot->seq, seq, memory_order_release);
+		return false;
+	}
+
+	atomic_store_explicit(&slot->buttons, buttons, memory_order_relaxed);
+	atomic_store_explicit(&slot->sticks, sticks, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_seq_cst);
+
+	// keep the time of an earlier change that has not been taken yet
+	if(input_time_us)
+	{
+		uint_fast64_t prev_time_us = 0;
+		atomic_compare_exchange_strong_explicit(&slot->input_time_us, &prev_time_us, input_time_us, memory_order_relaxed, memory_order_relaxed);
+	}
+	return true;
+}
+
+/**
+ * @return seq of the state that was read
+ */
+static uint64_t slot_read(struct chiaki_feedback_sender_slot_t *slot, ChiakiControllerState *state, uint64_t *input_time_us)
+{
+	while(true)
+	{
+		uint_fast64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if(seq & 1)
+			continue;
+		uint64_t buttons = atomic_load_explicit(&slot->buttons, memory_order_relaxed);
+		uint64_t sticks = atomic_load_explicit(&slot->sticks, memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+			continue;
+		slot_unpack(state, buttons, sticks);
+		// a change written after the read above may lose its time here, which only skips its latency sample
+		*input_time_us = atomic_exchange_explicit(&slot->input_time_us, 0, memory_order_relaxed);
+		return seq;
+	}
+}
+
+static void latency_stats_add(ChiakiFeedbackLatencyStats *stats, uint64_t latency_us)
+{
+	unsigned int bucket = 0;
+	while(bucket + 1 < CHIAKI_FEEDBACK_LATENCY_BUCKETS && latency_us >= (2ull << bucket))
+		bucket++;
+	stats->buckets[bucket]++;
+	stats->count++;
+	stats->sum_us += latency_us;
+	if(latency_us > stats->max_us)
+		stats->max_us = latency_us;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion, const ChiakiThreadAttr *thread_attr)
 {
 	feedback_sender->log = takion->log;
 	feedback_sender->takion = takion;
@@ -33,21 +141,38 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state);
 
 	feedback_sender->state_seq_num = 0;
+	feedback_sender->should_stop = false;
+	memset(&feedback_sender->latency_stats, 0, sizeof(feedback_sender->latency_stats));
+
+	feedback_sender->slot = chiaki_malloc(sizeof(*feedback_sender->slot));
+	if(!feedback_sender->slot)
+		return CHIAKI_ERR_MEMORY;
+	uint64_t buttons, sticks;
+	slot_pack(&feedback_sender->controller_state, &buttons, &sticks);
+	atomic_init(&feedback_sender->slot->seq, 0);
+	atomic_init(&feedback_sender->slot->buttons, buttons);
+	atomic_init(&feedback_sender->slot->sticks, sticks);
+	atomic_init(&feedback_sender->slot->input_time_us, 0);
+	atomic_init(&feedback_sender->slot->sender_waiting, false);
+	feedback_sender->slot_seq_taken = 0;
 
 	feedback_sender->history_seq_num = 0;
+	feedback_sender->history_updates = 0;
+	feedback_sender->history_packets = 0;
 	ChiakiErrorCode err = chiaki_feedback_history_buffer_init(&feedback_sender->history_buf, FEEDBACK_HISTORY_BUFFER_SIZE);
 	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+		goto error_slot;
 
 	err = chiaki_mutex_init(&feedback_sender->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_history_buffer;
+	chiaki_mutex_set_name(&feedback_sender->state_mutex, "feedback_sender_state");
 
 	err = chiaki_cond_init(&feedback_sender->state_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_mutex;
 
-	err = chiaki_thread_create(&feedback_sender->thread, feedback_sender_thread_func, feedback_sender);
+	err = chiaki_thread_create_attr(&feedback_sender->thread, feedback_sender_thread_func, feedback_sender, thread_attr, feedback_sender->log);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_cond;
 
@@ -60,6 +185,8 @@ error_mutex:
 	chiaki_mutex_fini(&feedback_sender->state_mutex);
 error_history_buffer:
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
+error_slot:
+	chiaki_free(feedback_sender->slot);
 	return err;
 }
 
@@ -73,27 +200,49 @@ CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_se
 	chiaki_cond_fini(&feedback_sender->state_cond);
 	chiaki_mutex_fini(&feedback_sender->state_mutex);
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
+	chiaki_free(feedback_sender->slot);
+
+	ChiakiFeedbackLatencyStats *stats = &feedback_sender->latency_stats;
+	if(stats->count)
+	{
+		CHIAKI_LOGI(feedback_sender->log, "FeedbackSender input to send latency: %llu samples, avg %llu us, max %llu us",
+				(unsigned long long)stats->count,
+				(unsigned long long)(stats->sum_us / stats->count),
+				(unsigned long long)stats->max_us);
+	}
+	if(feedback_sender->history_updates)
+	{
+		CHIAKI_LOGI(feedback_sender->log, "FeedbackSender sent %llu history packets for %llu button updates (%.2f per update)",
+				(unsigned long long)feedback_sender->history_packets,
+				(unsigned long long)feedback_sender->history_updates,
+				(double)feedback_sender->history_packets / (double)feedback_sender->history_updates);
+	}
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state, uint64_t input_time_us)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+	if(!slot_write(feedback_sender->slot, state, input_time_us))
+		return CHIAKI_ERR_SUCCESS;
 
-	if(chiaki_controller_state_equals(&feedback_sender->controller_state, state))
+	// Only wake the sender thread through the cond if it is actually waiting.
+	// Together with the seq_cst accesses in slot_write() and state_cond_check(), this can not miss a wakeup.
+	if(atomic_load_explicit(&feedback_sender->slot->sender_waiting, memory_order_seq_cst))
 	{
+		ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 		chiaki_mutex_unlock(&feedback_sender->state_mutex);
-		return CHIAKI_ERR_SUCCESS;
+		chiaki_cond_signal(&feedback_sender->state_cond);
 	}
 
-	feedback_sender->controller_state = *state;
-	feedback_sender->controller_state_changed = true;
+	return CHIAKI_ERR_SUCCESS;
+}
 
+CHIAKI_EXPORT void chiaki_feedback_sender_get_latency_stats(ChiakiFeedbackSender *feedback_sender, ChiakiFeedbackLatencyStats *stats)
+{
+	chiaki_mutex_lock(&feedback_sender->state_mutex);
+	*stats = feedback_sender->latency_stats;
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
-
-	return CHIAKI_ERR_SUCCESS;
 }
 
 static bool controller_state_equals_for_feedback_state(ChiakiControllerState *a, ChiakiControllerState *b)
@@ -125,9 +274,9 @@ static bool controller_state_equals_for_feedback_history(ChiakiControllerState *
 
 static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_sender)
 {
-	uint8_t buf[0x300];
-	size_t buf_size = sizeof(buf);
-	ChiakiErrorCode err = chiaki_feedback_history_buffer_format(&feedback_sender->history_buf, buf, &buf_size);
+	uint8_t buf[CHIAKI_TAKION_FEEDBACK_HEADER_SIZE + FEEDBACK_HISTORY_BUFFER_SIZE * CHIAKI_HISTORY_EVENT_SIZE_MAX];
+	size_t payload_size = sizeof(buf) - CHIAKI_TAKION_FEEDBACK_HEADER_SIZE;
+	ChiakiErrorCode err = chiaki_feedback_history_buffer_format(&feedback_sender->history_buf, buf + CHIAKI_TAKION_FEEDBACK_HEADER_SIZE, &payload_size);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format history buffer");
@@ -135,14 +284,32 @@ static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_s
 	}
 
 	//CHIAKI_LOGD(feedback_sender->log, "Feedback History:");
-	//chiaki_log_hexdump(feedback_sender->log, CHIAKI_LOG_DEBUG, buf, buf_size);
-	chiaki_takion_send_feedback_history(feedback_sender->takion, feedback_sender->history_seq_num++, buf, buf_size);
+	//chiaki_log_hexdump(feedback_sender->log, CHIAKI_LOG_DEBUG, buf + CHIAKI_TAKION_FEEDBACK_HEADER_SIZE, payload_size);
+	chiaki_takion_send_feedback_history_buf(feedback_sender->takion, feedback_sender->history_seq_num++, buf, CHIAKI_TAKION_FEEDBACK_HEADER_SIZE + payload_size);
+	feedback_sender->history_packets++;
 }
 
+static void feedback_sender_push_history_event(ChiakiFeedbackSender *feedback_sender, ChiakiFeedbackHistoryEvent *event, size_t *events_unsent)
+{
+	chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, event);
+	(*events_unsent)++;
+	// an event that drops out of the ring buffer before being sent would never reach the console
+	if(*events_unsent == FEEDBACK_HISTORY_BUFFER_SIZE)
+	{
+		feedback_sender_send_history_packet(feedback_sender);
+		*events_unsent = 0;
+	}
+}
+
+/**
+ * Push all button and trigger changes of the current update and send them together in a single packet.
+ * Each packet contains the whole history anyway, so separate packets per event would only be redundant.
+ */
 static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 {
 	ChiakiControllerState *state_prev = &feedback_sender->controller_state_prev;
 	ChiakiControllerState *state_now = &feedback_sender->controller_state;
+	size_t events_unsent = 0;
 	uint64_t buttons_prev = state_prev->buttons;
 	uint64_t buttons_now = state_now->buttons;
 	for(uint8_t i=0; i<CHIAKI_CONTROLLER_BUTTONS_COUNT; i++)
@@ -159,8 +326,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 				CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for button id %llu", (unsigned long long)button_id);
 				continue;
 			}
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			feedback_sender_push_history_event(feedback_sender, &event, &events_unsent);
 		}
 	}
 
@@ -169,10 +335,7 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 		ChiakiFeedbackHistoryEvent event;
 		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_L2, state_now->l2_state);
 		if(err == CHIAKI_ERR_SUCCESS)
-		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
-		}
+			feedback_sender_push_history_event(feedback_sender, &event, &events_unsent);
 		else
 			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for L2");
 	}
@@ -182,19 +345,21 @@ static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 		ChiakiFeedbackHistoryEvent event;
 		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_R2, state_now->r2_state);
 		if(err == CHIAKI_ERR_SUCCESS)
-		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
-		}
+			feedback_sender_push_history_event(feedback_sender, &event, &events_unsent);
 		else
 			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for R2");
 	}
+
+	if(events_unsent)
+		feedback_sender_send_history_packet(feedback_sender);
+	feedback_sender->history_updates++;
 }
 
 static bool state_cond_check(void *user)
 {
 	ChiakiFeedbackSender *feedback_sender = user;
-	return feedback_sender->should_stop || feedback_sender->controller_state_changed;
+	return feedback_sender->should_stop
+		|| atomic_load_explicit(&feedback_sender->slot->seq, memory_order_seq_cst) != feedback_sender->slot_seq_taken;
 }
 
 static void *feedback_sender_thread_func(void *user)
@@ -208,20 +373,26 @@ static void *feedback_sender_thread_func(void *user)
 	uint64_t next_timeout = FEEDBACK_STATE_TIMEOUT_MAX_MS;
 	while(true)
 	{
+		atomic_store_explicit(&feedback_sender->slot->sender_waiting, true, memory_order_seq_cst);
 		err = chiaki_cond_timedwait_pred(&feedback_sender->state_cond, &feedback_sender->state_mutex, next_timeout, state_cond_check, feedback_sender);
+		atomic_store_explicit(&feedback_sender->slot->sender_waiting, false, memory_order_relaxed);
 		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
 			break;
 
 		if(feedback_sender->should_stop)
 			break;
 
+		// sending must not hold the mutex, so state changes are published meanwhile
+		chiaki_mutex_unlock(&feedback_sender->state_mutex);
+
 		bool send_feedback_state = true;
 		bool send_feedback_history = false;
+		uint64_t input_time_us = 0;
 
-		if(feedback_sender->controller_state_changed)
+		if(atomic_load_explicit(&feedback_sender->slot->seq, memory_order_relaxed) != feedback_sender->slot_seq_taken)
 		{
 			// TODO: FEEDBACK_STATE_TIMEOUT_MIN_MS
-			feedback_sender->controller_state_changed = false;
+			feedback_sender->slot_seq_taken = slot_read(feedback_sender->slot, &feedback_sender->controller_state, &input_time_us);
 
 			// don't need to send feedback state if nothing relevant changed
 			if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
@@ -237,9 +408,16 @@ static void *feedback_sender_thread_func(void *user)
 			feedback_sender_send_history(feedback_sender);
 
 		feedback_sender->controller_state_prev = feedback_sender->controller_state;
+
+		uint64_t sent_time_us = input_time_us ? chiaki_time_now_monotonic_us() : 0;
+		err = chiaki_mutex_lock(&feedback_sender->state_mutex);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return NULL;
+		if(input_time_us && (send_feedback_state || send_feedback_history))
+			latency_stats_add(&feedback_sender->latency_stats, sent_time_us > input_time_us ? sent_time_us - input_time_us : 0);
 	}
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
 
 	return NULL;
-}
\ No newline at end of file
+}
@@ -46,12 +46,13 @@ CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_proce
 	frame_processor->units_fec_expected = 0;
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
+	frame_processor->flush_intact_size = 0;
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
-	free(frame_processor->frame_buf);
-	free(frame_processor->unit_slots);
+	chiaki_free(frame_processor->frame_buf);
+	chiaki_free(frame_processor->unit_slots);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
@@ -98,12 +99,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 		void *new_ptr = NULL;
 		if(frame_processor->unit_slots)
 		{
-			new_ptr = realloc(frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
+			new_ptr = chiaki_realloc(frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
 			if(!new_ptr)
-				free(frame_processor->unit_slots);
+				chiaki_free(frame_processor->unit_slots);
 		}
 		else
-			new_ptr = malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
+			new_ptr = chiaki_malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
 
 		frame_processor->unit_slots = new_ptr;
 		if(!new_ptr)
@@ -121,8 +122,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_size_per_unit;
 	if(frame_processor->frame_buf_size < frame_buf_size_required)
 	{
-		free(frame_processor->frame_buf);
-		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		chiaki_free(frame_processor->frame_buf);
+		frame_processor->frame_buf = chiaki_malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 		if(!frame_processor->frame_buf)
 		{
 			frame_processor->frame_buf_size = 0;
@@ -184,7 +185,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 
 	size_t erasures_count = (frame_processor->units_source_expected + frame_processor->units_fec_expected)
 			- (frame_processor->units_source_received + frame_processor->units_fec_received);
-	unsigned int *erasures = calloc(erasures_count, sizeof(unsigned int));
+	unsigned int *erasures = chiaki_calloc(erasures_count, sizeof(unsigned int));
 	if(!erasures)
 		return CHIAKI_ERR_MEMORY;
 
@@ -198,7 +199,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 			{
 				// should never happen by design, but too scary not to check
 				assert(false);
-				free(erasures);
+				chiaki_free(erasures);
 				return CHIAKI_ERR_UNKNOWN;
 			}
 			erasures[erasure_index++] = (unsigned int)i;
@@ -206,8 +207,9 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 	}
 	assert(erasure_index == erasures_count);
 
+	// the coding matrix depends on the number of fec units that have been sent, not received
 	ChiakiErrorCode err = chiaki_fec_decode(frame_processor->frame_buf, frame_processor->buf_size_per_unit,
-			frame_processor->units_source_expected, frame_processor->units_fec_received,
+			frame_processor->units_source_expected, frame_processor->units_fec_expected,
 			erasures, erasures_count);
 
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -237,7 +239,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 		}
 	}
 
-	free(erasures);
+	chiaki_free(erasures);
 	return err;
 }
 
@@ -257,18 +259,25 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 	}
 
 	size_t cur = 0;
+	bool intact = true;
 	for(size_t i=0; i<frame_processor->units_source_expected; i++)
 	{
 		ChiakiFrameUnit *unit = frame_processor->unit_slots + i;
 		if(!unit->data_size)
 		{
 			CHIAKI_LOGW(frame_processor->log, "Missing unit %#llx", (unsigned long long)i);
+			if(intact)
+				frame_processor->flush_intact_size = cur;
+			intact = false;
 			continue;
 		}
 		if(unit->data_size < 2)
 		{
 			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
 			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_size_per_unit, 0x50);
+			if(intact)
+				frame_processor->flush_intact_size = cur;
+			intact = false;
 			continue;
 		}
 		size_t part_size = unit->data_size - 2;
@@ -277,6 +286,9 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 		cur += part_size;
 	}
 
+	if(intact)
+		frame_processor->flush_intact_size = cur;
+
 	*frame = frame_processor->frame_buf;
 	*frame_size = cur;
 	return result;
@@ -35,7 +35,7 @@ static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index,
 
 static void *gkcrypt_thread_func(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, const ChiakiThreadAttr *key_buf_thread_attr, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	gkcrypt->log = log;
 	gkcrypt->index = index;
@@ -60,6 +60,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 		err = chiaki_mutex_init(&gkcrypt->key_buf_mutex, false);
 		if(err != CHIAKI_ERR_SUCCESS)
 			goto error_key_buf;
+		chiaki_mutex_set_name(&gkcrypt->key_buf_mutex, "gkcrypt_key_buf");
 
 		err = chiaki_cond_init(&gkcrypt->key_buf_cond);
 		if(err != CHIAKI_ERR_SUCCESS)
@@ -83,7 +84,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 
 	if(gkcrypt->key_buf)
 	{
-		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
+		err = chiaki_thread_create_attr(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt, key_buf_thread_attr, gkcrypt->log);
 		if(err != CHIAKI_ERR_SUCCESS)
 			goto error_key_buf_cond;
 
@@ -274,31 +275,28 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, siz
 	size_t padding_pre = key_pos % CHIAKI_GKCRYPT_BLOCK_SIZE;
 	size_t full_size = ((padding_pre + buf_size + CHIAKI_GKCRYPT_BLOCK_SIZE - 1) / CHIAKI_GKCRYPT_BLOCK_SIZE) * CHIAKI_GKCRYPT_BLOCK_SIZE;
 
-	uint8_t *key_stream = malloc(full_size);
+	uint8_t *key_stream = chiaki_malloc(full_size);
 	if(!key_stream)
 		return CHIAKI_ERR_MEMORY;
 
 	ChiakiErrorCode err = chiaki_gkcrypt_get_key_stream(gkcrypt, key_pos - padding_pre, key_stream, full_size);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(key_stream);
+		chiaki_free(key_stream);
 		return err;
 	}
 
 	xor_bytes(buf, key_stream + padding_pre, buf_size);
-	free(key_stream);
+	chiaki_free(key_stream);
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
 {
-	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
-
 	uint8_t *gmac_key = gkcrypt->key_gmac_current;
 	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+	uint64_t key_index = chiaki_gkcrypt_gmac_key_index(key_pos);
 
 	if(key_index > gkcrypt->key_gmac_index_current)
 	{
@@ -310,6 +308,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t
 		gmac_key = gmac_key_tmp;
 	}
 
+	return chiaki_gkcrypt_gmac_with_key(gkcrypt, gmac_key, key_pos, buf, buf_size, gmac_out);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_with_key(const ChiakiGKCrypt *gkcrypt, const uint8_t *gmac_key, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
+
 	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
 
 	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
@@ -0,0 +1,190 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/h264.h>
+
+#include <string.h>
+
+#define NAL_UNIT_TYPE_SLICE 1
+#define NAL_UNIT_TYPE_SLICE_IDR 5
+#define NAL_UNIT_TYPE_SPS 7
+#define NAL_UNIT_TYPE_PPS 8
+
+/**
+ * @return offset of the next 00 00 01 start code at or after offset, buf_size if none
+ */
+static size_t find_start_code(const uint8_t *buf, size_t buf_size, size_t offset)
+{
+	for(size_t i=offset; i+2<buf_size; i++)
+	{
+		if(buf[i+2] > 1)
+		{
+			i += 2;
+			continue;
+		}
+		if(buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 1)
+			return i;
+	}
+	return buf_size;
+}
+
+/**
+ * Reads the RBSP of a NAL unit bit by bit, skipping emulation prevention bytes
+ */
+typedef struct bit_reader_t
+{
+	const uint8_t *buf;
+	size_t size;
+	size_t byte;
+	unsigned int bit;
+	unsigned int zeros;
+} BitReader;
+
+static bool bit_reader_read(BitReader *reader, unsigned int *bit)
+{
+	if(reader->bit == 0)
+	{
+		if(reader->byte >= reader->size)
+			return false;
+		if(reader->zeros >= 2 && reader->buf[reader->byte] == 3)
+		{
+			reader->zeros = 0;
+			reader->byte++;
+			if(reader->byte >= reader->size)
+				return false;
+		}
+		reader->zeros = reader->buf[reader->byte] == 0 ? reader->zeros + 1 : 0;
+	}
+	*bit = (reader->buf[reader->byte] >> (7 - reader->bit)) & 1;
+	if(++reader->bit == 8)
+	{
+		reader->bit = 0;
+		reader->byte++;
+	}
+	return true;
+}
+
+static bool bit_reader_read_ue(BitReader *reader, uint32_t *value)
+{
+	unsigned int leading_zeros = 0;
+	unsigned int bit;
+	while(true)
+	{
+		if(!bit_reader_read(reader, &bit))
+			return false;
+		if(bit)
+			break;
+		if(++leading_zeros > 31)
+			return false;
+	}
+	uint32_t suffix = 0;
+	for(unsigned int i=0; i<leading_zeros; i++)
+	{
+		if(!bit_reader_read(reader, &bit))
+			return false;
+		suffix = (suffix << 1) | bit;
+	}
+	*value = (uint32_t)((1ull << leading_zeros) - 1 + suffix);
+	return true;
+}
+
+static ChiakiH264SliceType parse_slice_type(const uint8_t *rbsp, size_t size)
+{
+	BitReader reader = { rbsp, size, 0, 0, 0 };
+	uint32_t first_mb_in_slice, slice_type;
+	if(!bit_reader_read_ue(&reader, &first_mb_in_slice) || !bit_reader_read_ue(&reader, &slice_type))
+		return CHIAKI_H264_SLICE_TYPE_UNKNOWN;
+	if(slice_type > 9)
+		return CHIAKI_H264_SLICE_TYPE_UNKNOWN;
+	return (ChiakiH264SliceType)(slice_type % 5);
+}
+
+CHIAKI_EXPORT void chiaki_h264_frame_inspect(const uint8_t *buf, size_t buf_size, ChiakiH264FrameInfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->type = CHIAKI_H264_FRAME_TYPE_UNKNOWN;
+	info->slice_type = CHIAKI_H264_SLICE_TYPE_UNKNOWN;
+
+	bool idr = false;
+	bool ref = false;
+	size_t start = find_start_code(buf, buf_size, 0);
+	while(start < buf_size)
+	{
+		size_t nal = start + 3;
+		size_t next = find_start_code(buf, buf_size, nal);
+		if(nal >= next)
+		{
+			start = next;
+			continue;
+		}
+
+		uint8_t header = buf[nal];
+		unsigned int nal_ref_idc = (header >> 5) & 3;
+		switch(header & 0x1f)
+		{
+			case NAL_UNIT_TYPE_SLICE_IDR:
+				idr = true;
+				// fallthrough
+			case NAL_UNIT_TYPE_SLICE:
+				if(!info->slices)
+					info->slice_type = parse_slice_type(buf + nal + 1, next - nal - 1);
+				info->slices++;
+				if(nal_ref_idc)
+					ref = true;
+				break;
+			case NAL_UNIT_TYPE_SPS:
+				info->has_sps = true;
+				break;
+			case NAL_UNIT_TYPE_PPS:
+				info->has_pps = true;
+				break;
+			default:
+				break;
+		}
+		start = next;
+	}
+
+	if(!info->slices)
+		return;
+	if(idr)
+		info->type = CHIAKI_H264_FRAME_TYPE_IDR;
+	else if(ref)
+		info->type = CHIAKI_H264_FRAME_TYPE_REF;
+	else
+		info->type = CHIAKI_H264_FRAME_TYPE_NONREF;
+}
+
+CHIAKI_EXPORT size_t chiaki_h264_trim_incomplete(const uint8_t *buf, size_t buf_size, size_t intact_size)
+{
+	if(intact_size > buf_size)
+		intact_size = buf_size;
+
+	// the last start code that is completely intact begins the first incomplete NAL unit,
+	// a start code at intact_size can not be trusted because it follows the missing data
+	size_t trimmed = 0;
+	size_t start = find_start_code(buf, intact_size, 0);
+	while(start < intact_size)
+	{
+		trimmed = start;
+		start = find_start_code(buf, intact_size, start + 3);
+	}
+
+	// include the leading zero byte of a 4 byte start code in what is cut off
+	if(trimmed > 0 && buf[trimmed - 1] == 0)
+		trimmed--;
+	return trimmed;
+}
@@ -33,7 +33,7 @@ CHIAKI_EXPORT void chiaki_http_header_free(ChiakiHttpHeader *header)
 	{
 		ChiakiHttpHeader *cur = header;
 		header = header->next;
-		free(cur);
+		chiaki_free(cur);
 	}
 }
 
@@ -81,7 +81,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_http_header_parse(ChiakiHttpHeader **header
 					FAIL(CHIAKI_ERR_INVALID_DATA);
 
 				*buf = '\0';
-				ChiakiHttpHeader *entry = malloc(sizeof(ChiakiHttpHeader));
+				ChiakiHttpHeader *entry = chiaki_malloc(sizeof(ChiakiHttpHeader));
 				if(!entry)
 					FAIL(CHIAKI_ERR_MEMORY);
 				entry->key = key_ptr;
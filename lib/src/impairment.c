@@ -0,0 +1,393 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chiaki/impairment.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// Outgoing packets can only be flushed while waiting for incoming ones, so wake up regularly if they may be delayed.
+#define IMPAIRMENT_IO_TX_POLL_MS 1
+
+struct chiaki_impairment_packet_t
+{
+	ChiakiImpairmentPacket *next;
+	uint64_t due_us;
+	uint64_t jitter_us; // only for held packets
+	unsigned int hold_count; // only for held packets
+	uint64_t hold_until_us; // only for held packets
+	size_t size;
+	uint8_t buf[];
+};
+
+static uint64_t impairment_rand(ChiakiImpairment *impairment)
+{
+	// splitmix64
+	uint64_t z = (impairment->rng_state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * @return uniformly distributed in [0, 1)
+ */
+static double impairment_rand_unit(ChiakiImpairment *impairment)
+{
+	return (double)(impairment_rand(impairment) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void packet_list_free(ChiakiImpairmentPacket *packet)
+{
+	while(packet)
+	{
+		ChiakiImpairmentPacket *next = packet->next;
+		chiaki_free(packet);
+		packet = next;
+	}
+}
+
+CHIAKI_EXPORT void chiaki_impairment_init(ChiakiImpairment *impairment, const ChiakiImpairmentConfig *config)
+{
+	memset(impairment, 0, sizeof(*impairment));
+	if(config)
+		impairment->config = *config;
+	impairment->rng_state = impairment->config.seed;
+}
+
+CHIAKI_EXPORT void chiaki_impairment_fini(ChiakiImpairment *impairment)
+{
+	packet_list_free(impairment->queue);
+	packet_list_free(impairment->held);
+}
+
+CHIAKI_EXPORT bool chiaki_impairment_config_delays(const ChiakiImpairmentConfig *config)
+{
+	return config->delay_ms || config->jitter_ms || config->bandwidth_kbps || (config->reorder > 0.0 && config->reorder_depth);
+}
+
+static ChiakiImpairmentPacket *packet_new(const uint8_t *buf, size_t buf_size)
+{
+	ChiakiImpairmentPacket *packet = chiaki_malloc(sizeof(ChiakiImpairmentPacket) + buf_size);
+	if(!packet)
+		return NULL;
+	packet->next = NULL;
+	packet->due_us = 0;
+	packet->jitter_us = 0;
+	packet->hold_count = 0;
+	packet->hold_until_us = 0;
+	packet->size = buf_size;
+	memcpy(packet->buf, buf, buf_size);
+	return packet;
+}
+
+/**
+ * Pass packet over the link and insert it into the queue. Takes ownership of packet.
+ */
+static void impairment_enqueue(ChiakiImpairment *impairment, ChiakiImpairmentPacket *packet, uint64_t now_us, uint64_t jitter_us)
+{
+	uint64_t due_us = now_us;
+	if(impairment->config.bandwidth_kbps)
+	{
+		uint64_t start_us = impairment->link_free_us > now_us ? impairment->link_free_us : now_us;
+		if(impairment->config.queue_ms && start_us - now_us > (uint64_t)impairment->config.queue_ms * 1000)
+		{
+			impairment->stats.lost_queue++;
+			chiaki_free(packet);
+			return;
+		}
+		impairment->link_free_us = start_us + (uint64_t)packet->size * 8000 / impairment->config.bandwidth_kbps;
+		due_us = impairment->link_free_us;
+	}
+	due_us += (uint64_t)impairment->config.delay_ms * 1000 + jitter_us;
+	packet->due_us = due_us;
+
+	// keep packets with equal due time in order
+	ChiakiImpairmentPacket **cur = &impairment->queue;
+	while(*cur && (*cur)->due_us <= due_us)
+		cur = &(*cur)->next;
+	packet->next = *cur;
+	*cur = packet;
+}
+
+/**
+ * Release held packets that have not been overtaken by enough packets until their hold time expired,
+ * as if they arrived at that time.
+ */
+static void impairment_release_held_expired(ChiakiImpairment *impairment, uint64_t now_us)
+{
+	ChiakiImpairmentPacket **held = &impairment->held;
+	while(*held)
+	{
+		ChiakiImpairmentPacket *h = *held;
+		if(h->hold_until_us <= now_us)
+		{
+			*held = h->next;
+			impairment_enqueue(impairment, h, h->hold_until_us, h->jitter_us);
+		}
+		else
+			held = &h->next;
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impairment_push(ChiakiImpairment *impairment, const uint8_t *buf, size_t buf_size, uint64_t now_us)
+{
+	ChiakiImpairmentConfig *config = &impairment->config;
+	impairment->stats.packets++;
+	impairment_release_held_expired(impairment, now_us);
+
+	// always draw the same amount of numbers so decisions for later packets don't depend on earlier ones
+	double loss_rand = impairment_rand_unit(impairment);
+	double burst_rand = impairment_rand_unit(impairment);
+	double duplicate_rand = impairment_rand_unit(impairment);
+	double reorder_rand = impairment_rand_unit(impairment);
+	double jitter_rand = impairment_rand_unit(impairment);
+	uint64_t jitter_us = (uint64_t)(jitter_rand * config->jitter_ms * 1000.0);
+
+	if(impairment->stats.packets <= config->loss_first)
+	{
+		impairment->stats.lost_first++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	if(impairment->burst)
+	{
+		if(burst_rand < config->burst_loss_end)
+			impairment->burst = false;
+	}
+	else if(burst_rand < config->burst_loss_start)
+		impairment->burst = true;
+
+	if(impairment->burst)
+	{
+		impairment->stats.lost_burst++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+	if(loss_rand < config->loss)
+	{
+		impairment->stats.lost_random++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	ChiakiImpairmentPacket *packet = packet_new(buf, buf_size);
+	if(!packet)
+		return CHIAKI_ERR_MEMORY;
+
+	ChiakiImpairmentPacket *duplicate = NULL;
+	if(duplicate_rand < config->duplicate)
+	{
+		duplicate = packet_new(buf, buf_size);
+		if(!duplicate)
+		{
+			chiaki_free(packet);
+			return CHIAKI_ERR_MEMORY;
+		}
+		impairment->stats.duplicated++;
+	}
+
+	// packets held back before this one are overtaken by it
+	ChiakiImpairmentPacket *released = NULL;
+	ChiakiImpairmentPacket **held = &impairment->held;
+	while(*held)
+	{
+		ChiakiImpairmentPacket *h = *held;
+		if(--h->hold_count == 0)
+		{
+			*held = h->next;
+			h->next = released;
+			released = h;
+		}
+		else
+			held = &h->next;
+	}
+
+	if(config->reorder_depth && reorder_rand < config->reorder)
+	{
+		impairment->stats.reordered++;
+		packet->hold_count = config->reorder_depth;
+		packet->hold_until_us = now_us + (uint64_t)(config->reorder_hold_ms ? config->reorder_hold_ms : CHIAKI_IMPAIRMENT_REORDER_HOLD_MS_DEFAULT) * 1000;
+		packet->jitter_us = jitter_us;
+		packet->next = NULL;
+		*held = packet;
+	}
+	else
+		impairment_enqueue(impairment, packet, now_us, jitter_us);
+
+	if(duplicate)
+		impairment_enqueue(impairment, duplicate, now_us, jitter_us);
+
+	// released is in reverse order
+	ChiakiImpairmentPacket *ordered = NULL;
+	while(released)
+	{
+		ChiakiImpairmentPacket *next = released->next;
+		released->next = ordered;
+		ordered = released;
+		released = next;
+	}
+	while(ordered)
+	{
+		ChiakiImpairmentPacket *next = ordered->next;
+		impairment_enqueue(impairment, ordered, now_us, ordered->jitter_us);
+		ordered = next;
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT bool chiaki_impairment_pop(ChiakiImpairment *impairment, uint64_t now_us, uint8_t *buf, size_t *buf_size)
+{
+	impairment_release_held_expired(impairment, now_us);
+	ChiakiImpairmentPacket *packet = impairment->queue;
+	if(!packet || packet->due_us > now_us)
+		return false;
+	impairment->queue = packet->next;
+
+	size_t size = packet->size < *buf_size ? packet->size : *buf_size;
+	memcpy(buf, packet->buf, size);
+	*buf_size = size;
+	chiaki_free(packet);
+	impairment->stats.delivered++;
+	return true;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_impairment_next_due_us(ChiakiImpairment *impairment)
+{
+	uint64_t due_us = impairment->queue ? impairment->queue->due_us : UINT64_MAX;
+	// a held packet is due no earlier than when it is released
+	for(ChiakiImpairmentPacket *h = impairment->held; h; h = h->next)
+	{
+		if(h->hold_until_us < due_us)
+			due_us = h->hold_until_us;
+	}
+	return due_us;
+}
+
+static ChiakiErrorCode impairment_io_flush_tx(ChiakiImpairmentIO *io, chiaki_socket_t sock, uint64_t now_us)
+{
+	uint8_t buf[1500];
+	size_t buf_size = sizeof(buf);
+	while(chiaki_impairment_pop(&io->tx, now_us, buf, &buf_size))
+	{
+		ChiakiErrorCode err = io->next.send_cb(io->next.user, sock, buf, buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		buf_size = sizeof(buf);
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode impairment_io_send(void *user, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	ChiakiImpairmentIO *io = user;
+	chiaki_mutex_lock(&io->mutex);
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	ChiakiErrorCode err = chiaki_impairment_push(&io->tx, buf, buf_size, now_us);
+	if(err == CHIAKI_ERR_SUCCESS)
+		err = impairment_io_flush_tx(io, sock, now_us);
+	chiaki_mutex_unlock(&io->mutex);
+	return err;
+}
+
+static ChiakiErrorCode impairment_io_recv(void *user, chiaki_socket_t sock, ChiakiStopPipe *stop_pipe, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+{
+	ChiakiImpairmentIO *io = user;
+	size_t buf_size_max = *buf_size;
+	uint64_t deadline_ms = timeout_ms == UINT64_MAX ? UINT64_MAX : chiaki_time_now_monotonic_ms() + timeout_ms;
+
+	while(true)
+	{
+		chiaki_mutex_lock(&io->mutex);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		ChiakiErrorCode err = impairment_io_flush_tx(io, sock, now_us);
+		*buf_size = buf_size_max;
+		bool popped = chiaki_impairment_pop(&io->rx, now_us, buf, buf_size);
+		uint64_t next_due_us = chiaki_impairment_next_due_us(&io->rx);
+		uint64_t tx_next_due_us = chiaki_impairment_next_due_us(&io->tx);
+		if(tx_next_due_us < next_due_us)
+			next_due_us = tx_next_due_us;
+		chiaki_mutex_unlock(&io->mutex);
+
+		if(popped)
+			return CHIAKI_ERR_SUCCESS;
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+
+		uint64_t now_ms = now_us / 1000;
+		if(now_ms >= deadline_ms)
+			return CHIAKI_ERR_TIMEOUT;
+		uint64_t wait_ms = deadline_ms == UINT64_MAX ? UINT64_MAX : deadline_ms - now_ms;
+		if(next_due_us != UINT64_MAX)
+		{
+			uint64_t due_wait_ms = next_due_us > now_us ? (next_due_us - now_us + 999) / 1000 : 0;
+			if(due_wait_ms < wait_ms)
+				wait_ms = due_wait_ms;
+		}
+		if(io->tx_delays && wait_ms > IMPAIRMENT_IO_TX_POLL_MS)
+			wait_ms = IMPAIRMENT_IO_TX_POLL_MS;
+
+		*buf_size = buf_size_max;
+		err = io->next.recv_cb(io->next.user, sock, stop_pipe, buf, buf_size, wait_ms);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			continue;
+		// let the caller handle an empty datagram immediately, like without impairment
+		if(err != CHIAKI_ERR_SUCCESS || !*buf_size)
+			return err;
+
+		chiaki_mutex_lock(&io->mutex);
+		err = chiaki_impairment_push(&io->rx, buf, *buf_size, chiaki_time_now_monotonic_us());
+		chiaki_mutex_unlock(&io->mutex);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_impairment_io_init(ChiakiImpairmentIO *io, const ChiakiImpairmentConfig *rx_config, const ChiakiImpairmentConfig *tx_config)
+{
+	ChiakiErrorCode err = chiaki_mutex_init(&io->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_mutex_set_name(&io->mutex, "impairment");
+	chiaki_impairment_init(&io->rx, rx_config);
+	chiaki_impairment_init(&io->tx, tx_config);
+	io->tx_delays = chiaki_impairment_config_delays(&io->tx.config);
+	chiaki_datagram_io_init_socket(&io->next);
+	io->io.user = io;
+	io->io.send_cb = impairment_io_send;
+	io->io.send_batch_cb = NULL;
+	io->io.recv_cb = impairment_io_recv;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_impairment_io_fini(ChiakiImpairmentIO *io)
+{
+	chiaki_impairment_fini(&io->tx);
+	chiaki_impairment_fini(&io->rx);
+	chiaki_mutex_fini(&io->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_impairment_io_get_stats(ChiakiImpairmentIO *io, ChiakiImpairmentStats *rx_stats, ChiakiImpairmentStats *tx_stats)
+{
+	chiaki_mutex_lock(&io->mutex);
+	if(rx_stats)
+		*rx_stats = io->rx.stats;
+	if(tx_stats)
+		*tx_stats = io->tx.stats;
+	chiaki_mutex_unlock(&io->mutex);
+}
@@ -16,6 +16,7 @@
  */
 
 #include <chiaki/log.h>
+#include <chiaki/asynclog.h>
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -44,6 +45,7 @@ CHIAKI_EXPORT void chiaki_log_init(ChiakiLog *log, uint32_t level_mask, ChiakiLo
 	log->level_mask = level_mask;
 	log->cb = cb;
 	log->user = user;
+	log->async = NULL;
 }
 
 CHIAKI_EXPORT void chiaki_log_cb_print(ChiakiLogLevel level, const char *msg, void *user)
@@ -81,6 +83,15 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 		return;
 
 	va_list args;
+
+	if(log && log->async)
+	{
+		va_start(args, fmt);
+		chiaki_async_log_push(log->async, level, fmt, args);
+		va_end(args);
+		return;
+	}
+
 	char buf[0x100];
 	char *msg = buf;
 
@@ -93,7 +104,7 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 
 	if(written >= sizeof(buf))
 	{
-		msg = malloc(written + 1);
+		msg = chiaki_malloc(written + 1);
 		if(!msg)
 			return;
 
@@ -103,7 +114,7 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 
 		if(written < 0)
 		{
-			free(msg);
+			chiaki_free(msg);
 			return;
 		}
 	}
@@ -113,7 +124,7 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 	cb(level, msg, user);
 
 	if(msg != buf)
-		free(msg);
+		chiaki_free(msg);
 }
 
 #define HEXDUMP_WIDTH 0x10
@@ -179,7 +190,7 @@ CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level,
 	if(log && !(log->level_mask & level))
 		return;
 
-	char *str = malloc(buf_size * 2 + 1);
+	char *str = chiaki_malloc(buf_size * 2 + 1);
 	if(!str)
 		return;
 	for(size_t i=0; i<buf_size; i++)
@@ -190,5 +201,5 @@ CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level,
 	}
 	str[buf_size*2] = 0;
 	chiaki_log(log, level, "%s", str);
-	free(str);
+	chiaki_free(str);
 }
\ No newline at end of file
@@ -43,7 +43,7 @@ CHIAKI_EXPORT void chiaki_opus_decoder_init(ChiakiOpusDecoder *decoder, ChiakiLo
 
 CHIAKI_EXPORT void chiaki_opus_decoder_fini(ChiakiOpusDecoder *decoder)
 {
-	free(decoder->pcm_buf);
+	chiaki_free(decoder->pcm_buf);
 }
 
 CHIAKI_EXPORT void chiaki_opus_decoder_get_sink(ChiakiOpusDecoder *decoder, ChiakiAudioSink *sink)
@@ -75,11 +75,11 @@ static void chiaki_opus_decoder_header(ChiakiAudioHeader *header, void *user)
 	size_t pcm_buf_size_required = chiaki_audio_header_frame_buf_size(header);
 	int16_t *pcm_buf_old = decoder->pcm_buf;
 	if(!decoder->pcm_buf || decoder->pcm_buf_size != pcm_buf_size_required)
-		decoder->pcm_buf = realloc(decoder->pcm_buf, pcm_buf_size_required);
+		decoder->pcm_buf = chiaki_realloc(decoder->pcm_buf, pcm_buf_size_required);
 
 	if(!decoder->pcm_buf)
 	{
-		free(pcm_buf_old);
+		chiaki_free(pcm_buf_old);
 		CHIAKI_LOGE(decoder->log, "ChiakiOpusDecoder failed to alloc pcm buffer");
 		opus_decoder_destroy(decoder->opus_decoder);
 		decoder->opus_decoder = NULL;
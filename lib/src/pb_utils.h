@@ -82,7 +82,7 @@ static bool chiaki_pb_decode_buf_alloc(pb_istream_t *stream, const pb_field_t *f
 {
 	ChiakiPBDecodeBufAlloc *buf = *arg;
 	buf->size = stream->bytes_left;
-	buf->buf = malloc(buf->size);
+	buf->buf = chiaki_malloc(buf->size);
 	if(!buf->buf)
 		return false;
 	bool r = pb_read(stream, buf->buf, buf->size);
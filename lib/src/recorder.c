@@ -0,0 +1,684 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/recorder.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+// the writer thread wakes up once this much is buffered
+#define RECORDER_WRITE_SIZE (1024 * 1024)
+#define RECORDER_WRITE_INTERVAL_MS 1000
+
+// buf and write_buf are swapped, so each gets half of the backlog
+#define RECORDER_BUF_SIZE (CHIAKI_RECORDER_BACKLOG_MAX / 2)
+
+// start a new cluster at the first keyframe after this time
+#define RECORDER_CLUSTER_MIN_MS 1000
+// block timestamps are relative to the cluster as int16
+#define RECORDER_CLUSTER_MAX_MS 30000
+
+#define RECORDER_TRACK_VIDEO 1
+#define RECORDER_TRACK_AUDIO 2
+
+#define H264_NAL_TYPE_SLICE_IDR 5
+#define H264_NAL_TYPE_SPS 7
+#define H264_NAL_TYPE_PPS 8
+
+#define MKV_ID_EBML 0x1a45dfa3
+#define MKV_ID_EBML_VERSION 0x4286
+#define MKV_ID_EBML_READ_VERSION 0x42f7
+#define MKV_ID_EBML_MAX_ID_LENGTH 0x42f2
+#define MKV_ID_EBML_MAX_SIZE_LENGTH 0x42f3
+#define MKV_ID_DOC_TYPE 0x4282
+#define MKV_ID_DOC_TYPE_VERSION 0x4287
+#define MKV_ID_DOC_TYPE_READ_VERSION 0x4285
+#define MKV_ID_SEGMENT 0x18538067
+#define MKV_ID_INFO 0x1549a966
+#define MKV_ID_TIMESTAMP_SCALE 0x2ad7b1
+#define MKV_ID_MUXING_APP 0x4d80
+#define MKV_ID_WRITING_APP 0x5741
+#define MKV_ID_TRACKS 0x1654ae6b
+#define MKV_ID_TRACK_ENTRY 0xae
+#define MKV_ID_TRACK_NUMBER 0xd7
+#define MKV_ID_TRACK_UID 0x73c5
+#define MKV_ID_TRACK_TYPE 0x83
+#define MKV_ID_CODEC_ID 0x86
+#define MKV_ID_CODEC_PRIVATE 0x63a2
+#define MKV_ID_CODEC_DELAY 0x56aa
+#define MKV_ID_SEEK_PRE_ROLL 0x56bb
+#define MKV_ID_VIDEO 0xe0
+#define MKV_ID_PIXEL_WIDTH 0xb0
+#define MKV_ID_PIXEL_HEIGHT 0xba
+#define MKV_ID_AUDIO 0xe1
+#define MKV_ID_SAMPLING_FREQUENCY 0xb5
+#define MKV_ID_CHANNELS 0x9f
+#define MKV_ID_CLUSTER 0x1f43b675
+#define MKV_ID_CLUSTER_TIMESTAMP 0xe7
+#define MKV_ID_SIMPLE_BLOCK 0xa3
+
+#define MKV_TRACK_TYPE_VIDEO 1
+#define MKV_TRACK_TYPE_AUDIO 2
+
+// reserved size that is patched once the content is known
+#define MKV_SIZE_PLACEHOLDER_LEN 8
+
+static const uint8_t mkv_size_unknown[] = { 0x01, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+static bool buf_alloc(ChiakiRecorderBuf *buf, size_t size)
+{
+	buf->data = chiaki_malloc(size);
+	if(!buf->data)
+		return false;
+	buf->size = 0;
+	buf->alloc = size;
+	return true;
+}
+
+static bool buf_reserve(ChiakiRecorderBuf *buf, size_t size)
+{
+	if(buf->size + size <= buf->alloc)
+		return true;
+	size_t alloc_new = buf->alloc ? buf->alloc : RECORDER_WRITE_SIZE;
+	while(alloc_new < buf->size + size)
+		alloc_new *= 2;
+	uint8_t *data_new = chiaki_realloc(buf->data, alloc_new);
+	if(!data_new)
+		return false;
+	buf->data = data_new;
+	buf->alloc = alloc_new;
+	return true;
+}
+
+/**
+ * Only call after buf_reserve() or recorder_reserve() succeeded for the total size of the element.
+ */
+static void buf_put(ChiakiRecorderBuf *buf, const void *data, size_t size)
+{
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+static void buf_put_be(ChiakiRecorderBuf *buf, uint64_t v, size_t len)
+{
+	for(size_t i=0; i<len; i++)
+		buf->data[buf->size++] = (uint8_t)(v >> ((len - 1 - i) * 8));
+}
+
+static void mkv_put_id(ChiakiRecorderBuf *buf, uint32_t id)
+{
+	// ids already contain their length marker
+	size_t len = id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1;
+	buf_put_be(buf, id, len);
+}
+
+static void mkv_put_size(ChiakiRecorderBuf *buf, uint64_t size)
+{
+	size_t len = 1;
+	// all ones is reserved for unknown sizes
+	while(len < 8 && size >= (1ull << (7 * len)) - 1)
+		len++;
+	buf_put_be(buf, size | (1ull << (7 * len)), len);
+}
+
+static void mkv_put_uint(ChiakiRecorderBuf *buf, uint32_t id, uint64_t v)
+{
+	size_t len = 1;
+	while(len < 8 && (v >> (8 * len)))
+		len++;
+	mkv_put_id(buf, id);
+	mkv_put_size(buf, len);
+	buf_put_be(buf, v, len);
+}
+
+static void mkv_put_float(ChiakiRecorderBuf *buf, uint32_t id, double v)
+{
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	mkv_put_id(buf, id);
+	mkv_put_size(buf, sizeof(bits));
+	buf_put_be(buf, bits, sizeof(bits));
+}
+
+static void mkv_put_binary(ChiakiRecorderBuf *buf, uint32_t id, const void *data, size_t size)
+{
+	mkv_put_id(buf, id);
+	mkv_put_size(buf, size);
+	buf_put(buf, data, size);
+}
+
+static void mkv_put_string(ChiakiRecorderBuf *buf, uint32_t id, const char *str)
+{
+	mkv_put_binary(buf, id, str, strlen(str));
+}
+
+/**
+ * @return offset to pass to mkv_master_end()
+ */
+static size_t mkv_master_start(ChiakiRecorderBuf *buf, uint32_t id)
+{
+	mkv_put_id(buf, id);
+	size_t offset = buf->size;
+	buf->size += MKV_SIZE_PLACEHOLDER_LEN;
+	return offset;
+}
+
+static void mkv_master_end(ChiakiRecorderBuf *buf, size_t offset)
+{
+	uint64_t size = buf->size - offset - MKV_SIZE_PLACEHOLDER_LEN;
+	size_t end = buf->size;
+	buf->size = offset;
+	buf_put_be(buf, size | (1ull << (7 * MKV_SIZE_PLACEHOLDER_LEN)), MKV_SIZE_PLACEHOLDER_LEN);
+	buf->size = end;
+}
+
+// generous upper bound of the elements written around a block or in the headers
+#define MKV_OVERHEAD_MAX 0x100
+
+/**
+ * Iterate the NAL units of an Annex B stream.
+ *
+ * @param pos in: offset to start searching at, out: offset after the returned NAL unit
+ * @return false if there are no more NAL units
+ */
+static bool annexb_next_nal(const uint8_t *buf, size_t buf_size, size_t *pos, const uint8_t **nal, size_t *nal_size)
+{
+	size_t i = *pos;
+	for(; i + 3 <= buf_size; i++)
+	{
+		if(buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1)
+			break;
+	}
+	if(i + 3 > buf_size)
+		return false;
+	size_t start = i + 3;
+	size_t end = start;
+	for(; end + 3 <= buf_size; end++)
+	{
+		if(buf[end] == 0 && buf[end + 1] == 0 && buf[end + 2] == 1)
+			break;
+	}
+	if(end + 3 > buf_size)
+		end = buf_size;
+	*pos = end;
+	// trailing zeros belong to the next start code
+	while(end > start && buf[end - 1] == 0)
+		end--;
+	if(end == start)
+		return annexb_next_nal(buf, buf_size, pos, nal, nal_size);
+	*nal = buf + start;
+	*nal_size = end - start;
+	return true;
+}
+
+/**
+ * @return size of the Annex B stream converted to 4 byte length prefixes
+ */
+static size_t annexb_length_prefixed_size(const uint8_t *buf, size_t buf_size, bool *keyframe)
+{
+	size_t size = 0;
+	size_t pos = 0;
+	const uint8_t *nal;
+	size_t nal_size;
+	while(annexb_next_nal(buf, buf_size, &pos, &nal, &nal_size))
+	{
+		if(keyframe && (nal[0] & 0x1f) == H264_NAL_TYPE_SLICE_IDR)
+			*keyframe = true;
+		size += 4 + nal_size;
+	}
+	return size;
+}
+
+static void annexb_put_length_prefixed(ChiakiRecorderBuf *out, const uint8_t *buf, size_t buf_size)
+{
+	size_t pos = 0;
+	const uint8_t *nal;
+	size_t nal_size;
+	while(annexb_next_nal(buf, buf_size, &pos, &nal, &nal_size))
+	{
+		buf_put_be(out, nal_size, 4);
+		buf_put(out, nal, nal_size);
+	}
+}
+
+/**
+ * Build an AVCDecoderConfigurationRecord (avcC) from the SPS and PPS in header
+ */
+static bool avcc_build(ChiakiRecorderBuf *out, const uint8_t *header, size_t header_size)
+{
+	const uint8_t *sps[0x20], *pps[0x20];
+	size_t sps_size[0x20], pps_size[0x20];
+	size_t sps_count = 0, pps_count = 0;
+	size_t total = 7;
+
+	size_t pos = 0;
+	const uint8_t *nal;
+	size_t nal_size;
+	while(annexb_next_nal(header, header_size, &pos, &nal, &nal_size))
+	{
+		if(nal_size > UINT16_MAX)
+			continue;
+		uint8_t type = nal[0] & 0x1f;
+		if(type == H264_NAL_TYPE_SPS && nal_size >= 4 && sps_count < 0x1f)
+		{
+			sps[sps_count] = nal;
+			sps_size[sps_count++] = nal_size;
+			total += 2 + nal_size;
+		}
+		else if(type == H264_NAL_TYPE_PPS && pps_count < 0x1f)
+		{
+			pps[pps_count] = nal;
+			pps_size[pps_count++] = nal_size;
+			total += 2 + nal_size;
+		}
+	}
+	if(!sps_count || !pps_count || !buf_reserve(out, total))
+		return false;
+
+	out->data[out->size++] = 1; // configurationVersion
+	out->data[out->size++] = sps[0][1]; // AVCProfileIndication
+	out->data[out->size++] = sps[0][2]; // profile_compatibility
+	out->data[out->size++] = sps[0][3]; // AVCLevelIndication
+	out->data[out->size++] = 0xfc | 3; // lengthSizeMinusOne
+	out->data[out->size++] = 0xe0 | (uint8_t)sps_count;
+	for(size_t i=0; i<sps_count; i++)
+	{
+		buf_put_be(out, sps_size[i], 2);
+		buf_put(out, sps[i], sps_size[i]);
+	}
+	out->data[out->size++] = (uint8_t)pps_count;
+	for(size_t i=0; i<pps_count; i++)
+	{
+		buf_put_be(out, pps_size[i], 2);
+		buf_put(out, pps[i], pps_size[i]);
+	}
+	return true;
+}
+
+static void opus_head_build(uint8_t *out, ChiakiAudioHeader *header)
+{
+	memcpy(out, "OpusHead", 8);
+	out[8] = 1; // version
+	out[9] = header->channels;
+	out[10] = 0; out[11] = 0; // pre-skip
+	out[12] = (uint8_t)header->rate;
+	out[13] = (uint8_t)(header->rate >> 8);
+	out[14] = (uint8_t)(header->rate >> 16);
+	out[15] = (uint8_t)(header->rate >> 24);
+	out[16] = 0; out[17] = 0; // output gain
+	out[18] = 0; // channel mapping family
+}
+
+#define OPUS_HEAD_SIZE 19
+
+static bool recorder_check_stop(void *user)
+{
+	ChiakiRecorder *recorder = user;
+	return recorder->should_stop || recorder->buf.size >= RECORDER_WRITE_SIZE;
+}
+
+static void *recorder_writer_thread_func(void *user)
+{
+	ChiakiRecorder *recorder = user;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&recorder->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(true)
+	{
+		if(!recorder_check_stop(recorder))
+			chiaki_cond_timedwait_pred(&recorder->cond, &recorder->mutex, RECORDER_WRITE_INTERVAL_MS, recorder_check_stop, recorder);
+		bool stop = recorder->should_stop;
+
+		if(recorder->buf.size)
+		{
+			ChiakiRecorderBuf tmp = recorder->write_buf;
+			recorder->write_buf = recorder->buf;
+			recorder->buf = tmp;
+			recorder->buf.size = 0;
+
+			// the receiving threads can continue to fill buf in the meantime
+			chiaki_mutex_unlock(&recorder->mutex);
+			bool succ = fwrite(recorder->write_buf.data, 1, recorder->write_buf.size, recorder->file) == recorder->write_buf.size;
+			chiaki_mutex_lock(&recorder->mutex);
+
+			if(succ)
+				recorder->stats.bytes_written += recorder->write_buf.size;
+			else if(!recorder->failed)
+			{
+				CHIAKI_LOGE(recorder->log, "Recorder failed to write to file, stopping recording");
+				recorder->failed = true;
+			}
+			recorder->write_buf.size = 0;
+		}
+
+		if(stop)
+			break;
+	}
+
+	chiaki_mutex_unlock(&recorder->mutex);
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_recorder_init(ChiakiRecorder *recorder, ChiakiLog *log, const char *filename)
+{
+	memset(recorder, 0, sizeof(*recorder));
+	recorder->log = log;
+
+	recorder->file = fopen(filename, "wb");
+	if(!recorder->file)
+	{
+		CHIAKI_LOGE(log, "Recorder failed to open %s for writing", filename);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	// writes are already large
+	setvbuf(recorder->file, NULL, _IONBF, 0);
+
+	// allocated completely here, so the receiving threads never have to grow them
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
+	ChiakiRecorderBuf *buf = &recorder->buf;
+	if(!buf_alloc(buf, RECORDER_BUF_SIZE))
+		goto error_file;
+	if(!buf_alloc(&recorder->write_buf, RECORDER_BUF_SIZE))
+		goto error_buf;
+
+	size_t ebml = mkv_master_start(buf, MKV_ID_EBML);
+	mkv_put_uint(buf, MKV_ID_EBML_VERSION, 1);
+	mkv_put_uint(buf, MKV_ID_EBML_READ_VERSION, 1);
+	mkv_put_uint(buf, MKV_ID_EBML_MAX_ID_LENGTH, 4);
+	mkv_put_uint(buf, MKV_ID_EBML_MAX_SIZE_LENGTH, 8);
+	mkv_put_string(buf, MKV_ID_DOC_TYPE, "matroska");
+	mkv_put_uint(buf, MKV_ID_DOC_TYPE_VERSION, 4);
+	mkv_put_uint(buf, MKV_ID_DOC_TYPE_READ_VERSION, 2);
+	mkv_master_end(buf, ebml);
+
+	// sizes of the segment and clusters are left unknown, so the file stays readable when recording is interrupted
+	mkv_put_id(buf, MKV_ID_SEGMENT);
+	buf_put(buf, mkv_size_unknown, sizeof(mkv_size_unknown));
+
+	size_t info = mkv_master_start(buf, MKV_ID_INFO);
+	mkv_put_uint(buf, MKV_ID_TIMESTAMP_SCALE, 1000000); // ms
+	mkv_put_string(buf, MKV_ID_MUXING_APP, "Chiaki");
+	mkv_put_string(buf, MKV_ID_WRITING_APP, "Chiaki");
+	mkv_master_end(buf, info);
+
+	err = chiaki_mutex_init(&recorder->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_buf;
+	chiaki_mutex_set_name(&recorder->mutex, "recorder");
+
+	err = chiaki_cond_init(&recorder->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&recorder->writer_thread, recorder_writer_thread_func, recorder);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	chiaki_thread_set_name(&recorder->writer_thread, "Chiaki Recorder");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&recorder->cond);
+error_mutex:
+	chiaki_mutex_fini(&recorder->mutex);
+error_buf:
+	chiaki_free(recorder->buf.data);
+	chiaki_free(recorder->write_buf.data);
+error_file:
+	fclose(recorder->file);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_fini(ChiakiRecorder *recorder)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	recorder->should_stop = true;
+	chiaki_cond_signal(&recorder->cond);
+	chiaki_mutex_unlock(&recorder->mutex);
+
+	chiaki_thread_join(&recorder->writer_thread, NULL);
+	CHIAKI_LOGI(recorder->log, "Recorder finished with %llu video frames, %llu audio frames, %llu dropped, %llu bytes",
+			(unsigned long long)recorder->stats.video_frames,
+			(unsigned long long)recorder->stats.audio_frames,
+			(unsigned long long)recorder->stats.frames_dropped,
+			(unsigned long long)recorder->stats.bytes_written);
+
+	chiaki_cond_fini(&recorder->cond);
+	chiaki_mutex_fini(&recorder->mutex);
+	fclose(recorder->file);
+	chiaki_free(recorder->buf.data);
+	chiaki_free(recorder->write_buf.data);
+	chiaki_free(recorder->video_header);
+	chiaki_free(recorder->video_header_pending);
+}
+
+/**
+ * Check that an element of size fits into the preallocated recorder->buf.
+ * On failure, the frame is counted as dropped.
+ */
+static bool recorder_reserve(ChiakiRecorder *recorder, size_t size)
+{
+	if(recorder->buf.size + size <= recorder->buf.alloc)
+	{
+		if(recorder->dropping)
+		{
+			CHIAKI_LOGI(recorder->log, "Recorder caught up again");
+			recorder->dropping = false;
+		}
+		return true;
+	}
+	if(!recorder->dropping)
+	{
+		CHIAKI_LOGW(recorder->log, "Recorder can't keep up with writing, dropping frames");
+		recorder->dropping = true;
+	}
+	recorder->stats.frames_dropped++;
+	return false;
+}
+
+static bool recorder_write_tracks(ChiakiRecorder *recorder)
+{
+	ChiakiRecorderBuf avcc = { 0 };
+	if(!avcc_build(&avcc, recorder->video_header, recorder->video_header_size))
+	{
+		CHIAKI_LOGE(recorder->log, "Recorder failed to find SPS and PPS in the video header, not recording");
+		chiaki_free(avcc.data);
+		recorder->failed = true;
+		return false;
+	}
+
+	if(!recorder_reserve(recorder, MKV_OVERHEAD_MAX + avcc.size))
+	{
+		chiaki_free(avcc.data);
+		return false;
+	}
+
+	ChiakiRecorderBuf *buf = &recorder->buf;
+	size_t tracks = mkv_master_start(buf, MKV_ID_TRACKS);
+
+	size_t entry = mkv_master_start(buf, MKV_ID_TRACK_ENTRY);
+	mkv_put_uint(buf, MKV_ID_TRACK_NUMBER, RECORDER_TRACK_VIDEO);
+	mkv_put_uint(buf, MKV_ID_TRACK_UID, RECORDER_TRACK_VIDEO);
+	mkv_put_uint(buf, MKV_ID_TRACK_TYPE, MKV_TRACK_TYPE_VIDEO);
+	mkv_put_string(buf, MKV_ID_CODEC_ID, "V_MPEG4/ISO/AVC");
+	mkv_put_binary(buf, MKV_ID_CODEC_PRIVATE, avcc.data, avcc.size);
+	size_t video = mkv_master_start(buf, MKV_ID_VIDEO);
+	mkv_put_uint(buf, MKV_ID_PIXEL_WIDTH, recorder->width);
+	mkv_put_uint(buf, MKV_ID_PIXEL_HEIGHT, recorder->height);
+	mkv_master_end(buf, video);
+	mkv_master_end(buf, entry);
+	chiaki_free(avcc.data);
+
+	if(recorder->audio_header_set)
+	{
+		uint8_t opus_head[OPUS_HEAD_SIZE];
+		opus_head_build(opus_head, &recorder->audio_header);
+		entry = mkv_master_start(buf, MKV_ID_TRACK_ENTRY);
+		mkv_put_uint(buf, MKV_ID_TRACK_NUMBER, RECORDER_TRACK_AUDIO);
+		mkv_put_uint(buf, MKV_ID_TRACK_UID, RECORDER_TRACK_AUDIO);
+		mkv_put_uint(buf, MKV_ID_TRACK_TYPE, MKV_TRACK_TYPE_AUDIO);
+		mkv_put_string(buf, MKV_ID_CODEC_ID, "A_OPUS");
+		mkv_put_binary(buf, MKV_ID_CODEC_PRIVATE, opus_head, sizeof(opus_head));
+		mkv_put_uint(buf, MKV_ID_CODEC_DELAY, 0);
+		mkv_put_uint(buf, MKV_ID_SEEK_PRE_ROLL, 80000000); // ns, as recommended for Opus
+		size_t audio = mkv_master_start(buf, MKV_ID_AUDIO);
+		mkv_put_float(buf, MKV_ID_SAMPLING_FREQUENCY, (double)recorder->audio_header.rate);
+		mkv_put_uint(buf, MKV_ID_CHANNELS, recorder->audio_header.channels);
+		mkv_master_end(buf, audio);
+		mkv_master_end(buf, entry);
+	}
+
+	mkv_master_end(buf, tracks);
+	recorder->tracks_written = true;
+	recorder->start_ms = chiaki_time_now_monotonic_ms();
+	return true;
+}
+
+/**
+ * Reserve space and write the block header, opening a new cluster if necessary.
+ *
+ * @return false if the frame must be dropped
+ */
+static bool recorder_block_start(ChiakiRecorder *recorder, uint64_t track, bool keyframe, size_t payload_size)
+{
+	if(!recorder_reserve(recorder, MKV_OVERHEAD_MAX + payload_size))
+		return false;
+
+	uint64_t ts = chiaki_time_now_monotonic_ms() - recorder->start_ms;
+	ChiakiRecorderBuf *buf = &recorder->buf;
+	if(!recorder->cluster_open
+		|| ts - recorder->cluster_ms >= RECORDER_CLUSTER_MAX_MS
+		|| (keyframe && ts - recorder->cluster_ms >= RECORDER_CLUSTER_MIN_MS))
+	{
+		mkv_put_id(buf, MKV_ID_CLUSTER);
+		buf_put(buf, mkv_size_unknown, sizeof(mkv_size_unknown));
+		mkv_put_uint(buf, MKV_ID_CLUSTER_TIMESTAMP, ts);
+		recorder->cluster_open = true;
+		recorder->cluster_ms = ts;
+	}
+
+	mkv_put_id(buf, MKV_ID_SIMPLE_BLOCK);
+	mkv_put_size(buf, 4 + payload_size);
+	mkv_put_size(buf, track);
+	buf_put_be(buf, (uint16_t)(int16_t)(ts - recorder->cluster_ms), 2);
+	buf->data[buf->size++] = keyframe ? 0x80 : 0;
+	return true;
+}
+
+CHIAKI_EXPORT void chiaki_recorder_video_profile(ChiakiRecorder *recorder, ChiakiVideoProfile *profile)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	uint8_t **header = recorder->video_header ? &recorder->video_header_pending : &recorder->video_header;
+	size_t *header_size = recorder->video_header ? &recorder->video_header_pending_size : &recorder->video_header_size;
+	chiaki_free(*header);
+	*header = chiaki_malloc(profile->header_sz);
+	if(*header)
+	{
+		memcpy(*header, profile->header, profile->header_sz);
+		*header_size = profile->header_sz;
+	}
+	else
+		*header_size = 0;
+	if(header == &recorder->video_header)
+	{
+		recorder->width = profile->width;
+		recorder->height = profile->height;
+	}
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_video_frame(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	if(recorder->failed || !recorder->video_header)
+		goto beach;
+	if(!recorder->tracks_written && !recorder_write_tracks(recorder))
+		goto beach;
+
+	bool keyframe = false;
+	size_t payload_size = annexb_length_prefixed_size(buf, buf_size, &keyframe);
+	if(recorder->video_wait_keyframe && !keyframe)
+	{
+		recorder->stats.frames_dropped++;
+		goto beach;
+	}
+	size_t header_size = recorder->video_header_pending
+			? annexb_length_prefixed_size(recorder->video_header_pending, recorder->video_header_pending_size, NULL)
+			: 0;
+
+	if(!recorder_block_start(recorder, RECORDER_TRACK_VIDEO, keyframe, header_size + payload_size))
+	{
+		// the following frames would reference the dropped one
+		recorder->video_wait_keyframe = true;
+		goto beach;
+	}
+	recorder->video_wait_keyframe = false;
+	if(recorder->video_header_pending)
+	{
+		annexb_put_length_prefixed(&recorder->buf, recorder->video_header_pending, recorder->video_header_pending_size);
+		chiaki_free(recorder->video_header_pending);
+		recorder->video_header_pending = NULL;
+		recorder->video_header_pending_size = 0;
+	}
+	annexb_put_length_prefixed(&recorder->buf, buf, buf_size);
+	recorder->stats.video_frames++;
+	if(recorder->buf.size >= RECORDER_WRITE_SIZE)
+		chiaki_cond_signal(&recorder->cond);
+
+beach:
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_audio_header(ChiakiRecorder *recorder, ChiakiAudioHeader *header)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	if(recorder->tracks_written)
+		CHIAKI_LOGW(recorder->log, "Recorder got audio header after the tracks have been written, ignoring");
+	else
+	{
+		recorder->audio_header = *header;
+		recorder->audio_header_set = true;
+	}
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_audio_frame(ChiakiRecorder *recorder, const uint8_t *buf, size_t buf_size)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	// audio before the first video frame is not recorded, the tracks are only known then
+	if(recorder->failed || !recorder->tracks_written || !recorder->audio_header_set)
+		goto beach;
+	if(!recorder_block_start(recorder, RECORDER_TRACK_AUDIO, true, buf_size))
+		goto beach;
+	buf_put(&recorder->buf, buf, buf_size);
+	recorder->stats.audio_frames++;
+	if(recorder->buf.size >= RECORDER_WRITE_SIZE)
+		chiaki_cond_signal(&recorder->cond);
+
+beach:
+	chiaki_mutex_unlock(&recorder->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_recorder_get_stats(ChiakiRecorder *recorder, ChiakiRecorderStats *stats)
+{
+	chiaki_mutex_lock(&recorder->mutex);
+	*stats = recorder->stats;
+	chiaki_mutex_unlock(&recorder->mutex);
+}
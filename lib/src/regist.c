@@ -53,13 +53,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_regist_start(ChiakiRegist *regist, ChiakiLo
 {
 	regist->log = log;
 	regist->info = *info;
-	regist->info.host = strdup(regist->info.host);
+	regist->info.host = chiaki_strdup(regist->info.host);
 	if(!regist->info.host)
 		return CHIAKI_ERR_MEMORY;
 
 	if(regist->info.psn_online_id)
 	{
-		regist->info.psn_online_id = strdup(regist->info.psn_online_id);
+		regist->info.psn_online_id = chiaki_strdup(regist->info.psn_online_id);
 		if(!regist->info.psn_online_id)
 			goto error_host;
 	}
@@ -80,9 +80,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_regist_start(ChiakiRegist *regist, ChiakiLo
 error_stop_pipe:
 	chiaki_stop_pipe_fini(&regist->stop_pipe);
 error_psn_id:
-	free((char *)regist->info.psn_online_id);
+	chiaki_free((char *)regist->info.psn_online_id);
 error_host:
-	free((char *)regist->info.host);
+	chiaki_free((char *)regist->info.host);
 	return err;
 }
 
@@ -90,8 +90,8 @@ CHIAKI_EXPORT void chiaki_regist_fini(ChiakiRegist *regist)
 {
 	chiaki_thread_join(&regist->thread, NULL);
 	chiaki_stop_pipe_fini(&regist->stop_pipe);
-	free((char *)regist->info.psn_online_id);
-	free((char *)regist->info.host);
+	chiaki_free((char *)regist->info.psn_online_id);
+	chiaki_free((char *)regist->info.host);
 }
 
 CHIAKI_EXPORT void chiaki_regist_stop(ChiakiRegist *regist)
@@ -40,7 +40,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queu
 	queue->drop_strategy = CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END;
 	queue->drop_cb = NULL;
 	queue->drop_cb_user = NULL;
-	queue->queue = calloc(1 << size_exp, sizeof(ChiakiReorderQueueEntry));
+	queue->queue = chiaki_calloc(1 << size_exp, sizeof(ChiakiReorderQueueEntry));
 	if(!queue->queue)
 		return CHIAKI_ERR_MEMORY;
 	return CHIAKI_ERR_SUCCESS;
@@ -72,7 +72,7 @@ CHIAKI_EXPORT void chiaki_reorder_queue_fini(ChiakiReorderQueue *queue)
 				queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
 		}
 	}
-	free(queue->queue);
+	chiaki_free(queue->queue);
 }
 
 CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t seq_num, void *user)
@@ -45,6 +45,7 @@
 #define EXPECT_TIMEOUT_MS 5000
 
 #define SENKUSHA_PING_COUNT_DEFAULT 10
+#define SENKUSHA_PING_COUNT_CACHED 3
 #define EXPECT_PONG_TIMEOUT_MS 1000
 
 // Assuming IPv4, sizeof(ip header) + sizeof(udp header)
@@ -55,6 +56,10 @@
 // Amount of bytes to add to AV data size for MTU pings to get the full size of the ip packet for MTU
 #define MTU_PING_DATA_ADD (MTU_UDP_PACKET_ADD + MTU_AV_PACKET_ADD)
 
+// Probes sent at once per round of ladder MTU probing, at most 64.
+// 32 resolve the whole range of 576 to 1454 in two rounds.
+#define MTU_LADDER_SIZE 32
+
 typedef enum {
 	STATE_IDLE,
 	STATE_TAKION_CONNECT,
@@ -62,12 +67,21 @@ typedef enum {
 	STATE_EXPECT_DATA_ACK,
 	STATE_EXPECT_PONG,
 	STATE_EXPECT_MTU,
+	STATE_EXPECT_MTU_LADDER,
+	STATE_EXPECT_PONG_LADDER,
 	STATE_EXPECT_CLIENT_MTU_COMMAND
 } SenkushaState;
 
+/**
+ * Send the MTU probe with the given index of the current ladder round
+ */
+typedef ChiakiErrorCode (*MtuProbeSend)(ChiakiSenkusha *senkusha, size_t index, uint32_t mtu, void *user);
+
 static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us);
-static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
-static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t confirm_mtu, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t confirm_mtu, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_ladder(ChiakiSenkusha *senkusha, SenkushaState state, uint32_t min, uint32_t max, uint32_t confirm_mtu, uint32_t retries, uint64_t timeout_ms, MtuProbeSend send, void *send_user, uint32_t *mtu);
+static bool senkusha_cache_key(ChiakiSenkusha *senkusha, char *host, char *local);
 static void senkusha_takion_cb(ChiakiTakionEvent *event, void *user);
 static void senkusha_takion_data(ChiakiSenkusha *senkusha, ChiakiTakionMessageDataType data_type, uint8_t *buf, size_t buf_size);
 static void senkusha_takion_data_ack(ChiakiSenkusha *senkusha, ChiakiSeqNum32 seq_num);
@@ -87,6 +101,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, Chi
 	ChiakiErrorCode err = chiaki_mutex_init(&senkusha->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error;
+	chiaki_mutex_set_name(&senkusha->state_mutex, "senkusha_state");
 
 	err = chiaki_cond_init(&senkusha->state_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -99,6 +114,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, Chi
 	senkusha->data_ack_seq_num_expected = 0;
 	senkusha->ping_tag = 0;
 	senkusha->pong_time_us = 0;
+	senkusha->mtu_ladder = session->senkusha_mtu_ladder;
+	senkusha->mtu_probe_id_base = 0;
+	senkusha->mtu_probes_count = 0;
+	senkusha->mtu_probes_pending = 0;
 
 	return CHIAKI_ERR_SUCCESS;
 
@@ -142,7 +161,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	ChiakiTakionConnectInfo takion_info;
 	takion_info.log = senkusha->log;
 	takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
-	takion_info.sa = malloc(takion_info.sa_len);
+	takion_info.sa = chiaki_malloc(takion_info.sa_len);
 	if(!takion_info.sa)
 	{
 		err = CHIAKI_ERR_MEMORY;
@@ -156,6 +175,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	takion_info.enable_crypt = false;
 	takion_info.protocol_version = 7;
+	takion_info.io = NULL;
+	takion_info.rtt_us = 0;
+	takion_info.data_ack_delay_ms = 0;
+	takion_info.data_ack_chunks = 0;
+	takion_info.send_batch = false;
+	takion_info.send_batch_window_ms = 0;
+	takion_info.thread_attr = NULL;
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
@@ -165,7 +191,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	senkusha->state_failed = false;
 
 	err = chiaki_takion_connect(&senkusha->takion, &takion_info);
-	free(takion_info.sa);
+	chiaki_free(takion_info.sa);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "Senkusha connect failed");
@@ -217,7 +243,29 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	CHIAKI_LOGI(session->log, "Senkusha successfully received bang");
 
-	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
+	ChiakiSenkushaCache *cache = session->senkusha_cache;
+	char cache_host[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE];
+	char cache_local[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE];
+	if(cache && !senkusha_cache_key(senkusha, cache_host, cache_local))
+		cache = NULL;
+
+	// With cached results, the MTU tests start by probing the cached values and only
+	// search for the MTU if that probe fails, so a single probe each is enough if nothing changed.
+	ChiakiSenkushaCacheEntry cached;
+	bool cache_hit = cache && chiaki_senkusha_cache_lookup(cache, cache_host, cache_local, &cached);
+	uint32_t confirm_mtu_in = 0;
+	uint32_t confirm_mtu_out = 0;
+	if(cache_hit)
+	{
+		CHIAKI_LOGI(session->log, "Senkusha found cached results for %s via %s: MTU in %u, out %u, RTT %.3f ms",
+				cache_host, cache_local, (unsigned int)cached.mtu_in, (unsigned int)cached.mtu_out, (float)cached.rtt_us * 0.001f);
+		if(cached.mtu_in >= 576 && cached.mtu_in <= 1454)
+			confirm_mtu_in = cached.mtu_in;
+		if(cached.mtu_out >= 576 && cached.mtu_out <= 1454)
+			confirm_mtu_out = cached.mtu_out;
+	}
+
+	err = senkusha_run_rtt_test(senkusha, 0, cache_hit ? SENKUSHA_PING_COUNT_CACHED : SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed");
@@ -230,20 +278,30 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 	if(mtu_timeout_ms > 500)
 		mtu_timeout_ms = 500;
 
-	err = senkusha_run_mtu_in_test(senkusha, 576, 1454, 3, mtu_timeout_ms, mtu_in);
+	err = senkusha_run_mtu_in_test(senkusha, 576, 1454, confirm_mtu_in, 3, mtu_timeout_ms, mtu_in);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU in test failed");
 		goto disconnect;
 	}
 
-	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, 576, 1454, 3, mtu_timeout_ms, mtu_out);
+	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, 576, 1454, confirm_mtu_out, 3, mtu_timeout_ms, mtu_out);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU out test failed");
 		goto disconnect;
 	}
 
+	if(cache_hit)
+	{
+		if(*mtu_in == cached.mtu_in && *mtu_out == cached.mtu_out)
+			CHIAKI_LOGI(session->log, "Senkusha confirmed cached MTUs");
+		else
+			CHIAKI_LOGI(session->log, "Senkusha could not confirm cached MTUs, updating cache");
+	}
+	if(cache)
+		chiaki_senkusha_cache_store(cache, cache_host, cache_local, *mtu_in, *mtu_out, *rtt_us);
+
 disconnect:
 	CHIAKI_LOGI(session->log, "Senkusha is disconnecting");
 
@@ -356,12 +414,190 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
+static ChiakiErrorCode senkusha_mtu_in_probe_send(ChiakiSenkusha *senkusha, size_t index, uint32_t mtu, void *user)
+{
+	tkproto_SenkushaMtuCommand mtu_cmd;
+	memset(&mtu_cmd, 0, sizeof(mtu_cmd));
+	mtu_cmd.id = senkusha->mtu_probe_id_base + (uint32_t)index;
+	mtu_cmd.mtu_req = mtu;
+	mtu_cmd.has_num = true;
+	mtu_cmd.num = 1;
+	return senkusha_send_mtu_command(senkusha, &mtu_cmd);
+}
+
+typedef struct mtu_out_probe_t
+{
+	uint8_t *buf; // prepared with padding, as large as the largest probe
+	size_t buf_size;
+} MtuOutProbe;
+
+static ChiakiErrorCode senkusha_mtu_out_probe_send(ChiakiSenkusha *senkusha, size_t index, uint32_t mtu, void *user)
+{
+	MtuOutProbe *probe = user;
+
+	ChiakiTakionAVPacket av_packet = { 0 };
+	av_packet.codec = 0xff;
+	av_packet.is_video = false;
+	av_packet.frame_index = senkusha->ping_test_index;
+	av_packet.unit_index = (uint16_t)index;
+	av_packet.units_in_frame_total = 0x800;
+
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v7_av_packet_format_header(probe->buf, probe->buf_size, &header_size, &av_packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	assert(header_size == MTU_AV_PACKET_ADD);
+
+	*((chiaki_unaligned_uint32_t *)(probe->buf + MTU_AV_PACKET_ADD)) = 0;
+	*((chiaki_unaligned_uint32_t *)(probe->buf + MTU_AV_PACKET_ADD + 4)) = htonl(senkusha->ping_tag);
+
+	return chiaki_takion_send_raw(&senkusha->takion, probe->buf, mtu - MTU_UDP_PACKET_ADD);
+}
+
+/**
+ * Called with state_mutex locked when the probe with the given index of the current ladder round has been answered.
+ * The round is finished as soon as no probe larger than the largest answered one is outstanding anymore.
+ */
+static void senkusha_mtu_probe_answered(ChiakiSenkusha *senkusha, size_t index)
+{
+	senkusha->mtu_probes_pending &= ~((uint64_t)1 << index);
+	uint64_t answered = (((uint64_t)1 << senkusha->mtu_probes_count) - 1) & ~senkusha->mtu_probes_pending;
+	size_t highest = 0;
+	while(answered >> (highest + 1))
+		highest++;
+	if(!(senkusha->mtu_probes_pending >> highest))
+	{
+		senkusha->state_finished = true;
+		chiaki_cond_signal(&senkusha->state_cond);
+	}
+}
+
+/**
+ * Alternative to the binary search of the MTU tests, sending a whole ladder of probe sizes
+ * per round and continuing between the largest answered and the next larger probe.
+ * Like the binary search, min is assumed to work and a larger answered probe implies that
+ * all smaller ones would have worked too.
+ *
+ * Must be called with state_mutex locked.
+ *
+ * @param state STATE_EXPECT_MTU_LADDER or STATE_EXPECT_PONG_LADDER, determines how answers are attributed to the probes
+ * @param confirm_mtu if not 0, this is probed alone first and if it succeeds, it is the result without searching for a larger one
+ */
+static ChiakiErrorCode senkusha_run_mtu_ladder(ChiakiSenkusha *senkusha, SenkushaState state, uint32_t min, uint32_t max, uint32_t confirm_mtu, uint32_t retries, uint64_t timeout_ms, MtuProbeSend send, void *send_user, uint32_t *mtu)
+{
+	uint32_t good = min;
+	uint32_t bad = max + 1;
+	uint32_t probes[MTU_LADDER_SIZE];
+	bool confirm = confirm_mtu >= good && confirm_mtu < bad;
+
+	for(unsigned int round=0; bad - good > 1; round++)
+	{
+		size_t count;
+		if(confirm)
+		{
+			probes[0] = confirm_mtu;
+			count = 1;
+		}
+		else
+		{
+			uint32_t n = bad - good - 1;
+			if(n <= MTU_LADDER_SIZE)
+			{
+				count = n;
+				for(size_t i=0; i<count; i++)
+					probes[i] = good + 1 + (uint32_t)i;
+			}
+			else
+			{
+				count = MTU_LADDER_SIZE;
+				for(size_t i=0; i<count; i++)
+					probes[i] = good + (uint32_t)(((uint64_t)(i + 1) * (n + 1)) / (MTU_LADDER_SIZE + 1));
+			}
+		}
+
+		senkusha->state = state;
+		senkusha->state_finished = false;
+		senkusha->state_failed = false;
+		senkusha->mtu_probe_id_base = senkusha->mtu_id + 1;
+		senkusha->mtu_id += (uint32_t)count;
+		senkusha->mtu_probes_count = count;
+		senkusha->mtu_probes_pending = ((uint64_t)1 << count) - 1;
+		senkusha->ping_tag = chiaki_random_32();
+
+		CHIAKI_LOGI(senkusha->log, "Senkusha MTU ladder round %u with %u probes from %u to %u",
+				round, (unsigned int)count, (unsigned int)probes[0], (unsigned int)probes[count - 1]);
+
+		for(uint32_t attempt=0; attempt<retries && !senkusha->state_finished; attempt++)
+		{
+			uint64_t answered = (((uint64_t)1 << count) - 1) & ~senkusha->mtu_probes_pending;
+			for(size_t i=0; i<count; i++)
+			{
+				// no need to repeat probes that are smaller than an answered one
+				if(!(senkusha->mtu_probes_pending & ((uint64_t)1 << i)) || (answered >> i) > 1)
+					continue;
+				ChiakiErrorCode err = send(senkusha, i, probes[i], send_user);
+				if(err != CHIAKI_ERR_SUCCESS)
+				{
+					CHIAKI_LOGE(senkusha->log, "Senkusha failed to send MTU probe");
+					return err;
+				}
+			}
+
+			ChiakiErrorCode err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
+			assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
+			if(senkusha->should_stop)
+				return CHIAKI_ERR_CANCELED;
+			if(!senkusha->state_finished)
+				CHIAKI_LOGI(senkusha->log, "Senkusha MTU ladder round %u attempt %u timeout", round, (unsigned int)attempt);
+		}
+
+		uint64_t answered = (((uint64_t)1 << count) - 1) & ~senkusha->mtu_probes_pending;
+		senkusha->state = STATE_IDLE;
+
+		size_t next = 0; // index of the smallest probe larger than all answered ones
+		while(answered >> next)
+			next++;
+		if(next > 0)
+			good = probes[next - 1];
+		if(next < count)
+			bad = probes[next];
+
+		if(confirm)
+		{
+			confirm = false;
+			if(next > 0)
+			{
+				CHIAKI_LOGI(senkusha->log, "Senkusha confirmed MTU %u", (unsigned int)good);
+				break;
+			}
+		}
+
+		CHIAKI_LOGI(senkusha->log, "Senkusha MTU ladder round %u: %u works, %u does not", round, (unsigned int)good, (unsigned int)bad);
+	}
+
+	*mtu = good;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * @param confirm_mtu if not 0, this is probed first and if it succeeds, it is the result without searching for a larger one
+ */
+static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t confirm_mtu, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
 {
-	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, retries %u, timeout %llu ms",
-			(unsigned int)min, (unsigned int)max, (unsigned int)retries, (unsigned long long)timeout_ms);
+	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, confirm %u, retries %u, timeout %llu ms",
+			(unsigned int)min, (unsigned int)max, (unsigned int)confirm_mtu, (unsigned int)retries, (unsigned long long)timeout_ms);
+
+	if(senkusha->mtu_ladder)
+	{
+		senkusha->mtu_id = 0;
+		ChiakiErrorCode err = senkusha_run_mtu_ladder(senkusha, STATE_EXPECT_MTU_LADDER, min, max, confirm_mtu, retries, timeout_ms,
+				senkusha_mtu_in_probe_send, NULL, mtu);
+		if(err == CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGI(senkusha->log, "Senkusha determined inbound MTU %u", (unsigned int)*mtu);
+		return err;
+	}
 
-	uint32_t cur = max;
+	uint32_t cur = confirm_mtu ? confirm_mtu : max;
 	uint32_t request_id = 0;
 	while(max > min)
 	{
@@ -409,11 +645,18 @@ static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32
 			break;
 		}
 
+		if(success && cur == confirm_mtu)
+		{
+			CHIAKI_LOGI(senkusha->log, "Senkusha confirmed inbound MTU %u", (unsigned int)cur);
+			max = cur;
+			break;
+		}
+		// min always holds an MTU that works (or the lower bound), so the result is never an MTU that has not been probed
 		if(success)
-			min = cur + 1;
+			min = cur;
 		else
 			max = cur - 1;
-		cur = min + (max - min) / 2;
+		cur = min + (max - min + 1) / 2;
 	}
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha determined inbound MTU %u", (unsigned int)max);
@@ -422,13 +665,18 @@ static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
+/**
+ * @param confirm_mtu if not 0, this is probed first and if it succeeds, it is the result without searching for a larger one
+ */
+static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t confirm_mtu, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
 {
 	if(min < 8 + MTU_PING_DATA_ADD || max < min || mtu_in < min || mtu_in > max)
 		return CHIAKI_ERR_INVALID_DATA;
+	if(confirm_mtu && (confirm_mtu < min || confirm_mtu > max))
+		return CHIAKI_ERR_INVALID_DATA;
 
-	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU out test with min %u, max %u, retries %u, timeout %llu ms",
-				(unsigned int)min, (unsigned int)max, (unsigned int)retries, (unsigned long long)timeout_ms);
+	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU out test with min %u, max %u, confirm %u, retries %u, timeout %llu ms",
+				(unsigned int)min, (unsigned int)max, (unsigned int)confirm_mtu, (unsigned int)retries, (unsigned long long)timeout_ms);
 
 	senkusha->state = STATE_EXPECT_CLIENT_MTU_COMMAND;
 	senkusha->state_finished = false;
@@ -470,7 +718,7 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 	}
 
 	size_t packet_buf_size = max - MTU_UDP_PACKET_ADD;
-	uint8_t *packet_buf = malloc(packet_buf_size);
+	uint8_t *packet_buf = chiaki_malloc(packet_buf_size);
 	if(!packet_buf)
 		return CHIAKI_ERR_MEMORY;
 	memset(packet_buf, 0, MTU_AV_PACKET_ADD + 8);
@@ -480,7 +728,18 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 
 	err = CHIAKI_ERR_SUCCESS;
 
-	uint32_t cur = mtu_in;
+	if(senkusha->mtu_ladder)
+	{
+		senkusha->ping_test_index = 0;
+		MtuOutProbe probe = { packet_buf, packet_buf_size };
+		err = senkusha_run_mtu_ladder(senkusha, STATE_EXPECT_PONG_LADDER, min, max, confirm_mtu, retries, timeout_ms,
+				senkusha_mtu_out_probe_send, &probe, &max);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto beach;
+		goto mtu_determined;
+	}
+
+	uint32_t cur = confirm_mtu ? confirm_mtu : mtu_in;
 	while(max > min)
 	{
 		bool success = false;
@@ -548,13 +807,21 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 			break;
 		}
 
+		if(success && cur == confirm_mtu)
+		{
+			CHIAKI_LOGI(senkusha->log, "Senkusha confirmed outbound MTU %u", (unsigned int)cur);
+			max = cur;
+			break;
+		}
+		// min always holds an MTU that works (or the lower bound), so the result is never an MTU that has not been probed
 		if(success)
-			min = cur + 1;
+			min = cur;
 		else
 			max = cur - 1;
-		cur = min + (max - min) / 2;
+		cur = min + (max - min + 1) / 2;
 	}
 
+mtu_determined:
 	CHIAKI_LOGI(senkusha->log, "Senkusha determined outbound MTU %u", (unsigned int)max);
 	*mtu = max;
 
@@ -569,7 +836,7 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 		CHIAKI_LOGE(senkusha->log, "Senkusha failed to send client MTU command");
 
 beach:
-	free(packet_buf);
+	chiaki_free(packet_buf);
 	return err;
 }
 
@@ -723,6 +990,37 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 		chiaki_cond_signal(&senkusha->state_cond);
 		return;
 	}
+	else if(senkusha->state == STATE_EXPECT_MTU_LADDER)
+	{
+		uint16_t index = (uint16_t)(packet->frame_index - (uint16_t)senkusha->mtu_probe_id_base);
+		if(!packet->is_video || index >= senkusha->mtu_probes_count)
+		{
+			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid MTU response %u, size: %#llx, is video: %d",
+					(unsigned int)packet->frame_index, (unsigned long long)packet->data_size, packet->is_video ? 1 : 0);
+			goto beach;
+		}
+		senkusha_mtu_probe_answered(senkusha, index);
+	}
+	else if(senkusha->state == STATE_EXPECT_PONG_LADDER)
+	{
+		if(packet->is_video
+			|| packet->frame_index != senkusha->ping_test_index
+			|| packet->unit_index >= senkusha->mtu_probes_count
+			|| packet->data_size < 8)
+		{
+			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid MTU Pong %u/%u, size: %#llx",
+					(unsigned int)packet->frame_index, (unsigned int)packet->unit_index, (unsigned long long)packet->data_size);
+			goto beach;
+		}
+
+		uint32_t tag = ntohl(*((uint32_t *)(packet->data + 4)));
+		if(tag != senkusha->ping_tag)
+		{
+			CHIAKI_LOGW(senkusha->log, "Senkusha received MTU Pong with invalid tag");
+			goto beach;
+		}
+		senkusha_mtu_probe_answered(senkusha, packet->unit_index);
+	}
 
 beach:
 	chiaki_mutex_unlock(&senkusha->state_mutex);
@@ -888,3 +1186,22 @@ static ChiakiErrorCode senkusha_send_data_wait_for_ack(ChiakiSenkusha *senkusha,
 	return err;
 }
 
+static bool senkusha_cache_key(ChiakiSenkusha *senkusha, char *host, char *local)
+{
+	struct addrinfo *ai = senkusha->session->connect_info.host_addrinfo_selected;
+	if(!sockaddr_str(ai->ai_addr, host, CHIAKI_SENKUSHA_CACHE_ADDR_SIZE))
+		return false;
+
+	// the local address the OS chose for the connected socket identifies the interface
+	struct sockaddr_storage local_addr;
+	socklen_t local_addr_len = sizeof(local_addr);
+	if(getsockname(senkusha->takion.sock, (struct sockaddr *)&local_addr, &local_addr_len) < 0)
+	{
+		CHIAKI_LOGW(senkusha->log, "Senkusha failed to get local address, not using the cache");
+		return false;
+	}
+	if(!sockaddr_str((struct sockaddr *)&local_addr, local, CHIAKI_SENKUSHA_CACHE_ADDR_SIZE))
+		return false;
+
+	return true;
+}
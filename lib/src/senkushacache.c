@@ -0,0 +1,186 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/senkushacache.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define FILE_MAGIC "chiaki-senkusha-cache"
+#define FILE_VERSION 1
+
+static uint64_t now_sec()
+{
+	return (uint64_t)time(NULL);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_cache_init(ChiakiSenkushaCache *cache)
+{
+	cache->entries_count = 0;
+	cache->validity_sec = CHIAKI_SENKUSHA_CACHE_VALIDITY_SEC_DEFAULT;
+	ChiakiErrorCode err = chiaki_mutex_init(&cache->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	chiaki_mutex_set_name(&cache->mutex, "senkusha_cache");
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_senkusha_cache_fini(ChiakiSenkushaCache *cache)
+{
+	chiaki_mutex_fini(&cache->mutex);
+}
+
+static bool entry_valid(ChiakiSenkushaCache *cache, ChiakiSenkushaCacheEntry *entry, uint64_t now)
+{
+	// entries from the future are the result of a clock change and not trusted either
+	return entry->timestamp <= now && now - entry->timestamp < cache->validity_sec;
+}
+
+static ChiakiSenkushaCacheEntry *entry_find(ChiakiSenkushaCache *cache, const char *host, const char *local)
+{
+	for(size_t i=0; i<cache->entries_count; i++)
+	{
+		ChiakiSenkushaCacheEntry *entry = &cache->entries[i];
+		if(strcmp(entry->host, host) == 0 && strcmp(entry->local, local) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+static void entry_insert(ChiakiSenkushaCache *cache, const char *host, const char *local, uint32_t mtu_in, uint32_t mtu_out, uint64_t rtt_us, uint64_t timestamp)
+{
+	if(strlen(host) >= CHIAKI_SENKUSHA_CACHE_ADDR_SIZE || strlen(local) >= CHIAKI_SENKUSHA_CACHE_ADDR_SIZE)
+		return;
+
+	ChiakiSenkushaCacheEntry *entry = entry_find(cache, host, local);
+	if(!entry)
+	{
+		if(cache->entries_count < CHIAKI_SENKUSHA_CACHE_ENTRIES_MAX)
+			entry = &cache->entries[cache->entries_count++];
+		else
+		{
+			entry = &cache->entries[0];
+			for(size_t i=1; i<cache->entries_count; i++)
+			{
+				if(cache->entries[i].timestamp < entry->timestamp)
+					entry = &cache->entries[i];
+			}
+		}
+		strcpy(entry->host, host);
+		strcpy(entry->local, local);
+	}
+
+	entry->mtu_in = mtu_in;
+	entry->mtu_out = mtu_out;
+	entry->rtt_us = rtt_us;
+	entry->timestamp = timestamp;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_cache_load(ChiakiSenkushaCache *cache, const char *filename)
+{
+	FILE *f = fopen(filename, "r");
+	if(!f)
+		return errno == ENOENT ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_UNKNOWN;
+
+	ChiakiErrorCode err = CHIAKI_ERR_INVALID_DATA;
+	char line[256];
+	int version;
+	if(!fgets(line, sizeof(line), f)
+		|| sscanf(line, FILE_MAGIC " %d", &version) != 1
+		|| version != FILE_VERSION)
+		goto beach;
+
+	chiaki_mutex_lock(&cache->mutex);
+	while(fgets(line, sizeof(line), f))
+	{
+		char host[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE];
+		char local[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE];
+		unsigned int mtu_in, mtu_out;
+		unsigned long long rtt_us, timestamp;
+		if(sscanf(line, "%63s %63s %u %u %llu %llu", host, local, &mtu_in, &mtu_out, &rtt_us, &timestamp) != 6)
+			continue;
+		ChiakiSenkushaCacheEntry *existing = entry_find(cache, host, local);
+		if(existing && existing->timestamp >= timestamp)
+			continue;
+		entry_insert(cache, host, local, mtu_in, mtu_out, rtt_us, timestamp);
+	}
+	chiaki_mutex_unlock(&cache->mutex);
+	err = CHIAKI_ERR_SUCCESS;
+
+beach:
+	fclose(f);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_cache_save(ChiakiSenkushaCache *cache, const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if(!f)
+		return CHIAKI_ERR_UNKNOWN;
+
+	chiaki_mutex_lock(&cache->mutex);
+	uint64_t now = now_sec();
+	fprintf(f, FILE_MAGIC " %d\n", FILE_VERSION);
+	for(size_t i=0; i<cache->entries_count; i++)
+	{
+		ChiakiSenkushaCacheEntry *entry = &cache->entries[i];
+		if(!entry_valid(cache, entry, now))
+			continue;
+		fprintf(f, "%s %s %u %u %llu %llu\n", entry->host, entry->local,
+				(unsigned int)entry->mtu_in, (unsigned int)entry->mtu_out,
+				(unsigned long long)entry->rtt_us, (unsigned long long)entry->timestamp);
+	}
+	chiaki_mutex_unlock(&cache->mutex);
+
+	bool failed = ferror(f) != 0;
+	if(fclose(f) != 0)
+		failed = true;
+	return failed ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT bool chiaki_senkusha_cache_lookup(ChiakiSenkushaCache *cache, const char *host, const char *local, ChiakiSenkushaCacheEntry *entry)
+{
+	chiaki_mutex_lock(&cache->mutex);
+	ChiakiSenkushaCacheEntry *found = entry_find(cache, host, local);
+	bool r = found && entry_valid(cache, found, now_sec());
+	if(r)
+		*entry = *found;
+	chiaki_mutex_unlock(&cache->mutex);
+	return r;
+}
+
+CHIAKI_EXPORT void chiaki_senkusha_cache_store(ChiakiSenkushaCache *cache, const char *host, const char *local, uint32_t mtu_in, uint32_t mtu_out, uint64_t rtt_us)
+{
+	chiaki_mutex_lock(&cache->mutex);
+	entry_insert(cache, host, local, mtu_in, mtu_out, rtt_us, now_sec());
+	chiaki_mutex_unlock(&cache->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_senkusha_cache_invalidate(ChiakiSenkushaCache *cache, const char *host, const char *local)
+{
+	chiaki_mutex_lock(&cache->mutex);
+	ChiakiSenkushaCacheEntry *entry = entry_find(cache, host, local);
+	if(entry)
+	{
+		size_t index = entry - cache->entries;
+		memmove(entry, entry + 1, (cache->entries_count - index - 1) * sizeof(ChiakiSenkushaCacheEntry));
+		cache->entries_count--;
+	}
+	chiaki_mutex_unlock(&cache->mutex);
+}
@@ -21,6 +21,7 @@
 #include <chiaki/http.h>
 #include <chiaki/base64.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -166,6 +167,25 @@ CHIAKI_EXPORT const char *chiaki_quit_reason_string(ChiakiQuitReason reason)
 	}
 }
 
+CHIAKI_EXPORT const char *chiaki_thread_role_string(ChiakiThreadRole role)
+{
+	switch(role)
+	{
+		case CHIAKI_THREAD_ROLE_NETWORK:
+			return "network";
+		case CHIAKI_THREAD_ROLE_CRYPTO:
+			return "crypto";
+		case CHIAKI_THREAD_ROLE_DECODE:
+			return "decode";
+		case CHIAKI_THREAD_ROLE_AUDIO:
+			return "audio";
+		case CHIAKI_THREAD_ROLE_INPUT:
+			return "input";
+		default:
+			return "unknown";
+	}
+}
+
 
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, ChiakiConnectInfo *connect_info, ChiakiLog *log)
@@ -183,6 +203,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	err = chiaki_mutex_init(&session->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
+	chiaki_mutex_set_name(&session->state_mutex, "session_state");
 
 	err = chiaki_stop_pipe_init(&session->stop_pipe);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -237,8 +258,8 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 {
 	if(!session)
 		return;
-	free(session->login_pin);
-	free(session->quit_reason_str);
+	chiaki_free(session->login_pin);
+	chiaki_free(session->quit_reason_str);
 	chiaki_stream_connection_fini(&session->stream_connection);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 	chiaki_cond_fini(&session->state_cond);
@@ -248,6 +269,7 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session)
 {
+	session->start_us = chiaki_time_now_monotonic_us();
 	ChiakiErrorCode err = chiaki_thread_create(&session->session_thread, session_thread_func, session);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
@@ -277,26 +299,32 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_join(ChiakiSession *session)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state(ChiakiSession *session, ChiakiControllerState *state)
 {
+	return chiaki_session_set_controller_state_at(session, state, chiaki_time_now_monotonic_us());
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state_at(ChiakiSession *session, ChiakiControllerState *state, uint64_t input_time_us)
+{
+	// only contended while the feedback sender is started or stopped, the sender itself is never waited for
 	ChiakiErrorCode err = chiaki_mutex_lock(&session->stream_connection.feedback_sender_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 	session->controller_state = *state;
 	if(session->stream_connection.feedback_sender_active)
-		chiaki_feedback_sender_set_controller_state(&session->stream_connection.feedback_sender, &session->controller_state);
+		chiaki_feedback_sender_set_controller_state(&session->stream_connection.feedback_sender, &session->controller_state, input_time_us);
 	chiaki_mutex_unlock(&session->stream_connection.feedback_sender_mutex);
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_login_pin(ChiakiSession *session, const uint8_t *pin, size_t pin_size)
 {
-	uint8_t *buf = malloc(pin_size);
+	uint8_t *buf = chiaki_malloc(pin_size);
 	if(!buf)
 		return CHIAKI_ERR_MEMORY;
 	memcpy(buf, pin, pin_size);
 	ChiakiErrorCode err = chiaki_mutex_lock(&session->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 	if(session->login_pin_entered)
-		free(session->login_pin);
+		chiaki_free(session->login_pin);
 	session->login_pin_entered = true;
 	session->login_pin = buf;
 	session->login_pin_size = pin_size;
@@ -345,12 +373,116 @@ static bool session_check_state_pred_session_id(void *user)
 		   || session->ctrl_session_id_received;
 }
 
+/**
+ * Everything the stream connection needs that does not depend on the console,
+ * done on a separate thread while the session thread is waiting for the network.
+ */
+typedef struct session_prepare_t
+{
+	ChiakiSession *session;
+	ChiakiThread thread;
+	bool running;
+	ChiakiErrorCode err;
+	uint64_t duration_us;
+} SessionPrepare;
+
+static void *session_prepare_thread_func(void *arg)
+{
+	SessionPrepare *prepare = arg;
+	ChiakiSession *session = prepare->session;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+
+	prepare->err = chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key));
+	if(prepare->err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to generate handshake key");
+		goto beach;
+	}
+
+	prepare->err = chiaki_ecdh_init(&session->ecdh);
+	if(prepare->err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
+		goto beach;
+	}
+
+	session->audio_receiver = chiaki_audio_receiver_new(session);
+	if(!session->audio_receiver)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to initialize Audio Receiver");
+		prepare->err = CHIAKI_ERR_MEMORY;
+		goto error_ecdh;
+	}
+
+	session->video_receiver = chiaki_video_receiver_new(session);
+	if(!session->video_receiver)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to initialize Video Receiver");
+		prepare->err = CHIAKI_ERR_MEMORY;
+		goto error_audio_receiver;
+	}
+
+	goto beach;
+
+error_audio_receiver:
+	chiaki_audio_receiver_free(session->audio_receiver);
+	session->audio_receiver = NULL;
+error_ecdh:
+	chiaki_ecdh_fini(&session->ecdh);
+beach:
+	prepare->duration_us = chiaki_time_now_monotonic_us() - start_us;
+	return NULL;
+}
+
+static ChiakiErrorCode session_prepare_start(SessionPrepare *prepare, ChiakiSession *session)
+{
+	prepare->session = session;
+	prepare->err = CHIAKI_ERR_UNKNOWN;
+	prepare->duration_us = 0;
+	ChiakiErrorCode err = chiaki_thread_create(&prepare->thread, session_prepare_thread_func, prepare);
+	prepare->running = err == CHIAKI_ERR_SUCCESS;
+	if(prepare->running)
+		chiaki_thread_set_name(&prepare->thread, "Chiaki Session Prepare");
+	return err;
+}
+
+/**
+ * @return the result of the preparation, can be called multiple times
+ */
+static ChiakiErrorCode session_prepare_join(SessionPrepare *prepare)
+{
+	if(prepare->running)
+	{
+		chiaki_thread_join(&prepare->thread, NULL);
+		prepare->running = false;
+	}
+	return prepare->err;
+}
+
+/**
+ * Free everything that session_prepare_thread_func() has allocated.
+ */
+static void session_prepare_fini(SessionPrepare *prepare)
+{
+	if(session_prepare_join(prepare) != CHIAKI_ERR_SUCCESS)
+		return;
+	ChiakiSession *session = prepare->session;
+	chiaki_video_receiver_free(session->video_receiver);
+	session->video_receiver = NULL;
+	chiaki_audio_receiver_free(session->audio_receiver);
+	session->audio_receiver = NULL;
+	chiaki_ecdh_fini(&session->ecdh);
+}
+
 #define ENABLE_SENKUSHA
 
 static void *session_thread_func(void *arg)
 {
 	ChiakiSession *session = arg;
 	bool success;
+	uint64_t phase_start_us;
+	ChiakiSessionStartupTimings *timings = &session->startup_timings;
+	memset(timings, 0, sizeof(*timings));
 
 	chiaki_mutex_lock(&session->state_mutex);
 
@@ -367,8 +499,17 @@ static void *session_thread_func(void *arg)
 
 	CHECK_STOP(quit);
 
+	SessionPrepare prepare;
+	ChiakiErrorCode err = session_prepare_start(&prepare, session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to start preparation thread");
+		QUIT(quit);
+	}
+
 	CHIAKI_LOGI(session->log, "Starting session request");
 
+	phase_start_us = chiaki_time_now_monotonic_us();
 	ChiakiRpVersion server_rp_version = CHIAKI_RP_VERSION_UNKNOWN;
 	success = session_thread_request_session(session, &server_rp_version);
 
@@ -380,8 +521,9 @@ static void *session_thread_func(void *arg)
 	}
 
 	if(!success)
-		QUIT(quit);
+		QUIT(quit_prepare);
 
+	timings->session_request_us = chiaki_time_now_monotonic_us() - phase_start_us;
 	CHIAKI_LOGI(session->log, "Session request successful");
 
 	chiaki_rpcrypt_init_auth(&session->rpcrypt, session->nonce, session->connect_info.morning);
@@ -391,9 +533,10 @@ static void *session_thread_func(void *arg)
 
 	CHIAKI_LOGI(session->log, "Starting ctrl");
 
-	ChiakiErrorCode err = chiaki_ctrl_start(&session->ctrl, session);
+	phase_start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_ctrl_start(&session->ctrl, session);
 	if(err != CHIAKI_ERR_SUCCESS)
-		QUIT(quit);
+		QUIT(quit_prepare);
 
 	chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, SESSION_EXPECT_TIMEOUT_MS, session_check_state_pred_ctrl_start, session);
 	CHECK_STOP(quit_ctrl);
@@ -418,7 +561,9 @@ static void *session_thread_func(void *arg)
 		chiaki_session_send_event(session, &event);
 		pin_incorrect = true;
 
+		uint64_t pin_start_us = chiaki_time_now_monotonic_us();
 		chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, UINT64_MAX, session_check_state_pred_pin, session);
+		timings->login_pin_us += chiaki_time_now_monotonic_us() - pin_start_us;
 		CHECK_STOP(quit_ctrl);
 		if(session->ctrl_failed)
 		{
@@ -430,7 +575,7 @@ static void *session_thread_func(void *arg)
 		CHIAKI_LOGI(session->log, "Session received entered Login PIN, forwarding to Ctrl");
 		chiaki_ctrl_set_login_pin(&session->ctrl, session->login_pin, session->login_pin_size);
 		session->login_pin_entered = false;
-		free(session->login_pin);
+		chiaki_free(session->login_pin);
 		session->login_pin = NULL;
 		session->login_pin_size = 0;
 
@@ -449,9 +594,12 @@ ctrl_failed:
 		QUIT(quit_ctrl);
 	}
 
+	timings->ctrl_us = chiaki_time_now_monotonic_us() - phase_start_us - timings->login_pin_us;
+
 #ifdef ENABLE_SENKUSHA
 	CHIAKI_LOGI(session->log, "Starting Senkusha");
 
+	phase_start_us = chiaki_time_now_monotonic_us();
 	ChiakiSenkusha senkusha;
 	err = chiaki_senkusha_init(&senkusha, session);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -471,35 +619,15 @@ ctrl_failed:
 		session->mtu_out = 1454;
 		session->rtt_us = 1000;
 	}
+	timings->senkusha_us = chiaki_time_now_monotonic_us() - phase_start_us;
 #endif
 
-	err = chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key));
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to generate handshake key");
-		QUIT(quit_ctrl);
-	}
-
-	err = chiaki_ecdh_init(&session->ecdh);
+	phase_start_us = chiaki_time_now_monotonic_us();
+	err = session_prepare_join(&prepare);
+	timings->prepare_wait_us = chiaki_time_now_monotonic_us() - phase_start_us;
+	timings->prepare_us = prepare.duration_us;
 	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
 		QUIT(quit_ctrl);
-	}
-
-	session->audio_receiver = chiaki_audio_receiver_new(session);
-	if(!session->audio_receiver)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to initialize Audio Receiver");
-		QUIT(quit_ecdh);
-	}
-
-	session->video_receiver = chiaki_video_receiver_new(session);
-	if(!session->video_receiver)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to initialize Video Receiver");
-		QUIT(quit_audio_receiver);
-	}
 
 	chiaki_mutex_unlock(&session->state_mutex);
 	err = chiaki_stream_connection_run(&session->stream_connection);
@@ -508,7 +636,7 @@ ctrl_failed:
 	{
 		CHIAKI_LOGE(session->log, "Remote disconnected from StreamConnection");
 		session->quit_reason = CHIAKI_QUIT_REASON_STREAM_CONNECTION_REMOTE_DISCONNECTED;
-		session->quit_reason_str = strdup(session->stream_connection.remote_disconnect_reason);
+		session->quit_reason_str = chiaki_strdup(session->stream_connection.remote_disconnect_reason);
 	}
 	else if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_CANCELED)
 	{
@@ -521,23 +649,18 @@ ctrl_failed:
 		session->quit_reason = CHIAKI_QUIT_REASON_STOPPED;
 	}
 
-	chiaki_video_receiver_free(session->video_receiver);
-	session->video_receiver = NULL;
+	session->video_receiver_stats = session->video_receiver->stats;
 
 	chiaki_mutex_unlock(&session->state_mutex);
 
-quit_audio_receiver:
-	chiaki_audio_receiver_free(session->audio_receiver);
-	session->audio_receiver = NULL;
-
-quit_ecdh:
-	chiaki_ecdh_fini(&session->ecdh);
-
 quit_ctrl:
 	chiaki_ctrl_stop(&session->ctrl);
 	chiaki_ctrl_join(&session->ctrl);
 	CHIAKI_LOGI(session->log, "Ctrl stopped");
 
+quit_prepare:
+	session_prepare_fini(&prepare);
+
 	ChiakiEvent quit_event;
 quit:
 
@@ -594,14 +717,14 @@ static bool session_thread_request_session(ChiakiSession *session, ChiakiRpVersi
 		//if(ai->ai_protocol != IPPROTO_TCP)
 		//	continue;
 
-		struct sockaddr *sa = malloc(ai->ai_addrlen);
+		struct sockaddr *sa = chiaki_malloc(ai->ai_addrlen);
 		if(!sa)
 			continue;
 		memcpy(sa, ai->ai_addr, ai->ai_addrlen);
 
 		if(sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
 		{
-			free(sa);
+			chiaki_free(sa);
 			continue;
 		}
 
@@ -611,7 +734,7 @@ static bool session_thread_request_session(ChiakiSession *session, ChiakiRpVersi
 		int r = getnameinfo(sa, (socklen_t)ai->ai_addrlen, session->connect_info.hostname, sizeof(session->connect_info.hostname), NULL, 0, 0);
 		if(r != 0)
 		{
-			free(sa);
+			chiaki_free(sa);
 			continue;
 		}
 
@@ -625,7 +748,7 @@ static bool session_thread_request_session(ChiakiSession *session, ChiakiRpVersi
 #else
             CHIAKI_LOGE(session->log, "Failed to create socket to request session: %s", strerror(errno));
 #endif
-			free(sa);
+			chiaki_free(sa);
 			continue;
 		}
 
@@ -642,7 +765,7 @@ static bool session_thread_request_session(ChiakiSession *session, ChiakiRpVersi
 			session->quit_reason = CHIAKI_QUIT_REASON_STOPPED;
 			CHIAKI_SOCKET_CLOSE(session_sock);
 			session_sock = -1;
-			free(sa);
+			chiaki_free(sa);
 			break;
 		}
 		else if(err != CHIAKI_ERR_SUCCESS)
@@ -654,11 +777,11 @@ static bool session_thread_request_session(ChiakiSession *session, ChiakiRpVersi
 				session->quit_reason = CHIAKI_QUIT_REASON_NONE;
 			CHIAKI_SOCKET_CLOSE(session_sock);
 			session_sock = -1;
-			free(sa);
+			chiaki_free(sa);
 			continue;
 		}
 
-		free(sa);
+		chiaki_free(sa);
 
 		session->connect_info.host_addrinfo_selected = ai;
 		break;
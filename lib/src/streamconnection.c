@@ -22,6 +22,7 @@
 #include <chiaki/base64.h>
 #include <chiaki/audio.h>
 #include <chiaki/video.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 #include <assert.h>
@@ -81,6 +82,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	ChiakiErrorCode err = chiaki_mutex_init(&stream_connection->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error;
+	chiaki_mutex_set_name(&stream_connection->state_mutex, "stream_connection_state");
 
 	err = chiaki_cond_init(&stream_connection->state_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -89,6 +91,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnecti
 	err = chiaki_mutex_init(&stream_connection->feedback_sender_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_cond;
+	chiaki_mutex_set_name(&stream_connection->feedback_sender_mutex, "stream_connection_feedback_sender");
 
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
@@ -109,12 +112,12 @@ error:
 
 CHIAKI_EXPORT void chiaki_stream_connection_fini(ChiakiStreamConnection *stream_connection)
 {
-	free(stream_connection->remote_disconnect_reason);
+	chiaki_free(stream_connection->remote_disconnect_reason);
 
 	chiaki_gkcrypt_free(stream_connection->gkcrypt_remote);
 	chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
 
-	free(stream_connection->ecdh_secret);
+	chiaki_free(stream_connection->ecdh_secret);
 
 	chiaki_mutex_fini(&stream_connection->feedback_sender_mutex);
 
@@ -133,11 +136,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 {
 	ChiakiSession *session = stream_connection->session;
 	ChiakiErrorCode err;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
 
 	ChiakiTakionConnectInfo takion_info;
 	takion_info.log = stream_connection->log;
 	takion_info.sa_len = session->connect_info.host_addrinfo_selected->ai_addrlen;
-	takion_info.sa = malloc(takion_info.sa_len);
+	takion_info.sa = chiaki_malloc(takion_info.sa_len);
 	if(!takion_info.sa)
 		return CHIAKI_ERR_MEMORY;
 	memcpy(takion_info.sa, session->connect_info.host_addrinfo_selected->ai_addr, takion_info.sa_len);
@@ -147,6 +151,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	takion_info.enable_crypt = true;
 	takion_info.protocol_version = 9;
+	takion_info.io = session->stream_datagram_io;
+	takion_info.rtt_us = session->rtt_us;
+	takion_info.data_ack_delay_ms = session->data_ack_delay_ms;
+	takion_info.data_ack_chunks = session->data_ack_chunks;
+	takion_info.send_batch = session->send_batch;
+	takion_info.send_batch_window_ms = session->send_batch_window_ms;
+	takion_info.thread_attr = &session->thread_attrs[CHIAKI_THREAD_ROLE_NETWORK];
 
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
@@ -164,7 +175,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
 	err = chiaki_takion_connect(&stream_connection->takion, &takion_info);
-	free(takion_info.sa);
+	chiaki_free(takion_info.sa);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection connect failed");
@@ -230,7 +241,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion);
+	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion, &session->thread_attrs[CHIAKI_THREAD_ROLE_INPUT]);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
@@ -238,15 +249,30 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 		goto disconnect;
 	}
 	stream_connection->feedback_sender_active = true;
-	chiaki_feedback_sender_set_controller_state(&stream_connection->feedback_sender, &session->controller_state);
+	chiaki_feedback_sender_set_controller_state(&stream_connection->feedback_sender, &session->controller_state, 0);
 	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
 
 	stream_connection->state = STATE_IDLE;
 	stream_connection->state_finished = false;
 	stream_connection->state_failed = false;
 
+	ChiakiSessionStartupTimings *timings = &session->startup_timings;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	timings->stream_connection_us = now_us - start_us;
+	timings->total_us = now_us - session->start_us;
+	CHIAKI_LOGI(session->log, "Session startup took %llu ms: session request %llu ms, ctrl %llu ms, Senkusha %llu ms, "
+			"preparation %llu ms (waited %llu ms), stream connection %llu ms",
+			(unsigned long long)(timings->total_us - timings->login_pin_us) / 1000,
+			(unsigned long long)timings->session_request_us / 1000,
+			(unsigned long long)timings->ctrl_us / 1000,
+			(unsigned long long)timings->senkusha_us / 1000,
+			(unsigned long long)timings->prepare_us / 1000,
+			(unsigned long long)timings->prepare_wait_us / 1000,
+			(unsigned long long)timings->stream_connection_us / 1000);
+
 	ChiakiEvent event = { 0 };
 	event.type = CHIAKI_EVENT_CONNECTED;
+	event.connected.startup_timings = *timings;
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
 	chiaki_session_send_event(session, &event);
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
@@ -268,6 +294,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 	stream_connection->feedback_sender_active = false;
+	chiaki_feedback_sender_get_latency_stats(&stream_connection->feedback_sender, &session->input_latency_stats);
 	chiaki_feedback_sender_fini(&stream_connection->feedback_sender);
 	chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
 
@@ -292,6 +319,8 @@ close_takion:
 	chiaki_mutex_unlock(&stream_connection->state_mutex);
 
 	chiaki_takion_close(&stream_connection->takion);
+	session->stream_recv_stats = stream_connection->takion.recv_stats;
+	session->stream_send_stats = stream_connection->takion.send_stats;
 	CHIAKI_LOGI(session->log, "StreamConnection closed takion");
 
 	return err;
@@ -382,8 +411,8 @@ static void stream_connection_takion_data_handle_disconnect(ChiakiStreamConnecti
 	CHIAKI_LOGI(stream_connection->log, "Remote disconnected from StreamConnection with reason \"%s\"", reason);
 
 	stream_connection->remote_disconnected = true;
-	free(stream_connection->remote_disconnect_reason);
-	stream_connection->remote_disconnect_reason = strdup(reason);
+	chiaki_free(stream_connection->remote_disconnect_reason);
+	stream_connection->remote_disconnect_reason = chiaki_strdup(reason);
 	chiaki_cond_signal(&stream_connection->state_cond);
 }
 
@@ -412,17 +441,17 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 {
 	ChiakiSession *session = stream_connection->session;
 
-	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 2, session->handshake_key, stream_connection->ecdh_secret);
+	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, &session->thread_attrs[CHIAKI_THREAD_ROLE_CRYPTO], 2, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_local)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize local GKCrypt with index 2");
 		return CHIAKI_ERR_UNKNOWN;
 	}
-	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 3, session->handshake_key, stream_connection->ecdh_secret);
+	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, &session->thread_attrs[CHIAKI_THREAD_ROLE_CRYPTO], 3, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_remote)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize remote GKCrypt with index 3");
-		free(stream_connection->gkcrypt_local);
+		chiaki_free(stream_connection->gkcrypt_local);
 		stream_connection->gkcrypt_local = NULL;
 		return CHIAKI_ERR_UNKNOWN;
 	}
@@ -494,7 +523,7 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 	}
 
 	assert(!stream_connection->ecdh_secret);
-	stream_connection->ecdh_secret = malloc(CHIAKI_ECDH_SECRET_SIZE);
+	stream_connection->ecdh_secret = chiaki_malloc(CHIAKI_ECDH_SECRET_SIZE);
 	if(!stream_connection->ecdh_secret)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to alloc ECDH secret memory");
@@ -509,7 +538,7 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(stream_connection->ecdh_secret);
+		chiaki_free(stream_connection->ecdh_secret);
 		stream_connection->ecdh_secret = NULL;
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to derive secret from bang");
 		goto error;
@@ -555,10 +584,10 @@ static bool pb_decode_resolution(pb_istream_t *stream, const pb_field_t *field,
 		return true;
 	}
 
-	uint8_t *header_buf_padded = realloc(header_buf.buf, header_buf.size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	uint8_t *header_buf_padded = chiaki_realloc(header_buf.buf, header_buf.size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 	if(!header_buf_padded)
 	{
-		free(header_buf.buf);
+		chiaki_free(header_buf.buf);
 		CHIAKI_LOGE(ctx->stream_connection->session->log, "Failed to realloc video header with padding");
 		return true;
 	}
@@ -18,6 +18,7 @@
 #include <chiaki/takion.h>
 #include <chiaki/congestioncontrol.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <fcntl.h>
 #include <stdbool.h>
@@ -25,6 +26,7 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #ifdef _WIN32
 #include <ws2tcpip.h>
@@ -45,14 +47,30 @@
 #define TAKION_REORDER_QUEUE_SIZE_EXP 4 // => 16 entries
 #define TAKION_SEND_BUFFER_SIZE 16
 
+// with the reorder queue size above, there can never be more than 8 gaps
+#define TAKION_DATA_ACK_GAP_BLOCKS_MAX 8
+
 #define TAKION_POSTPONE_PACKETS_SIZE 32
 
+#define TAKION_GMAC_KEY_INDEX_NONE UINT64_MAX
+
+// when the kernel drops datagrams, SO_RCVBUF is doubled up to this size, at most once per interval
+#define TAKION_RCVBUF_CHECK_INTERVAL_MS 200
+
+#define TAKION_SEND_QUEUE_SIZE 32
+#define TAKION_SEND_QUEUE_DATAGRAM_MAX 1500 // larger datagrams are sent directly
+
 #define TAKION_MESSAGE_HEADER_SIZE 0x10
 
 #define TAKION_PACKET_BASE_TYPE_MASK 0xf
 
 #define TAKION_EXPECT_TIMEOUT_MS 5000
 
+// INIT and COOKIE are retransmitted until acked, starting after twice the rtt if known
+#define TAKION_HANDSHAKE_RTO_DEFAULT_MS 50
+#define TAKION_HANDSHAKE_RTO_MIN_MS 10
+#define TAKION_HANDSHAKE_RTO_MAX_MS 1000
+
 /**
  * Base type of Takion packets. Lower nibble of the first byte in datagrams.
  */
@@ -164,6 +182,49 @@ typedef struct chiaki_takion_postponed_packet_t
 	size_t buf_size;
 } ChiakiTakionPostponedPacket;
 
+struct chiaki_takion_send_state_t
+{
+	atomic_uint_fast32_t seq_num;
+	atomic_size_t key_pos;
+
+	/**
+	 * Seqlock caching the gmac key of the latest key index, so it does not have to be derived for every packet.
+	 * Writers never wait for each other, if one is already active, the others just don't update the cache.
+	 */
+	atomic_uint_fast64_t gmac_key_seq; // odd while a writer is active
+	atomic_uint_fast64_t gmac_key_index;
+	atomic_uint_fast64_t gmac_key[CHIAKI_GKCRYPT_BLOCK_SIZE / sizeof(uint64_t)];
+};
+
+typedef struct takion_send_queue_batch_t
+{
+	uint8_t bufs[TAKION_SEND_QUEUE_SIZE][TAKION_SEND_QUEUE_DATAGRAM_MAX];
+	size_t buf_sizes[TAKION_SEND_QUEUE_SIZE];
+	size_t count;
+} TakionSendQueueBatch;
+
+/**
+ * Datagrams queued by any thread, sent together by the send queue thread.
+ * Senders fill one batch while the thread sends the other.
+ * A datagram is only sent directly by its sender if nothing is queued or being sent,
+ * so it never overtakes datagrams that have been queued before.
+ */
+struct chiaki_takion_send_queue_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond; // wakes up the thread
+	ChiakiCond space_cond; // wakes up senders waiting for a full batch to be taken or for the queue to become idle
+	bool should_stop;
+	bool stopped; // the thread has sent everything and exited
+	bool sending; // the thread is sending a batch
+	unsigned int direct_sending; // senders sending directly, only with window_ms 0
+	ChiakiThread thread;
+	uint64_t window_ms;
+	TakionSendQueueBatch batches[2];
+	TakionSendQueueBatch *pending; // filled by senders
+	ChiakiTakionSendStats stats;
+};
+
 
 static void *takion_thread_func(void *user);
 static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
@@ -176,9 +237,14 @@ static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint32_t key
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
-static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
-static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
+static ChiakiErrorCode takion_recv_handshake_reply(ChiakiTakion *takion, uint64_t timeout_ms, uint8_t *chunk_type, TakionMessagePayloadInitAck *init_ack_payload);
 static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
+static void takion_send_data_ack(ChiakiTakion *takion);
+static int takion_get_rcvbuf(ChiakiTakion *takion);
+static void takion_check_kernel_drops(ChiakiTakion *takion);
+static ChiakiErrorCode takion_send_queue_start(ChiakiTakion *takion, uint64_t window_ms, const ChiakiThreadAttr *thread_attr);
+static void takion_send_queue_stop(ChiakiTakion *takion);
+static void takion_send_queue_free(ChiakiTakion *takion);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info)
 {
@@ -199,23 +265,53 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 			return CHIAKI_ERR_INVALID_DATA;
 	}
 
+	takion->send_state = chiaki_malloc(sizeof(struct chiaki_takion_send_state_t));
+	if(!takion->send_state)
+		return CHIAKI_ERR_MEMORY;
+
 	takion->gkcrypt_local = NULL;
-	ret = chiaki_mutex_init(&takion->gkcrypt_local_mutex, true);
-	if(ret != CHIAKI_ERR_SUCCESS)
-		return ret;
-	takion->key_pos_local = 0;
+	atomic_init(&takion->send_state->key_pos, 0);
+	atomic_init(&takion->send_state->gmac_key_seq, 0);
+	atomic_init(&takion->send_state->gmac_key_index, TAKION_GMAC_KEY_INDEX_NONE);
+	for(size_t i=0; i<sizeof(takion->send_state->gmac_key) / sizeof(takion->send_state->gmac_key[0]); i++)
+		atomic_init(&takion->send_state->gmac_key[i], 0);
 	takion->gkcrypt_remote = NULL;
 	takion->cb = info->cb;
 	takion->cb_user = info->cb_user;
+	if(info->io)
+		takion->io = *info->io;
+	else
+	{
+		chiaki_datagram_io_init_socket(&takion->io);
+		takion->io.user = &takion->socket_stats;
+	}
+	memset(&takion->socket_stats, 0, sizeof(takion->socket_stats));
+	memset(&takion->recv_stats, 0, sizeof(takion->recv_stats));
+	memset(&takion->send_stats, 0, sizeof(takion->send_stats));
+	takion->kernel_drops_last = 0;
+	takion->kernel_drops_pending = 0;
+	takion->rcvbuf_limited = false;
+	takion->rcvbuf_check_last_ms = 0;
 	takion->a_rwnd = TAKION_A_RWND;
 
 	takion->tag_local = chiaki_random_32(); // 0x4823
-	takion->seq_num_local = takion->tag_local;
-	ret = chiaki_mutex_init(&takion->seq_num_local_mutex, false);
-	if(ret != CHIAKI_ERR_SUCCESS)
-		goto error_gkcrypt_local_mutex;
+	atomic_init(&takion->send_state->seq_num, takion->tag_local);
 	takion->tag_remote = 0;
 
+	if(info->rtt_us)
+	{
+		takion->handshake_rto_ms = info->rtt_us * 2 / 1000;
+		if(takion->handshake_rto_ms < TAKION_HANDSHAKE_RTO_MIN_MS)
+			takion->handshake_rto_ms = TAKION_HANDSHAKE_RTO_MIN_MS;
+		if(takion->handshake_rto_ms > TAKION_HANDSHAKE_RTO_MAX_MS)
+			takion->handshake_rto_ms = TAKION_HANDSHAKE_RTO_MAX_MS;
+	}
+	else
+		takion->handshake_rto_ms = TAKION_HANDSHAKE_RTO_DEFAULT_MS;
+
+	takion->data_ack_delay_ms = info->data_ack_delay_ms;
+	takion->data_ack_chunks = info->data_ack_chunks ? info->data_ack_chunks : CHIAKI_TAKION_DATA_ACK_CHUNKS_DEFAULT;
+
 	takion->enable_crypt = info->enable_crypt;
 	takion->postponed_packets = NULL;
 	takion->postponed_packets_size = 0;
@@ -227,7 +323,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create stop pipe");
-		goto error_seq_num_local_mutex;
+		goto error_send_state;
 	}
 
 	takion->sock = socket(info->sa->sa_family, SOCK_DGRAM, IPPROTO_UDP);
@@ -238,14 +334,22 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_pipe;
 	}
 
-	const int rcvbuf_val = takion->a_rwnd;
-	int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const void *)&rcvbuf_val, sizeof(rcvbuf_val));
+	takion->rcvbuf_requested = takion->a_rwnd;
+	int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const void *)&takion->rcvbuf_requested, sizeof(takion->rcvbuf_requested));
 	if(r < 0)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: %s", strerror(errno));
 		ret = CHIAKI_ERR_NETWORK;
 		goto error_sock;
 	}
+	takion->recv_stats.rcvbuf_size = takion_get_rcvbuf(takion);
+
+	if(!info->io)
+	{
+		takion->recv_stats.kernel_drops_supported = chiaki_datagram_socket_enable_drop_stats(takion->sock) == CHIAKI_ERR_SUCCESS;
+		if(!takion->recv_stats.kernel_drops_supported)
+			CHIAKI_LOGW(takion->log, "Takion can't monitor datagrams dropped by the kernel on this platform");
+	}
 
 	if(info->ip_dontfrag)
 	{
@@ -283,25 +387,38 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_sock;
 	}
 
-	err = chiaki_thread_create(&takion->thread, takion_thread_func, takion);
-	if(r != CHIAKI_ERR_SUCCESS)
+	takion->send_queue = NULL;
+	if(info->send_batch)
+	{
+		err = takion_send_queue_start(takion, info->send_batch_window_ms, info->thread_attr);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(takion->log, "Takion failed to start send queue");
+			ret = err;
+			goto error_sock;
+		}
+	}
+
+	err = chiaki_thread_create_attr(&takion->thread, takion_thread_func, takion, info->thread_attr, takion->log);
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		ret = err;
-		goto error_sock;
+		goto error_send_queue;
 	}
 
 	chiaki_thread_set_name(&takion->thread, "Chiaki Takion");
 
 	return CHIAKI_ERR_SUCCESS;
 
+error_send_queue:
+	takion_send_queue_stop(takion);
+	takion_send_queue_free(takion);
 error_sock:
 	CHIAKI_SOCKET_CLOSE(takion->sock);
 error_pipe:
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
-error_seq_num_local_mutex:
-	chiaki_mutex_fini(&takion->seq_num_local_mutex);
-error_gkcrypt_local_mutex:
-	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
+error_send_state:
+	chiaki_free(takion->send_state);
 	return ret;
 }
 
@@ -310,46 +427,304 @@ CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion)
 	chiaki_stop_pipe_stop(&takion->stop_pipe);
 	chiaki_thread_join(&takion->thread, NULL);
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
-	chiaki_mutex_fini(&takion->seq_num_local_mutex);
-	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
+	takion_send_queue_free(takion);
+	chiaki_free(takion->send_state);
+}
+
+CHIAKI_EXPORT void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *gkcrypt_local, ChiakiGKCrypt *gkcrypt_remote)
+{
+	takion->gkcrypt_local = gkcrypt_local;
+	takion->gkcrypt_remote = gkcrypt_remote;
+	// a cached key would belong to the previous gkcrypt
+	atomic_store_explicit(&takion->send_state->gmac_key_index, TAKION_GMAC_KEY_INDEX_NONE, memory_order_relaxed);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, size_t *key_pos)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+	if(!takion->gkcrypt_local)
+	{
+		*key_pos = 0;
+		return CHIAKI_ERR_SUCCESS;
+	}
 
-	if(takion->gkcrypt_local)
+	// check before publishing, a failed call must not leave the shared position wrapped
+	size_t cur = atomic_load_explicit(&takion->send_state->key_pos, memory_order_relaxed);
+	do
 	{
-		size_t cur = takion->key_pos_local;
 		if(SIZE_MAX - cur < data_size)
-		{
-			chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
 			return CHIAKI_ERR_OVERFLOW;
-		}
+	} while(!atomic_compare_exchange_weak_explicit(&takion->send_state->key_pos, &cur, cur + data_size,
+			memory_order_relaxed, memory_order_relaxed));
+	*key_pos = cur;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static bool takion_gmac_key_cache_read(struct chiaki_takion_send_state_t *state, uint64_t key_index, uint8_t *key_out)
+{
+	uint_fast64_t seq = atomic_load_explicit(&state->gmac_key_seq, memory_order_acquire);
+	if(seq & 1)
+		return false;
+	if(atomic_load_explicit(&state->gmac_key_index, memory_order_relaxed) != key_index)
+		return false;
+	uint64_t key[sizeof(state->gmac_key) / sizeof(state->gmac_key[0])];
+	for(size_t i=0; i<sizeof(key) / sizeof(key[0]); i++)
+		key[i] = atomic_load_explicit(&state->gmac_key[i], memory_order_relaxed);
+	atomic_thread_fence(memory_order_acquire);
+	if(atomic_load_explicit(&state->gmac_key_seq, memory_order_relaxed) != seq)
+		return false;
+	memcpy(key_out, key, CHIAKI_GKCRYPT_BLOCK_SIZE);
+	return true;
+}
+
+static void takion_gmac_key_cache_write(struct chiaki_takion_send_state_t *state, uint64_t key_index, const uint8_t *key_buf)
+{
+	uint_fast64_t seq = atomic_load_explicit(&state->gmac_key_seq, memory_order_relaxed);
+	if((seq & 1) || !atomic_compare_exchange_strong_explicit(&state->gmac_key_seq, &seq, seq + 1, memory_order_acquire, memory_order_relaxed))
+		return;
+	atomic_thread_fence(memory_order_release);
 
-		*key_pos = cur;
-		takion->key_pos_local = cur + data_size;
+	// key indices only grow, don't let a late packet replace the newer key
+	uint64_t cached_index = atomic_load_explicit(&state->gmac_key_index, memory_order_relaxed);
+	if(cached_index == TAKION_GMAC_KEY_INDEX_NONE || key_index > cached_index)
+	{
+		uint64_t key[sizeof(state->gmac_key) / sizeof(state->gmac_key[0])];
+		memcpy(key, key_buf, CHIAKI_GKCRYPT_BLOCK_SIZE);
+		for(size_t i=0; i<sizeof(key) / sizeof(key[0]); i++)
+			atomic_store_explicit(&state->gmac_key[i], key[i], memory_order_relaxed);
+		atomic_store_explicit(&state->gmac_key_index, key_index, memory_order_relaxed);
 	}
-	else
-		*key_pos = 0;
 
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	atomic_store_explicit(&state->gmac_key_seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Calculate a gmac with gkcrypt_local, thread-safe without locking.
+ */
+static ChiakiErrorCode takion_gmac_local(ChiakiTakion *takion, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	uint64_t key_index = chiaki_gkcrypt_gmac_key_index(key_pos);
+	uint8_t gmac_key[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	if(!takion_gmac_key_cache_read(takion->send_state, key_index, gmac_key))
+	{
+		chiaki_gkcrypt_gen_tmp_gmac_key(takion->gkcrypt_local, key_index, gmac_key);
+		takion_gmac_key_cache_write(takion->send_state, key_index, gmac_key);
+	}
+	return chiaki_gkcrypt_gmac_with_key(takion->gkcrypt_local, gmac_key, key_pos, buf, buf_size, gmac_out);
+}
+
+static bool takion_send_queue_check(void *user)
+{
+	struct chiaki_takion_send_queue_t *queue = user;
+	return queue->should_stop || queue->pending->count;
+}
+
+static bool takion_send_queue_full_check(void *user)
+{
+	struct chiaki_takion_send_queue_t *queue = user;
+	return queue->should_stop || queue->pending->count == TAKION_SEND_QUEUE_SIZE;
+}
+
+static bool takion_send_queue_space_check(void *user)
+{
+	struct chiaki_takion_send_queue_t *queue = user;
+	return queue->stopped || queue->pending->count < TAKION_SEND_QUEUE_SIZE;
+}
+
+static bool takion_send_queue_idle_check(void *user)
+{
+	struct chiaki_takion_send_queue_t *queue = user;
+	return queue->stopped || (!queue->sending && !queue->pending->count);
+}
+
+static void *takion_send_queue_thread_func(void *user)
+{
+	ChiakiTakion *takion = user;
+	struct chiaki_takion_send_queue_t *queue = takion->send_queue;
+
+	chiaki_mutex_lock(&queue->mutex);
+	while(true)
+	{
+		chiaki_cond_wait_pred(&queue->cond, &queue->mutex, takion_send_queue_check, queue);
+		if(!queue->pending->count)
+			break; // only when stopping, anything left is still sent below
+
+		if(queue->window_ms && !queue->should_stop)
+			chiaki_cond_timedwait_pred(&queue->cond, &queue->mutex, queue->window_ms, takion_send_queue_full_check, queue);
+
+		TakionSendQueueBatch *batch = queue->pending;
+		queue->pending = batch == &queue->batches[0] ? &queue->batches[1] : &queue->batches[0];
+		queue->sending = true;
+		chiaki_cond_broadcast(&queue->space_cond);
+		chiaki_mutex_unlock(&queue->mutex);
+
+		const uint8_t *bufs[TAKION_SEND_QUEUE_SIZE];
+		for(size_t i=0; i<batch->count; i++)
+			bufs[i] = batch->bufs[i];
+		ChiakiErrorCode err = chiaki_datagram_io_send_batch(&takion->io, takion->sock, bufs, batch->buf_sizes, batch->count);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGE(takion->log, "Takion failed to send batch of %llu datagrams: %s", (unsigned long long)batch->count, chiaki_error_string(err));
+
+		chiaki_mutex_lock(&queue->mutex);
+		queue->stats.datagrams_batched += batch->count;
+		queue->stats.batches++;
+		batch->count = 0;
+		queue->sending = false;
+		chiaki_cond_broadcast(&queue->space_cond);
+	}
+	queue->stopped = true;
+	chiaki_cond_broadcast(&queue->space_cond);
+	chiaki_mutex_unlock(&queue->mutex);
+
+	return NULL;
+}
+
+static ChiakiErrorCode takion_send_queue_start(ChiakiTakion *takion, uint64_t window_ms, const ChiakiThreadAttr *thread_attr)
+{
+	struct chiaki_takion_send_queue_t *queue = chiaki_malloc(sizeof(struct chiaki_takion_send_queue_t));
+	if(!queue)
+		return CHIAKI_ERR_MEMORY;
+	queue->should_stop = false;
+	queue->stopped = false;
+	queue->sending = false;
+	queue->direct_sending = 0;
+	queue->window_ms = window_ms;
+	queue->batches[0].count = 0;
+	queue->batches[1].count = 0;
+	queue->pending = &queue->batches[0];
+	memset(&queue->stats, 0, sizeof(queue->stats));
+	queue->stats.batch_supported = takion->io.send_batch_cb != NULL;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&queue->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_queue;
+	chiaki_mutex_set_name(&queue->mutex, "takion_send_queue");
+	err = chiaki_cond_init(&queue->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	err = chiaki_cond_init(&queue->space_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	takion->send_queue = queue;
+	err = chiaki_thread_create_attr(&queue->thread, takion_send_queue_thread_func, takion, thread_attr, takion->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_space_cond;
+	chiaki_thread_set_name(&queue->thread, "Chiaki Takion Send");
+
 	return CHIAKI_ERR_SUCCESS;
+
+error_space_cond:
+	takion->send_queue = NULL;
+	chiaki_cond_fini(&queue->space_cond);
+error_cond:
+	chiaki_cond_fini(&queue->cond);
+error_mutex:
+	chiaki_mutex_fini(&queue->mutex);
+error_queue:
+	chiaki_free(queue);
+	return err;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+/**
+ * Send everything that is still queued and stop the thread.
+ * Datagrams sent afterwards go out directly until takion_send_queue_free().
+ */
+static void takion_send_queue_stop(ChiakiTakion *takion)
 {
-	int r = send(takion->sock, buf, buf_size, 0);
-	if(r < 0)
-		return CHIAKI_ERR_NETWORK;
+	struct chiaki_takion_send_queue_t *queue = takion->send_queue;
+	if(!queue)
+		return;
+
+	chiaki_mutex_lock(&queue->mutex);
+	queue->should_stop = true;
+	chiaki_cond_signal(&queue->cond);
+	chiaki_mutex_unlock(&queue->mutex);
+	chiaki_thread_join(&queue->thread, NULL);
+
+	takion->send_stats = queue->stats;
+	CHIAKI_LOGI(takion->log, "Takion sent %llu queued datagrams in %llu batches and %llu datagrams directly",
+			(unsigned long long)queue->stats.datagrams_batched, (unsigned long long)queue->stats.batches,
+			(unsigned long long)queue->stats.datagrams_direct);
+}
+
+static void takion_send_queue_free(ChiakiTakion *takion)
+{
+	struct chiaki_takion_send_queue_t *queue = takion->send_queue;
+	if(!queue)
+		return;
+	takion->send_queue = NULL;
+	chiaki_cond_fini(&queue->space_cond);
+	chiaki_cond_fini(&queue->cond);
+	chiaki_mutex_fini(&queue->mutex);
+	chiaki_free(queue);
+}
+
+/**
+ * Queue buf, waiting for the thread to take a full batch if necessary, or send it directly.
+ * buf is sent directly if it does not fit into the queue, after waiting for everything queued before,
+ * or if window_ms is 0 and nothing is queued or being sent, so there is nothing to batch with.
+ */
+static ChiakiErrorCode takion_send_queue_send(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	struct chiaki_takion_send_queue_t *queue = takion->send_queue;
+	chiaki_mutex_lock(&queue->mutex);
+	bool direct;
+	if(buf_size > TAKION_SEND_QUEUE_DATAGRAM_MAX)
+	{
+		chiaki_cond_wait_pred(&queue->space_cond, &queue->mutex, takion_send_queue_idle_check, queue);
+		direct = true;
+	}
+	else if(!queue->window_ms && !queue->direct_sending && takion_send_queue_idle_check(queue))
+		direct = true; // skip the hop to the thread
+	else
+	{
+		chiaki_cond_wait_pred(&queue->space_cond, &queue->mutex, takion_send_queue_space_check, queue);
+		direct = queue->stopped;
+	}
+
+	if(direct)
+	{
+		if(queue->stopped)
+		{
+			chiaki_mutex_unlock(&queue->mutex);
+			return takion->io.send_cb(takion->io.user, takion->sock, buf, buf_size);
+		}
+		queue->stats.datagrams_direct++;
+		queue->direct_sending++;
+		chiaki_mutex_unlock(&queue->mutex);
+		ChiakiErrorCode err = takion->io.send_cb(takion->io.user, takion->sock, buf, buf_size);
+		chiaki_mutex_lock(&queue->mutex);
+		queue->direct_sending--;
+		chiaki_mutex_unlock(&queue->mutex);
+		return err;
+	}
+
+	TakionSendQueueBatch *batch = queue->pending;
+	memcpy(batch->bufs[batch->count], buf, buf_size);
+	batch->buf_sizes[batch->count] = buf_size;
+	batch->count++;
+	// the thread waits for the first datagram, or for a full batch during the window
+	if(batch->count == 1 || batch->count == TAKION_SEND_QUEUE_SIZE)
+		chiaki_cond_signal(&queue->cond);
+	chiaki_mutex_unlock(&queue->mutex);
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	if(takion->send_queue)
+		return takion_send_queue_send(takion, buf, buf_size);
+	return takion->io.send_cb(takion->io.user, takion->sock, buf, buf_size);
+}
 
-static ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint8_t *mac_out, uint8_t *mac_old_out, ChiakiTakionPacketKeyPos *key_pos_out)
+/**
+ * @param takion_local if not NULL, crypt is ignored and the gmac is calculated with takion_gmac_local()
+ */
+static ChiakiErrorCode takion_packet_mac(ChiakiTakion *takion_local, ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint8_t *mac_out, uint8_t *mac_old_out, ChiakiTakionPacketKeyPos *key_pos_out)
 {
+	if(takion_local)
+		crypt = takion_local->gkcrypt_local;
+
 	if(buf_size < 1)
 		return CHIAKI_ERR_BUF_TOO_SMALL;
 
@@ -373,7 +748,10 @@ static ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *b
 	{
 		if(base_type == TAKION_PACKET_TYPE_CONTROL)
 			memset(buf + key_pos_offset, 0, sizeof(ChiakiTakionPacketKeyPos));
-		chiaki_gkcrypt_gmac(crypt, key_pos, buf, buf_size, buf + mac_offset);
+		if(takion_local)
+			takion_gmac_local(takion_local, key_pos, buf, buf_size, buf + mac_offset);
+		else
+			chiaki_gkcrypt_gmac(crypt, key_pos, buf, buf_size, buf + mac_offset);
 		*((ChiakiTakionPacketKeyPos *)(buf + key_pos_offset)) = htonl(key_pos);
 	}
 
@@ -385,14 +763,15 @@ static ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *b
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *buf, size_t buf_size, uint8_t *mac_out, uint8_t *mac_old_out, ChiakiTakionPacketKeyPos *key_pos_out)
+{
+	return takion_packet_mac(NULL, crypt, buf, buf_size, mac_out, mac_old_out, key_pos_out);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
 	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
-	err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, mac, NULL, NULL);
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	ChiakiErrorCode err = takion_packet_mac(takion, NULL, buf, buf_size, mac, NULL, NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -413,7 +792,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 		return err;
 
 	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size;
-	uint8_t *packet_buf = malloc(packet_size);
+	uint8_t *packet_buf = chiaki_malloc(packet_size);
 	if(!packet_buf)
 		return CHIAKI_ERR_MEMORY;
 	packet_buf[0] = TAKION_PACKET_TYPE_CONTROL;
@@ -422,11 +801,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 
 	uint8_t *msg_payload = packet_buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
 
-	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
-	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
+	ChiakiSeqNum32 seq_num_val = (ChiakiSeqNum32)atomic_fetch_add_explicit(&takion->send_state->seq_num, 1, memory_order_relaxed);
 
 	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num_val);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 4)) = htons(channel);
@@ -438,7 +813,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
+		chiaki_free(packet_buf);
 		return err;
 	}
 
@@ -450,25 +825,36 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	return err;
 }
 
-static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion, uint32_t seq_num)
+/**
+ * @param gap_blocks pairs of start and end offsets relative to seq_num of chunks received after a gap, like in SCTP
+ */
+static ChiakiErrorCode chiaki_takion_send_message_data_ack(ChiakiTakion *takion, uint32_t seq_num, const uint16_t *gap_blocks, size_t gap_blocks_count)
 {
-	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0xc];
+	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0xc + TAKION_DATA_ACK_GAP_BLOCKS_MAX * 4];
+	assert(gap_blocks_count <= TAKION_DATA_ACK_GAP_BLOCKS_MAX);
+	size_t payload_size = 0xc + gap_blocks_count * 4;
+	size_t buf_size = 1 + TAKION_MESSAGE_HEADER_SIZE + payload_size;
 	buf[0] = TAKION_PACKET_TYPE_CONTROL;
 
 	size_t key_pos;
-	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, sizeof(buf), &key_pos);
+	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, buf_size, &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
-	takion_write_message_header(buf + 1, takion->tag_remote, key_pos, TAKION_CHUNK_TYPE_DATA_ACK, 0, 0xc);
+	takion_write_message_header(buf + 1, takion->tag_remote, key_pos, TAKION_CHUNK_TYPE_DATA_ACK, 0, payload_size);
 
 	uint8_t *data_ack = buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
 	*((chiaki_unaligned_uint32_t *)(data_ack + 0)) = htonl(seq_num);
 	*((chiaki_unaligned_uint32_t *)(data_ack + 4)) = htonl(takion->a_rwnd);
-	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = 0;
+	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = htons((uint16_t)gap_blocks_count);
 	*((chiaki_unaligned_uint16_t *)(data_ack + 0xa)) = 0;
+	for(size_t i=0; i<gap_blocks_count; i++)
+	{
+		*((chiaki_unaligned_uint16_t *)(data_ack + 0xc + i * 4)) = htons(gap_blocks[i * 2]);
+		*((chiaki_unaligned_uint16_t *)(data_ack + 0xc + i * 4 + 2)) = htons(gap_blocks[i * 2 + 1]);
+	}
 
-	return chiaki_takion_send(takion, buf, sizeof(buf));
+	return chiaki_takion_send(takion, buf, buf_size);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_congestion(ChiakiTakion *takion, ChiakiTakionCongestionPacket *packet)
@@ -480,13 +866,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_congestion(ChiakiTakion *takion
 	*((chiaki_unaligned_uint16_t *)(buf + 3)) = htons(packet->word_1);
 	*((chiaki_unaligned_uint16_t *)(buf + 5)) = htons(packet->word_2);
 
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	*((chiaki_unaligned_uint32_t *)(buf + 0xb)) = htonl((uint32_t)takion->key_pos_local); // TODO: is this correct? shouldn't key_pos be 0 for mac calculation?
-	err = chiaki_gkcrypt_gmac(takion->gkcrypt_local, takion->key_pos_local, buf, sizeof(buf), buf + 7);
-	takion->key_pos_local += sizeof(buf);
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	size_t key_pos = atomic_fetch_add_explicit(&takion->send_state->key_pos, sizeof(buf), memory_order_relaxed);
+	*((chiaki_unaligned_uint32_t *)(buf + 0xb)) = htonl((uint32_t)key_pos); // TODO: is this correct? shouldn't key_pos be 0 for mac calculation?
+	ChiakiErrorCode err = takion_gmac_local(takion, key_pos, buf, sizeof(buf), buf + 7);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -501,30 +883,23 @@ static ChiakiErrorCode takion_send_feedback_packet(ChiakiTakion *takion, uint8_t
 
 	size_t payload_size = buf_size - 0xc;
 
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
 	size_t key_pos;
-	err = chiaki_takion_crypt_advance_key_pos(takion, payload_size + CHIAKI_GKCRYPT_BLOCK_SIZE, &key_pos);
+	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, payload_size + CHIAKI_GKCRYPT_BLOCK_SIZE, &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
 	err = chiaki_gkcrypt_encrypt(takion->gkcrypt_local, key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, buf + 0xc, payload_size);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
 	*((chiaki_unaligned_uint32_t *)(buf + 4)) = htonl((uint32_t)key_pos);
 
-	err = chiaki_gkcrypt_gmac(takion->gkcrypt_local, key_pos, buf, buf_size, buf + 8);
+	err = takion_gmac_local(takion, key_pos, buf, buf_size, buf + 8);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
 	chiaki_takion_send_raw(takion, buf, buf_size);
-
-beach:
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
-	return err;
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, ChiakiFeedbackState *feedback_state)
@@ -541,103 +916,130 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *ta
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *payload, size_t payload_size)
 {
-	size_t buf_size = 0xc + payload_size;
-	uint8_t *buf = malloc(buf_size);
+	size_t buf_size = CHIAKI_TAKION_FEEDBACK_HEADER_SIZE + payload_size;
+	uint8_t *buf = chiaki_malloc(buf_size);
 	if(!buf)
 		return CHIAKI_ERR_MEMORY;
+	memcpy(buf + CHIAKI_TAKION_FEEDBACK_HEADER_SIZE, payload, payload_size);
+	ChiakiErrorCode err = chiaki_takion_send_feedback_history_buf(takion, seq_num, buf, buf_size);
+	chiaki_free(buf);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history_buf(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *buf, size_t buf_size)
+{
 	buf[0] = TAKION_PACKET_TYPE_FEEDBACK_HISTORY;
 	*((chiaki_unaligned_uint16_t *)(buf + 1)) = htons(seq_num);
 	buf[3] = 0; // TODO
 	*((chiaki_unaligned_uint32_t *)(buf + 4)) = 0; // key pos
 	*((chiaki_unaligned_uint32_t *)(buf + 8)) = 0; // gmac
-	memcpy(buf + 0xc, payload, payload_size);
-	ChiakiErrorCode err = takion_send_feedback_packet(takion, buf, buf_size);
-	free(buf);
-	return err;
+	return takion_send_feedback_packet(takion, buf, buf_size);
 }
 
 static ChiakiErrorCode takion_handshake(ChiakiTakion *takion, uint32_t *seq_num_remote_initial)
 {
 	ChiakiErrorCode err;
 
-	// INIT ->
+	// INIT -> until INIT_ACK <-, then COOKIE -> until COOKIE_ACK <-
+	// Each is retransmitted with exponential backoff, so a single lost datagram only costs one rto.
 
 	TakionMessagePayloadInit init_payload;
 	init_payload.tag = takion->tag_local;
 	init_payload.a_rwnd = TAKION_A_RWND;
 	init_payload.outbound_streams = TAKION_OUTBOUND_STREAMS;
 	init_payload.inbound_streams = TAKION_INBOUND_STREAMS;
-	init_payload.initial_seq_num = takion->seq_num_local;
-	err = takion_send_message_init(takion, &init_payload);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to send init");
-		return err;
-	}
+	init_payload.initial_seq_num = (uint32_t)atomic_load_explicit(&takion->send_state->seq_num, memory_order_relaxed);
 
-	CHIAKI_LOGI(takion->log, "Takion sent init");
-
-
-	// INIT_ACK <-
-
-	TakionMessagePayloadInitAck init_ack_payload;
-	err = takion_recv_message_init_ack(takion, &init_ack_payload);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to receive init ack");
-		return err;
-	}
+	bool cookie_phase = false;
+	uint8_t cookie[TAKION_COOKIE_SIZE];
+	uint64_t rto_ms = takion->handshake_rto_ms;
+	uint64_t phase_deadline_ms = chiaki_time_now_monotonic_ms() + TAKION_EXPECT_TIMEOUT_MS;
+	unsigned int transmissions = 0;
 
-	if(init_ack_payload.tag == 0)
+	while(true)
 	{
-		CHIAKI_LOGE(takion->log, "Takion remote tag in init ack is 0");
-		return CHIAKI_ERR_INVALID_RESPONSE;
-	}
+		const char *msg_name = cookie_phase ? "cookie" : "init";
+		if(cookie_phase)
+			err = takion_send_message_cookie(takion, cookie);
+		else
+			err = takion_send_message_init(takion, &init_payload);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(takion->log, "Takion failed to send %s", msg_name);
+			return err;
+		}
+		transmissions++;
+		if(transmissions == 1)
+			CHIAKI_LOGI(takion->log, "Takion sent %s", msg_name);
 
-	CHIAKI_LOGI(takion->log, "Takion received init ack with remote tag %#x, outbound streams: %#x, inbound streams: %#x",
-				init_ack_payload.tag, init_ack_payload.outbound_streams, init_ack_payload.inbound_streams);
+		uint64_t now_ms = chiaki_time_now_monotonic_ms();
+		uint64_t retransmit_ms = now_ms + rto_ms;
+		if(retransmit_ms > phase_deadline_ms)
+			retransmit_ms = phase_deadline_ms;
 
-	takion->tag_remote = init_ack_payload.tag;
-	*seq_num_remote_initial = takion->tag_remote; //init_ack_payload.initial_seq_num;
+		bool send_now = false;
+		while(!send_now && now_ms < retransmit_ms)
+		{
+			uint8_t chunk_type;
+			TakionMessagePayloadInitAck init_ack_payload;
+			err = takion_recv_handshake_reply(takion, retransmit_ms - now_ms, &chunk_type, &init_ack_payload);
+			if(err == CHIAKI_ERR_TIMEOUT)
+				break;
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				if(err != CHIAKI_ERR_CANCELED)
+					CHIAKI_LOGE(takion->log, "Takion failed to receive %s ack", msg_name);
+				return err;
+			}
+			now_ms = chiaki_time_now_monotonic_ms();
 
-	if(init_ack_payload.outbound_streams == 0 || init_ack_payload.inbound_streams == 0
-	   || init_ack_payload.outbound_streams > TAKION_INBOUND_STREAMS
-	   || init_ack_payload.inbound_streams < TAKION_OUTBOUND_STREAMS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion min/max check failed");
-		return CHIAKI_ERR_INVALID_RESPONSE;
-	}
+			if(chunk_type == TAKION_CHUNK_TYPE_COOKIE_ACK)
+			{
+				if(!cookie_phase)
+					continue;
+				CHIAKI_LOGI(takion->log, "Takion received cookie ack after %u transmission(s) of cookie", transmissions);
+				CHIAKI_LOGI(takion->log, "Takion connected");
+				return CHIAKI_ERR_SUCCESS;
+			}
 
+			// init ack, possibly a late answer to a retransmitted init
+			if(cookie_phase && init_ack_payload.tag == takion->tag_remote)
+				continue;
 
-	// COOKIE ->
+			CHIAKI_LOGI(takion->log, "Takion received init ack with remote tag %#x, outbound streams: %#x, inbound streams: %#x",
+						init_ack_payload.tag, init_ack_payload.outbound_streams, init_ack_payload.inbound_streams);
 
-	err = takion_send_message_cookie(takion, init_ack_payload.cookie);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to send cookie");
-		return err;
-	}
+			// a later init ack with a different tag supersedes the previous one
+			takion->tag_remote = init_ack_payload.tag;
+			*seq_num_remote_initial = takion->tag_remote; //init_ack_payload.initial_seq_num;
+			memcpy(cookie, init_ack_payload.cookie, TAKION_COOKIE_SIZE);
 
-	CHIAKI_LOGI(takion->log, "Takion sent cookie");
+			if(!cookie_phase)
+			{
+				if(transmissions > 1)
+					CHIAKI_LOGI(takion->log, "Takion needed %u transmissions of init", transmissions);
+				cookie_phase = true;
+				transmissions = 0;
+				rto_ms = takion->handshake_rto_ms;
+				phase_deadline_ms = now_ms + TAKION_EXPECT_TIMEOUT_MS;
+			}
+			send_now = true;
+		}
 
+		if(send_now)
+			continue;
 
-	// COOKIE_ACK <-
+		if(chiaki_time_now_monotonic_ms() >= phase_deadline_ms)
+		{
+			CHIAKI_LOGE(takion->log, "Takion %s ack receive timeout after %u transmission(s)", msg_name, transmissions);
+			return CHIAKI_ERR_TIMEOUT;
+		}
 
-	err = takion_recv_message_cookie_ack(takion);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Takion failed to receive cookie ack");
-		return err;
+		rto_ms *= 2;
+		if(rto_ms > TAKION_HANDSHAKE_RTO_MAX_MS)
+			rto_ms = TAKION_HANDSHAKE_RTO_MAX_MS;
+		CHIAKI_LOGI(takion->log, "Takion retransmitting %s, next timeout %llu ms", msg_name, (unsigned long long)rto_ms);
 	}
-
-	CHIAKI_LOGI(takion->log, "Takion received cookie ack");
-
-
-	// done!
-
-	CHIAKI_LOGI(takion->log, "Takion connected");
-
-	return CHIAKI_ERR_SUCCESS;
 }
 
 static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
@@ -645,8 +1047,8 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
 	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
-	free(entry);
+	chiaki_free(entry->packet_buf);
+	chiaki_free(entry);
 }
 
 static void *takion_thread_func(void *user)
@@ -662,6 +1064,10 @@ static void *takion_thread_func(void *user)
 
 	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
+	takion->data_ack_seq_num = seq_num_remote_initial - 1;
+	takion->data_ack_chunks_pending = 0;
+	memset(&takion->data_ack_stats, 0, sizeof(takion->data_ack_stats));
+
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
 	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
 		goto error_reoder_queue;
@@ -714,33 +1120,57 @@ static void *takion_thread_func(void *user)
 				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
 				takion_handle_packet(takion, packet->buf, packet->buf_size);
 			}
-			free(takion->postponed_packets);
+			chiaki_free(takion->postponed_packets);
 			takion->postponed_packets = NULL;
 			takion->postponed_packets_size = 0;
 			takion->postponed_packets_count = 0;
 		}
 
+		uint64_t timeout_ms = UINT64_MAX;
+		if(takion->data_ack_chunks_pending)
+		{
+			uint64_t now_ms = chiaki_time_now_monotonic_ms();
+			timeout_ms = takion->data_ack_deadline_ms > now_ms ? takion->data_ack_deadline_ms - now_ms : 0;
+		}
+
 		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
+		uint8_t *buf = chiaki_malloc(received_size); // TODO: no malloc?
 		if(!buf)
 			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
+		ChiakiErrorCode err = timeout_ms ? takion_recv(takion, buf, &received_size, timeout_ms) : CHIAKI_ERR_TIMEOUT;
+		if(err == CHIAKI_ERR_TIMEOUT)
+		{
+			chiaki_free(buf);
+			takion_send_data_ack(takion);
+			continue;
+		}
 		if(err != CHIAKI_ERR_SUCCESS)
 		{
-			free(buf);
+			chiaki_free(buf);
 			break;
 		}
-		uint8_t *resized_buf = realloc(buf, received_size);
+		uint8_t *resized_buf = chiaki_realloc(buf, received_size);
 		if(!resized_buf)
 		{
-			free(buf);
+			chiaki_free(buf);
 			continue;
 		}
+		takion_check_kernel_drops(takion);
 		takion_handle_packet(takion, resized_buf, received_size);
 	}
 
 	// chiaki_congestion_control_stop(&congestion_control);
 
+	if(takion->recv_stats.kernel_drops)
+		CHIAKI_LOGW(takion->log, "Takion receive buffer overflowed, the kernel dropped %llu datagrams in total, buffer size is %d bytes",
+				(unsigned long long)takion->recv_stats.kernel_drops, takion->recv_stats.rcvbuf_size);
+
+	CHIAKI_LOGI(takion->log, "Takion acked %llu data chunks (%llu duplicates) with %llu acks (%llu with gaps)",
+			(unsigned long long)takion->data_ack_stats.chunks_received,
+			(unsigned long long)takion->data_ack_stats.duplicates_received,
+			(unsigned long long)takion->data_ack_stats.acks_sent,
+			(unsigned long long)takion->data_ack_stats.gap_acks_sent);
+
 	chiaki_takion_send_buffer_fini(&takion->send_buffer);
 
 error_reoder_queue:
@@ -753,32 +1183,105 @@ beach:
 		event.type = CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 		takion->cb(&event, takion->cb_user);
 	}
+	takion_send_queue_stop(takion);
 	CHIAKI_SOCKET_CLOSE(takion->sock);
 	return NULL;
 }
 
 
+/**
+ * @return SO_RCVBUF as reported by the kernel, which may differ from what was set, or 0 on failure
+ */
+static int takion_get_rcvbuf(ChiakiTakion *takion)
+{
+	int val = 0;
+	socklen_t len = sizeof(val);
+	if(getsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (void *)&val, &len) < 0)
+		return 0;
+	return val;
+}
+
+CHIAKI_EXPORT uint32_t chiaki_takion_kernel_drops_accumulate(uint64_t *total, uint32_t *last, uint32_t raw)
+{
+	uint32_t new_drops = raw - *last; // unsigned arithmetic takes care of the wrap
+	*last = raw;
+	*total += new_drops;
+	return new_drops;
+}
+
+CHIAKI_EXPORT bool chiaki_takion_rcvbuf_grow(int *requested)
+{
+	*requested = *requested > CHIAKI_TAKION_RCVBUF_MAX / 2 ? CHIAKI_TAKION_RCVBUF_MAX : *requested * 2;
+	return *requested < CHIAKI_TAKION_RCVBUF_MAX;
+}
+
+/**
+ * Sync recv_stats.kernel_drops and double SO_RCVBUF if the kernel dropped datagrams,
+ * so local overload can be told apart from loss in the network.
+ * Only growing the buffer and the warning are rate-limited.
+ */
+static void takion_check_kernel_drops(ChiakiTakion *takion)
+{
+	takion->kernel_drops_pending += chiaki_takion_kernel_drops_accumulate(&takion->recv_stats.kernel_drops,
+			&takion->kernel_drops_last, takion->socket_stats.kernel_drops);
+	if(!takion->kernel_drops_pending)
+		return;
+
+	uint64_t now_ms = chiaki_time_now_monotonic_ms();
+	if(now_ms - takion->rcvbuf_check_last_ms < TAKION_RCVBUF_CHECK_INTERVAL_MS)
+		return;
+	takion->rcvbuf_check_last_ms = now_ms;
+
+	uint64_t new_drops = takion->kernel_drops_pending;
+	takion->kernel_drops_pending = 0;
+
+	if(takion->rcvbuf_limited)
+	{
+		CHIAKI_LOGW(takion->log, "Takion receive buffer overflowed, the kernel dropped %llu datagrams", (unsigned long long)new_drops);
+		return;
+	}
+
+	int size_prev = takion->recv_stats.rcvbuf_size;
+	if(!chiaki_takion_rcvbuf_grow(&takion->rcvbuf_requested))
+		takion->rcvbuf_limited = true;
+	if(setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const void *)&takion->rcvbuf_requested, sizeof(takion->rcvbuf_requested)) < 0)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: %s", strerror(errno));
+		takion->rcvbuf_limited = true;
+		return;
+	}
+	int size = takion_get_rcvbuf(takion);
+	if(size > size_prev)
+	{
+		takion->recv_stats.rcvbuf_size = size;
+		takion->recv_stats.rcvbuf_grows++;
+		CHIAKI_LOGW(takion->log, "Takion receive buffer overflowed, the kernel dropped %llu datagrams, increased buffer from %d to %d bytes",
+				(unsigned long long)new_drops, size_prev, size);
+	}
+	else
+	{
+		// the kernel silently caps the size, e.g. at net.core.rmem_max on Linux
+		CHIAKI_LOGW(takion->log, "Takion receive buffer overflowed, the kernel dropped %llu datagrams, but the buffer can't grow beyond %d bytes",
+				(unsigned long long)new_drops, size_prev);
+		takion->rcvbuf_limited = true;
+	}
+}
+
 static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
 {
-	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	ChiakiErrorCode err = takion->io.recv_cb(takion->io.user, takion->sock, &takion->stop_pipe, buf, buf_size, timeout_ms);
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
 		return err;
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		CHIAKI_LOGE(takion->log, "Takion select failed: %s", strerror(errno));
+		CHIAKI_LOGE(takion->log, "Takion recv failed: %s", chiaki_error_string(err));
 		return err;
 	}
-
-	int received_sz = recv(takion->sock, buf, *buf_size, 0);
-	if(received_sz <= 0)
+	if(!*buf_size)
 	{
-		if(received_sz < 0)
-			CHIAKI_LOGE(takion->log, "Takion recv failed: %s", strerror(errno));
-		else
-			CHIAKI_LOGE(takion->log, "Takion recv returned 0");
+		CHIAKI_LOGE(takion->log, "Takion recv returned 0");
 		return CHIAKI_ERR_NETWORK;
 	}
-	*buf_size = (size_t)received_sz;
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -816,7 +1319,7 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 {
 	if(!takion->postponed_packets)
 	{
-		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
+		takion->postponed_packets = chiaki_calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
 		if(!takion->postponed_packets)
 			return;
 		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
@@ -846,7 +1349,7 @@ static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_
 
 	if(takion_handle_packet_mac(takion, base_type, buf, buf_size) != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_free(buf);
 		return;
 	}
 
@@ -862,13 +1365,13 @@ static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_
 			else
 			{
 				takion_handle_packet_av(takion, base_type, buf, buf_size);
-				free(buf);
+				chiaki_free(buf);
 			}
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion packet with unknown type %#x received", base_type);
 			chiaki_log_hexdump(takion->log, CHIAKI_LOG_WARNING, buf, buf_size);
-			free(buf);
+			chiaki_free(buf);
 			break;
 	}
 }
@@ -880,7 +1383,7 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 	ChiakiErrorCode err = takion_parse_message(takion, buf+1, buf_size-1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(buf);
+		chiaki_free(buf);
 		return;
 	}
 
@@ -894,32 +1397,79 @@ static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, siz
 			break;
 		case TAKION_CHUNK_TYPE_DATA_ACK:
 			takion_handle_packet_message_data_ack(takion, msg.chunk_flags, msg.payload, msg.payload_size);
-			free(buf);
+			chiaki_free(buf);
+			break;
+		case TAKION_CHUNK_TYPE_INIT_ACK:
+		case TAKION_CHUNK_TYPE_COOKIE_ACK:
+			// late replies to retransmitted handshake messages
+			chiaki_free(buf);
 			break;
 		default:
 			CHIAKI_LOGW(takion->log, "Takion received message with unknown chunk type = %#x", msg.chunk_type);
-			free(buf);
+			chiaki_free(buf);
 			break;
 	}
 }
 
 
-static void takion_flush_data_queue(ChiakiTakion *takion)
+/**
+ * Acknowledge everything delivered so far and report the chunks waiting behind gaps.
+ */
+static void takion_send_data_ack(ChiakiTakion *takion)
+{
+	uint16_t gap_blocks[TAKION_DATA_ACK_GAP_BLOCKS_MAX * 2];
+	size_t gap_blocks_count = 0;
+	bool in_block = false;
+	// gap reports are only sent when delaying acks, so the default behaves exactly as before
+	uint64_t count = takion->data_ack_delay_ms ? chiaki_reorder_queue_count(&takion->data_queue) : 0;
+	for(uint64_t i=0; i<count; i++)
+	{
+		// offsets are relative to the cumulative seq num, which is the one right before the queue's begin
+		uint16_t offset = (uint16_t)(i + 1);
+		uint64_t seq_num;
+		void *entry;
+		bool received = chiaki_reorder_queue_peek(&takion->data_queue, i, &seq_num, &entry);
+		if(received && !in_block)
+		{
+			if(gap_blocks_count == TAKION_DATA_ACK_GAP_BLOCKS_MAX)
+				break;
+			gap_blocks[gap_blocks_count * 2] = offset;
+			gap_blocks_count++;
+			in_block = true;
+		}
+		if(received)
+			gap_blocks[gap_blocks_count * 2 - 1] = offset;
+		else
+			in_block = false;
+	}
+
+	chiaki_takion_send_message_data_ack(takion, takion->data_ack_seq_num, gap_blocks, gap_blocks_count);
+	takion->data_ack_chunks_pending = 0;
+	takion->data_ack_stats.acks_sent++;
+	if(gap_blocks_count)
+		takion->data_ack_stats.gap_acks_sent++;
+}
+
+/**
+ * @return number of chunks delivered
+ */
+static unsigned int takion_flush_data_queue(ChiakiTakion *takion)
 {
 	uint64_t seq_num = 0;
-	bool ack = false;
+	unsigned int pulled_count = 0;
 	while(true)
 	{
 		TakionDataPacketEntry *entry;
 		bool pulled = chiaki_reorder_queue_pull(&takion->data_queue, &seq_num, (void **)&entry);
 		if(!pulled)
 			break;
-		ack = true;
+		pulled_count++;
+		takion->data_ack_seq_num = (ChiakiSeqNum32)seq_num;
 
 		if(entry->payload_size < 9)
 		{
-			free(entry->packet_buf);
-			free(entry);
+			chiaki_free(entry->packet_buf);
+			chiaki_free(entry);
 			continue;
 		}
 
@@ -944,12 +1494,11 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
-		free(entry);
+		chiaki_free(entry->packet_buf);
+		chiaki_free(entry);
 	}
 
-	if(ack)
-		chiaki_takion_send_message_data_ack(takion, (uint32_t)seq_num);
+	return pulled_count;
 }
 
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size)
@@ -963,7 +1512,7 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 		return;
 	}
 
-	TakionDataPacketEntry *entry = malloc(sizeof(TakionDataPacketEntry));
+	TakionDataPacketEntry *entry = chiaki_malloc(sizeof(TakionDataPacketEntry));
 	if(!entry)
 		return;
 
@@ -975,15 +1524,41 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 	entry->channel = ntohs(*((chiaki_unaligned_uint16_t *)(payload + 4)));
 	ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(payload + 0)));
 
+	takion->data_ack_stats.chunks_received++;
+	bool duplicate = !chiaki_seq_num_32_gt(seq_num, takion->data_ack_seq_num);
+	if(duplicate)
+		takion->data_ack_stats.duplicates_received++;
+
 	chiaki_reorder_queue_push(&takion->data_queue, seq_num, entry);
-	takion_flush_data_queue(takion);
+	unsigned int delivered = takion_flush_data_queue(takion);
+
+	if(!takion->data_ack_delay_ms)
+	{
+		if(delivered)
+			takion_send_data_ack(takion);
+		return;
+	}
+
+	// Like SCTP, a duplicate means our ack was lost and a gap means a chunk was lost,
+	// so the sender should know about either as soon as possible.
+	if(duplicate || chiaki_reorder_queue_count(&takion->data_queue))
+	{
+		takion_send_data_ack(takion);
+		return;
+	}
+
+	if(!takion->data_ack_chunks_pending)
+		takion->data_ack_deadline_ms = chiaki_time_now_monotonic_ms() + takion->data_ack_delay_ms;
+	takion->data_ack_chunks_pending += delivered;
+	if(takion->data_ack_chunks_pending >= takion->data_ack_chunks)
+		takion_send_data_ack(takion);
 }
 
 static void takion_handle_packet_message_data_ack(ChiakiTakion *takion, uint8_t flags, uint8_t *buf, size_t buf_size)
 {
-	if(buf_size != 0xc)
+	if(buf_size < 0xc)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received data ack with size %#x != %#x", buf_size, 0xa);
+		CHIAKI_LOGE(takion->log, "Takion received data ack with size %#x < %#x", (unsigned int)buf_size, 0xc);
 		return;
 	}
 
@@ -1100,91 +1675,87 @@ static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t
 
 
 
-static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload)
+static ChiakiErrorCode takion_parse_handshake_reply(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint8_t *chunk_type, TakionMessagePayloadInitAck *init_ack_payload)
 {
-	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE + 0x10 + TAKION_COOKIE_SIZE];
-	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	if(received_size < sizeof(message))
+	if(buf_size < 1 + TAKION_MESSAGE_HEADER_SIZE)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received packet of size %#x while expecting init ack packet of exactly %#x", received_size, sizeof(message));
+		CHIAKI_LOGW(takion->log, "Takion received packet of size %#x while expecting handshake reply", (unsigned int)buf_size);
 		return CHIAKI_ERR_INVALID_RESPONSE;
 	}
 
-	if(message[0] != TAKION_PACKET_TYPE_CONTROL)
+	if(buf[0] != TAKION_PACKET_TYPE_CONTROL)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received packet of type %#x while expecting init ack message with type %#x", message[0], TAKION_PACKET_TYPE_CONTROL);
+		CHIAKI_LOGW(takion->log, "Takion received packet of type %#x while expecting handshake reply with type %#x", buf[0], TAKION_PACKET_TYPE_CONTROL);
 		return CHIAKI_ERR_INVALID_RESPONSE;
 	}
 
 	TakionMessage msg;
-	err = takion_parse_message(takion, message + 1, received_size - 1, &msg);
+	ChiakiErrorCode err = takion_parse_message(takion, buf + 1, buf_size - 1, &msg);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		CHIAKI_LOGE(takion->log, "Failed to parse message while expecting init ack");
+		CHIAKI_LOGW(takion->log, "Failed to parse message while expecting handshake reply");
 		return CHIAKI_ERR_INVALID_RESPONSE;
 	}
 
-	if(msg.chunk_type != TAKION_CHUNK_TYPE_INIT_ACK || msg.chunk_flags != 0x0)
+	if(msg.chunk_type == TAKION_CHUNK_TYPE_INIT_ACK && msg.chunk_flags == 0x0 && msg.payload_size == 0x10 + TAKION_COOKIE_SIZE)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received unexpected message with type (%#x, %#x) while expecting init ack", msg.chunk_type, msg.chunk_flags);
+		uint8_t *pl = msg.payload;
+		init_ack_payload->tag = ntohl(*((chiaki_unaligned_uint32_t *)(pl + 0)));
+		init_ack_payload->a_rwnd = ntohl(*((chiaki_unaligned_uint32_t *)(pl + 4)));
+		init_ack_payload->outbound_streams = ntohs(*((chiaki_unaligned_uint16_t *)(pl + 8)));
+		init_ack_payload->inbound_streams = ntohs(*((chiaki_unaligned_uint16_t *)(pl + 0xa)));
+		init_ack_payload->initial_seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(pl + 0xc)));
+		memcpy(init_ack_payload->cookie, pl + 0x10, TAKION_COOKIE_SIZE);
+
+		// ignored like any other invalid packet, so the handshake continues until a valid one arrives or it times out
+		if(init_ack_payload->tag == 0)
+		{
+			CHIAKI_LOGW(takion->log, "Takion received init ack with remote tag 0");
+			return CHIAKI_ERR_INVALID_RESPONSE;
+		}
+		if(init_ack_payload->outbound_streams == 0 || init_ack_payload->inbound_streams == 0
+		   || init_ack_payload->outbound_streams > TAKION_INBOUND_STREAMS
+		   || init_ack_payload->inbound_streams < TAKION_OUTBOUND_STREAMS)
+		{
+			CHIAKI_LOGW(takion->log, "Takion received init ack with invalid outbound streams: %#x, inbound streams: %#x",
+					init_ack_payload->outbound_streams, init_ack_payload->inbound_streams);
+			return CHIAKI_ERR_INVALID_RESPONSE;
+		}
+	}
+	else if(!(msg.chunk_type == TAKION_CHUNK_TYPE_COOKIE_ACK && msg.chunk_flags == 0x0 && msg.payload_size == 0))
+	{
+		CHIAKI_LOGW(takion->log, "Takion received unexpected message with type (%#x, %#x) while expecting handshake reply", msg.chunk_type, msg.chunk_flags);
 		return CHIAKI_ERR_INVALID_RESPONSE;
 	}
 
-	assert(msg.payload_size == 0x10 + TAKION_COOKIE_SIZE);
-
-	uint8_t *pl = msg.payload;
-	payload->tag = ntohl(*((chiaki_unaligned_uint32_t *)(pl + 0)));
-	payload->a_rwnd = ntohl(*((chiaki_unaligned_uint32_t *)(pl + 4)));
-	payload->outbound_streams = ntohs(*((chiaki_unaligned_uint16_t *)(pl + 8)));
-	payload->inbound_streams = ntohs(*((chiaki_unaligned_uint16_t *)(pl + 0xa)));
-	payload->initial_seq_num = ntohl(*((chiaki_unaligned_uint32_t *)(pl + 0xc)));
-	memcpy(payload->cookie, pl + 0x10, TAKION_COOKIE_SIZE);
-
+	*chunk_type = msg.chunk_type;
 	return CHIAKI_ERR_SUCCESS;
 }
 
-
-static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
+/**
+ * Wait for the next init ack or cookie ack, ignoring anything else that arrives in the meantime.
+ *
+ * @param init_ack_payload filled if chunk_type is TAKION_CHUNK_TYPE_INIT_ACK
+ */
+static ChiakiErrorCode takion_recv_handshake_reply(ChiakiTakion *takion, uint64_t timeout_ms, uint8_t *chunk_type, TakionMessagePayloadInitAck *init_ack_payload)
 {
-	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE];
-	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	if(received_size < sizeof(message))
-	{
-		CHIAKI_LOGE(takion->log, "Takion received packet of size %#x while expecting cookie ack packet of exactly %#x", received_size, sizeof(message));
-		return CHIAKI_ERR_INVALID_RESPONSE;
-	}
-
-	if(message[0] != TAKION_PACKET_TYPE_CONTROL)
+	uint64_t deadline_ms = chiaki_time_now_monotonic_ms() + timeout_ms;
+	while(true)
 	{
-		CHIAKI_LOGE(takion->log, "Takion received packet of type %#x while expecting cookie ack message with type %#x", message[0], TAKION_PACKET_TYPE_CONTROL);
-		return CHIAKI_ERR_INVALID_RESPONSE;
-	}
+		uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE + 0x10 + TAKION_COOKIE_SIZE];
+		size_t received_size = sizeof(message);
+		ChiakiErrorCode err = takion_recv(takion, message, &received_size, timeout_ms);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
 
-	TakionMessage msg;
-	err = takion_parse_message(takion, message + 1, received_size - 1, &msg);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(takion->log, "Failed to parse message while expecting cookie ack");
-		return CHIAKI_ERR_INVALID_RESPONSE;
-	}
+		if(takion_parse_handshake_reply(takion, message, received_size, chunk_type, init_ack_payload) == CHIAKI_ERR_SUCCESS)
+			return CHIAKI_ERR_SUCCESS;
 
-	if(msg.chunk_type != TAKION_CHUNK_TYPE_COOKIE_ACK || msg.chunk_flags != 0x0)
-	{
-		CHIAKI_LOGE(takion->log, "Takion received unexpected message with type (%#x, %#x) while expecting cookie ack", msg.chunk_type, msg.chunk_flags);
-		return CHIAKI_ERR_INVALID_RESPONSE;
+		uint64_t now_ms = chiaki_time_now_monotonic_ms();
+		if(now_ms >= deadline_ms)
+			return CHIAKI_ERR_TIMEOUT;
+		timeout_ms = deadline_ms - now_ms;
 	}
-
-	assert(msg.payload_size == 0);
-
-	return CHIAKI_ERR_SUCCESS;
 }
 
 
@@ -1295,6 +1866,65 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPac
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
+{
+	size_t header_size = 0x12 + (packet->is_video ? 3 : 1);
+	if(packet->uses_nalu_info_structs)
+		header_size += 3;
+	*header_size_out = header_size;
+
+	if(header_size > buf_size)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	buf[0] = packet->is_video ? TAKION_PACKET_TYPE_VIDEO : TAKION_PACKET_TYPE_AUDIO;
+	if(packet->uses_nalu_info_structs)
+		buf[0] |= 0x10;
+
+	*(chiaki_unaligned_uint16_t *)(buf + 1) = htons(packet->packet_index);
+	*(chiaki_unaligned_uint16_t *)(buf + 3) = htons(packet->frame_index);
+
+	uint32_t dword_2;
+	if(packet->is_video)
+	{
+		dword_2 = (packet->units_in_frame_fec & 0x3ff)
+			| (((uint32_t)(packet->units_in_frame_total - 1) & 0x7ff) << 0xa)
+			| (((uint32_t)packet->unit_index & 0x7ff) << 0x15);
+	}
+	else
+	{
+		dword_2 = (packet->units_in_frame_fec & 0xffff)
+			| (((uint32_t)(packet->units_in_frame_total - 1) & 0xff) << 0x10)
+			| (((uint32_t)packet->unit_index & 0xff) << 0x18);
+	}
+	*(chiaki_unaligned_uint32_t *)(buf + 5) = htonl(dword_2);
+
+	buf[9] = packet->codec;
+
+	*(chiaki_unaligned_uint32_t *)(buf + 0xa) = 0; // mac
+	*(chiaki_unaligned_uint32_t *)(buf + 0xe) = htonl(packet->key_pos);
+
+	uint8_t *cur = buf + 0x12;
+	if(packet->is_video)
+	{
+		*(chiaki_unaligned_uint16_t *)cur = htons(packet->word_at_0x18);
+		cur[2] = packet->adaptive_stream_index << 5;
+		cur += 3;
+	}
+	else
+	{
+		cur[0] = 0; // unknown
+		cur += 1;
+	}
+
+	if(packet->uses_nalu_info_structs)
+	{
+		*(chiaki_unaligned_uint16_t *)cur = 0; // unknown
+		cur[2] = 0; // unknown
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v7_av_packet_format_header(uint8_t *buf, size_t buf_size, size_t *header_size_out, ChiakiTakionAVPacket *packet)
 {
 	size_t header_size = CHIAKI_TAKION_V7_AV_HEADER_SIZE_BASE;
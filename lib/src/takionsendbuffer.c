@@ -48,7 +48,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuf
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
 
-	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
+	send_buffer->packets = chiaki_calloc(size, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
 	send_buffer->packets_size = size;
@@ -59,6 +59,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuf
 	ChiakiErrorCode err = chiaki_mutex_init(&send_buffer->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_packets;
+	chiaki_mutex_set_name(&send_buffer->mutex, "takion_send_buffer");
 
 	err = chiaki_cond_init(&send_buffer->cond);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -76,7 +77,7 @@ error_cond:
 error_mutex:
 	chiaki_mutex_fini(&send_buffer->mutex);
 error_packets:
-	free(send_buffer->packets);
+	chiaki_free(send_buffer->packets);
 	return err;
 }
 
@@ -92,11 +93,11 @@ CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_b
 	assert(err == CHIAKI_ERR_SUCCESS);
 
 	for(size_t i=0; i<send_buffer->packets_count; i++)
-		free(send_buffer->packets[i].buf);
+		chiaki_free(send_buffer->packets[i].buf);
 
 	chiaki_cond_fini(&send_buffer->cond);
 	chiaki_mutex_fini(&send_buffer->mutex);
-	free(send_buffer->packets);
+	chiaki_free(send_buffer->packets);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
@@ -139,7 +140,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuf
 
 beach:
 	if(err != CHIAKI_ERR_SUCCESS)
-		free(buf);
+		chiaki_free(buf);
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
@@ -163,7 +164,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 			if(acked_seq_nums)
 				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
 
-			free(send_buffer->packets[i].buf);
+			chiaki_free(send_buffer->packets[i].buf);
 			if(shift_start == SIZE_MAX)
 			{
 				// first shift
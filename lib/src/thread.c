@@ -19,35 +19,298 @@
 
 #include <chiaki/thread.h>
 #include <chiaki/time.h>
+#include <chiaki/log.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+#include <stdatomic.h>
+#endif
+#ifndef _WIN32
+#include <sched.h>
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+// nice value for CHIAKI_THREAD_PRIORITY_LOW and CHIAKI_THREAD_PRIORITY_HIGH on Linux
+#define THREAD_NICE_LOW 10
+#define THREAD_NICE_HIGH -10
+
+#define THREAD_REALTIME_PRIORITY_DEFAULT 10
+
+CHIAKI_EXPORT const char *chiaki_thread_priority_string(ChiakiThreadPriority priority)
+{
+	switch(priority)
+	{
+		case CHIAKI_THREAD_PRIORITY_DEFAULT:
+			return "default";
+		case CHIAKI_THREAD_PRIORITY_LOW:
+			return "low";
+		case CHIAKI_THREAD_PRIORITY_HIGH:
+			return "high";
+		case CHIAKI_THREAD_PRIORITY_REALTIME:
+			return "realtime";
+		default:
+			return "unknown";
+	}
+}
+
+static ChiakiErrorCode thread_attr_parse_cpus(uint64_t *cpu_affinity, const char *str)
+{
+	*cpu_affinity = 0;
+	while(true)
+	{
+		char *end;
+		unsigned long first = strtoul(str, &end, 10);
+		if(end == str)
+			return CHIAKI_ERR_INVALID_DATA;
+		unsigned long last = first;
+		str = end;
+		if(*str == '-')
+		{
+			str++;
+			last = strtoul(str, &end, 10);
+			if(end == str)
+				return CHIAKI_ERR_INVALID_DATA;
+			str = end;
+		}
+		if(last < first || last >= 64)
+			return CHIAKI_ERR_INVALID_DATA;
+		for(unsigned long i=first; i<=last; i++)
+			*cpu_affinity |= 1ull << i;
+		if(!*str)
+			return CHIAKI_ERR_SUCCESS;
+		if(*str != ',')
+			return CHIAKI_ERR_INVALID_DATA;
+		str++;
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_attr_parse(ChiakiThreadAttr *attr, const char *str)
+{
+	memset(attr, 0, sizeof(*attr));
+	size_t priority_len = strcspn(str, "=:");
+	bool found = false;
+	for(ChiakiThreadPriority priority=CHIAKI_THREAD_PRIORITY_DEFAULT; priority<=CHIAKI_THREAD_PRIORITY_REALTIME; priority++)
+	{
+		const char *name = chiaki_thread_priority_string(priority);
+		if(strlen(name) == priority_len && !strncmp(str, name, priority_len))
+		{
+			attr->priority = priority;
+			found = true;
+			break;
+		}
+	}
+	if(!found)
+		return CHIAKI_ERR_INVALID_DATA;
+	str += priority_len;
+
+	if(*str == '=')
+	{
+		if(attr->priority != CHIAKI_THREAD_PRIORITY_REALTIME)
+			return CHIAKI_ERR_INVALID_DATA;
+		str++;
+		char *end;
+		long realtime_priority = strtol(str, &end, 10);
+		if(end == str || realtime_priority <= 0 || realtime_priority > 99)
+			return CHIAKI_ERR_INVALID_DATA;
+		attr->realtime_priority = (int)realtime_priority;
+		str = end;
+	}
+
+	if(!*str)
+		return CHIAKI_ERR_SUCCESS;
+	if(*str != ':')
+		return CHIAKI_ERR_INVALID_DATA;
+	return thread_attr_parse_cpus(&attr->cpu_affinity, str + 1);
+}
+
 #if _WIN32
 static DWORD WINAPI win32_thread_func(LPVOID param)
 {
 	ChiakiThread *thread = (ChiakiThread *)param;
+	if(!chiaki_thread_attr_is_default(&thread->attr))
+		chiaki_thread_set_attr_current(&thread->attr, thread->log);
 	thread->ret = thread->func(thread->arg);
 	return 0;
 }
+#else
+static void *posix_thread_func(void *param)
+{
+	ChiakiThread *thread = param;
+	chiaki_thread_set_attr_current(&thread->attr, thread->log);
+	return thread->func(thread->arg);
+}
 #endif
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create(ChiakiThread *thread, ChiakiThreadFunc func, void *arg)
 {
-#if _WIN32
+	return chiaki_thread_create_attr(thread, func, arg, NULL, NULL);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_create_attr(ChiakiThread *thread, ChiakiThreadFunc func, void *arg, const ChiakiThreadAttr *attr, ChiakiLog *log)
+{
 	thread->func = func;
 	thread->arg = arg;
 	thread->ret = NULL;
+	if(attr)
+		thread->attr = *attr;
+	else
+		memset(&thread->attr, 0, sizeof(thread->attr));
+	thread->log = log;
+#if _WIN32
 	thread->thread = CreateThread(NULL, 0, win32_thread_func, thread, 0, 0);
 	if(!thread->thread)
 		return CHIAKI_ERR_THREAD;
 #else
-	int r = pthread_create(&thread->thread, NULL, func, arg);
+	// only go through posix_thread_func if there is something to apply, so threads
+	// created without attributes do not depend on thread staying in place
+	int r = chiaki_thread_attr_is_default(attr)
+		? pthread_create(&thread->thread, NULL, func, arg)
+		: pthread_create(&thread->thread, NULL, posix_thread_func, thread);
+	if(r != 0)
+		return CHIAKI_ERR_THREAD;
+#endif
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode thread_set_affinity_current(uint64_t cpu_affinity, ChiakiLog *log)
+{
+#if _WIN32
+	if(!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)cpu_affinity))
+	{
+		CHIAKI_LOGW(log, "Thread failed to set CPU affinity to 0x%llx", (unsigned long long)cpu_affinity);
+		return CHIAKI_ERR_THREAD;
+	}
+	return CHIAKI_ERR_SUCCESS;
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(unsigned int i=0; i<64 && i<CPU_SETSIZE; i++)
+	{
+		if(cpu_affinity & (1ull << i))
+			CPU_SET(i, &set);
+	}
+	int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if(r != 0)
+	{
+		CHIAKI_LOGW(log, "Thread failed to set CPU affinity to 0x%llx: %s", (unsigned long long)cpu_affinity, strerror(r));
+		return CHIAKI_ERR_THREAD;
+	}
+	return CHIAKI_ERR_SUCCESS;
+#else
+	CHIAKI_LOGW(log, "Thread CPU affinity is not supported on this platform");
+	return CHIAKI_ERR_THREAD;
+#endif
+}
+
+#ifndef _WIN32
+static ChiakiErrorCode thread_set_nice_current(bool high, ChiakiLog *log)
+{
+#ifdef __linux__
+	// on Linux, the nice value is per thread when given the tid
+	int nice = high ? THREAD_NICE_HIGH : THREAD_NICE_LOW;
+	if(setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) < 0)
+	{
+		CHIAKI_LOGW(log, "Thread failed to set nice value %d: %s", nice, strerror(errno));
+		return CHIAKI_ERR_THREAD;
+	}
+	return CHIAKI_ERR_SUCCESS;
+#else
+	struct sched_param param = { 0 };
+	int policy;
+	int r = pthread_getschedparam(pthread_self(), &policy, &param);
+	if(r == 0)
+	{
+		param.sched_priority = high ? sched_get_priority_max(policy) : sched_get_priority_min(policy);
+		r = pthread_setschedparam(pthread_self(), policy, &param);
+	}
 	if(r != 0)
+	{
+		CHIAKI_LOGW(log, "Thread failed to set scheduling priority: %s", strerror(r));
 		return CHIAKI_ERR_THREAD;
+	}
+	return CHIAKI_ERR_SUCCESS;
 #endif
+}
+#endif
+
+static ChiakiErrorCode thread_set_priority_current(const ChiakiThreadAttr *attr, ChiakiLog *log)
+{
+#if _WIN32
+	int priority;
+	switch(attr->priority)
+	{
+		case CHIAKI_THREAD_PRIORITY_LOW:
+			priority = THREAD_PRIORITY_BELOW_NORMAL;
+			break;
+		case CHIAKI_THREAD_PRIORITY_HIGH:
+			priority = THREAD_PRIORITY_HIGHEST;
+			break;
+		case CHIAKI_THREAD_PRIORITY_REALTIME:
+			priority = THREAD_PRIORITY_TIME_CRITICAL;
+			break;
+		default:
+			return CHIAKI_ERR_SUCCESS;
+	}
+	if(!SetThreadPriority(GetCurrentThread(), priority))
+	{
+		CHIAKI_LOGW(log, "Thread failed to set priority %s", chiaki_thread_priority_string(attr->priority));
+		return CHIAKI_ERR_THREAD;
+	}
 	return CHIAKI_ERR_SUCCESS;
+#else
+	switch(attr->priority)
+	{
+		case CHIAKI_THREAD_PRIORITY_LOW:
+			return thread_set_nice_current(false, log);
+		case CHIAKI_THREAD_PRIORITY_HIGH:
+			return thread_set_nice_current(true, log);
+		case CHIAKI_THREAD_PRIORITY_REALTIME:
+		{
+			int min = sched_get_priority_min(SCHED_FIFO);
+			int max = sched_get_priority_max(SCHED_FIFO);
+			struct sched_param param = { 0 };
+			param.sched_priority = attr->realtime_priority ? attr->realtime_priority : THREAD_REALTIME_PRIORITY_DEFAULT;
+			if(param.sched_priority < min)
+				param.sched_priority = min;
+			if(param.sched_priority > max)
+				param.sched_priority = max;
+			int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+			if(r == 0)
+				return CHIAKI_ERR_SUCCESS;
+			CHIAKI_LOGW(log, "Thread failed to switch to SCHED_FIFO with priority %d: %s, falling back to high priority",
+					param.sched_priority, strerror(r));
+			thread_set_nice_current(true, log);
+			return CHIAKI_ERR_THREAD;
+		}
+		default:
+			return CHIAKI_ERR_SUCCESS;
+	}
+#endif
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_attr_current(const ChiakiThreadAttr *attr, ChiakiLog *log)
+{
+	if(chiaki_thread_attr_is_default(attr))
+		return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	if(attr->cpu_affinity)
+	{
+		ChiakiErrorCode err = thread_set_affinity_current(attr->cpu_affinity, log);
+		if(err != CHIAKI_ERR_SUCCESS)
+			ret = err;
+	}
+	ChiakiErrorCode err = thread_set_priority_current(attr, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		ret = err;
+	return ret;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_join(ChiakiThread *thread, void **retval)
@@ -72,12 +335,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const
 {
 #if defined(_WIN32) && defined(CHIAKI_WINDOWS_THREAD_NAME)
 	int len = MultiByteToWideChar(CP_UTF8, 0, name, -1, NULL, 0);
-	wchar_t *wstr = calloc(sizeof(wchar_t), len+1);
+	wchar_t *wstr = chiaki_calloc(sizeof(wchar_t), len+1);
 	if(!wstr)
 		return CHIAKI_ERR_MEMORY;
 	MultiByteToWideChar(CP_UTF8, 0, name, -1, wstr, len);
 	SetThreadDescription(thread->thread, wstr);
-	free(wstr);
+	chiaki_free(wstr);
 #else
 #ifdef __GLIBC__
 	int r = pthread_setname_np(thread->thread, name);
@@ -91,8 +354,175 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_thread_set_name(ChiakiThread *thread, const
 }
 
 
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+typedef struct chiaki_mutex_profile_t
+{
+	const char *name;
+	atomic_uint_fast64_t acquisitions;
+	atomic_uint_fast64_t contended;
+	atomic_uint_fast64_t wait_ns;
+	atomic_uint_fast64_t hold_ns;
+	atomic_uint_fast64_t hold_max_ns;
+} ChiakiMutexProfile;
+
+// entries are only ever added, so pointers to them stay valid
+static ChiakiMutexProfile mutex_profiles[CHIAKI_MUTEX_PROFILE_NAMES_MAX];
+static atomic_size_t mutex_profiles_count;
+static atomic_flag mutex_profiles_lock = ATOMIC_FLAG_INIT;
+static ChiakiMutexProfile mutex_profile_overflow = { "other" }; // once mutex_profiles is full
+
+static ChiakiMutexProfile *mutex_profile_get(const char *name)
+{
+	while(atomic_flag_test_and_set_explicit(&mutex_profiles_lock, memory_order_acquire));
+	size_t count = atomic_load_explicit(&mutex_profiles_count, memory_order_relaxed);
+	ChiakiMutexProfile *profile = NULL;
+	for(size_t i=0; i<count; i++)
+	{
+		if(strcmp(mutex_profiles[i].name, name) == 0)
+		{
+			profile = &mutex_profiles[i];
+			break;
+		}
+	}
+	if(!profile && count < CHIAKI_MUTEX_PROFILE_NAMES_MAX)
+	{
+		profile = &mutex_profiles[count];
+		profile->name = name;
+		atomic_store_explicit(&mutex_profiles_count, count + 1, memory_order_release);
+	}
+	atomic_flag_clear_explicit(&mutex_profiles_lock, memory_order_release);
+	return profile ? profile : &mutex_profile_overflow;
+}
+
+static void mutex_profile_acquired(ChiakiMutex *mutex, uint64_t wait_ns, bool contended)
+{
+	if(mutex->depth++)
+		return;
+	mutex->locked_ns = chiaki_time_now_monotonic_ns();
+	ChiakiMutexProfile *profile = mutex->profile;
+	atomic_fetch_add_explicit(&profile->acquisitions, 1, memory_order_relaxed);
+	if(contended)
+	{
+		atomic_fetch_add_explicit(&profile->contended, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&profile->wait_ns, wait_ns, memory_order_relaxed);
+	}
+}
+
+static void mutex_profile_release(ChiakiMutex *mutex)
+{
+	if(--mutex->depth)
+		return;
+	uint64_t hold_ns = chiaki_time_now_monotonic_ns() - mutex->locked_ns;
+	ChiakiMutexProfile *profile = mutex->profile;
+	atomic_fetch_add_explicit(&profile->hold_ns, hold_ns, memory_order_relaxed);
+	uint_fast64_t hold_max_ns = atomic_load_explicit(&profile->hold_max_ns, memory_order_relaxed);
+	while(hold_ns > hold_max_ns
+			&& !atomic_compare_exchange_weak_explicit(&profile->hold_max_ns, &hold_max_ns, hold_ns, memory_order_relaxed, memory_order_relaxed));
+}
+
+static int mutex_profile_stats_cmp(const void *a, const void *b)
+{
+	const ChiakiMutexProfileStats *sa = a;
+	const ChiakiMutexProfileStats *sb = b;
+	if(sa->wait_ns != sb->wait_ns)
+		return sa->wait_ns > sb->wait_ns ? -1 : 1;
+	if(sa->hold_ns != sb->hold_ns)
+		return sa->hold_ns > sb->hold_ns ? -1 : 1;
+	return strcmp(sa->name, sb->name);
+}
+
+// a condition wait releases the mutex, so its hold time is split around the wait
+#define MUTEX_PROFILE_COND_WAIT_BEGIN(mutex) \
+	unsigned int profile_depth = (mutex)->depth; \
+	(mutex)->depth = 1; \
+	mutex_profile_release(mutex);
+#define MUTEX_PROFILE_COND_WAIT_END(mutex) do { \
+		mutex_profile_acquired((mutex), 0, false); \
+		(mutex)->depth = profile_depth; \
+	} while(0)
+#else
+#define MUTEX_PROFILE_COND_WAIT_BEGIN(mutex)
+#define MUTEX_PROFILE_COND_WAIT_END(mutex) do {} while(0)
+#endif
+
+CHIAKI_EXPORT void chiaki_mutex_set_name(ChiakiMutex *mutex, const char *name)
+{
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	mutex->profile = mutex_profile_get(name);
+#else
+	(void)mutex; (void)name;
+#endif
+}
+
+CHIAKI_EXPORT size_t chiaki_mutex_profile_get(ChiakiMutexProfileStats *stats, size_t stats_max)
+{
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	ChiakiMutexProfileStats all[CHIAKI_MUTEX_PROFILE_NAMES_MAX + 1];
+	size_t count = atomic_load_explicit(&mutex_profiles_count, memory_order_acquire);
+	for(size_t i=0; i<=count; i++)
+	{
+		ChiakiMutexProfile *profile = i < count ? &mutex_profiles[i] : &mutex_profile_overflow;
+		all[i].name = profile->name;
+		all[i].acquisitions = atomic_load_explicit(&profile->acquisitions, memory_order_relaxed);
+		all[i].contended = atomic_load_explicit(&profile->contended, memory_order_relaxed);
+		all[i].wait_ns = atomic_load_explicit(&profile->wait_ns, memory_order_relaxed);
+		all[i].hold_ns = atomic_load_explicit(&profile->hold_ns, memory_order_relaxed);
+		all[i].hold_max_ns = atomic_load_explicit(&profile->hold_max_ns, memory_order_relaxed);
+	}
+	if(all[count].acquisitions) // the overflow entry is only reported when used
+		count++;
+	qsort(all, count, sizeof(all[0]), mutex_profile_stats_cmp);
+	if(count > stats_max)
+		count = stats_max;
+	memcpy(stats, all, count * sizeof(all[0]));
+	return count;
+#else
+	(void)stats; (void)stats_max;
+	return 0;
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_mutex_profile_reset()
+{
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	size_t count = atomic_load_explicit(&mutex_profiles_count, memory_order_acquire);
+	for(size_t i=0; i<=count; i++)
+	{
+		ChiakiMutexProfile *profile = i < count ? &mutex_profiles[i] : &mutex_profile_overflow;
+		atomic_store_explicit(&profile->acquisitions, 0, memory_order_relaxed);
+		atomic_store_explicit(&profile->contended, 0, memory_order_relaxed);
+		atomic_store_explicit(&profile->wait_ns, 0, memory_order_relaxed);
+		atomic_store_explicit(&profile->hold_ns, 0, memory_order_relaxed);
+		atomic_store_explicit(&profile->hold_max_ns, 0, memory_order_relaxed);
+	}
+#endif
+}
+
+CHIAKI_EXPORT void chiaki_mutex_profile_log(ChiakiLog *log, ChiakiLogLevel level)
+{
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	ChiakiMutexProfileStats stats[CHIAKI_MUTEX_PROFILE_NAMES_MAX + 1];
+	size_t count = chiaki_mutex_profile_get(stats, CHIAKI_MUTEX_PROFILE_NAMES_MAX + 1);
+	chiaki_log(log, level, "Mutex Profile: %-24s %12s %10s %12s %12s %12s", "name", "acquisitions", "contended", "wait ms", "hold ms", "max hold us");
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiMutexProfileStats *s = &stats[i];
+		chiaki_log(log, level, "Mutex Profile: %-24s %12llu %10llu %12.3f %12.3f %12.3f",
+				s->name, (unsigned long long)s->acquisitions, (unsigned long long)s->contended,
+				(double)s->wait_ns / 1000000.0, (double)s->hold_ns / 1000000.0, (double)s->hold_max_ns / 1000.0);
+	}
+#else
+	chiaki_log(log, level, "Mutex Profile: not available, build with CHIAKI_LIB_ENABLE_MUTEX_PROFILING");
+#endif
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_init(ChiakiMutex *mutex, bool rec)
 {
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	mutex->profile = mutex_profile_get("unnamed");
+	mutex->depth = 0;
+	mutex->locked_ns = 0;
+#endif
 #if _WIN32
 	InitializeCriticalSection(&mutex->cs);
 	(void)rec; // always recursive
@@ -128,12 +558,39 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_fini(ChiakiMutex *mutex)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_lock(ChiakiMutex *mutex)
 {
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	// try first to tell contended acquisitions apart and only time those
+	bool contended = false;
+	uint64_t wait_ns = 0;
+#if _WIN32
+	if(!TryEnterCriticalSection(&mutex->cs))
+	{
+		contended = true;
+		uint64_t wait_start_ns = chiaki_time_now_monotonic_ns();
+		EnterCriticalSection(&mutex->cs);
+		wait_ns = chiaki_time_now_monotonic_ns() - wait_start_ns;
+	}
+#else
+	int r = pthread_mutex_trylock(&mutex->mutex);
+	if(r == EBUSY)
+	{
+		contended = true;
+		uint64_t wait_start_ns = chiaki_time_now_monotonic_ns();
+		r = pthread_mutex_lock(&mutex->mutex);
+		wait_ns = chiaki_time_now_monotonic_ns() - wait_start_ns;
+	}
+	if(r != 0)
+		return CHIAKI_ERR_UNKNOWN;
+#endif
+	mutex_profile_acquired(mutex, wait_ns, contended);
+#else
 #if _WIN32
 	EnterCriticalSection(&mutex->cs);
 #else
 	int r = pthread_mutex_lock(&mutex->mutex);
 	if(r != 0)
 		return CHIAKI_ERR_UNKNOWN;
+#endif
 #endif
 	return CHIAKI_ERR_SUCCESS;
 }
@@ -150,12 +607,18 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_trylock(ChiakiMutex *mutex)
 		return CHIAKI_ERR_MUTEX_LOCKED;
 	else if(r != 0)
 		return CHIAKI_ERR_UNKNOWN;
+#endif
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	mutex_profile_acquired(mutex, 0, false);
 #endif
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_mutex_unlock(ChiakiMutex *mutex)
 {
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	mutex_profile_release(mutex);
+#endif
 #if _WIN32
 	LeaveCriticalSection(&mutex->cs);
 #else
@@ -212,12 +675,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_fini(ChiakiCond *cond)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait(ChiakiCond *cond, ChiakiMutex *mutex)
 {
+	MUTEX_PROFILE_COND_WAIT_BEGIN(mutex);
 #if _WIN32
 	int r = SleepConditionVariableCS(&cond->cond, &mutex->cs, INFINITE);
+	MUTEX_PROFILE_COND_WAIT_END(mutex);
 	if(!r)
 		return CHIAKI_ERR_THREAD;
 #else
 	int r = pthread_cond_wait(&cond->cond, &mutex->mutex);
+	MUTEX_PROFILE_COND_WAIT_END(mutex);
 	if(r != 0)
 		return CHIAKI_ERR_UNKNOWN;
 #endif
@@ -227,7 +693,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait(ChiakiCond *cond, ChiakiMutex *mu
 #if !__APPLE__ && !defined(_WIN32)
 static ChiakiErrorCode chiaki_cond_timedwait_abs(ChiakiCond *cond, ChiakiMutex *mutex, struct timespec *timeout)
 {
+	MUTEX_PROFILE_COND_WAIT_BEGIN(mutex);
 	int r = pthread_cond_timedwait(&cond->cond, &mutex->mutex, timeout);
+	MUTEX_PROFILE_COND_WAIT_END(mutex);
 	if(r != 0)
 	{
 		if(r == ETIMEDOUT)
@@ -253,7 +721,9 @@ static void set_timeout(struct timespec *timeout, uint64_t ms_from_now)
 CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait(ChiakiCond *cond, ChiakiMutex *mutex, uint64_t timeout_ms)
 {
 #if _WIN32
+	MUTEX_PROFILE_COND_WAIT_BEGIN(mutex);
 	int r = SleepConditionVariableCS(&cond->cond, &mutex->cs, (DWORD)timeout_ms);
+	MUTEX_PROFILE_COND_WAIT_END(mutex);
 	if(!r)
 	{
 		if(GetLastError() == ERROR_TIMEOUT)
@@ -266,7 +736,9 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait(ChiakiCond *cond, ChiakiMute
 #if __APPLE__
 	timeout.tv_sec = (__darwin_time_t)(timeout_ms / 1000);
 	timeout.tv_nsec = (long)((timeout_ms % 1000) * 1000000);
+	MUTEX_PROFILE_COND_WAIT_BEGIN(mutex);
 	int r = pthread_cond_timedwait_relative_np(&cond->cond, &mutex->mutex, &timeout);
+	MUTEX_PROFILE_COND_WAIT_END(mutex);
 	if(r != 0)
 	{
 		if(r == ETIMEDOUT)
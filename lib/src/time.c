@@ -41,3 +41,21 @@ CHIAKI_EXPORT uint64_t chiaki_time_now_monotonic_us()
 	return time.tv_sec * 1000000 + time.tv_nsec / 1000;
 #endif
 }
+
+CHIAKI_EXPORT uint64_t chiaki_time_now_monotonic_ns()
+{
+#if _WIN32
+	LARGE_INTEGER f;
+	if(!QueryPerformanceFrequency(&f))
+		return 0;
+	LARGE_INTEGER v;
+	if(!QueryPerformanceCounter(&v))
+		return 0;
+	return (uint64_t)(v.QuadPart / f.QuadPart) * 1000000000
+		+ (uint64_t)(v.QuadPart % f.QuadPart) * 1000000000 / f.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
@@ -17,6 +17,7 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/h264.h>
 
 #include <string.h>
 
@@ -32,6 +33,7 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 
 	video_receiver->frame_index_cur = -1;
 	video_receiver->frame_index_prev = -1;
+	memset(&video_receiver->stats, 0, sizeof(video_receiver->stats));
 
 	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
 }
@@ -39,7 +41,7 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
-		free(video_receiver->profiles[i].header);
+		chiaki_free(video_receiver->profiles[i].header);
 	chiaki_frame_processor_fini(&video_receiver->frame_processor);
 }
 
@@ -61,6 +63,9 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 		CHIAKI_LOGI(video_receiver->log, "  %zu: %ux%u", i, profile->width, profile->height);
 		//chiaki_log_hexdump(video_receiver->log, CHIAKI_LOG_DEBUG, profile->header, profile->header_sz);
 	}
+
+	if(video_receiver->session->video_profiles_cb)
+		video_receiver->session->video_profiles_cb(video_receiver->profiles, video_receiver->profiles_count, video_receiver->session->video_profiles_cb_user);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
@@ -88,8 +93,15 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
+		if(video_receiver->session->video_profiles_cb)
+		{
+			if(video_receiver->session->video_profile_switch_cb)
+				video_receiver->session->video_profile_switch_cb((size_t)video_receiver->profile_cur, video_receiver->session->video_profiles_cb_user);
+		}
+		else if(video_receiver->session->video_sample_cb)
 			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, video_receiver->session->video_sample_cb_user);
+		if(video_receiver->session->recorder)
+			chiaki_recorder_video_profile(video_receiver->session->recorder, profile);
 	}
 
 	// next frame?
@@ -100,6 +112,10 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur)
 			chiaki_video_receiver_flush_frame(video_receiver);
 
+		// frames in between that did not arrive at all
+		if(video_receiver->frame_index_cur >= 0)
+			video_receiver->stats.frames_lost += (ChiakiSeqNum16)(frame_index - (ChiakiSeqNum16)video_receiver->frame_index_cur - 1);
+
 		ChiakiSeqNum16 next_frame_expected = (ChiakiSeqNum16)(video_receiver->frame_index_prev_complete + 1);
 		if(chiaki_seq_num_16_gt(frame_index, next_frame_expected)
 			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
@@ -138,10 +154,35 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		)
 	{
 		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d", (int)video_receiver->frame_index_cur);
+		video_receiver->stats.frames_lost++;
 		return CHIAKI_ERR_UNKNOWN;
 	}
 
-	// TODO: Error Concealment on CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED)
+	{
+		video_receiver->stats.frames_lost++;
+
+		// Only pass on the slices before the first missing unit,
+		// the decoder conceals the rest of the picture from the previous frame.
+		frame_size = chiaki_h264_trim_incomplete(frame, frame_size, video_receiver->frame_processor.flush_intact_size);
+		ChiakiH264FrameInfo info;
+		chiaki_h264_frame_inspect(frame, frame_size, &info);
+		if(!info.slices)
+		{
+			CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d, no intact slices", (int)video_receiver->frame_index_cur);
+			// done with this frame, so it is neither flushed nor counted as lost again
+			video_receiver->frame_index_prev = video_receiver->frame_index_cur;
+			return CHIAKI_ERR_UNKNOWN;
+		}
+		CHIAKI_LOGW(video_receiver->log, "Failed to complete frame %d, passing on %u intact slices", (int)video_receiver->frame_index_cur, info.slices);
+		video_receiver->stats.frames_concealed++;
+	}
+	else
+	{
+		video_receiver->stats.frames++;
+		if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+			video_receiver->stats.frames_fec_recovered++;
+	}
 
 	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 
@@ -155,6 +196,9 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 		}
 	}
 
+	if(video_receiver->session->recorder)
+		chiaki_recorder_video_frame(video_receiver->session->recorder, frame, frame_size);
+
 	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
 
 	if(succ)
@@ -0,0 +1,91 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <munit.h>
+
+#include <chiaki/allocator.h>
+#include <chiaki/reorderqueue.h>
+
+#include <string.h>
+
+static MunitResult test_instrumented(const MunitParameter params[], void *user)
+{
+	ChiakiInstrumentedAllocator ia;
+	ChiakiErrorCode err = chiaki_instrumented_allocator_init(&ia, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiAllocator allocator_prev;
+	chiaki_get_allocator(&allocator_prev);
+	ChiakiAllocator allocator;
+	chiaki_instrumented_allocator_get(&ia, &allocator);
+	chiaki_set_allocator(&allocator);
+
+	const char *site_loop = NULL;
+	for(int i=0; i<3; i++)
+	{
+		site_loop = CHIAKI_ALLOC_SITE;
+		void *ptr = chiaki_malloc_at(16, site_loop);
+		munit_assert_not_null(ptr);
+		chiaki_free(ptr);
+	}
+
+	// allocations inside the lib go through the allocator too
+	ChiakiReorderQueue queue;
+	err = chiaki_reorder_queue_init_16(&queue, 4, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_reorder_queue_fini(&queue);
+
+	void *aligned = chiaki_aligned_alloc(64, 100);
+	munit_assert_not_null(aligned);
+	munit_assert_uint64((uint64_t)(uintptr_t)aligned % 64, ==, 0);
+	memset(aligned, 0xff, 100);
+	chiaki_aligned_free(aligned);
+
+	chiaki_set_allocator(&allocator_prev);
+
+	munit_assert_uint64(chiaki_instrumented_allocator_get_allocs(&ia), ==, 5);
+	munit_assert_uint64(ia.frees, ==, 5);
+
+	ChiakiAllocSiteStats sites[4];
+	size_t sites_count = chiaki_instrumented_allocator_get_sites(&ia, sites, 4);
+	munit_assert_size(sites_count, ==, 3);
+	munit_assert_string_equal(sites[0].site, site_loop);
+	munit_assert_uint64(sites[0].allocs, ==, 3);
+	munit_assert_uint64(sites[0].bytes, ==, 48);
+	munit_assert_not_null(strstr(sites[1].site, "reorderqueue.c"));
+	munit_assert_uint64(sites[1].allocs, ==, 1);
+	munit_assert_uint64(sites[2].allocs, ==, 1);
+
+	chiaki_instrumented_allocator_reset(&ia);
+	munit_assert_uint64(chiaki_instrumented_allocator_get_allocs(&ia), ==, 0);
+	munit_assert_size(chiaki_instrumented_allocator_get_sites(&ia, sites, 4), ==, 0);
+
+	chiaki_instrumented_allocator_fini(&ia);
+	return MUNIT_OK;
+}
+
+MunitTest tests_allocator[] = {
+	{
+		"/instrumented",
+		test_instrumented,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,144 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/asynclog.h>
+
+#include <string.h>
+#include <stdio.h>
+
+#define MSGS_MAX 0x10
+
+typedef struct async_log_test_t
+{
+	char msgs[MSGS_MAX][0x100];
+	size_t lens[MSGS_MAX];
+	char tails[MSGS_MAX][0x10]; // end of long messages
+	ChiakiLogLevel levels[MSGS_MAX];
+	size_t msgs_count;
+} AsyncLogTest;
+
+static void async_log_test_cb(ChiakiLogLevel level, const char *msg, void *user)
+{
+	AsyncLogTest *test = user;
+	if(test->msgs_count >= MSGS_MAX)
+		return;
+	strncpy(test->msgs[test->msgs_count], msg, sizeof(test->msgs[0]) - 1);
+	test->lens[test->msgs_count] = strlen(msg);
+	size_t tail_len = test->lens[test->msgs_count] < sizeof(test->tails[0]) ? test->lens[test->msgs_count] : sizeof(test->tails[0]) - 1;
+	strcpy(test->tails[test->msgs_count], msg + test->lens[test->msgs_count] - tail_len);
+	test->levels[test->msgs_count] = level;
+	test->msgs_count++;
+}
+
+static MunitResult test_async_log_format(const MunitParameter params[], void *user)
+{
+	AsyncLogTest test = { 0 };
+	ChiakiAsyncLog alog;
+	ChiakiErrorCode err = chiaki_async_log_init(&alog, async_log_test_cb, &test, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiLog log;
+	chiaki_log_init_async(&log, CHIAKI_LOG_ALL & ~CHIAKI_LOG_VERBOSE, &alog);
+
+	char str[] = "volatile";
+	CHIAKI_LOGI(&log, "Plain message");
+	CHIAKI_LOGW(&log, "int %d, unsigned %#x, 64 bit %llu, size %zu", -42, 0xbeefu, (unsigned long long)0x123456789abcdefULL, (size_t)1337);
+	CHIAKI_LOGE(&log, "double %.3f, width %*d, str %s, %%", 3.14159, 5, 7, str);
+	CHIAKI_LOGV(&log, "Filtered");
+	memset(str, 0, sizeof(str)); // string arguments must have been copied
+	CHIAKI_LOGD(&log, "null %s, precision %.*s|", (const char *)NULL, 3, "abcdef");
+	// the precision bounds strings that are not NUL-terminated
+	char unterminated[4] = { 'w', 'x', 'y', 'z' };
+	CHIAKI_LOGI(&log, "fixed %.4s, star %.*s, negative %.*s|", unterminated, 2, unterminated, -1, "omitted");
+
+	chiaki_async_log_fini(&alog);
+
+	munit_assert_size(test.msgs_count, ==, 5);
+	munit_assert_string_equal(test.msgs[0], "Plain message");
+	munit_assert_int(test.levels[0], ==, CHIAKI_LOG_INFO);
+	munit_assert_string_equal(test.msgs[1], "int -42, unsigned 0xbeef, 64 bit 81985529216486895, size 1337");
+	munit_assert_int(test.levels[1], ==, CHIAKI_LOG_WARNING);
+	munit_assert_string_equal(test.msgs[2], "double 3.142, width     7, str volatile, %");
+	munit_assert_int(test.levels[2], ==, CHIAKI_LOG_ERROR);
+	munit_assert_string_equal(test.msgs[3], "null (null), precision abc|");
+	munit_assert_int(test.levels[3], ==, CHIAKI_LOG_DEBUG);
+	munit_assert_string_equal(test.msgs[4], "fixed wxyz, star wx, negative omitted|");
+
+	return MUNIT_OK;
+}
+
+static char long_fmt[0x800];
+
+static MunitResult test_async_log_long(const MunitParameter params[], void *user)
+{
+	AsyncLogTest test = { 0 };
+	ChiakiAsyncLog alog;
+	ChiakiErrorCode err = chiaki_async_log_init(&alog, async_log_test_cb, &test, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiLog log;
+	chiaki_log_init_async(&log, CHIAKI_LOG_ALL, &alog);
+
+	char long_str[0x400];
+	memset(long_str, 'a', sizeof(long_str) - 1);
+	long_str[sizeof(long_str) - 1] = '\0';
+	CHIAKI_LOGI(&log, "%s", long_str);
+	CHIAKI_LOGI(&log, "after");
+
+	// longer than the message buffer of the background thread
+	memset(long_fmt, 'b', sizeof(long_fmt) - 1);
+	CHIAKI_LOGI(&log, long_fmt);
+
+	chiaki_async_log_fini(&alog);
+
+	// too long for a slot, but must not be truncated
+	munit_assert_size(test.msgs_count, ==, 3);
+	munit_assert_size(test.lens[0], ==, sizeof(long_str) - 1);
+	munit_assert_size(strspn(test.msgs[0], "a"), ==, sizeof(test.msgs[0]) - 1);
+	munit_assert_string_equal(test.msgs[1], "after");
+
+	// truncated visibly
+	munit_assert_size(test.lens[2], <, sizeof(long_fmt) - 1);
+	munit_assert_size(strspn(test.msgs[2], "b"), ==, sizeof(test.msgs[0]) - 1);
+	munit_assert_size(test.lens[2], >, sizeof(test.msgs[0]) - 1);
+	munit_assert_string_equal(test.tails[2] + strlen(test.tails[2]) - 5, "[...]");
+
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_async_log[] = {
+	{
+		"/format",
+		test_async_log_format,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/long",
+		test_async_log_long,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,198 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <munit.h>
+
+#include <chiaki/datagram.h>
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#define DATAGRAMS_COUNT 40 // more than fit into a single sendmmsg() call
+
+static void fill_datagrams(uint8_t bufs[DATAGRAMS_COUNT][64], const uint8_t *buf_ptrs[DATAGRAMS_COUNT], size_t buf_sizes[DATAGRAMS_COUNT])
+{
+	for(size_t i=0; i<DATAGRAMS_COUNT; i++)
+	{
+		buf_sizes[i] = 1 + i % 64;
+		memset(bufs[i], (int)i, buf_sizes[i]);
+		buf_ptrs[i] = bufs[i];
+	}
+}
+
+static MunitResult test_socket_send_batch(const MunitParameter params[], void *user)
+{
+#ifdef _WIN32
+	return MUNIT_SKIP;
+#else
+	int socks[2];
+	if(socketpair(AF_UNIX, SOCK_DGRAM, 0, socks) < 0)
+		return MUNIT_SKIP;
+
+	static uint8_t bufs[DATAGRAMS_COUNT][64];
+	const uint8_t *buf_ptrs[DATAGRAMS_COUNT];
+	size_t buf_sizes[DATAGRAMS_COUNT];
+	fill_datagrams(bufs, buf_ptrs, buf_sizes);
+
+	ChiakiErrorCode err = chiaki_datagram_socket_send_batch(NULL, socks[0], buf_ptrs, buf_sizes, DATAGRAMS_COUNT);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// every datagram must arrive on its own and in order
+	for(size_t i=0; i<DATAGRAMS_COUNT; i++)
+	{
+		uint8_t buf[128];
+		ssize_t r = recv(socks[1], buf, sizeof(buf), 0);
+		munit_assert_ssize(r, ==, (ssize_t)buf_sizes[i]);
+		munit_assert_memory_equal(buf_sizes[i], buf, bufs[i]);
+	}
+
+	close(socks[0]);
+	close(socks[1]);
+	return MUNIT_OK;
+#endif
+}
+
+typedef struct send_record_t
+{
+	size_t calls;
+	size_t bytes;
+} SendRecord;
+
+static ChiakiErrorCode record_send(void *user, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	SendRecord *record = user;
+	munit_assert_size(buf_size, ==, 1 + record->calls % 64);
+	record->calls++;
+	record->bytes += buf_size;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static MunitResult test_io_send_batch_fallback(const MunitParameter params[], void *user)
+{
+	static uint8_t bufs[DATAGRAMS_COUNT][64];
+	const uint8_t *buf_ptrs[DATAGRAMS_COUNT];
+	size_t buf_sizes[DATAGRAMS_COUNT];
+	fill_datagrams(bufs, buf_ptrs, buf_sizes);
+
+	SendRecord record = { 0 };
+	ChiakiDatagramIO io = { 0 };
+	io.user = &record;
+	io.send_cb = record_send;
+	io.send_batch_cb = NULL;
+
+	ChiakiErrorCode err = chiaki_datagram_io_send_batch(&io, CHIAKI_INVALID_SOCKET, buf_ptrs, buf_sizes, DATAGRAMS_COUNT);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(record.calls, ==, DATAGRAMS_COUNT);
+
+	size_t bytes_expected = 0;
+	for(size_t i=0; i<DATAGRAMS_COUNT; i++)
+		bytes_expected += buf_sizes[i];
+	munit_assert_size(record.bytes, ==, bytes_expected);
+	return MUNIT_OK;
+}
+
+static MunitResult test_socket_drop_stats(const MunitParameter params[], void *user)
+{
+#ifdef _WIN32
+	return MUNIT_SKIP;
+#else
+	int sock_rx = socket(AF_INET, SOCK_DGRAM, 0);
+	int sock_tx = socket(AF_INET, SOCK_DGRAM, 0);
+	munit_assert_int(sock_rx, >=, 0);
+	munit_assert_int(sock_tx, >=, 0);
+	if(chiaki_datagram_socket_enable_drop_stats(sock_rx) != CHIAKI_ERR_SUCCESS)
+	{
+		close(sock_rx);
+		close(sock_tx);
+		return MUNIT_SKIP;
+	}
+
+	// smallest possible receive buffer, so that it overflows quickly
+	const int rcvbuf = 1;
+	setsockopt(sock_rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	munit_assert_int(bind(sock_rx, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+	socklen_t addr_len = sizeof(addr);
+	munit_assert_int(getsockname(sock_rx, (struct sockaddr *)&addr, &addr_len), ==, 0);
+	munit_assert_int(connect(sock_tx, (struct sockaddr *)&addr, sizeof(addr)), ==, 0);
+
+	uint8_t buf[1024] = { 0 };
+	for(size_t i=0; i<256; i++)
+		chiaki_datagram_socket_send(NULL, sock_tx, buf, sizeof(buf));
+
+	ChiakiStopPipe stop_pipe;
+	munit_assert_int(chiaki_stop_pipe_init(&stop_pipe), ==, CHIAKI_ERR_SUCCESS);
+	ChiakiDatagramSocketStats stats = { 0 };
+	size_t buf_size = sizeof(buf);
+	ChiakiErrorCode err = chiaki_datagram_socket_recv(&stats, sock_rx, &stop_pipe, buf, &buf_size, 1000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(buf_size, ==, sizeof(buf));
+
+	// the count is attached to datagrams queued after the drops
+	chiaki_datagram_socket_send(NULL, sock_tx, buf, sizeof(buf));
+	while(!stats.kernel_drops)
+	{
+		buf_size = sizeof(buf);
+		err = chiaki_datagram_socket_recv(&stats, sock_rx, &stop_pipe, buf, &buf_size, 1000);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	chiaki_stop_pipe_fini(&stop_pipe);
+	close(sock_rx);
+	close(sock_tx);
+	return MUNIT_OK;
+#endif
+}
+
+MunitTest tests_datagram[] = {
+	{
+		"/socket_send_batch",
+		test_socket_send_batch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/io_send_batch_fallback",
+		test_io_send_batch_fallback,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/socket_drop_stats",
+		test_socket_drop_stats,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,290 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/discoveryservice.h>
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#include "test_log.h"
+
+static MunitResult test_probe_addrs_parse(const MunitParameter params[], void *user)
+{
+	struct sockaddr_storage *addrs;
+	size_t addrs_count;
+	ChiakiErrorCode err = chiaki_discovery_probe_addrs_parse("10.0.1.7, 10.0.2.77/24,192.168.0.4/31", &addrs, &addrs_count);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(addrs_count, ==, 1 + 254 + 2);
+
+	char buf[INET_ADDRSTRLEN];
+	const struct sockaddr_in *addr = (const struct sockaddr_in *)&addrs[0];
+	munit_assert_int(addr->sin_family, ==, AF_INET);
+	munit_assert_int(ntohs(addr->sin_port), ==, CHIAKI_DISCOVERY_PORT);
+	munit_assert_string_equal(inet_ntop(AF_INET, &addr->sin_addr, buf, sizeof(buf)), "10.0.1.7");
+	addr = (const struct sockaddr_in *)&addrs[1];
+	munit_assert_string_equal(inet_ntop(AF_INET, &addr->sin_addr, buf, sizeof(buf)), "10.0.2.1");
+	addr = (const struct sockaddr_in *)&addrs[254];
+	munit_assert_string_equal(inet_ntop(AF_INET, &addr->sin_addr, buf, sizeof(buf)), "10.0.2.254");
+	addr = (const struct sockaddr_in *)&addrs[255];
+	munit_assert_string_equal(inet_ntop(AF_INET, &addr->sin_addr, buf, sizeof(buf)), "192.168.0.4");
+	addr = (const struct sockaddr_in *)&addrs[256];
+	munit_assert_string_equal(inet_ntop(AF_INET, &addr->sin_addr, buf, sizeof(buf)), "192.168.0.5");
+	chiaki_free(addrs);
+
+	const char *invalid[] = { "", "10.0.1.7,", "10.0.1", "10.0.0.0/8", "10.0.0.0/33", "10.0.0.0/", "host" };
+	for(size_t i=0; i<sizeof(invalid) / sizeof(invalid[0]); i++)
+	{
+		err = chiaki_discovery_probe_addrs_parse(invalid[i], &addrs, &addrs_count);
+		munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+	}
+
+	return MUNIT_OK;
+}
+
+#ifndef _WIN32
+
+#define RESPONDERS_COUNT 6
+#define EVENT_TIMEOUT_MS 3000
+
+typedef struct responder_t
+{
+	unsigned int id;
+	chiaki_socket_t sock;
+	struct sockaddr_in addr;
+	ChiakiStopPipe stop_pipe;
+	ChiakiThread thread;
+	ChiakiMutex *mutex;
+	bool silent;
+	bool standby;
+} Responder;
+
+typedef struct host_events_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	unsigned int added[RESPONDERS_COUNT];
+	unsigned int updated[RESPONDERS_COUNT];
+	unsigned int removed[RESPONDERS_COUNT];
+	ChiakiDiscoveryHostState state[RESPONDERS_COUNT];
+	size_t hosts_count;
+} HostEvents;
+
+static void *responder_thread_func(void *user)
+{
+	Responder *responder = user;
+	while(chiaki_stop_pipe_select_single(&responder->stop_pipe, responder->sock, false, UINT64_MAX) == CHIAKI_ERR_SUCCESS)
+	{
+		char buf[512];
+		struct sockaddr_in client_addr;
+		socklen_t client_addr_size = sizeof(client_addr);
+		ssize_t n = recvfrom(responder->sock, buf, sizeof(buf), 0, (struct sockaddr *)&client_addr, &client_addr_size);
+		if(n <= 0 || strncmp(buf, "SRCH", 4) != 0)
+			continue;
+
+		chiaki_mutex_lock(responder->mutex);
+		bool silent = responder->silent;
+		bool standby = responder->standby;
+		chiaki_mutex_unlock(responder->mutex);
+		if(silent)
+			continue;
+
+		int len = snprintf(buf, sizeof(buf),
+				"HTTP/1.1 %s\n"
+				"host-id:TEST%04u\n"
+				"host-type:PS4\n"
+				"host-name:Test %u\n"
+				"host-request-port:997\n",
+				standby ? "620 Server Standby" : "200 Ok", responder->id, responder->id);
+		sendto(responder->sock, buf, (size_t)len + 1, 0, (struct sockaddr *)&client_addr, client_addr_size);
+	}
+	return NULL;
+}
+
+static void host_cb(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user)
+{
+	HostEvents *events = user;
+	unsigned int id;
+	munit_assert_int(sscanf(host->host_id, "TEST%u", &id), ==, 1);
+	munit_assert_uint(id, <, RESPONDERS_COUNT);
+	chiaki_mutex_lock(&events->mutex);
+	switch(event)
+	{
+		case CHIAKI_DISCOVERY_SERVICE_HOST_ADDED:
+			events->added[id]++;
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_UPDATED:
+			events->updated[id]++;
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED:
+			events->removed[id]++;
+			break;
+	}
+	events->state[id] = host->state;
+	chiaki_mutex_unlock(&events->mutex);
+	chiaki_cond_signal(&events->cond);
+}
+
+static void hosts_cb(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user)
+{
+	HostEvents *events = user;
+	chiaki_mutex_lock(&events->mutex);
+	events->hosts_count = hosts_count;
+	chiaki_mutex_unlock(&events->mutex);
+	chiaki_cond_signal(&events->cond);
+}
+
+static bool all_added(void *user)
+{
+	HostEvents *events = user;
+	for(size_t i=0; i<RESPONDERS_COUNT; i++)
+		if(!events->added[i])
+			return false;
+	return events->hosts_count == RESPONDERS_COUNT;
+}
+
+static bool host_2_standby(void *user)
+{
+	HostEvents *events = user;
+	return events->state[2] == CHIAKI_DISCOVERY_HOST_STATE_STANDBY;
+}
+
+static bool host_1_removed(void *user)
+{
+	HostEvents *events = user;
+	return events->removed[1] > 0 && events->hosts_count == RESPONDERS_COUNT - 1;
+}
+
+#endif
+
+static MunitResult test_host_events(const MunitParameter params[], void *user)
+{
+#ifdef _WIN32
+	return MUNIT_SKIP;
+#else
+	HostEvents events = { 0 };
+	ChiakiErrorCode err = chiaki_mutex_init(&events.mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_cond_init(&events.cond);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	Responder responders[RESPONDERS_COUNT];
+	struct sockaddr_storage probe_addrs[RESPONDERS_COUNT];
+	memset(probe_addrs, 0, sizeof(probe_addrs));
+	for(unsigned int i=0; i<RESPONDERS_COUNT; i++)
+	{
+		Responder *responder = &responders[i];
+		memset(responder, 0, sizeof(*responder));
+		responder->id = i;
+		responder->mutex = &events.mutex;
+		responder->sock = socket(AF_INET, SOCK_DGRAM, 0);
+		munit_assert_int(responder->sock, >=, 0);
+		responder->addr.sin_family = AF_INET;
+		responder->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		munit_assert_int(bind(responder->sock, (struct sockaddr *)&responder->addr, sizeof(responder->addr)), ==, 0);
+		socklen_t addr_size = sizeof(responder->addr);
+		munit_assert_int(getsockname(responder->sock, (struct sockaddr *)&responder->addr, &addr_size), ==, 0);
+		memcpy(&probe_addrs[i], &responder->addr, sizeof(responder->addr));
+		err = chiaki_stop_pipe_init(&responder->stop_pipe);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		err = chiaki_thread_create(&responder->thread, responder_thread_func, responder);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	ChiakiDiscoveryServiceOptions options = { 0 };
+	options.hosts_max = RESPONDERS_COUNT;
+	options.host_drop_pings = 3;
+	options.ping_ms = 10;
+	options.probe_addrs = probe_addrs;
+	options.probe_addrs_count = RESPONDERS_COUNT;
+	options.cb = hosts_cb;
+	options.host_cb = host_cb;
+	options.cb_user = &events;
+
+	ChiakiDiscoveryService service;
+	err = chiaki_discovery_service_init(&service, &options, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_mutex_lock(&events.mutex);
+	err = chiaki_cond_timedwait_pred(&events.cond, &events.mutex, EVENT_TIMEOUT_MS, all_added, &events);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// a changed host is only reported once
+	responders[2].standby = true;
+	err = chiaki_cond_timedwait_pred(&events.cond, &events.mutex, EVENT_TIMEOUT_MS, host_2_standby, &events);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint(events.updated[2], ==, 1);
+
+	// a silent host is removed and the others must still be found after it was moved out of the table
+	responders[1].silent = true;
+	err = chiaki_cond_timedwait_pred(&events.cond, &events.mutex, EVENT_TIMEOUT_MS, host_1_removed, &events);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&events.mutex);
+
+	usleep(options.ping_ms * 5 * 1000);
+
+	chiaki_discovery_service_fini(&service);
+
+	for(unsigned int i=0; i<RESPONDERS_COUNT; i++)
+	{
+		munit_assert_uint(events.added[i], ==, 1);
+		munit_assert_uint(events.removed[i], ==, i == 1 ? 1 : 0);
+		munit_assert_uint(events.updated[i], ==, i == 2 ? 1 : 0);
+	}
+
+	for(unsigned int i=0; i<RESPONDERS_COUNT; i++)
+	{
+		chiaki_stop_pipe_stop(&responders[i].stop_pipe);
+		chiaki_thread_join(&responders[i].thread, NULL);
+		chiaki_stop_pipe_fini(&responders[i].stop_pipe);
+		CHIAKI_SOCKET_CLOSE(responders[i].sock);
+	}
+
+	chiaki_cond_fini(&events.cond);
+	chiaki_mutex_fini(&events.mutex);
+	return MUNIT_OK;
+#endif
+}
+
+MunitTest tests_discovery_service[] = {
+	{
+		"/probe_addrs_parse",
+		test_probe_addrs_parse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/host_events",
+		test_host_events,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,174 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_CHIAKI_EMULATOR_H
+#define CHIAKI_CHIAKI_EMULATOR_H
+
+#include <chiaki/common.h>
+#include <chiaki/log.h>
+#include <chiaki/session.h>
+#include <chiaki/impairment.h>
+#include <chiaki/discoveryservice.h>
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_EMULATOR_MTU_DEFAULT 1454
+
+/**
+ * Configuration of the emulated console.
+ *
+ * The emulator listens on the same ports as a real console (9295 TCP, 9296 and 9297 UDP)
+ * on the given host, so a regular ChiakiSession can connect to it unchanged.
+ */
+typedef struct chiaki_emulator_config_t
+{
+	const char *host; // address to listen on, e.g. "127.0.0.1"
+	char regist_key[CHIAKI_SESSION_AUTH_SIZE]; // must match the client's ChiakiConnectInfo
+	uint8_t morning[0x10]; // must match the client's ChiakiConnectInfo
+
+	const char *video_file; // H.264 Annex B elementary stream or NULL to send synthetic frames
+	bool video_loop; // restart video_file from the beginning when it ends
+	unsigned int width;
+	unsigned int height;
+	unsigned int fps;
+	unsigned int bitrate; // kbit/s, only determines the frame size of synthetic video
+	unsigned int fec_percent; // fec units per frame relative to the source units
+	unsigned int mtu; // used for packetizing video and enforced as path MTU towards Senkusha
+	bool audio; // also send an audio stream
+	unsigned int data_burst; // data messages sent back to back every second while streaming, to exercise data acks
+
+	/**
+	 * Only used by chiaki_emulator_bench_run(), applied to the client's stream connection.
+	 */
+	ChiakiImpairmentConfig client_rx_impairment;
+	ChiakiImpairmentConfig client_tx_impairment;
+	bool client_senkusha_mtu_ladder; // see chiaki_session_set_senkusha_mtu_ladder()
+	uint64_t client_data_ack_delay_ms; // see chiaki_session_set_data_ack_delay()
+	unsigned int client_data_ack_chunks;
+	bool client_send_batch; // see chiaki_session_set_send_batch()
+	uint64_t client_send_batch_window_ms;
+	bool client_plain_io; // the client uses its socket directly, the impairments are ignored
+} ChiakiEmulatorConfig;
+
+CHIAKI_EXPORT void chiaki_emulator_config_default(ChiakiEmulatorConfig *config);
+
+typedef struct chiaki_emulator_stats_t
+{
+	uint64_t sessions; // stream connections that received STREAMINFOACK
+	uint64_t video_frames_sent;
+	uint64_t video_frames_skipped; // frames that could not be packetized
+	uint64_t video_packets_sent;
+	uint64_t video_bytes_sent; // frame payload only
+	uint64_t audio_packets_sent;
+	uint64_t corrupt_frame_reports;
+	uint64_t data_sent; // data messages on the stream connection
+	uint64_t data_acks_received; // data acks from the client on the stream connection
+	uint64_t data_acked_late; // data acked after the resend timeout, a console would have retransmitted it
+} ChiakiEmulatorStats;
+
+typedef struct chiaki_emulator_t ChiakiEmulator;
+
+/**
+ * Create the emulator and start listening.
+ *
+ * @return the emulator or NULL on failure
+ */
+CHIAKI_EXPORT ChiakiEmulator *chiaki_emulator_new(const ChiakiEmulatorConfig *config, ChiakiLog *log);
+
+/**
+ * Stop all servers and free the emulator.
+ */
+CHIAKI_EXPORT void chiaki_emulator_free(ChiakiEmulator *emulator);
+
+CHIAKI_EXPORT void chiaki_emulator_get_stats(ChiakiEmulator *emulator, ChiakiEmulatorStats *stats);
+
+
+typedef struct chiaki_emulator_bench_result_t
+{
+	ChiakiQuitReason quit_reason; // CHIAKI_QUIT_REASON_NONE if the session was still running at the end
+	uint64_t connect_us; // chiaki_session_start() until CHIAKI_EVENT_CONNECTED
+	ChiakiSessionStartupTimings startup;
+	uint32_t mtu_in; // determined by Senkusha
+	uint32_t mtu_out;
+	uint64_t rtt_us;
+	uint64_t first_frame_us; // chiaki_session_start() until the first complete video frame
+	uint64_t frames; // complete video frames received by the client
+	uint64_t bytes; // bytes of all received video frames
+	uint64_t duration_us; // first until last received frame
+	double fps;
+	double mbits;
+	ChiakiVideoReceiverStats video; // frames completed, recovered with FEC and lost on the client
+	ChiakiTakionRecvStats client_recv; // kernel drops are only available with client_plain_io
+	ChiakiTakionSendStats client_send;
+	ChiakiImpairmentStats client_rx_impairment;
+	ChiakiImpairmentStats client_tx_impairment;
+	ChiakiEmulatorStats server; // stats of the emulator at the end of the run
+} ChiakiEmulatorBenchResult;
+
+/**
+ * Start an emulator, connect a ChiakiSession to it over loopback and receive video for duration_ms.
+ *
+ * @return CHIAKI_ERR_SUCCESS if at least one frame was received and result has been filled
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_emulator_bench_run(const ChiakiEmulatorConfig *config, uint64_t duration_ms, ChiakiLog *log, ChiakiEmulatorBenchResult *result);
+
+
+/**
+ * Fleet of synthetic consoles that only answer discovery requests, each on its own UDP port.
+ */
+typedef struct chiaki_emulator_discovery_bench_config_t
+{
+	const char *host; // address the fleet listens on, must be IPv4
+	unsigned int hosts;
+	unsigned int drop_percent; // hosts that stop answering after all have been discovered
+	unsigned int change_percent; // hosts that switch to standby after all have been discovered
+	uint64_t ping_ms;
+	uint64_t host_drop_pings;
+} ChiakiEmulatorDiscoveryBenchConfig;
+
+CHIAKI_EXPORT void chiaki_emulator_discovery_bench_config_default(ChiakiEmulatorDiscoveryBenchConfig *config);
+
+typedef struct chiaki_emulator_discovery_bench_result_t
+{
+	uint64_t discover_us; // service start until all hosts have been added
+	uint64_t change_us; // fleet change until all dropped and changed hosts have been reported
+	uint64_t requests; // discovery requests received by the fleet
+	uint64_t added; // events of the host callback
+	uint64_t updated;
+	uint64_t removed;
+	uint64_t reports; // calls of the full state callback
+	ChiakiDiscoveryServiceStats service;
+} ChiakiEmulatorDiscoveryBenchResult;
+
+/**
+ * Start a fleet, discover it with a ChiakiDiscoveryService using unicast probes over loopback,
+ * then change part of the fleet and wait until the service has reported exactly these changes.
+ *
+ * @return CHIAKI_ERR_SUCCESS if every host has been reported as expected and result has been filled
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_emulator_discovery_bench_run(const ChiakiEmulatorDiscoveryBenchConfig *config, ChiakiLog *log, ChiakiEmulatorDiscoveryBenchResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CHIAKI_CHIAKI_EMULATOR_H
@@ -0,0 +1,209 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include "emulator.h"
+
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#define BENCH_CONNECT_TIMEOUT_MS 15000
+#define BENCH_FIRST_FRAME_TIMEOUT_MS 10000
+
+typedef struct bench_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	uint64_t start_us;
+	bool connected;
+	bool quit;
+	ChiakiQuitReason quit_reason;
+	bool header_received;
+	uint64_t connect_us;
+	ChiakiSessionStartupTimings startup;
+	uint64_t first_frame_us;
+	uint64_t last_frame_us;
+	uint64_t frames;
+	uint64_t bytes;
+} Bench;
+
+static void bench_event_cb(ChiakiEvent *event, void *user)
+{
+	Bench *bench = user;
+	chiaki_mutex_lock(&bench->mutex);
+	switch(event->type)
+	{
+		case CHIAKI_EVENT_CONNECTED:
+			bench->connected = true;
+			bench->connect_us = chiaki_time_now_monotonic_us() - bench->start_us;
+			bench->startup = event->connected.startup_timings;
+			break;
+		case CHIAKI_EVENT_QUIT:
+			bench->quit = true;
+			bench->quit_reason = event->quit.reason;
+			break;
+		default:
+			break;
+	}
+	chiaki_mutex_unlock(&bench->mutex);
+	chiaki_cond_signal(&bench->cond);
+}
+
+static bool bench_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	Bench *bench = user;
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	chiaki_mutex_lock(&bench->mutex);
+	if(!bench->header_received)
+	{
+		// the first sample is the video header from streaminfo
+		bench->header_received = true;
+		chiaki_mutex_unlock(&bench->mutex);
+		return true;
+	}
+	if(!bench->frames)
+	{
+		bench->first_frame_us = now_us;
+		chiaki_mutex_unlock(&bench->mutex);
+		chiaki_cond_signal(&bench->cond);
+		chiaki_mutex_lock(&bench->mutex);
+	}
+	bench->last_frame_us = now_us;
+	bench->frames++;
+	bench->bytes += buf_size;
+	chiaki_mutex_unlock(&bench->mutex);
+	return true;
+}
+
+static bool bench_check_connected(void *user)
+{
+	Bench *bench = user;
+	return bench->connected || bench->quit;
+}
+
+static bool bench_check_first_frame(void *user)
+{
+	Bench *bench = user;
+	return bench->frames || bench->quit;
+}
+
+static bool bench_check_quit(void *user)
+{
+	Bench *bench = user;
+	return bench->quit;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_emulator_bench_run(const ChiakiEmulatorConfig *config, uint64_t duration_ms, ChiakiLog *log, ChiakiEmulatorBenchResult *result)
+{
+	memset(result, 0, sizeof(*result));
+
+	Bench bench = { 0 };
+	ChiakiErrorCode err = chiaki_mutex_init(&bench.mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = chiaki_cond_init(&bench.cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	ChiakiEmulator *emulator = chiaki_emulator_new(config, log);
+	if(!emulator)
+	{
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_cond;
+	}
+
+	ChiakiConnectInfo connect_info = { 0 };
+	connect_info.host = config->host;
+	memcpy(connect_info.regist_key, config->regist_key, sizeof(connect_info.regist_key));
+	memcpy(connect_info.morning, config->morning, sizeof(connect_info.morning));
+	connect_info.video_profile.width = config->width;
+	connect_info.video_profile.height = config->height;
+	connect_info.video_profile.max_fps = config->fps;
+	connect_info.video_profile.bitrate = config->bitrate;
+
+	ChiakiImpairmentIO impairment_io;
+	err = chiaki_impairment_io_init(&impairment_io, &config->client_rx_impairment, &config->client_tx_impairment);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_emulator;
+
+	ChiakiSession session;
+	err = chiaki_session_init(&session, &connect_info, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_impairment_io;
+	chiaki_session_set_event_cb(&session, bench_event_cb, &bench);
+	chiaki_session_set_video_sample_cb(&session, bench_video_sample_cb, &bench);
+	if(!config->client_plain_io)
+		chiaki_session_set_stream_datagram_io(&session, &impairment_io.io);
+	chiaki_session_set_senkusha_mtu_ladder(&session, config->client_senkusha_mtu_ladder);
+	chiaki_session_set_data_ack_delay(&session, config->client_data_ack_delay_ms, config->client_data_ack_chunks);
+	chiaki_session_set_send_batch(&session, config->client_send_batch, config->client_send_batch_window_ms);
+
+	bench.start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_session_start(&session);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_session;
+
+	chiaki_mutex_lock(&bench.mutex);
+	chiaki_cond_timedwait_pred(&bench.cond, &bench.mutex, BENCH_CONNECT_TIMEOUT_MS, bench_check_connected, &bench);
+	if(bench.connected && !bench.quit)
+		chiaki_cond_timedwait_pred(&bench.cond, &bench.mutex, BENCH_FIRST_FRAME_TIMEOUT_MS, bench_check_first_frame, &bench);
+	if(bench.frames && !bench.quit)
+		chiaki_cond_timedwait_pred(&bench.cond, &bench.mutex, duration_ms, bench_check_quit, &bench);
+	chiaki_mutex_unlock(&bench.mutex);
+
+	chiaki_session_stop(&session);
+	chiaki_session_join(&session);
+	result->video = session.video_receiver_stats;
+	result->client_recv = session.stream_recv_stats;
+	result->client_send = session.stream_send_stats;
+	result->mtu_in = session.mtu_in;
+	result->mtu_out = session.mtu_out;
+	result->rtt_us = session.rtt_us;
+	chiaki_impairment_io_get_stats(&impairment_io, &result->client_rx_impairment, &result->client_tx_impairment);
+
+	chiaki_mutex_lock(&bench.mutex);
+	result->quit_reason = bench.quit && bench.quit_reason != CHIAKI_QUIT_REASON_STOPPED ? bench.quit_reason : CHIAKI_QUIT_REASON_NONE;
+	result->connect_us = bench.connect_us;
+	result->startup = bench.startup;
+	result->first_frame_us = bench.frames ? bench.first_frame_us - bench.start_us : 0;
+	result->frames = bench.frames;
+	result->bytes = bench.bytes;
+	result->duration_us = bench.frames ? bench.last_frame_us - bench.first_frame_us : 0;
+	if(result->duration_us)
+	{
+		// frames after the first one span the measured duration
+		result->fps = (double)(result->frames - 1) * 1000000.0 / (double)result->duration_us;
+		result->mbits = (double)result->bytes * 8.0 / (double)result->duration_us;
+	}
+	chiaki_mutex_unlock(&bench.mutex);
+
+	err = bench.frames ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_TIMEOUT;
+
+error_session:
+	chiaki_session_fini(&session);
+error_impairment_io:
+	chiaki_impairment_io_fini(&impairment_io);
+error_emulator:
+	chiaki_emulator_get_stats(emulator, &result->server);
+	chiaki_emulator_free(emulator);
+error_cond:
+	chiaki_cond_fini(&bench.cond);
+error_mutex:
+	chiaki_mutex_fini(&bench.mutex);
+	return err;
+}
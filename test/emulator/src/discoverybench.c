@@ -0,0 +1,378 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+
+#include <chiaki/time.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define poll WSAPoll
+typedef WSAPOLLFD DiscoveryFleetPollFd;
+#else
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+typedef struct pollfd DiscoveryFleetPollFd;
+#endif
+
+#define DISCOVERY_BENCH_POLL_MS 20
+#define DISCOVERY_BENCH_TIMEOUT_MS 15000
+
+typedef struct discovery_fleet_host_t
+{
+	bool silent;
+	bool standby;
+	bool added;
+	bool updated;
+	bool removed;
+} DiscoveryFleetHost;
+
+typedef struct discovery_fleet_t
+{
+	ChiakiLog *log;
+	unsigned int hosts_count;
+	DiscoveryFleetPollFd *fds;
+	struct sockaddr_storage *addrs;
+	ChiakiThread thread;
+
+	ChiakiMutex mutex; // protects everything below
+	ChiakiCond cond;
+	bool should_stop;
+	DiscoveryFleetHost *hosts;
+	uint64_t requests;
+	unsigned int added;
+	unsigned int updated;
+	unsigned int removed;
+	unsigned int expect_updated;
+	unsigned int expect_removed;
+	uint64_t reports;
+	uint64_t events_unexpected;
+} DiscoveryFleet;
+
+static void discovery_fleet_respond(DiscoveryFleet *fleet, unsigned int index)
+{
+	char buf[512];
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_size = sizeof(client_addr);
+	int n = recvfrom(fleet->fds[index].fd, buf, sizeof(buf), 0, (struct sockaddr *)&client_addr, &client_addr_size);
+	if(n < 4 || strncmp(buf, "SRCH", 4) != 0)
+		return;
+
+	chiaki_mutex_lock(&fleet->mutex);
+	fleet->requests++;
+	bool silent = fleet->hosts[index].silent;
+	bool standby = fleet->hosts[index].standby;
+	chiaki_mutex_unlock(&fleet->mutex);
+	if(silent)
+		return;
+
+	int len = snprintf(buf, sizeof(buf),
+			"HTTP/1.1 %s\n"
+			"host-id:FLEET%05u\n"
+			"host-type:PS4\n"
+			"host-name:Fleet %u\n"
+			"host-request-port:997\n"
+			"device-discovery-protocol-version:" CHIAKI_DISCOVERY_PROTOCOL_VERSION "\n"
+			"system-version:07020001\n",
+			standby ? "620 Server Standby" : "200 Ok", index, index);
+	sendto(fleet->fds[index].fd, buf, (size_t)len + 1, 0, (struct sockaddr *)&client_addr, client_addr_size);
+}
+
+static void *discovery_fleet_thread_func(void *user)
+{
+	DiscoveryFleet *fleet = user;
+	while(true)
+	{
+		chiaki_mutex_lock(&fleet->mutex);
+		bool should_stop = fleet->should_stop;
+		chiaki_mutex_unlock(&fleet->mutex);
+		if(should_stop)
+			break;
+
+		int r = poll(fleet->fds, fleet->hosts_count, DISCOVERY_BENCH_POLL_MS);
+		if(r < 0)
+		{
+			CHIAKI_LOGE(fleet->log, "Discovery Fleet failed to poll");
+			break;
+		}
+		for(unsigned int i=0; i<fleet->hosts_count && r > 0; i++)
+		{
+			if(!(fleet->fds[i].revents & POLLIN))
+				continue;
+			r--;
+			discovery_fleet_respond(fleet, i);
+		}
+	}
+	return NULL;
+}
+
+static void discovery_fleet_host_cb(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user)
+{
+	DiscoveryFleet *fleet = user;
+	unsigned int index;
+	if(sscanf(host->host_id, "FLEET%u", &index) != 1 || index >= fleet->hosts_count)
+	{
+		CHIAKI_LOGE(fleet->log, "Discovery Bench got event for unknown host %s", host->host_id);
+		return;
+	}
+
+	chiaki_mutex_lock(&fleet->mutex);
+	DiscoveryFleetHost *fleet_host = &fleet->hosts[index];
+	switch(event)
+	{
+		case CHIAKI_DISCOVERY_SERVICE_HOST_ADDED:
+			if(fleet_host->added)
+				fleet->events_unexpected++;
+			fleet_host->added = true;
+			fleet->added++;
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_UPDATED:
+			if(!fleet_host->standby || fleet_host->updated || host->state != CHIAKI_DISCOVERY_HOST_STATE_STANDBY)
+				fleet->events_unexpected++;
+			fleet_host->updated = true;
+			fleet->updated++;
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED:
+			if(!fleet_host->silent || fleet_host->removed)
+				fleet->events_unexpected++;
+			fleet_host->removed = true;
+			fleet->removed++;
+			break;
+	}
+	chiaki_mutex_unlock(&fleet->mutex);
+	chiaki_cond_signal(&fleet->cond);
+}
+
+static void discovery_fleet_hosts_cb(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user)
+{
+	DiscoveryFleet *fleet = user;
+	chiaki_mutex_lock(&fleet->mutex);
+	fleet->reports++;
+	chiaki_mutex_unlock(&fleet->mutex);
+}
+
+static bool discovery_fleet_check_added(void *user)
+{
+	DiscoveryFleet *fleet = user;
+	return fleet->added >= fleet->hosts_count;
+}
+
+static bool discovery_fleet_check_changed(void *user)
+{
+	DiscoveryFleet *fleet = user;
+	return fleet->updated >= fleet->expect_updated && fleet->removed >= fleet->expect_removed;
+}
+
+static bool discovery_fleet_check_unexpected(void *user)
+{
+	DiscoveryFleet *fleet = user;
+	return fleet->events_unexpected > 0;
+}
+
+static ChiakiErrorCode discovery_fleet_init(DiscoveryFleet *fleet, const char *host, unsigned int hosts_count, ChiakiLog *log)
+{
+	memset(fleet, 0, sizeof(*fleet));
+	fleet->log = log;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&fleet->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = chiaki_cond_init(&fleet->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = CHIAKI_ERR_MEMORY;
+	fleet->fds = chiaki_calloc(hosts_count, sizeof(DiscoveryFleetPollFd));
+	if(!fleet->fds)
+		goto error_cond;
+	fleet->addrs = chiaki_calloc(hosts_count, sizeof(struct sockaddr_storage));
+	if(!fleet->addrs)
+		goto error_fds;
+	fleet->hosts = chiaki_calloc(hosts_count, sizeof(DiscoveryFleetHost));
+	if(!fleet->hosts)
+		goto error_addrs;
+
+	struct sockaddr_in addr = { 0 };
+	addr.sin_family = AF_INET;
+	if(inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+	{
+		CHIAKI_LOGE(log, "Discovery Fleet needs an IPv4 address to listen on");
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto error_hosts;
+	}
+
+	// not with chiaki_emu_socket_bind() because SO_REUSEADDR could give multiple hosts the same port
+	err = CHIAKI_ERR_NETWORK;
+	for(; fleet->hosts_count<hosts_count; fleet->hosts_count++)
+	{
+		chiaki_socket_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		if(CHIAKI_SOCKET_IS_INVALID(sock))
+		{
+			CHIAKI_LOGE(log, "Discovery Fleet failed to create socket");
+			goto error_socks;
+		}
+		struct sockaddr_in *sock_addr = (struct sockaddr_in *)&fleet->addrs[fleet->hosts_count];
+		*sock_addr = addr;
+		socklen_t addr_size = sizeof(*sock_addr);
+		if(bind(sock, (struct sockaddr *)sock_addr, addr_size) < 0
+				|| getsockname(sock, (struct sockaddr *)sock_addr, &addr_size) < 0)
+		{
+			CHIAKI_LOGE(log, "Discovery Fleet failed to bind host %u: " CHIAKI_SOCKET_ERROR_FMT, fleet->hosts_count, CHIAKI_SOCKET_ERROR_VALUE);
+			CHIAKI_SOCKET_CLOSE(sock);
+			goto error_socks;
+		}
+		fleet->fds[fleet->hosts_count].fd = sock;
+		fleet->fds[fleet->hosts_count].events = POLLIN;
+	}
+
+	err = chiaki_thread_create(&fleet->thread, discovery_fleet_thread_func, fleet);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_socks;
+	chiaki_thread_set_name(&fleet->thread, "Chiaki Emu Discovery Fleet");
+
+	return CHIAKI_ERR_SUCCESS;
+error_socks:
+	for(unsigned int i=0; i<fleet->hosts_count; i++)
+		CHIAKI_SOCKET_CLOSE(fleet->fds[i].fd);
+error_hosts:
+	chiaki_free(fleet->hosts);
+error_addrs:
+	chiaki_free(fleet->addrs);
+error_fds:
+	chiaki_free(fleet->fds);
+error_cond:
+	chiaki_cond_fini(&fleet->cond);
+error_mutex:
+	chiaki_mutex_fini(&fleet->mutex);
+	return err;
+}
+
+static void discovery_fleet_fini(DiscoveryFleet *fleet)
+{
+	chiaki_mutex_lock(&fleet->mutex);
+	fleet->should_stop = true;
+	chiaki_mutex_unlock(&fleet->mutex);
+	chiaki_thread_join(&fleet->thread, NULL);
+	for(unsigned int i=0; i<fleet->hosts_count; i++)
+		CHIAKI_SOCKET_CLOSE(fleet->fds[i].fd);
+	chiaki_free(fleet->hosts);
+	chiaki_free(fleet->addrs);
+	chiaki_free(fleet->fds);
+	chiaki_cond_fini(&fleet->cond);
+	chiaki_mutex_fini(&fleet->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_emulator_discovery_bench_config_default(ChiakiEmulatorDiscoveryBenchConfig *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->host = "127.0.0.1";
+	config->hosts = 256;
+	config->drop_percent = 10;
+	config->change_percent = 10;
+	config->ping_ms = 100;
+	config->host_drop_pings = 3;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_emulator_discovery_bench_run(const ChiakiEmulatorDiscoveryBenchConfig *config, ChiakiLog *log, ChiakiEmulatorDiscoveryBenchResult *result)
+{
+	memset(result, 0, sizeof(*result));
+	if(!config->hosts || config->drop_percent + config->change_percent > 100)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	DiscoveryFleet fleet;
+	ChiakiErrorCode err = discovery_fleet_init(&fleet, config->host, config->hosts, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	ChiakiDiscoveryServiceOptions options = { 0 };
+	options.hosts_max = config->hosts;
+	options.host_drop_pings = config->host_drop_pings;
+	options.ping_ms = config->ping_ms;
+	options.probe_addrs = fleet.addrs;
+	options.probe_addrs_count = config->hosts;
+	options.cb = discovery_fleet_hosts_cb;
+	options.host_cb = discovery_fleet_host_cb;
+	options.cb_user = &fleet;
+
+	ChiakiDiscoveryService service;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	err = chiaki_discovery_service_init(&service, &options, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_fleet;
+
+	chiaki_mutex_lock(&fleet.mutex);
+	err = chiaki_cond_timedwait_pred(&fleet.cond, &fleet.mutex, DISCOVERY_BENCH_TIMEOUT_MS, discovery_fleet_check_added, &fleet);
+	if(err == CHIAKI_ERR_SUCCESS)
+	{
+		result->discover_us = chiaki_time_now_monotonic_us() - start_us;
+
+		// the first hosts fall silent, the ones after them go to standby
+		fleet.expect_removed = config->hosts * config->drop_percent / 100;
+		fleet.expect_updated = config->hosts * config->change_percent / 100;
+		for(unsigned int i=0; i<fleet.expect_removed; i++)
+			fleet.hosts[i].silent = true;
+		for(unsigned int i=fleet.expect_removed; i<fleet.expect_removed + fleet.expect_updated; i++)
+			fleet.hosts[i].standby = true;
+
+		start_us = chiaki_time_now_monotonic_us();
+		err = chiaki_cond_timedwait_pred(&fleet.cond, &fleet.mutex, DISCOVERY_BENCH_TIMEOUT_MS, discovery_fleet_check_changed, &fleet);
+		if(err == CHIAKI_ERR_SUCCESS)
+			result->change_us = chiaki_time_now_monotonic_us() - start_us;
+		else
+			CHIAKI_LOGE(log, "Discovery Bench timed out waiting for %u removed and %u updated hosts, got %u and %u",
+					fleet.expect_removed, fleet.expect_updated, fleet.removed, fleet.updated);
+	}
+	else
+		CHIAKI_LOGE(log, "Discovery Bench timed out after discovering %u of %u hosts", fleet.added, config->hosts);
+	chiaki_mutex_unlock(&fleet.mutex);
+
+	if(err == CHIAKI_ERR_SUCCESS)
+	{
+		// give the service a few more pings to report anything it should not
+		chiaki_mutex_lock(&fleet.mutex);
+		chiaki_cond_timedwait_pred(&fleet.cond, &fleet.mutex, config->ping_ms * (config->host_drop_pings + 2), discovery_fleet_check_unexpected, &fleet);
+		chiaki_mutex_unlock(&fleet.mutex);
+	}
+
+	chiaki_discovery_service_get_stats(&service, &result->service);
+	chiaki_discovery_service_fini(&service);
+
+	chiaki_mutex_lock(&fleet.mutex);
+	result->requests = fleet.requests;
+	result->added = fleet.added;
+	result->updated = fleet.updated;
+	result->removed = fleet.removed;
+	result->reports = fleet.reports;
+	if(err == CHIAKI_ERR_SUCCESS && (fleet.events_unexpected
+			|| fleet.added != config->hosts
+			|| fleet.removed != fleet.expect_removed
+			|| fleet.updated != fleet.expect_updated))
+	{
+		CHIAKI_LOGE(log, "Discovery Bench expected %u added, %u removed and %u updated hosts, got %u, %u and %u with %llu unexpected events",
+				config->hosts, fleet.expect_removed, fleet.expect_updated,
+				fleet.added, fleet.removed, fleet.updated, (unsigned long long)fleet.events_unexpected);
+		err = CHIAKI_ERR_UNKNOWN;
+	}
+	chiaki_mutex_unlock(&fleet.mutex);
+
+error_fleet:
+	discovery_fleet_fini(&fleet);
+	return err;
+}
@@ -0,0 +1,182 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <netdb.h>
+#endif
+
+CHIAKI_EXPORT void chiaki_emulator_config_default(ChiakiEmulatorConfig *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->host = "127.0.0.1";
+	memcpy(config->regist_key, "emulator", 8);
+	for(size_t i=0; i<sizeof(config->morning); i++)
+		config->morning[i] = (uint8_t)i;
+	config->width = 1280;
+	config->height = 720;
+	config->fps = 60;
+	config->bitrate = 10000;
+	config->fec_percent = 5;
+	config->mtu = CHIAKI_EMULATOR_MTU_DEFAULT;
+	config->audio = true;
+}
+
+ChiakiErrorCode chiaki_emu_socket_bind(ChiakiLog *log, const char *host, uint16_t port, bool tcp, chiaki_socket_t *sock_out)
+{
+	struct addrinfo hints = { 0 };
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_socktype = tcp ? SOCK_STREAM : SOCK_DGRAM;
+	struct addrinfo *addrinfos;
+	int r = getaddrinfo(host, NULL, &hints, &addrinfos);
+	if(r != 0 || !addrinfos)
+	{
+		CHIAKI_LOGE(log, "Emulator failed to getaddrinfo for %s", host);
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	struct sockaddr_storage addr;
+	size_t addr_len = addrinfos->ai_addrlen;
+	if(addr_len > sizeof(addr))
+		addr_len = sizeof(addr);
+	memcpy(&addr, addrinfos->ai_addr, addr_len);
+	freeaddrinfo(addrinfos);
+	if(set_port((struct sockaddr *)&addr, htons(port)) != CHIAKI_ERR_SUCCESS)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	chiaki_socket_t sock = socket(addr.ss_family, tcp ? SOCK_STREAM : SOCK_DGRAM, tcp ? IPPROTO_TCP : IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(sock))
+	{
+		CHIAKI_LOGE(log, "Emulator failed to create socket");
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	const int reuse = 1;
+	r = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *)&reuse, sizeof(reuse));
+	if(r < 0)
+		CHIAKI_LOGW(log, "Emulator failed to setsockopt SO_REUSEADDR");
+
+	r = bind(sock, (struct sockaddr *)&addr, (socklen_t)addr_len);
+	if(r < 0)
+	{
+		CHIAKI_LOGE(log, "Emulator failed to bind to %s:%u: " CHIAKI_SOCKET_ERROR_FMT, host, (unsigned int)port, CHIAKI_SOCKET_ERROR_VALUE);
+		CHIAKI_SOCKET_CLOSE(sock);
+		return CHIAKI_ERR_NETWORK;
+	}
+
+	if(tcp)
+	{
+		r = listen(sock, 4);
+		if(r < 0)
+		{
+			CHIAKI_LOGE(log, "Emulator failed to listen on %s:%u", host, (unsigned int)port);
+			CHIAKI_SOCKET_CLOSE(sock);
+			return CHIAKI_ERR_NETWORK;
+		}
+	}
+
+	*sock_out = sock;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiEmulator *chiaki_emulator_new(const ChiakiEmulatorConfig *config, ChiakiLog *log)
+{
+	if(!config->host || !config->fps || config->mtu < 0x100 || config->mtu > CHIAKI_EMULATOR_MTU_DEFAULT)
+	{
+		CHIAKI_LOGE(log, "Emulator config is invalid");
+		return NULL;
+	}
+
+	ChiakiEmulator *emulator = calloc(1, sizeof(ChiakiEmulator));
+	if(!emulator)
+		return NULL;
+	emulator->log = log;
+	emulator->config = *config;
+	emulator->config.host = strdup(config->host);
+	if(!emulator->config.host)
+		goto error;
+	if(config->video_file)
+	{
+		emulator->config.video_file = strdup(config->video_file);
+		if(!emulator->config.video_file)
+			goto error_host;
+	}
+
+	ChiakiErrorCode err = chiaki_mutex_init(&emulator->state_mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_video_file;
+
+	err = chiaki_emu_stream_server_start(emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_state_mutex;
+
+	err = chiaki_emu_senkusha_server_start(emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stream;
+
+	err = chiaki_emu_session_server_start(emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_senkusha;
+
+	CHIAKI_LOGI(log, "Emulator listening on %s", config->host);
+	return emulator;
+
+error_senkusha:
+	chiaki_emu_senkusha_server_stop(emulator);
+error_stream:
+	chiaki_emu_stream_server_stop(emulator);
+error_state_mutex:
+	chiaki_mutex_fini(&emulator->state_mutex);
+error_video_file:
+	free((char *)emulator->config.video_file);
+error_host:
+	free((char *)emulator->config.host);
+error:
+	free(emulator);
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_emulator_free(ChiakiEmulator *emulator)
+{
+	if(!emulator)
+		return;
+	chiaki_emu_session_server_stop(emulator);
+	chiaki_emu_senkusha_server_stop(emulator);
+	chiaki_emu_stream_server_stop(emulator);
+	chiaki_mutex_fini(&emulator->state_mutex);
+	free((char *)emulator->config.video_file);
+	free((char *)emulator->config.host);
+	free(emulator);
+}
+
+CHIAKI_EXPORT void chiaki_emulator_get_stats(ChiakiEmulator *emulator, ChiakiEmulatorStats *stats)
+{
+	chiaki_mutex_lock(&emulator->state_mutex);
+	*stats = emulator->stats;
+	chiaki_mutex_unlock(&emulator->state_mutex);
+
+	chiaki_mutex_lock(&emulator->stream_takion.mutex);
+	stats->data_sent = emulator->stream_takion.data_sent;
+	stats->data_acks_received = emulator->stream_takion.data_acks_received;
+	stats->data_acked_late = emulator->stream_takion.data_acked_late;
+	chiaki_mutex_unlock(&emulator->stream_takion.mutex);
+}
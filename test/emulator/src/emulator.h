@@ -0,0 +1,198 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_EMULATOR_EMULATOR_H
+#define CHIAKI_EMULATOR_EMULATOR_H
+
+#include <chiaki-emulator.h>
+
+#include <chiaki/thread.h>
+#include <chiaki/stoppipe.h>
+#include <chiaki/sock.h>
+#include <chiaki/gkcrypt.h>
+#include <chiaki/rpcrypt.h>
+#include <chiaki/ecdh.h>
+#include <chiaki/seqnum.h>
+#include <chiaki/takion.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#endif
+
+#define CHIAKI_EMU_SESSION_PORT 9295
+#define CHIAKI_EMU_STREAM_PORT 9296
+#define CHIAKI_EMU_SENKUSHA_PORT 9297
+
+/**
+ * Create a socket bound to host:port.
+ *
+ * @param tcp if true, create a listening TCP socket, otherwise UDP
+ */
+ChiakiErrorCode chiaki_emu_socket_bind(ChiakiLog *log, const char *host, uint16_t port, bool tcp, chiaki_socket_t *sock_out);
+
+/**
+ * Console side of Takion.
+ *
+ * Answers the handshake of a single client, acks all received data and sends data and av packets.
+ * A new INIT from any address replaces the current client.
+ * MACs of received packets are not verified.
+ */
+typedef struct chiaki_emu_takion_t ChiakiEmuTakion;
+
+typedef enum {
+	CHIAKI_EMU_TAKION_EVENT_INIT, // a new client started the handshake, previous state should be dropped
+	CHIAKI_EMU_TAKION_EVENT_CONNECTED,
+	CHIAKI_EMU_TAKION_EVENT_DATA, // buf is the protobuf payload
+	CHIAKI_EMU_TAKION_EVENT_AV // buf is the full raw packet
+} ChiakiEmuTakionEventType;
+
+typedef struct chiaki_emu_takion_event_t
+{
+	ChiakiEmuTakionEventType type;
+	uint8_t *buf;
+	size_t buf_size;
+} ChiakiEmuTakionEvent;
+
+typedef void (*ChiakiEmuTakionCallback)(ChiakiEmuTakion *takion, ChiakiEmuTakionEvent *event, void *user);
+
+#define CHIAKI_EMU_TAKION_DATA_UNACKED_MAX 0x100
+
+struct chiaki_emu_takion_t
+{
+	ChiakiLog *log;
+	const char *name;
+	ChiakiEmuTakionCallback cb;
+	void *cb_user;
+
+	chiaki_socket_t sock;
+	ChiakiThread thread;
+	ChiakiStopPipe stop_pipe;
+
+	/**
+	 * Protects everything below, held while sending.
+	 */
+	ChiakiMutex mutex;
+	bool connected;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	uint32_t tag_local;
+	uint32_t tag_remote;
+	ChiakiSeqNum32 seq_num_local;
+	ChiakiGKCrypt *gkcrypt_local; // not owned, NULL means unencrypted
+	size_t key_pos_local;
+	ChiakiSeqNum16 video_packet_index;
+	ChiakiSeqNum16 audio_packet_index;
+	uint64_t data_sent;
+	uint64_t data_acks_received;
+	ChiakiSeqNum32 data_seq_num_unacked; // oldest data message not acked yet
+	uint64_t data_sent_ms[CHIAKI_EMU_TAKION_DATA_UNACKED_MAX]; // indexed by seq num
+	uint64_t data_acked_late;
+};
+
+ChiakiErrorCode chiaki_emu_takion_init(ChiakiEmuTakion *takion, ChiakiLog *log, const char *name, const char *host, uint16_t port, ChiakiEmuTakionCallback cb, void *cb_user);
+void chiaki_emu_takion_fini(ChiakiEmuTakion *takion);
+void chiaki_emu_takion_set_crypt(ChiakiEmuTakion *takion, ChiakiGKCrypt *gkcrypt_local);
+ChiakiErrorCode chiaki_emu_takion_send_raw(ChiakiEmuTakion *takion, const uint8_t *buf, size_t buf_size);
+ChiakiErrorCode chiaki_emu_takion_send_message_data(ChiakiEmuTakion *takion, uint16_t channel, const uint8_t *buf, size_t buf_size);
+
+/**
+ * Send a v9 av packet. packet_index and key_pos of packet are assigned here and data is encrypted in place.
+ */
+ChiakiErrorCode chiaki_emu_takion_send_av(ChiakiEmuTakion *takion, ChiakiTakionAVPacket *packet);
+
+
+/**
+ * Source of H.264 access units.
+ */
+typedef struct chiaki_emu_video_source_t
+{
+	uint8_t *buf;
+	size_t buf_size;
+	size_t *frames; // offsets into buf, frames_count + 1 entries
+	size_t frames_count;
+	size_t frame_cur;
+	bool loop;
+	uint8_t *header; // SPS and PPS, sent as the video header in streaminfo
+	size_t header_size;
+} ChiakiEmuVideoSource;
+
+/**
+ * Load an Annex B elementary stream and split it into access units.
+ */
+ChiakiErrorCode chiaki_emu_video_source_init_file(ChiakiEmuVideoSource *source, ChiakiLog *log, const char *filename, bool loop);
+
+/**
+ * Endless source of frames of frame_size bytes that are not decodable, but look like slices to the receiver.
+ */
+ChiakiErrorCode chiaki_emu_video_source_init_synthetic(ChiakiEmuVideoSource *source, size_t frame_size);
+
+void chiaki_emu_video_source_fini(ChiakiEmuVideoSource *source);
+
+/**
+ * @return false if the source has ended
+ */
+bool chiaki_emu_video_source_next(ChiakiEmuVideoSource *source, const uint8_t **frame, size_t *frame_size);
+
+
+struct chiaki_emulator_t
+{
+	ChiakiLog *log;
+	ChiakiEmulatorConfig config;
+
+	/**
+	 * Protects rpcrypt and stats.
+	 */
+	ChiakiMutex state_mutex;
+	ChiakiRPCrypt rpcrypt; // of the latest session request
+	bool rpcrypt_valid;
+	char session_id[CHIAKI_SESSION_ID_SIZE_MAX];
+	ChiakiEmulatorStats stats;
+
+	chiaki_socket_t session_sock;
+	ChiakiThread session_thread;
+	ChiakiStopPipe session_stop_pipe;
+
+	chiaki_socket_t ctrl_sock;
+	ChiakiThread ctrl_thread;
+	ChiakiStopPipe ctrl_stop_pipe;
+	bool ctrl_thread_running;
+
+	ChiakiEmuTakion senkusha_takion;
+
+	ChiakiEmuTakion stream_takion;
+	ChiakiECDH ecdh;
+	bool ecdh_initialized;
+	ChiakiGKCrypt *gkcrypt_local;
+	ChiakiEmuVideoSource video_source;
+	ChiakiThread av_thread;
+	ChiakiStopPipe av_stop_pipe;
+	bool av_thread_running;
+};
+
+ChiakiErrorCode chiaki_emu_session_server_start(ChiakiEmulator *emulator);
+void chiaki_emu_session_server_stop(ChiakiEmulator *emulator);
+
+ChiakiErrorCode chiaki_emu_senkusha_server_start(ChiakiEmulator *emulator);
+void chiaki_emu_senkusha_server_stop(ChiakiEmulator *emulator);
+
+ChiakiErrorCode chiaki_emu_stream_server_start(ChiakiEmulator *emulator);
+void chiaki_emu_stream_server_stop(ChiakiEmulator *emulator);
+
+#endif // CHIAKI_EMULATOR_EMULATOR_H
@@ -0,0 +1,478 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+
+#include <chiaki/random.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#define TAKION_PACKET_TYPE_CONTROL 0
+#define TAKION_PACKET_TYPE_VIDEO 2
+#define TAKION_PACKET_TYPE_AUDIO 3
+#define TAKION_PACKET_BASE_TYPE_MASK 0xf
+
+#define TAKION_CHUNK_TYPE_DATA 0
+#define TAKION_CHUNK_TYPE_INIT 1
+#define TAKION_CHUNK_TYPE_INIT_ACK 2
+#define TAKION_CHUNK_TYPE_DATA_ACK 3
+#define TAKION_CHUNK_TYPE_COOKIE 0xa
+#define TAKION_CHUNK_TYPE_COOKIE_ACK 0xb
+
+#define TAKION_MESSAGE_HEADER_SIZE 0x10
+#define TAKION_COOKIE_SIZE 0x20
+#define TAKION_A_RWND 0x19000
+#define TAKION_STREAMS 0x64
+
+#define EMU_TAKION_RECV_BUF_SIZE 0x1000
+
+// same as the client's own resend timeout, a console would have resent data not acked by then
+#define EMU_TAKION_DATA_RESEND_TIMEOUT_MS 200
+
+static void *emu_takion_thread_func(void *user);
+
+ChiakiErrorCode chiaki_emu_takion_init(ChiakiEmuTakion *takion, ChiakiLog *log, const char *name, const char *host, uint16_t port, ChiakiEmuTakionCallback cb, void *cb_user)
+{
+	memset(takion, 0, sizeof(*takion));
+	takion->log = log;
+	takion->name = name;
+	takion->cb = cb;
+	takion->cb_user = cb_user;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&takion->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_stop_pipe_init(&takion->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_emu_socket_bind(log, host, port, false, &takion->sock);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+
+	err = chiaki_thread_create(&takion->thread, emu_takion_thread_func, takion);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_sock;
+	chiaki_thread_set_name(&takion->thread, name);
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_sock:
+	CHIAKI_SOCKET_CLOSE(takion->sock);
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&takion->stop_pipe);
+error_mutex:
+	chiaki_mutex_fini(&takion->mutex);
+	return err;
+}
+
+void chiaki_emu_takion_fini(ChiakiEmuTakion *takion)
+{
+	chiaki_stop_pipe_stop(&takion->stop_pipe);
+	chiaki_thread_join(&takion->thread, NULL);
+	CHIAKI_SOCKET_CLOSE(takion->sock);
+	chiaki_stop_pipe_fini(&takion->stop_pipe);
+	chiaki_mutex_fini(&takion->mutex);
+}
+
+void chiaki_emu_takion_set_crypt(ChiakiEmuTakion *takion, ChiakiGKCrypt *gkcrypt_local)
+{
+	chiaki_mutex_lock(&takion->mutex);
+	takion->gkcrypt_local = gkcrypt_local;
+	takion->key_pos_local = 0;
+	chiaki_mutex_unlock(&takion->mutex);
+}
+
+/**
+ * takion->mutex must be locked.
+ */
+static ChiakiErrorCode emu_takion_send_locked(ChiakiEmuTakion *takion, uint8_t *buf, size_t buf_size)
+{
+	if(!takion->addr_len)
+		return CHIAKI_ERR_DISCONNECTED;
+
+	if(takion->gkcrypt_local)
+	{
+		uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		ChiakiErrorCode err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, mac, NULL, NULL);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+
+	int r = sendto(takion->sock, (const void *)buf, buf_size, 0, (struct sockaddr *)&takion->addr, takion->addr_len);
+	if(r < 0)
+		return CHIAKI_ERR_NETWORK;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+ChiakiErrorCode chiaki_emu_takion_send_raw(ChiakiEmuTakion *takion, const uint8_t *buf, size_t buf_size)
+{
+	chiaki_mutex_lock(&takion->mutex);
+	ChiakiErrorCode err = CHIAKI_ERR_DISCONNECTED;
+	if(takion->addr_len)
+	{
+		int r = sendto(takion->sock, (const void *)buf, buf_size, 0, (struct sockaddr *)&takion->addr, takion->addr_len);
+		err = r < 0 ? CHIAKI_ERR_NETWORK : CHIAKI_ERR_SUCCESS;
+	}
+	chiaki_mutex_unlock(&takion->mutex);
+	return err;
+}
+
+static void emu_takion_write_message_header(uint8_t *buf, uint32_t tag, uint32_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size)
+{
+	*((chiaki_unaligned_uint32_t *)(buf + 0)) = htonl(tag);
+	memset(buf + 4, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+	*((chiaki_unaligned_uint32_t *)(buf + 8)) = htonl(key_pos);
+	*(buf + 0xc) = chunk_type;
+	*(buf + 0xd) = chunk_flags;
+	*((chiaki_unaligned_uint16_t *)(buf + 0xe)) = htons((uint16_t)(payload_data_size + 4));
+}
+
+/**
+ * takion->mutex must be locked.
+ */
+static size_t emu_takion_advance_key_pos(ChiakiEmuTakion *takion, size_t data_size)
+{
+	if(!takion->gkcrypt_local)
+		return 0;
+	size_t key_pos = takion->key_pos_local;
+	takion->key_pos_local += data_size;
+	return key_pos;
+}
+
+ChiakiErrorCode chiaki_emu_takion_send_message_data(ChiakiEmuTakion *takion, uint16_t channel, const uint8_t *buf, size_t buf_size)
+{
+	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size;
+	uint8_t *packet_buf = malloc(packet_size);
+	if(!packet_buf)
+		return CHIAKI_ERR_MEMORY;
+
+	chiaki_mutex_lock(&takion->mutex);
+	packet_buf[0] = TAKION_PACKET_TYPE_CONTROL;
+	size_t key_pos = emu_takion_advance_key_pos(takion, buf_size);
+	emu_takion_write_message_header(packet_buf + 1, takion->tag_remote, (uint32_t)key_pos, TAKION_CHUNK_TYPE_DATA, 1, 9 + buf_size);
+
+	uint8_t *msg_payload = packet_buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
+	ChiakiSeqNum32 seq_num = takion->seq_num_local++;
+	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num);
+	takion->data_sent++;
+	if(seq_num - takion->data_seq_num_unacked >= CHIAKI_EMU_TAKION_DATA_UNACKED_MAX)
+	{
+		// too much unacked data to keep track of, the oldest would surely have been resent
+		takion->data_acked_late++;
+		takion->data_seq_num_unacked++;
+	}
+	takion->data_sent_ms[seq_num % CHIAKI_EMU_TAKION_DATA_UNACKED_MAX] = chiaki_time_now_monotonic_ms();
+	*((chiaki_unaligned_uint16_t *)(msg_payload + 4)) = htons(channel);
+	*((chiaki_unaligned_uint16_t *)(msg_payload + 6)) = 0;
+	*(msg_payload + 8) = CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF;
+	memcpy(msg_payload + 9, buf, buf_size);
+
+	ChiakiErrorCode err = emu_takion_send_locked(takion, packet_buf, packet_size);
+	chiaki_mutex_unlock(&takion->mutex);
+	free(packet_buf);
+
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "%s failed to send data packet: %s", takion->name, chiaki_error_string(err));
+	return err;
+}
+
+ChiakiErrorCode chiaki_emu_takion_send_av(ChiakiEmuTakion *takion, ChiakiTakionAVPacket *packet)
+{
+	uint8_t buf[EMU_TAKION_RECV_BUF_SIZE];
+
+	chiaki_mutex_lock(&takion->mutex);
+	packet->packet_index = packet->is_video ? takion->video_packet_index++ : takion->audio_packet_index++;
+	packet->key_pos = (uint32_t)emu_takion_advance_key_pos(takion, packet->data_size + CHIAKI_GKCRYPT_BLOCK_SIZE);
+
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v9_av_packet_format_header(buf, sizeof(buf), &header_size, packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+	if(header_size + packet->data_size > sizeof(buf))
+	{
+		err = CHIAKI_ERR_BUF_TOO_SMALL;
+		goto beach;
+	}
+
+	if(takion->gkcrypt_local)
+	{
+		err = chiaki_gkcrypt_encrypt(takion->gkcrypt_local, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto beach;
+	}
+	memcpy(buf + header_size, packet->data, packet->data_size);
+
+	err = emu_takion_send_locked(takion, buf, header_size + packet->data_size);
+beach:
+	chiaki_mutex_unlock(&takion->mutex);
+	return err;
+}
+
+/**
+ * takion->mutex must be locked.
+ */
+static ChiakiErrorCode emu_takion_send_data_ack(ChiakiEmuTakion *takion, uint32_t seq_num)
+{
+	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0xc];
+	buf[0] = TAKION_PACKET_TYPE_CONTROL;
+	size_t key_pos = emu_takion_advance_key_pos(takion, sizeof(buf));
+	emu_takion_write_message_header(buf + 1, takion->tag_remote, (uint32_t)key_pos, TAKION_CHUNK_TYPE_DATA_ACK, 0, 0xc);
+
+	uint8_t *data_ack = buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
+	*((chiaki_unaligned_uint32_t *)(data_ack + 0)) = htonl(seq_num);
+	*((chiaki_unaligned_uint32_t *)(data_ack + 4)) = htonl(TAKION_A_RWND);
+	*((chiaki_unaligned_uint16_t *)(data_ack + 8)) = 0;
+	*((chiaki_unaligned_uint16_t *)(data_ack + 0xa)) = 0;
+
+	return emu_takion_send_locked(takion, buf, sizeof(buf));
+}
+
+static void emu_takion_handle_init(ChiakiEmuTakion *takion, struct sockaddr_storage *addr, socklen_t addr_len, uint8_t *payload, size_t payload_size)
+{
+	if(payload_size != 0x10)
+	{
+		CHIAKI_LOGW(takion->log, "%s received init with invalid size", takion->name);
+		return;
+	}
+
+	uint32_t tag_remote = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+
+	chiaki_mutex_lock(&takion->mutex);
+	// the client retransmits its init until it gets an init ack, so answer it again with the same tag
+	bool retransmission = !takion->connected && takion->tag_local
+		&& tag_remote == takion->tag_remote
+		&& addr_len == takion->addr_len && memcmp(addr, &takion->addr, addr_len) == 0;
+	chiaki_mutex_unlock(&takion->mutex);
+
+	if(!retransmission)
+	{
+		// drop the previous client before anything is sent to the new one
+		ChiakiEmuTakionEvent event = { 0 };
+		event.type = CHIAKI_EMU_TAKION_EVENT_INIT;
+		takion->cb(takion, &event, takion->cb_user);
+	}
+
+	chiaki_mutex_lock(&takion->mutex);
+	if(retransmission)
+		goto send;
+	takion->connected = false;
+	takion->gkcrypt_local = NULL;
+	takion->key_pos_local = 0;
+	takion->video_packet_index = 0;
+	takion->audio_packet_index = 0;
+	memcpy(&takion->addr, addr, addr_len);
+	takion->addr_len = addr_len;
+	takion->tag_remote = tag_remote;
+	do
+		takion->tag_local = chiaki_random_32();
+	while(!takion->tag_local);
+	// the client expects data to start at our tag
+	takion->seq_num_local = takion->tag_local;
+	takion->data_seq_num_unacked = takion->seq_num_local;
+
+send:;
+	uint8_t buf[1 + TAKION_MESSAGE_HEADER_SIZE + 0x10 + TAKION_COOKIE_SIZE];
+	buf[0] = TAKION_PACKET_TYPE_CONTROL;
+	emu_takion_write_message_header(buf + 1, takion->tag_remote, 0, TAKION_CHUNK_TYPE_INIT_ACK, 0, 0x10 + TAKION_COOKIE_SIZE);
+	uint8_t *pl = buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
+	*((chiaki_unaligned_uint32_t *)(pl + 0)) = htonl(takion->tag_local);
+	*((chiaki_unaligned_uint32_t *)(pl + 4)) = htonl(TAKION_A_RWND);
+	*((chiaki_unaligned_uint16_t *)(pl + 8)) = htons(TAKION_STREAMS);
+	*((chiaki_unaligned_uint16_t *)(pl + 0xa)) = htons(TAKION_STREAMS);
+	*((chiaki_unaligned_uint32_t *)(pl + 0xc)) = htonl(takion->seq_num_local);
+	chiaki_random_bytes_crypt(pl + 0x10, TAKION_COOKIE_SIZE);
+
+	ChiakiErrorCode err = emu_takion_send_locked(takion, buf, sizeof(buf));
+	chiaki_mutex_unlock(&takion->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(takion->log, "%s failed to send init ack", takion->name);
+	else
+		CHIAKI_LOGI(takion->log, "%s received %sinit, sent init ack with tag %#x", takion->name,
+				retransmission ? "retransmitted " : "", (unsigned int)takion->tag_local);
+}
+
+/**
+ * Forget all data up to and including seq_num, counting what was acked after the resend timeout.
+ * takion->mutex must be locked.
+ */
+static void emu_takion_data_acked(ChiakiEmuTakion *takion, ChiakiSeqNum32 seq_num)
+{
+	// acks for data that was never sent are ignored
+	if(!chiaki_seq_num_32_lt(seq_num, takion->seq_num_local))
+		return;
+	uint64_t now_ms = chiaki_time_now_monotonic_ms();
+	while(!chiaki_seq_num_32_gt(takion->data_seq_num_unacked, seq_num))
+	{
+		uint64_t sent_ms = takion->data_sent_ms[takion->data_seq_num_unacked % CHIAKI_EMU_TAKION_DATA_UNACKED_MAX];
+		if(now_ms - sent_ms > EMU_TAKION_DATA_RESEND_TIMEOUT_MS)
+			takion->data_acked_late++;
+		takion->data_seq_num_unacked++;
+	}
+}
+
+static void emu_takion_handle_message(ChiakiEmuTakion *takion, uint8_t *buf, size_t buf_size)
+{
+	uint8_t *msg = buf + 1;
+	size_t msg_size = buf_size - 1;
+	if(msg_size < TAKION_MESSAGE_HEADER_SIZE)
+		return;
+
+	uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)msg));
+	uint8_t chunk_type = msg[0xc];
+	uint16_t payload_size = ntohs(*((chiaki_unaligned_uint16_t *)(msg + 0xe)));
+	if(msg_size != (size_t)payload_size + 0xc || payload_size < 4)
+	{
+		CHIAKI_LOGW(takion->log, "%s received message with invalid size", takion->name);
+		return;
+	}
+	payload_size -= 4;
+	uint8_t *payload = msg + TAKION_MESSAGE_HEADER_SIZE;
+
+	chiaki_mutex_lock(&takion->mutex);
+	bool tag_valid = tag == takion->tag_local;
+	chiaki_mutex_unlock(&takion->mutex);
+	if(!tag_valid)
+	{
+		CHIAKI_LOGW(takion->log, "%s received message with unknown tag", takion->name);
+		return;
+	}
+
+	switch(chunk_type)
+	{
+		case TAKION_CHUNK_TYPE_COOKIE:
+		{
+			uint8_t ack[1 + TAKION_MESSAGE_HEADER_SIZE];
+			ack[0] = TAKION_PACKET_TYPE_CONTROL;
+			chiaki_mutex_lock(&takion->mutex);
+			emu_takion_write_message_header(ack + 1, takion->tag_remote, 0, TAKION_CHUNK_TYPE_COOKIE_ACK, 0, 0);
+			emu_takion_send_locked(takion, ack, sizeof(ack));
+			bool was_connected = takion->connected;
+			takion->connected = true;
+			chiaki_mutex_unlock(&takion->mutex);
+			if(!was_connected)
+			{
+				CHIAKI_LOGI(takion->log, "%s connected", takion->name);
+				ChiakiEmuTakionEvent event = { 0 };
+				event.type = CHIAKI_EMU_TAKION_EVENT_CONNECTED;
+				takion->cb(takion, &event, takion->cb_user);
+			}
+			break;
+		}
+		case TAKION_CHUNK_TYPE_DATA:
+		{
+			if(payload_size < 9)
+				return;
+			uint32_t seq_num = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+			chiaki_mutex_lock(&takion->mutex);
+			emu_takion_send_data_ack(takion, seq_num);
+			chiaki_mutex_unlock(&takion->mutex);
+			ChiakiEmuTakionEvent event = { 0 };
+			event.type = CHIAKI_EMU_TAKION_EVENT_DATA;
+			event.buf = payload + 9;
+			event.buf_size = payload_size - 9;
+			takion->cb(takion, &event, takion->cb_user);
+			break;
+		}
+		case TAKION_CHUNK_TYPE_DATA_ACK:
+		{
+			if(payload_size < 4)
+			{
+				CHIAKI_LOGW(takion->log, "%s received data ack with invalid size", takion->name);
+				return;
+			}
+			ChiakiSeqNum32 seq_num = ntohl(*((chiaki_unaligned_uint32_t *)payload));
+			chiaki_mutex_lock(&takion->mutex);
+			takion->data_acks_received++;
+			emu_takion_data_acked(takion, seq_num);
+			chiaki_mutex_unlock(&takion->mutex);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static void *emu_takion_thread_func(void *user)
+{
+	ChiakiEmuTakion *takion = user;
+	uint8_t buf[EMU_TAKION_RECV_BUF_SIZE];
+
+	while(true)
+	{
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, UINT64_MAX);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
+
+		struct sockaddr_storage addr;
+		socklen_t addr_len = sizeof(addr);
+		int received = recvfrom(takion->sock, (void *)buf, sizeof(buf), 0, (struct sockaddr *)&addr, &addr_len);
+		if(received <= 0)
+		{
+			if(received < 0)
+				CHIAKI_LOGE(takion->log, "%s failed to recv: " CHIAKI_SOCKET_ERROR_FMT, takion->name, CHIAKI_SOCKET_ERROR_VALUE);
+			continue;
+		}
+		size_t buf_size = (size_t)received;
+
+		uint8_t base_type = buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
+		if(base_type == TAKION_PACKET_TYPE_CONTROL && buf_size >= 1 + TAKION_MESSAGE_HEADER_SIZE
+			&& buf[1 + 0xc] == TAKION_CHUNK_TYPE_INIT)
+		{
+			emu_takion_handle_init(takion, &addr, addr_len, buf + 1 + TAKION_MESSAGE_HEADER_SIZE, buf_size - 1 - TAKION_MESSAGE_HEADER_SIZE);
+			continue;
+		}
+
+		chiaki_mutex_lock(&takion->mutex);
+		bool from_client = takion->addr_len == addr_len && memcmp(&takion->addr, &addr, addr_len) == 0;
+		chiaki_mutex_unlock(&takion->mutex);
+		if(!from_client)
+			continue;
+
+		switch(base_type)
+		{
+			case TAKION_PACKET_TYPE_CONTROL:
+				emu_takion_handle_message(takion, buf, buf_size);
+				break;
+			case TAKION_PACKET_TYPE_VIDEO:
+			case TAKION_PACKET_TYPE_AUDIO:
+			{
+				ChiakiEmuTakionEvent event = { 0 };
+				event.type = CHIAKI_EMU_TAKION_EVENT_AV;
+				event.buf = buf;
+				event.buf_size = buf_size;
+				takion->cb(takion, &event, takion->cb_user);
+				break;
+			}
+			default:
+				// feedback, congestion, etc.
+				break;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,543 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chiaki-emulator.h>
+
+#include <argp.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+static const char doc[] =
+	"Offline PS4 emulator for Chiaki benchmarks"
+	"\v"
+	"By default, an emulated console is started on the given host and a Chiaki session "
+	"is connected to it for the given duration, then the results are printed.\n"
+	"With --serve, only the emulated console is started, so any other client can connect to it.\n"
+	"With --discovery-fleet, a fleet of consoles that only answer discovery requests is discovered instead.";
+
+#define ARG_KEY_HOST 'H'
+#define ARG_KEY_VIDEO 'v'
+#define ARG_KEY_LOOP 'l'
+#define ARG_KEY_WIDTH 'w'
+#define ARG_KEY_HEIGHT 'h'
+#define ARG_KEY_FPS 'f'
+#define ARG_KEY_BITRATE 'b'
+#define ARG_KEY_FEC 'F'
+#define ARG_KEY_MTU 'M'
+#define ARG_KEY_NO_AUDIO 'A'
+#define ARG_KEY_REGISTKEY 'r'
+#define ARG_KEY_MORNING 'm'
+#define ARG_KEY_SERVE 's'
+#define ARG_KEY_DURATION 'd'
+#define ARG_KEY_VERBOSE 'V'
+#define ARG_KEY_SEED 0x100
+#define ARG_KEY_LOSS 0x101
+#define ARG_KEY_BURST_START 0x102
+#define ARG_KEY_BURST_END 0x103
+#define ARG_KEY_DUPLICATE 0x104
+#define ARG_KEY_REORDER 0x105
+#define ARG_KEY_REORDER_DEPTH 0x106
+#define ARG_KEY_DELAY 0x107
+#define ARG_KEY_JITTER 0x108
+#define ARG_KEY_BANDWIDTH 0x109
+#define ARG_KEY_QUEUE 0x10a
+#define ARG_KEY_UPLINK_LOSS 0x10b
+#define ARG_KEY_MTU_LADDER 0x10c
+#define ARG_KEY_ACK_DELAY 0x10d
+#define ARG_KEY_DATA_BURST 0x10e
+#define ARG_KEY_SEND_BATCH 0x10f
+#define ARG_KEY_DISCOVERY_FLEET 0x110
+#define ARG_KEY_PLAIN_IO 0x111
+#define ARG_KEY_LOSS_FIRST 0x112
+#define ARG_KEY_UPLINK_LOSS_FIRST 0x113
+#define ARG_KEY_REORDER_HOLD 0x114
+
+static struct argp_option options[] = {
+	{ "host", ARG_KEY_HOST, "Host", 0, "Address to listen on (default 127.0.0.1)", 0 },
+	{ "video", ARG_KEY_VIDEO, "File", 0, "H.264 Annex B elementary stream to send instead of synthetic frames", 0 },
+	{ "loop", ARG_KEY_LOOP, NULL, 0, "Loop the video file", 0 },
+	{ "width", ARG_KEY_WIDTH, "Width", 0, "Video width", 0 },
+	{ "height", ARG_KEY_HEIGHT, "Height", 0, "Video height", 0 },
+	{ "fps", ARG_KEY_FPS, "FPS", 0, "Video frame rate", 0 },
+	{ "bitrate", ARG_KEY_BITRATE, "kbit/s", 0, "Video bitrate, determines the size of synthetic frames", 0 },
+	{ "fec", ARG_KEY_FEC, "Percent", 0, "FEC units per frame relative to source units", 0 },
+	{ "mtu", ARG_KEY_MTU, "MTU", 0, "MTU used for packetizing video and emulated path MTU for Senkusha", 0 },
+	{ "mtu-ladder", ARG_KEY_MTU_LADDER, NULL, 0, "Let the client probe many MTUs at once instead of a binary search", 0 },
+	{ "ack-delay", ARG_KEY_ACK_DELAY, "Milliseconds", 0, "Let the client ack data cumulatively after at most this delay", 0 },
+	{ "send-batch", ARG_KEY_SEND_BATCH, "Milliseconds", 0, "Let the client send datagrams in batches, collected for up to this time", 0 },
+	{ "plain-io", ARG_KEY_PLAIN_IO, NULL, 0, "Let the client use its socket directly, without any of the impairments below", 0 },
+	{ "data-burst", ARG_KEY_DATA_BURST, "Count", 0, "Send this many data messages back to back every second", 0 },
+	{ "no-audio", ARG_KEY_NO_AUDIO, NULL, 0, "Don't send audio", 0 },
+	{ "registkey", ARG_KEY_REGISTKEY, "RegistKey", 0, "Regist Key the client must use (default \"emulator\")", 0 },
+	{ "morning", ARG_KEY_MORNING, "Morning", 0, "Morning the client must use as 32 hex digits", 0 },
+	{ "serve", ARG_KEY_SERVE, NULL, 0, "Only run the emulated console until interrupted", 0 },
+	{ "duration", ARG_KEY_DURATION, "Seconds", 0, "Duration of the benchmark (default 10)", 0 },
+	{ "discovery-fleet", ARG_KEY_DISCOVERY_FLEET, "Count", 0, "Benchmark discovering this many synthetic consoles instead of streaming", 0 },
+	{ "verbose", ARG_KEY_VERBOSE, NULL, 0, "Verbose Logging", 0 },
+	{ NULL, 0, NULL, 0, "Network impairment of the stream received by the benchmark client:", 1 },
+	{ "seed", ARG_KEY_SEED, "Seed", 0, "Seed for random impairments, runs with the same seed drop the same packets", 1 },
+	{ "loss", ARG_KEY_LOSS, "Probability", 0, "Random packet loss (0.0 - 1.0)", 1 },
+	{ "loss-first", ARG_KEY_LOSS_FIRST, "Packets", 0, "Lose this many packets at the start, i.e. during the handshake", 1 },
+	{ "burst-start", ARG_KEY_BURST_START, "Probability", 0, "Probability of a loss burst starting at a packet", 1 },
+	{ "burst-end", ARG_KEY_BURST_END, "Probability", 0, "Probability of a loss burst ending at a packet", 1 },
+	{ "duplicate", ARG_KEY_DUPLICATE, "Probability", 0, "Packet duplication", 1 },
+	{ "reorder", ARG_KEY_REORDER, "Probability", 0, "Probability of a packet being held back", 1 },
+	{ "reorder-depth", ARG_KEY_REORDER_DEPTH, "Packets", 0, "Number of packets overtaking a held back packet (default 3)", 1 },
+	{ "reorder-hold", ARG_KEY_REORDER_HOLD, "ms", 0, "Max time a packet is held back if fewer packets follow (default 50)", 1 },
+	{ "delay", ARG_KEY_DELAY, "ms", 0, "Constant delay", 1 },
+	{ "jitter", ARG_KEY_JITTER, "ms", 0, "Additional random delay", 1 },
+	{ "bandwidth", ARG_KEY_BANDWIDTH, "kbit/s", 0, "Link capacity", 1 },
+	{ "queue", ARG_KEY_QUEUE, "ms", 0, "Max queueing delay at the link capacity before packets are dropped", 1 },
+	{ "uplink-loss", ARG_KEY_UPLINK_LOSS, "Probability", 0, "Random loss of packets sent by the client", 1 },
+	{ "uplink-loss-first", ARG_KEY_UPLINK_LOSS_FIRST, "Packets", 0, "Lose this many packets sent by the client at the start", 1 },
+	{ 0 }
+};
+
+typedef struct arguments
+{
+	ChiakiEmulatorConfig config;
+	ChiakiEmulatorDiscoveryBenchConfig discovery_config;
+	bool serve;
+	bool discovery;
+	unsigned long duration_s;
+	bool verbose;
+} Arguments;
+
+static bool parse_uint(const char *arg, unsigned int *out)
+{
+	char *end;
+	unsigned long v = strtoul(arg, &end, 0);
+	if(!*arg || *end)
+		return false;
+	*out = (unsigned int)v;
+	return true;
+}
+
+static bool parse_probability(const char *arg, double *out)
+{
+	char *end;
+	double v = strtod(arg, &end);
+	if(!*arg || *end || v < 0.0 || v > 1.0)
+		return false;
+	*out = v;
+	return true;
+}
+
+static bool parse_hex(const char *arg, uint8_t *out, size_t out_size)
+{
+	if(strlen(arg) != out_size * 2)
+		return false;
+	for(size_t i=0; i<out_size; i++)
+	{
+		char byte[3] = { arg[i*2], arg[i*2+1], '\0' };
+		char *end;
+		out[i] = (uint8_t)strtoul(byte, &end, 16);
+		if(*end)
+			return false;
+	}
+	return true;
+}
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+	ChiakiEmulatorConfig *config = &arguments->config;
+	ChiakiImpairmentConfig *rx = &config->client_rx_impairment;
+
+	switch(key)
+	{
+		case ARG_KEY_HOST:
+			config->host = arg;
+			break;
+		case ARG_KEY_VIDEO:
+			config->video_file = arg;
+			break;
+		case ARG_KEY_LOOP:
+			config->video_loop = true;
+			break;
+		case ARG_KEY_WIDTH:
+			if(!parse_uint(arg, &config->width))
+				argp_usage(state);
+			break;
+		case ARG_KEY_HEIGHT:
+			if(!parse_uint(arg, &config->height))
+				argp_usage(state);
+			break;
+		case ARG_KEY_FPS:
+			if(!parse_uint(arg, &config->fps) || !config->fps)
+				argp_usage(state);
+			break;
+		case ARG_KEY_BITRATE:
+			if(!parse_uint(arg, &config->bitrate))
+				argp_usage(state);
+			break;
+		case ARG_KEY_FEC:
+			if(!parse_uint(arg, &config->fec_percent))
+				argp_usage(state);
+			break;
+		case ARG_KEY_MTU:
+			if(!parse_uint(arg, &config->mtu))
+				argp_usage(state);
+			break;
+		case ARG_KEY_MTU_LADDER:
+			config->client_senkusha_mtu_ladder = true;
+			break;
+		case ARG_KEY_ACK_DELAY:
+		{
+			unsigned int delay_ms;
+			if(!parse_uint(arg, &delay_ms))
+				argp_usage(state);
+			config->client_data_ack_delay_ms = delay_ms;
+			break;
+		}
+		case ARG_KEY_SEND_BATCH:
+		{
+			unsigned int window_ms;
+			if(!parse_uint(arg, &window_ms))
+				argp_usage(state);
+			config->client_send_batch = true;
+			config->client_send_batch_window_ms = window_ms;
+			break;
+		}
+		case ARG_KEY_PLAIN_IO:
+			config->client_plain_io = true;
+			break;
+		case ARG_KEY_DATA_BURST:
+			if(!parse_uint(arg, &config->data_burst))
+				argp_usage(state);
+			break;
+		case ARG_KEY_NO_AUDIO:
+			config->audio = false;
+			break;
+		case ARG_KEY_REGISTKEY:
+			if(strlen(arg) > sizeof(config->regist_key))
+				argp_usage(state);
+			memset(config->regist_key, 0, sizeof(config->regist_key));
+			memcpy(config->regist_key, arg, strlen(arg));
+			break;
+		case ARG_KEY_MORNING:
+			if(!parse_hex(arg, config->morning, sizeof(config->morning)))
+				argp_usage(state);
+			break;
+		case ARG_KEY_SERVE:
+			arguments->serve = true;
+			break;
+		case ARG_KEY_DURATION:
+		{
+			unsigned int duration;
+			if(!parse_uint(arg, &duration) || !duration)
+				argp_usage(state);
+			arguments->duration_s = duration;
+			break;
+		}
+		case ARG_KEY_DISCOVERY_FLEET:
+			if(!parse_uint(arg, &arguments->discovery_config.hosts) || !arguments->discovery_config.hosts)
+				argp_usage(state);
+			arguments->discovery = true;
+			break;
+		case ARG_KEY_VERBOSE:
+			arguments->verbose = true;
+			break;
+		case ARG_KEY_SEED:
+		{
+			char *end;
+			rx->seed = strtoull(arg, &end, 0);
+			if(!*arg || *end)
+				argp_usage(state);
+			config->client_tx_impairment.seed = rx->seed + 1;
+			break;
+		}
+		case ARG_KEY_LOSS:
+			if(!parse_probability(arg, &rx->loss))
+				argp_usage(state);
+			break;
+		case ARG_KEY_BURST_START:
+			if(!parse_probability(arg, &rx->burst_loss_start))
+				argp_usage(state);
+			break;
+		case ARG_KEY_BURST_END:
+			if(!parse_probability(arg, &rx->burst_loss_end))
+				argp_usage(state);
+			break;
+		case ARG_KEY_DUPLICATE:
+			if(!parse_probability(arg, &rx->duplicate))
+				argp_usage(state);
+			break;
+		case ARG_KEY_REORDER:
+			if(!parse_probability(arg, &rx->reorder))
+				argp_usage(state);
+			break;
+		case ARG_KEY_REORDER_DEPTH:
+			if(!parse_uint(arg, &rx->reorder_depth))
+				argp_usage(state);
+			break;
+		case ARG_KEY_REORDER_HOLD:
+			if(!parse_uint(arg, &rx->reorder_hold_ms))
+				argp_usage(state);
+			break;
+		case ARG_KEY_DELAY:
+			if(!parse_uint(arg, &rx->delay_ms))
+				argp_usage(state);
+			break;
+		case ARG_KEY_JITTER:
+			if(!parse_uint(arg, &rx->jitter_ms))
+				argp_usage(state);
+			break;
+		case ARG_KEY_BANDWIDTH:
+			if(!parse_uint(arg, &rx->bandwidth_kbps))
+				argp_usage(state);
+			break;
+		case ARG_KEY_QUEUE:
+			if(!parse_uint(arg, &rx->queue_ms))
+				argp_usage(state);
+			break;
+		case ARG_KEY_UPLINK_LOSS:
+			if(!parse_probability(arg, &config->client_tx_impairment.loss))
+				argp_usage(state);
+			break;
+		case ARG_KEY_LOSS_FIRST:
+			if(!parse_uint(arg, &rx->loss_first))
+				argp_usage(state);
+			break;
+		case ARG_KEY_UPLINK_LOSS_FIRST:
+			if(!parse_uint(arg, &config->client_tx_impairment.loss_first))
+				argp_usage(state);
+			break;
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, NULL, doc, 0, 0, 0 };
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void sig_handler(int sig)
+{
+	interrupted = 1;
+}
+
+static void print_stats(const ChiakiEmulatorStats *stats)
+{
+	printf("Server:\n");
+	printf("  sessions:              %llu\n", (unsigned long long)stats->sessions);
+	printf("  video frames sent:     %llu\n", (unsigned long long)stats->video_frames_sent);
+	printf("  video frames skipped:  %llu\n", (unsigned long long)stats->video_frames_skipped);
+	printf("  video packets sent:    %llu\n", (unsigned long long)stats->video_packets_sent);
+	printf("  video bytes sent:      %llu\n", (unsigned long long)stats->video_bytes_sent);
+	printf("  audio packets sent:    %llu\n", (unsigned long long)stats->audio_packets_sent);
+	printf("  corrupt frame reports: %llu\n", (unsigned long long)stats->corrupt_frame_reports);
+	printf("  data messages sent:    %llu\n", (unsigned long long)stats->data_sent);
+	printf("  data acks received:    %llu\n", (unsigned long long)stats->data_acks_received);
+	printf("  data acked late:       %llu\n", (unsigned long long)stats->data_acked_late);
+}
+
+static void print_impairment_stats(const char *name, const ChiakiImpairmentStats *stats)
+{
+	if(!stats->packets)
+		return;
+	printf("Impairment (%s):\n", name);
+	printf("  packets:               %llu\n", (unsigned long long)stats->packets);
+	printf("  delivered:             %llu\n", (unsigned long long)stats->delivered);
+	printf("  lost at the start:     %llu\n", (unsigned long long)stats->lost_first);
+	printf("  lost randomly:         %llu\n", (unsigned long long)stats->lost_random);
+	printf("  lost in bursts:        %llu\n", (unsigned long long)stats->lost_burst);
+	printf("  dropped from queue:    %llu\n", (unsigned long long)stats->lost_queue);
+	printf("  duplicated:            %llu\n", (unsigned long long)stats->duplicated);
+	printf("  reordered:             %llu\n", (unsigned long long)stats->reordered);
+}
+
+static int serve(Arguments *arguments, ChiakiLog *log)
+{
+	ChiakiEmulator *emulator = chiaki_emulator_new(&arguments->config, log);
+	if(!emulator)
+		return 1;
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	CHIAKI_LOGI(log, "Emulator running on %s, press Ctrl+C to stop", arguments->config.host);
+	while(!interrupted)
+	{
+#ifdef _WIN32
+		Sleep(100);
+#else
+		usleep(100000);
+#endif
+	}
+
+	ChiakiEmulatorStats stats;
+	chiaki_emulator_get_stats(emulator, &stats);
+	chiaki_emulator_free(emulator);
+	print_stats(&stats);
+	return 0;
+}
+
+static int bench(Arguments *arguments, ChiakiLog *log)
+{
+	ChiakiEmulatorBenchResult result;
+	ChiakiErrorCode err = chiaki_emulator_bench_run(&arguments->config, (uint64_t)arguments->duration_s * 1000, log, &result);
+
+	printf("Client:\n");
+	printf("  quit reason:           %s\n", result.quit_reason == CHIAKI_QUIT_REASON_NONE ? "none" : chiaki_quit_reason_string(result.quit_reason));
+	printf("  connect:               %.3f ms\n", (double)result.connect_us / 1000.0);
+	printf("    session request:     %.3f ms\n", (double)result.startup.session_request_us / 1000.0);
+	printf("    ctrl:                %.3f ms\n", (double)result.startup.ctrl_us / 1000.0);
+	printf("    senkusha:            %.3f ms\n", (double)result.startup.senkusha_us / 1000.0);
+	printf("    preparation:         %.3f ms (waited %.3f ms)\n", (double)result.startup.prepare_us / 1000.0, (double)result.startup.prepare_wait_us / 1000.0);
+	printf("    stream connection:   %.3f ms\n", (double)result.startup.stream_connection_us / 1000.0);
+	printf("  mtu in:                %u\n", (unsigned int)result.mtu_in);
+	printf("  mtu out:               %u\n", (unsigned int)result.mtu_out);
+	printf("  rtt:                   %.3f ms\n", (double)result.rtt_us / 1000.0);
+	printf("  first frame:           %.3f ms\n", (double)result.first_frame_us / 1000.0);
+	printf("  frames received:       %llu\n", (unsigned long long)result.frames);
+	printf("  bytes received:        %llu\n", (unsigned long long)result.bytes);
+	printf("  duration:              %.3f s\n", (double)result.duration_us / 1000000.0);
+	printf("  frame rate:            %.2f fps\n", result.fps);
+	printf("  bitrate:               %.2f Mbit/s\n", result.mbits);
+	printf("  frames complete:       %llu\n", (unsigned long long)result.video.frames);
+	printf("  frames recovered:      %llu\n", (unsigned long long)result.video.frames_fec_recovered);
+	printf("  frames lost:           %llu\n", (unsigned long long)result.video.frames_lost);
+	if(result.client_recv.kernel_drops_supported)
+		printf("  kernel drops:          %llu\n", (unsigned long long)result.client_recv.kernel_drops);
+	else
+		printf("  kernel drops:          unavailable\n");
+	printf("  receive buffer:        %d bytes\n", result.client_recv.rcvbuf_size);
+	if(arguments->config.client_send_batch)
+	{
+		printf("  datagrams batched:     %llu\n", (unsigned long long)result.client_send.datagrams_batched);
+		printf("  batches:               %llu%s\n", (unsigned long long)result.client_send.batches,
+				result.client_send.batch_supported ? "" : " (sent one by one)");
+		printf("  datagrams sent direct: %llu\n", (unsigned long long)result.client_send.datagrams_direct);
+	}
+	print_impairment_stats("downlink", &result.client_rx_impairment);
+	print_impairment_stats("uplink", &result.client_tx_impairment);
+	print_stats(&result.server);
+
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Benchmark failed: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+
+	// below 576, even the RTT test fails and the session uses fallback values
+	if(arguments->config.mtu >= 576 && (result.mtu_in != arguments->config.mtu || result.mtu_out != arguments->config.mtu))
+	{
+		fprintf(stderr, "Senkusha determined MTU in %u, out %u instead of the emulated %u\n",
+				(unsigned int)result.mtu_in, (unsigned int)result.mtu_out, arguments->config.mtu);
+		return 1;
+	}
+
+	if(arguments->config.client_data_ack_delay_ms)
+	{
+		// delayed acks must cover several messages at once, but never so late that data would be resent
+		const ChiakiEmulatorStats *server = &result.server;
+		if(!server->data_sent || server->data_acks_received >= server->data_sent)
+		{
+			fprintf(stderr, "Client sent %llu data acks for %llu data messages\n",
+					(unsigned long long)server->data_acks_received, (unsigned long long)server->data_sent);
+			return 1;
+		}
+		if(server->data_acked_late)
+		{
+			fprintf(stderr, "Client acked %llu data messages too late, they would have been retransmitted\n",
+					(unsigned long long)server->data_acked_late);
+			return 1;
+		}
+	}
+
+	if(arguments->config.client_send_batch)
+	{
+		const ChiakiTakionSendStats *send = &result.client_send;
+		if(!send->datagrams_batched && !send->datagrams_direct)
+		{
+			fprintf(stderr, "Client sent no datagrams through the send queue\n");
+			return 1;
+		}
+		// with a window, everything that fits goes through the thread
+		if(arguments->config.client_send_batch_window_ms && !send->batches)
+		{
+			fprintf(stderr, "Client sent %llu datagrams in %llu batches\n",
+					(unsigned long long)send->datagrams_batched, (unsigned long long)send->batches);
+			return 1;
+		}
+		if(arguments->config.client_plain_io && !send->batch_supported)
+		{
+			fprintf(stderr, "Client did not use the batch send of its socket\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int discovery_bench(Arguments *arguments, ChiakiLog *log)
+{
+	arguments->discovery_config.host = arguments->config.host;
+	ChiakiEmulatorDiscoveryBenchResult result;
+	ChiakiErrorCode err = chiaki_emulator_discovery_bench_run(&arguments->discovery_config, log, &result);
+
+	printf("Discovery:\n");
+	printf("  hosts:                 %u\n", arguments->discovery_config.hosts);
+	printf("  discover all:          %.3f ms\n", (double)result.discover_us / 1000.0);
+	printf("  report changes:        %.3f ms\n", (double)result.change_us / 1000.0);
+	printf("  pings:                 %llu\n", (unsigned long long)result.service.pings);
+	printf("  probes sent:           %llu\n", (unsigned long long)result.service.probes_sent);
+	printf("  requests received:     %llu\n", (unsigned long long)result.requests);
+	printf("  responses received:    %llu\n", (unsigned long long)result.service.responses);
+	printf("  hosts added:           %llu\n", (unsigned long long)result.added);
+	printf("  hosts updated:         %llu\n", (unsigned long long)result.updated);
+	printf("  hosts removed:         %llu\n", (unsigned long long)result.removed);
+	printf("  full state reports:    %llu\n", (unsigned long long)result.reports);
+
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		fprintf(stderr, "Discovery benchmark failed: %s\n", chiaki_error_string(err));
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	chiaki_emulator_config_default(&arguments.config);
+	chiaki_emulator_discovery_bench_config_default(&arguments.discovery_config);
+	arguments.duration_s = 10;
+	arguments.config.client_rx_impairment.reorder_depth = 3;
+	arguments.config.client_tx_impairment.seed = 1;
+	argp_parse(&argp, argc, argv, 0, NULL, &arguments);
+
+	ChiakiLog log;
+	chiaki_log_init(&log, arguments.verbose ? CHIAKI_LOG_ALL : (CHIAKI_LOG_ALL & ~(CHIAKI_LOG_VERBOSE | CHIAKI_LOG_DEBUG)), chiaki_log_cb_print, NULL);
+
+	if(arguments.serve)
+		return serve(&arguments, &log);
+	return arguments.discovery ? discovery_bench(&arguments, &log) : bench(&arguments, &log);
+}
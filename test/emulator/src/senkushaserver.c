@@ -0,0 +1,153 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <takion.pb.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "pb_utils.h"
+
+#define MTU_UDP_PACKET_ADD 0x1c
+
+static ChiakiErrorCode senkusha_server_send_message(ChiakiEmulator *emulator, tkproto_TakionMessage *msg)
+{
+	uint8_t buf[0x80];
+	pb_ostream_t stream = pb_ostream_from_buffer(buf, sizeof(buf));
+	if(!pb_encode(&stream, tkproto_TakionMessage_fields, msg))
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Senkusha protobuf encoding failed");
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	return chiaki_emu_takion_send_message_data(&emulator->senkusha_takion, 1, buf, stream.bytes_written);
+}
+
+static void senkusha_server_send_bang(ChiakiEmulator *emulator)
+{
+	tkproto_TakionMessage msg = { 0 };
+	msg.type = tkproto_TakionMessage_PayloadType_BANG;
+	msg.has_bang_payload = true;
+	msg.bang_payload.server_version = 7;
+	msg.bang_payload.encrypted_key_accepted = true;
+	msg.bang_payload.version_accepted = true;
+	msg.bang_payload.session_key.arg = "";
+	msg.bang_payload.session_key.funcs.encode = chiaki_pb_encode_string;
+	senkusha_server_send_message(emulator, &msg);
+}
+
+/**
+ * Answer an MTU in request with video packets of exactly the requested size.
+ */
+static void senkusha_server_mtu_command(ChiakiEmulator *emulator, tkproto_SenkushaMtuCommand *cmd)
+{
+	size_t packet_size = cmd->mtu_req > MTU_UDP_PACKET_ADD ? cmd->mtu_req - MTU_UDP_PACKET_ADD : 0;
+	uint8_t buf[CHIAKI_EMULATOR_MTU_DEFAULT];
+	if(packet_size > sizeof(buf))
+	{
+		CHIAKI_LOGW(emulator->log, "Emulator Senkusha ignoring MTU request of %u", (unsigned int)cmd->mtu_req);
+		return;
+	}
+	if(cmd->mtu_req > emulator->config.mtu)
+		return; // would be dropped on a path with this MTU
+	memset(buf, 0, sizeof(buf));
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = true;
+	packet.frame_index = (ChiakiSeqNum16)cmd->id;
+	packet.units_in_frame_total = 1;
+	size_t header_size;
+	if(chiaki_takion_v7_av_packet_format_header(buf, sizeof(buf), &header_size, &packet) != CHIAKI_ERR_SUCCESS || header_size > packet_size)
+		return;
+
+	unsigned int num = cmd->has_num && cmd->num ? cmd->num : 1;
+	for(unsigned int i=0; i<num; i++)
+		chiaki_emu_takion_send_raw(&emulator->senkusha_takion, buf, packet_size);
+}
+
+static void senkusha_server_data(ChiakiEmulator *emulator, uint8_t *buf, size_t buf_size)
+{
+	tkproto_TakionMessage msg = { 0 };
+	pb_istream_t stream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&stream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Senkusha failed to decode data protobuf");
+		return;
+	}
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_BIG:
+			senkusha_server_send_bang(emulator);
+			break;
+		case tkproto_TakionMessage_PayloadType_SENKUSHA:
+			if(!msg.has_senkusha_payload)
+				break;
+			if(msg.senkusha_payload.command == tkproto_SenkushaPayload_Command_MTU_COMMAND && msg.senkusha_payload.has_mtu_command)
+				senkusha_server_mtu_command(emulator, &msg.senkusha_payload.mtu_command);
+			else if(msg.senkusha_payload.command == tkproto_SenkushaPayload_Command_CLIENT_MTU_COMMAND
+					&& msg.senkusha_payload.has_client_mtu_command
+					&& msg.senkusha_payload.client_mtu_command.state)
+			{
+				// confirm the start of the MTU out test
+				tkproto_TakionMessage reply = { 0 };
+				reply.type = tkproto_TakionMessage_PayloadType_SENKUSHA;
+				reply.has_senkusha_payload = true;
+				reply.senkusha_payload.command = tkproto_SenkushaPayload_Command_CLIENT_MTU_COMMAND;
+				reply.senkusha_payload.has_client_mtu_command = true;
+				reply.senkusha_payload.client_mtu_command = msg.senkusha_payload.client_mtu_command;
+				senkusha_server_send_message(emulator, &reply);
+			}
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(emulator->log, "Emulator Senkusha client disconnected");
+			break;
+		default:
+			break;
+	}
+}
+
+static void senkusha_server_takion_cb(ChiakiEmuTakion *takion, ChiakiEmuTakionEvent *event, void *user)
+{
+	ChiakiEmulator *emulator = user;
+	switch(event->type)
+	{
+		case CHIAKI_EMU_TAKION_EVENT_DATA:
+			senkusha_server_data(emulator, event->buf, event->buf_size);
+			break;
+		case CHIAKI_EMU_TAKION_EVENT_AV:
+			// pings are echoed unchanged, unless they would not have fit through the emulated path
+			if(event->buf_size + MTU_UDP_PACKET_ADD <= emulator->config.mtu)
+				chiaki_emu_takion_send_raw(takion, event->buf, event->buf_size);
+			break;
+		default:
+			break;
+	}
+}
+
+ChiakiErrorCode chiaki_emu_senkusha_server_start(ChiakiEmulator *emulator)
+{
+	return chiaki_emu_takion_init(&emulator->senkusha_takion, emulator->log, "Emulator Senkusha",
+			emulator->config.host, CHIAKI_EMU_SENKUSHA_PORT, senkusha_server_takion_cb, emulator);
+}
+
+void chiaki_emu_senkusha_server_stop(ChiakiEmulator *emulator)
+{
+	chiaki_emu_takion_fini(&emulator->senkusha_takion);
+}
@@ -0,0 +1,326 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+
+#include <chiaki/http.h>
+#include <chiaki/base64.h>
+#include <chiaki/random.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#define strcasecmp _stricmp
+#else
+#include <arpa/inet.h>
+#include <strings.h>
+#endif
+
+#define SESSION_EXPECT_TIMEOUT_MS 5000
+
+#define CTRL_MESSAGE_TYPE_SESSION_ID 0x33
+#define CTRL_SESSION_ID_SIZE 0x4a
+
+static void *session_server_thread_func(void *user);
+static void *ctrl_thread_func(void *user);
+
+ChiakiErrorCode chiaki_emu_session_server_start(ChiakiEmulator *emulator)
+{
+	emulator->ctrl_thread_running = false;
+
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&emulator->ctrl_stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_stop_pipe_init(&emulator->session_stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_ctrl_stop_pipe;
+
+	err = chiaki_emu_socket_bind(emulator->log, emulator->config.host, CHIAKI_EMU_SESSION_PORT, true, &emulator->session_sock);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_session_stop_pipe;
+
+	err = chiaki_thread_create(&emulator->session_thread, session_server_thread_func, emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_sock;
+	chiaki_thread_set_name(&emulator->session_thread, "Emulator Session");
+
+	return CHIAKI_ERR_SUCCESS;
+
+error_sock:
+	CHIAKI_SOCKET_CLOSE(emulator->session_sock);
+error_session_stop_pipe:
+	chiaki_stop_pipe_fini(&emulator->session_stop_pipe);
+error_ctrl_stop_pipe:
+	chiaki_stop_pipe_fini(&emulator->ctrl_stop_pipe);
+	return err;
+}
+
+static void ctrl_stop(ChiakiEmulator *emulator)
+{
+	if(!emulator->ctrl_thread_running)
+		return;
+	chiaki_stop_pipe_stop(&emulator->ctrl_stop_pipe);
+	chiaki_thread_join(&emulator->ctrl_thread, NULL);
+	chiaki_stop_pipe_reset(&emulator->ctrl_stop_pipe);
+	CHIAKI_SOCKET_CLOSE(emulator->ctrl_sock);
+	emulator->ctrl_thread_running = false;
+}
+
+void chiaki_emu_session_server_stop(ChiakiEmulator *emulator)
+{
+	chiaki_stop_pipe_stop(&emulator->session_stop_pipe);
+	chiaki_thread_join(&emulator->session_thread, NULL);
+	ctrl_stop(emulator);
+	CHIAKI_SOCKET_CLOSE(emulator->session_sock);
+	chiaki_stop_pipe_fini(&emulator->session_stop_pipe);
+	chiaki_stop_pipe_fini(&emulator->ctrl_stop_pipe);
+}
+
+static ChiakiErrorCode send_all(chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	while(buf_size > 0)
+	{
+		int sent = send(sock, (const void *)buf, buf_size, 0);
+		if(sent <= 0)
+			return CHIAKI_ERR_NETWORK;
+		buf += sent;
+		buf_size -= (size_t)sent;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode send_response(chiaki_socket_t sock, const char *status, const char *extra_headers)
+{
+	char buf[512];
+	int len = snprintf(buf, sizeof(buf),
+			"HTTP/1.1 %s\r\n"
+			"Content-Length: 0\r\n"
+			"%s"
+			"\r\n", status, extra_headers ? extra_headers : "");
+	if(len < 0 || (size_t)len >= sizeof(buf))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	return send_all(sock, (const uint8_t *)buf, (size_t)len);
+}
+
+static const char *header_value(ChiakiHttpHeader *headers, const char *key)
+{
+	for(ChiakiHttpHeader *header=headers; header; header=header->next)
+	{
+		if(strcasecmp(header->key, key) == 0)
+			return header->value;
+	}
+	return NULL;
+}
+
+static void handle_session_request(ChiakiEmulator *emulator, chiaki_socket_t sock, ChiakiHttpHeader *headers)
+{
+	if(!header_value(headers, "RP-Registkey"))
+	{
+		CHIAKI_LOGW(emulator->log, "Emulator received session request without RP-Registkey");
+		send_response(sock, "403 Forbidden", NULL);
+		return;
+	}
+
+	uint8_t nonce[CHIAKI_RPCRYPT_KEY_SIZE];
+	ChiakiErrorCode err = chiaki_random_bytes_crypt(nonce, sizeof(nonce));
+	if(err != CHIAKI_ERR_SUCCESS)
+		return;
+
+	char nonce_b64[(CHIAKI_RPCRYPT_KEY_SIZE + 2) / 3 * 4 + 1];
+	err = chiaki_base64_encode(nonce, sizeof(nonce), nonce_b64, sizeof(nonce_b64));
+	if(err != CHIAKI_ERR_SUCCESS)
+		return;
+
+	chiaki_mutex_lock(&emulator->state_mutex);
+	chiaki_rpcrypt_init_auth(&emulator->rpcrypt, nonce, emulator->config.morning);
+	emulator->rpcrypt_valid = true;
+	chiaki_mutex_unlock(&emulator->state_mutex);
+
+	const char *rp_version = header_value(headers, "RP-Version");
+	char extra_headers[128];
+	snprintf(extra_headers, sizeof(extra_headers),
+			"RP-Version: %s\r\n"
+			"RP-Nonce: %s\r\n", rp_version ? rp_version : "9.0", nonce_b64);
+	if(send_response(sock, "200 OK", extra_headers) != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(emulator->log, "Emulator failed to send session response");
+	else
+		CHIAKI_LOGI(emulator->log, "Emulator accepted session request");
+}
+
+/**
+ * @return true if sock has been taken over by the ctrl thread
+ */
+static bool handle_ctrl_request(ChiakiEmulator *emulator, chiaki_socket_t sock, ChiakiHttpHeader *headers)
+{
+	const char *auth_b64 = header_value(headers, "RP-Auth");
+	uint8_t auth[CHIAKI_SESSION_AUTH_SIZE];
+	size_t auth_size = sizeof(auth);
+	bool auth_valid = auth_b64
+			&& chiaki_base64_decode(auth_b64, strlen(auth_b64), auth, &auth_size) == CHIAKI_ERR_SUCCESS
+			&& auth_size == sizeof(auth);
+
+	uint8_t server_type[0x10] = { 0 };
+	char session_id_msg[8 + 1 + CTRL_SESSION_ID_SIZE];
+	uint8_t *session_id_payload = (uint8_t *)session_id_msg + 8;
+
+	chiaki_mutex_lock(&emulator->state_mutex);
+	if(auth_valid)
+	{
+		auth_valid = emulator->rpcrypt_valid
+			&& chiaki_rpcrypt_decrypt(&emulator->rpcrypt, 0, auth, auth, sizeof(auth)) == CHIAKI_ERR_SUCCESS
+			&& memcmp(auth, emulator->config.regist_key, sizeof(auth)) == 0;
+	}
+	if(auth_valid)
+	{
+		chiaki_rpcrypt_encrypt(&emulator->rpcrypt, 0, server_type, server_type, sizeof(server_type));
+
+		static const char alnum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+		uint8_t rand_buf[CTRL_SESSION_ID_SIZE];
+		chiaki_random_bytes_crypt(rand_buf, sizeof(rand_buf));
+		for(size_t i=0; i<CTRL_SESSION_ID_SIZE; i++)
+			emulator->session_id[i] = alnum[rand_buf[i] % (sizeof(alnum) - 1)];
+		emulator->session_id[CTRL_SESSION_ID_SIZE] = '\0';
+
+		session_id_payload[0] = CTRL_SESSION_ID_SIZE;
+		memcpy(session_id_payload + 1, emulator->session_id, CTRL_SESSION_ID_SIZE);
+		chiaki_rpcrypt_encrypt(&emulator->rpcrypt, 1, session_id_payload, session_id_payload, 1 + CTRL_SESSION_ID_SIZE);
+	}
+	chiaki_mutex_unlock(&emulator->state_mutex);
+
+	if(!auth_valid)
+	{
+		CHIAKI_LOGW(emulator->log, "Emulator received ctrl request with invalid RP-Auth");
+		send_response(sock, "403 Forbidden", NULL);
+		return false;
+	}
+
+	char server_type_b64[(sizeof(server_type) + 2) / 3 * 4 + 1];
+	chiaki_base64_encode(server_type, sizeof(server_type), server_type_b64, sizeof(server_type_b64));
+	char extra_headers[128];
+	snprintf(extra_headers, sizeof(extra_headers), "RP-Server-Type: %s\r\n", server_type_b64);
+	if(send_response(sock, "200 OK", extra_headers) != CHIAKI_ERR_SUCCESS)
+		return false;
+
+	*((chiaki_unaligned_uint32_t *)(session_id_msg + 0)) = htonl(1 + CTRL_SESSION_ID_SIZE);
+	*((chiaki_unaligned_uint16_t *)(session_id_msg + 4)) = htons(CTRL_MESSAGE_TYPE_SESSION_ID);
+	*((chiaki_unaligned_uint16_t *)(session_id_msg + 6)) = 0;
+	if(send_all(sock, (const uint8_t *)session_id_msg, sizeof(session_id_msg)) != CHIAKI_ERR_SUCCESS)
+		return false;
+
+	// only one ctrl connection at a time, the previous client must be gone anyway
+	ctrl_stop(emulator);
+	emulator->ctrl_sock = sock;
+	if(chiaki_thread_create(&emulator->ctrl_thread, ctrl_thread_func, emulator) != CHIAKI_ERR_SUCCESS)
+		return false;
+	chiaki_thread_set_name(&emulator->ctrl_thread, "Emulator Ctrl");
+	emulator->ctrl_thread_running = true;
+
+	CHIAKI_LOGI(emulator->log, "Emulator accepted ctrl request");
+	return true;
+}
+
+static void handle_connection(ChiakiEmulator *emulator, chiaki_socket_t sock)
+{
+	char buf[0x400];
+	size_t header_size;
+	size_t received_size;
+	ChiakiErrorCode err = chiaki_recv_http_header(sock, buf, sizeof(buf) - 1, &header_size, &received_size, &emulator->session_stop_pipe, SESSION_EXPECT_TIMEOUT_MS);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto close;
+	buf[header_size] = '\0';
+
+	char *line_end = strstr(buf, "\r\n");
+	if(!line_end)
+		goto close;
+	*line_end = '\0';
+	char *headers_buf = line_end + 2;
+
+	ChiakiHttpHeader *headers;
+	err = chiaki_http_header_parse(&headers, headers_buf, header_size - (headers_buf - buf));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator failed to parse request headers");
+		goto close;
+	}
+
+	bool keep = false;
+	if(strcmp(buf, "GET /sce/rp/session HTTP/1.1") == 0)
+		handle_session_request(emulator, sock, headers);
+	else if(strcmp(buf, "GET /sce/rp/session/ctrl HTTP/1.1") == 0)
+		keep = handle_ctrl_request(emulator, sock, headers);
+	else
+	{
+		CHIAKI_LOGW(emulator->log, "Emulator received unknown request \"%s\"", buf);
+		send_response(sock, "404 Not Found", NULL);
+	}
+
+	chiaki_http_header_free(headers);
+	if(keep)
+		return;
+close:
+	CHIAKI_SOCKET_CLOSE(sock);
+}
+
+static void *session_server_thread_func(void *user)
+{
+	ChiakiEmulator *emulator = user;
+
+	while(true)
+	{
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&emulator->session_stop_pipe, emulator->session_sock, false, UINT64_MAX);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
+
+		chiaki_socket_t sock = accept(emulator->session_sock, NULL, NULL);
+		if(CHIAKI_SOCKET_IS_INVALID(sock))
+		{
+			CHIAKI_LOGE(emulator->log, "Emulator failed to accept: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			continue;
+		}
+
+		handle_connection(emulator, sock);
+	}
+
+	return NULL;
+}
+
+static void *ctrl_thread_func(void *user)
+{
+	ChiakiEmulator *emulator = user;
+	uint8_t buf[0x400];
+
+	// Messages from the client are not interpreted, only drained until the connection is closed.
+	while(true)
+	{
+		ChiakiErrorCode err = chiaki_stop_pipe_select_single(&emulator->ctrl_stop_pipe, emulator->ctrl_sock, false, UINT64_MAX);
+		if(err != CHIAKI_ERR_SUCCESS)
+			break;
+
+		int received = recv(emulator->ctrl_sock, (void *)buf, sizeof(buf), 0);
+		if(received <= 0)
+		{
+			CHIAKI_LOGI(emulator->log, "Emulator ctrl connection closed");
+			break;
+		}
+	}
+
+	return NULL;
+}
@@ -0,0 +1,543 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+
+#include <chiaki/audio.h>
+#include <chiaki/base64.h>
+#include <chiaki/fec.h>
+#include <chiaki/session.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include <takion.pb.h>
+#include <pb_encode.h>
+#include <pb_decode.h>
+#include "pb_utils.h"
+#include "utils.h"
+
+#define MTU_UDP_PACKET_ADD 0x1c
+#define VIDEO_HEADER_SIZE 0x15
+#define VIDEO_UNITS_MAX 0x100
+#define VIDEO_CODEC 3
+// packets sent back to back before yielding, to stay below the client's receive buffer size
+#define VIDEO_BURST_PACKETS 32
+
+#define AUDIO_CODEC 5
+#define AUDIO_CHANNELS 2
+#define AUDIO_BITS 16
+#define AUDIO_RATE 48000
+#define AUDIO_FRAME_SIZE 480
+#define AUDIO_UNIT_SIZE 0x40
+#define AUDIO_OPUS_TOC 0xf4 // CELT-only fullband 10 ms stereo
+
+#define LAUNCH_SPEC_BUF_SIZE 0x800
+
+static void *av_thread_func(void *user);
+
+static void stream_server_av_stop(ChiakiEmulator *emulator)
+{
+	if(!emulator->av_thread_running)
+		return;
+	chiaki_stop_pipe_stop(&emulator->av_stop_pipe);
+	chiaki_thread_join(&emulator->av_thread, NULL);
+	chiaki_stop_pipe_reset(&emulator->av_stop_pipe);
+	emulator->av_thread_running = false;
+}
+
+static void stream_server_reset(ChiakiEmulator *emulator)
+{
+	stream_server_av_stop(emulator);
+	chiaki_emu_takion_set_crypt(&emulator->stream_takion, NULL);
+	if(emulator->gkcrypt_local)
+	{
+		chiaki_gkcrypt_free(emulator->gkcrypt_local);
+		emulator->gkcrypt_local = NULL;
+	}
+	if(emulator->ecdh_initialized)
+	{
+		chiaki_ecdh_fini(&emulator->ecdh);
+		emulator->ecdh_initialized = false;
+	}
+}
+
+static ChiakiErrorCode stream_server_send_message(ChiakiEmulator *emulator, uint16_t channel, tkproto_TakionMessage *msg, size_t buf_size)
+{
+	uint8_t *buf = malloc(buf_size);
+	if(!buf)
+		return CHIAKI_ERR_MEMORY;
+	pb_ostream_t stream = pb_ostream_from_buffer(buf, buf_size);
+	ChiakiErrorCode err = CHIAKI_ERR_UNKNOWN;
+	if(pb_encode(&stream, tkproto_TakionMessage_fields, msg))
+		err = chiaki_emu_takion_send_message_data(&emulator->stream_takion, channel, buf, stream.bytes_written);
+	else
+		CHIAKI_LOGE(emulator->log, "Emulator Stream protobuf encoding failed");
+	free(buf);
+	return err;
+}
+
+static bool pb_encode_resolution(pb_ostream_t *stream, const pb_field_t *field, void *const *arg)
+{
+	const tkproto_ResolutionPayload *resolution = *arg;
+	if(!pb_encode_tag_for_field(stream, field))
+		return false;
+	return pb_encode_submessage(stream, tkproto_ResolutionPayload_fields, resolution);
+}
+
+/**
+ * Extract the handshake key from the encrypted launch spec the same way the console would.
+ */
+static ChiakiErrorCode stream_server_launch_spec_handshake_key(ChiakiEmulator *emulator, const uint8_t *launch_spec_b64, size_t launch_spec_b64_size, uint8_t *handshake_key)
+{
+	uint8_t json[LAUNCH_SPEC_BUF_SIZE];
+	size_t json_size = sizeof(json) - 1;
+	ChiakiErrorCode err = chiaki_base64_decode((const char *)launch_spec_b64, launch_spec_b64_size, json, &json_size);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	uint8_t key_stream[LAUNCH_SPEC_BUF_SIZE];
+	memset(key_stream, 0, json_size);
+	chiaki_mutex_lock(&emulator->state_mutex);
+	err = emulator->rpcrypt_valid
+			? chiaki_rpcrypt_encrypt(&emulator->rpcrypt, 0, key_stream, key_stream, json_size)
+			: CHIAKI_ERR_UNINITIALIZED;
+	chiaki_mutex_unlock(&emulator->state_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	xor_bytes(json, key_stream, json_size);
+	json[json_size] = '\0';
+
+	static const char key_prefix[] = "\"handshakeKey\":\"";
+	char *key_b64 = strstr((char *)json, key_prefix);
+	if(!key_b64)
+		return CHIAKI_ERR_INVALID_DATA;
+	key_b64 += sizeof(key_prefix) - 1;
+	char *key_b64_end = strchr(key_b64, '"');
+	if(!key_b64_end)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	size_t handshake_key_size = CHIAKI_HANDSHAKE_KEY_SIZE;
+	err = chiaki_base64_decode(key_b64, key_b64_end - key_b64, handshake_key, &handshake_key_size);
+	if(err != CHIAKI_ERR_SUCCESS || handshake_key_size != CHIAKI_HANDSHAKE_KEY_SIZE)
+		return CHIAKI_ERR_INVALID_DATA;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void stream_server_handle_big(ChiakiEmulator *emulator, uint8_t *buf, size_t buf_size)
+{
+	uint8_t launch_spec[LAUNCH_SPEC_BUF_SIZE * 2];
+	ChiakiPBDecodeBuf launch_spec_buf = { sizeof(launch_spec), 0, launch_spec };
+	uint8_t client_pub_key[128];
+	ChiakiPBDecodeBuf client_pub_key_buf = { sizeof(client_pub_key), 0, client_pub_key };
+	uint8_t client_sig[32];
+	ChiakiPBDecodeBuf client_sig_buf = { sizeof(client_sig), 0, client_sig };
+
+	tkproto_TakionMessage msg = { 0 };
+	msg.big_payload.launch_spec.arg = &launch_spec_buf;
+	msg.big_payload.launch_spec.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_pub_key.arg = &client_pub_key_buf;
+	msg.big_payload.ecdh_pub_key.funcs.decode = chiaki_pb_decode_buf;
+	msg.big_payload.ecdh_sig.arg = &client_sig_buf;
+	msg.big_payload.ecdh_sig.funcs.decode = chiaki_pb_decode_buf;
+
+	pb_istream_t stream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&stream, tkproto_TakionMessage_fields, &msg) || !msg.has_big_payload)
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Stream failed to decode big");
+		return;
+	}
+
+	uint8_t handshake_key[CHIAKI_HANDSHAKE_KEY_SIZE];
+	ChiakiErrorCode err = stream_server_launch_spec_handshake_key(emulator, launch_spec, launch_spec_buf.size, handshake_key);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Stream failed to get handshake key from launch spec");
+		return;
+	}
+
+	stream_server_reset(emulator);
+	err = chiaki_ecdh_init(&emulator->ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return;
+	emulator->ecdh_initialized = true;
+
+	uint8_t pub_key[128];
+	ChiakiPBBuf pub_key_buf = { sizeof(pub_key), pub_key };
+	uint8_t sig[32];
+	ChiakiPBBuf sig_buf = { sizeof(sig), sig };
+	err = chiaki_ecdh_get_local_pub_key(&emulator->ecdh, pub_key, &pub_key_buf.size, handshake_key, sig, &sig_buf.size);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Stream failed to get ECDH key and sig");
+		return;
+	}
+
+	uint8_t secret[CHIAKI_ECDH_SECRET_SIZE];
+	err = chiaki_ecdh_derive_secret(&emulator->ecdh, secret, client_pub_key, client_pub_key_buf.size, handshake_key, client_sig, client_sig_buf.size);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Stream failed to derive ECDH secret, client sig is probably invalid");
+		return;
+	}
+
+	// console side uses the indices mirrored relative to the client
+	emulator->gkcrypt_local = chiaki_gkcrypt_new(emulator->log, 0, NULL, 3, handshake_key, secret);
+	if(!emulator->gkcrypt_local)
+		return;
+
+	tkproto_TakionMessage bang = { 0 };
+	bang.type = tkproto_TakionMessage_PayloadType_BANG;
+	bang.has_bang_payload = true;
+	bang.bang_payload.server_version = msg.big_payload.client_version;
+	bang.bang_payload.encrypted_key_accepted = true;
+	bang.bang_payload.version_accepted = true;
+	bang.bang_payload.session_key.arg = "";
+	bang.bang_payload.session_key.funcs.encode = chiaki_pb_encode_string;
+	bang.bang_payload.ecdh_pub_key.arg = &pub_key_buf;
+	bang.bang_payload.ecdh_pub_key.funcs.encode = chiaki_pb_encode_buf;
+	bang.bang_payload.ecdh_sig.arg = &sig_buf;
+	bang.bang_payload.ecdh_sig.funcs.encode = chiaki_pb_encode_buf;
+	err = stream_server_send_message(emulator, 1, &bang, 0x200);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return;
+
+	// the client only checks MACs after processing bang
+	chiaki_emu_takion_set_crypt(&emulator->stream_takion, emulator->gkcrypt_local);
+
+	ChiakiPBBuf video_header_buf = { emulator->video_source.header_size, emulator->video_source.header };
+	tkproto_ResolutionPayload resolution = { 0 };
+	resolution.width = emulator->config.width;
+	resolution.height = emulator->config.height;
+	resolution.video_header.arg = &video_header_buf;
+	resolution.video_header.funcs.encode = chiaki_pb_encode_buf;
+
+	ChiakiAudioHeader audio_header = { 0 };
+	audio_header.channels = AUDIO_CHANNELS;
+	audio_header.bits = AUDIO_BITS;
+	audio_header.rate = AUDIO_RATE;
+	audio_header.frame_size = AUDIO_FRAME_SIZE;
+	uint8_t audio_header_raw[CHIAKI_AUDIO_HEADER_SIZE];
+	chiaki_audio_header_save(&audio_header, audio_header_raw);
+	ChiakiPBBuf audio_header_buf = { sizeof(audio_header_raw), audio_header_raw };
+
+	tkproto_TakionMessage streaminfo = { 0 };
+	streaminfo.type = tkproto_TakionMessage_PayloadType_STREAMINFO;
+	streaminfo.has_stream_info_payload = true;
+	streaminfo.stream_info_payload.audio_header.arg = &audio_header_buf;
+	streaminfo.stream_info_payload.audio_header.funcs.encode = chiaki_pb_encode_buf;
+	streaminfo.stream_info_payload.resolution.arg = &resolution;
+	streaminfo.stream_info_payload.resolution.funcs.encode = pb_encode_resolution;
+	stream_server_send_message(emulator, 1, &streaminfo, 0x100 + video_header_buf.size);
+
+	CHIAKI_LOGI(emulator->log, "Emulator Stream sent bang and streaminfo");
+}
+
+static void stream_server_data(ChiakiEmulator *emulator, uint8_t *buf, size_t buf_size)
+{
+	tkproto_TakionMessage msg = { 0 };
+	pb_istream_t stream = pb_istream_from_buffer(buf, buf_size);
+	if(!pb_decode(&stream, tkproto_TakionMessage_fields, &msg))
+	{
+		CHIAKI_LOGE(emulator->log, "Emulator Stream failed to decode data protobuf");
+		return;
+	}
+
+	switch(msg.type)
+	{
+		case tkproto_TakionMessage_PayloadType_BIG:
+			stream_server_handle_big(emulator, buf, buf_size);
+			break;
+		case tkproto_TakionMessage_PayloadType_STREAMINFOACK:
+			if(emulator->av_thread_running || !emulator->gkcrypt_local)
+				break;
+			chiaki_mutex_lock(&emulator->state_mutex);
+			emulator->stats.sessions++;
+			chiaki_mutex_unlock(&emulator->state_mutex);
+			if(chiaki_thread_create(&emulator->av_thread, av_thread_func, emulator) != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGE(emulator->log, "Emulator Stream failed to create av thread");
+				break;
+			}
+			chiaki_thread_set_name(&emulator->av_thread, "Chiaki Emu AV");
+			emulator->av_thread_running = true;
+			CHIAKI_LOGI(emulator->log, "Emulator Stream started streaming");
+			break;
+		case tkproto_TakionMessage_PayloadType_CORRUPTFRAME:
+			chiaki_mutex_lock(&emulator->state_mutex);
+			emulator->stats.corrupt_frame_reports++;
+			chiaki_mutex_unlock(&emulator->state_mutex);
+			break;
+		case tkproto_TakionMessage_PayloadType_DISCONNECT:
+			CHIAKI_LOGI(emulator->log, "Emulator Stream client disconnected");
+			stream_server_av_stop(emulator);
+			break;
+		default:
+			break;
+	}
+}
+
+static void stream_server_takion_cb(ChiakiEmuTakion *takion, ChiakiEmuTakionEvent *event, void *user)
+{
+	ChiakiEmulator *emulator = user;
+	switch(event->type)
+	{
+		case CHIAKI_EMU_TAKION_EVENT_INIT:
+			stream_server_reset(emulator);
+			break;
+		case CHIAKI_EMU_TAKION_EVENT_DATA:
+			stream_server_data(emulator, event->buf, event->buf_size);
+			break;
+		default:
+			break;
+	}
+}
+
+static ChiakiErrorCode stream_server_send_video_frame(ChiakiEmulator *emulator, ChiakiSeqNum16 frame_index, const uint8_t *frame, size_t frame_size, uint8_t **frame_buf, size_t *frame_buf_size)
+{
+	// max unit size including the padding field, aligned for the fec
+	size_t unit_size_max = (emulator->config.mtu - MTU_UDP_PACKET_ADD - VIDEO_HEADER_SIZE) & ~(size_t)7;
+	size_t k = (frame_size + unit_size_max - 3) / (unit_size_max - 2);
+	size_t m = (k * emulator->config.fec_percent + 99) / 100;
+	if(frame_size < 2 || k + (m ? m : 1) > VIDEO_UNITS_MAX)
+	{
+		chiaki_mutex_lock(&emulator->state_mutex);
+		emulator->stats.video_frames_skipped++;
+		chiaki_mutex_unlock(&emulator->state_mutex);
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+	}
+
+	// distribute the frame evenly so all units share the same size
+	size_t chunk_size_min = frame_size / k;
+	size_t chunk_rem = frame_size % k;
+	size_t unit_size = ((chunk_size_min + (chunk_rem ? 1 : 0) + 2 + 7) & ~(size_t)7);
+
+	size_t buf_size_required = (k + m) * unit_size;
+	if(*frame_buf_size < buf_size_required)
+	{
+		uint8_t *buf_new = realloc(*frame_buf, buf_size_required);
+		if(!buf_new)
+			return CHIAKI_ERR_MEMORY;
+		*frame_buf = buf_new;
+		*frame_buf_size = buf_size_required;
+	}
+	uint8_t *buf = *frame_buf;
+	memset(buf, 0, buf_size_required);
+
+	size_t frame_pos = 0;
+	for(size_t i=0; i<k; i++)
+	{
+		size_t chunk_size = chunk_size_min + (i < chunk_rem ? 1 : 0);
+		uint8_t *unit = buf + i * unit_size;
+		*((chiaki_unaligned_uint16_t *)unit) = htons((uint16_t)(unit_size - chunk_size - 2));
+		memcpy(unit + 2, frame + frame_pos, chunk_size);
+		frame_pos += chunk_size;
+	}
+
+	if(m)
+	{
+		ChiakiErrorCode err = chiaki_fec_encode(buf, unit_size, (unsigned int)k, (unsigned int)m);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+
+	size_t bytes_sent = 0;
+	for(size_t i=0; i<k+m; i++)
+	{
+		ChiakiTakionAVPacket packet = { 0 };
+		packet.is_video = true;
+		packet.frame_index = frame_index;
+		packet.unit_index = (ChiakiSeqNum16)i;
+		packet.units_in_frame_total = (uint16_t)(k + m);
+		packet.units_in_frame_fec = (uint16_t)m;
+		packet.codec = VIDEO_CODEC;
+		packet.data = buf + i * unit_size;
+		packet.data_size = i < k ? chunk_size_min + (i < chunk_rem ? 1 : 0) + 2 : unit_size;
+
+		ChiakiErrorCode err = chiaki_emu_takion_send_av(&emulator->stream_takion, &packet);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+		bytes_sent += packet.data_size;
+
+		if((i + 1) % VIDEO_BURST_PACKETS == 0 && i + 1 < k + m)
+		{
+			if(chiaki_stop_pipe_sleep(&emulator->av_stop_pipe, 1) == CHIAKI_ERR_CANCELED)
+				return CHIAKI_ERR_CANCELED;
+		}
+	}
+
+	chiaki_mutex_lock(&emulator->state_mutex);
+	emulator->stats.video_frames_sent++;
+	emulator->stats.video_packets_sent += k + m;
+	emulator->stats.video_bytes_sent += bytes_sent;
+	chiaki_mutex_unlock(&emulator->state_mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode stream_server_send_audio_frame(ChiakiEmulator *emulator, ChiakiSeqNum16 frame_index)
+{
+	uint8_t buf[AUDIO_UNIT_SIZE] = { 0 };
+	buf[0] = AUDIO_OPUS_TOC;
+
+	ChiakiTakionAVPacket packet = { 0 };
+	packet.is_video = false;
+	packet.frame_index = frame_index;
+	packet.unit_index = 0;
+	packet.units_in_frame_total = 1;
+	packet.units_in_frame_fec = (AUDIO_UNIT_SIZE << 8) | 1; // unit size, no fec units, one source unit
+	packet.codec = AUDIO_CODEC;
+	packet.data = buf;
+	packet.data_size = sizeof(buf);
+	ChiakiErrorCode err = chiaki_emu_takion_send_av(&emulator->stream_takion, &packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	chiaki_mutex_lock(&emulator->state_mutex);
+	emulator->stats.audio_packets_sent++;
+	chiaki_mutex_unlock(&emulator->state_mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
+#define AUDIO_FRAME_INTERVAL_US (AUDIO_FRAME_SIZE * 1000000ULL / AUDIO_RATE)
+#define DATA_BURST_INTERVAL_US 1000000ULL
+
+static void stream_server_send_data_burst(ChiakiEmulator *emulator)
+{
+	for(unsigned int i=0; i<emulator->config.data_burst; i++)
+	{
+		tkproto_TakionMessage msg = { 0 };
+		msg.type = tkproto_TakionMessage_PayloadType_HEARTBEAT;
+		if(stream_server_send_message(emulator, 1, &msg, 8) != CHIAKI_ERR_SUCCESS)
+			return;
+	}
+}
+
+static void *av_thread_func(void *user)
+{
+	ChiakiEmulator *emulator = user;
+
+	uint8_t *frame_buf = NULL;
+	size_t frame_buf_size = 0;
+	ChiakiSeqNum16 video_frame_index = 1;
+	ChiakiSeqNum16 audio_frame_index = 1;
+	uint64_t video_interval_us = 1000000ULL / emulator->config.fps;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	uint64_t video_next_us = start_us;
+	uint64_t audio_next_us = start_us;
+	uint64_t data_next_us = start_us;
+	bool video_ended = false;
+
+	while(true)
+	{
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+
+		if(!video_ended && now_us >= video_next_us)
+		{
+			const uint8_t *frame;
+			size_t frame_size;
+			if(chiaki_emu_video_source_next(&emulator->video_source, &frame, &frame_size))
+			{
+				ChiakiErrorCode err = stream_server_send_video_frame(emulator, video_frame_index, frame, frame_size, &frame_buf, &frame_buf_size);
+				if(err == CHIAKI_ERR_CANCELED)
+					break;
+				if(err == CHIAKI_ERR_SUCCESS)
+					video_frame_index++;
+			}
+			else
+			{
+				CHIAKI_LOGI(emulator->log, "Emulator Stream video source ended");
+				video_ended = true;
+			}
+			video_next_us += video_interval_us;
+			// don't try to catch up after stalls
+			if(video_next_us < now_us)
+				video_next_us = now_us + video_interval_us;
+		}
+
+		if(emulator->config.audio && now_us >= audio_next_us)
+		{
+			stream_server_send_audio_frame(emulator, audio_frame_index++);
+			audio_next_us += AUDIO_FRAME_INTERVAL_US;
+			if(audio_next_us < now_us)
+				audio_next_us = now_us + AUDIO_FRAME_INTERVAL_US;
+		}
+
+		if(emulator->config.data_burst && now_us >= data_next_us)
+		{
+			stream_server_send_data_burst(emulator);
+			data_next_us = now_us + DATA_BURST_INTERVAL_US;
+		}
+
+		uint64_t next_us = video_ended ? UINT64_MAX : video_next_us;
+		if(emulator->config.audio && audio_next_us < next_us)
+			next_us = audio_next_us;
+		if(emulator->config.data_burst && data_next_us < next_us)
+			next_us = data_next_us;
+		now_us = chiaki_time_now_monotonic_us();
+		uint64_t timeout_ms = next_us == UINT64_MAX ? 1000 : (next_us > now_us ? (next_us - now_us + 999) / 1000 : 0);
+		if(timeout_ms && chiaki_stop_pipe_sleep(&emulator->av_stop_pipe, (uint32_t)timeout_ms) == CHIAKI_ERR_CANCELED)
+			break;
+	}
+
+	free(frame_buf);
+	return NULL;
+}
+
+ChiakiErrorCode chiaki_emu_stream_server_start(ChiakiEmulator *emulator)
+{
+	emulator->gkcrypt_local = NULL;
+	emulator->ecdh_initialized = false;
+	emulator->av_thread_running = false;
+
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&emulator->av_stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	if(emulator->config.video_file)
+		err = chiaki_emu_video_source_init_file(&emulator->video_source, emulator->log, emulator->config.video_file, emulator->config.video_loop);
+	else
+		err = chiaki_emu_video_source_init_synthetic(&emulator->video_source, (size_t)emulator->config.bitrate * 1000 / 8 / emulator->config.fps);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+
+	err = chiaki_emu_takion_init(&emulator->stream_takion, emulator->log, "Emulator Stream",
+			emulator->config.host, CHIAKI_EMU_STREAM_PORT, stream_server_takion_cb, emulator);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_video_source;
+
+	return CHIAKI_ERR_SUCCESS;
+error_video_source:
+	chiaki_emu_video_source_fini(&emulator->video_source);
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&emulator->av_stop_pipe);
+	return err;
+}
+
+void chiaki_emu_stream_server_stop(ChiakiEmulator *emulator)
+{
+	chiaki_emu_takion_fini(&emulator->stream_takion);
+	stream_server_reset(emulator);
+	chiaki_emu_video_source_fini(&emulator->video_source);
+	chiaki_stop_pipe_fini(&emulator->av_stop_pipe);
+}
@@ -0,0 +1,224 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "emulator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAL_TYPE_SLICE 1
+#define NAL_TYPE_SLICE_IDR 5
+#define NAL_TYPE_SEI 6
+#define NAL_TYPE_SPS 7
+#define NAL_TYPE_PPS 8
+#define NAL_TYPE_AUD 9
+
+/**
+ * @return offset of the next start code (00 00 01) at or after pos or buf_size
+ */
+static size_t find_start_code(const uint8_t *buf, size_t buf_size, size_t pos)
+{
+	for(; pos + 3 <= buf_size; pos++)
+	{
+		if(buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
+			return pos;
+	}
+	return buf_size;
+}
+
+static ChiakiErrorCode frames_push(ChiakiEmuVideoSource *source, size_t *frames_size, size_t offset)
+{
+	if(source->frames_count + 1 >= *frames_size)
+	{
+		size_t size_new = *frames_size ? *frames_size * 2 : 0x100;
+		size_t *frames_new = realloc(source->frames, size_new * sizeof(size_t));
+		if(!frames_new)
+			return CHIAKI_ERR_MEMORY;
+		source->frames = frames_new;
+		*frames_size = size_new;
+	}
+	source->frames[source->frames_count++] = offset;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+ChiakiErrorCode chiaki_emu_video_source_init_file(ChiakiEmuVideoSource *source, ChiakiLog *log, const char *filename, bool loop)
+{
+	memset(source, 0, sizeof(*source));
+	source->loop = loop;
+
+	FILE *f = fopen(filename, "rb");
+	if(!f)
+	{
+		CHIAKI_LOGE(log, "Emulator failed to open video file %s", filename);
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	ChiakiErrorCode err = CHIAKI_ERR_UNKNOWN;
+	if(fseek(f, 0, SEEK_END) != 0)
+		goto error_file;
+	long size = ftell(f);
+	if(size <= 0 || fseek(f, 0, SEEK_SET) != 0)
+		goto error_file;
+	source->buf_size = (size_t)size;
+	source->buf = malloc(source->buf_size);
+	if(!source->buf)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_file;
+	}
+	if(fread(source->buf, 1, source->buf_size, f) != source->buf_size)
+		goto error_buf;
+	fclose(f);
+	f = NULL;
+
+	// An access unit starts at an AUD, SPS, PPS or SEI or at the first slice of a picture,
+	// but only if the current one already contains a slice.
+	const uint8_t *buf = source->buf;
+	size_t frames_size = 0;
+	bool au_has_slice = false;
+	size_t header_start = 0;
+	size_t header_end = 0;
+	size_t pos = find_start_code(buf, source->buf_size, 0);
+	while(pos < source->buf_size)
+	{
+		// include the leading zero of 4-byte start codes
+		size_t nal_start = pos > 0 && buf[pos - 1] == 0 ? pos - 1 : pos;
+		size_t payload = pos + 3;
+		size_t next = find_start_code(buf, source->buf_size, payload);
+		if(payload >= source->buf_size)
+			break;
+
+		uint8_t nal_type = buf[payload] & 0x1f;
+		bool is_slice = nal_type >= NAL_TYPE_SLICE && nal_type <= NAL_TYPE_SLICE_IDR;
+		// first_mb_in_slice == 0 is encoded as a single 1 bit
+		bool first_slice = is_slice && payload + 1 < source->buf_size && (buf[payload + 1] & 0x80);
+		bool au_start = source->frames_count == 0
+				|| (au_has_slice && (first_slice || nal_type == NAL_TYPE_AUD || nal_type == NAL_TYPE_SEI || nal_type == NAL_TYPE_SPS || nal_type == NAL_TYPE_PPS));
+		if(au_start)
+		{
+			err = frames_push(source, &frames_size, nal_start);
+			if(err != CHIAKI_ERR_SUCCESS)
+				goto error_buf;
+			au_has_slice = false;
+		}
+		if(is_slice)
+			au_has_slice = true;
+
+		if((nal_type == NAL_TYPE_SPS || nal_type == NAL_TYPE_PPS) && !source->header)
+		{
+			if(!header_end)
+				header_start = nal_start;
+			header_end = next;
+		}
+		else if(is_slice && header_end && !source->header)
+		{
+			source->header_size = header_end - header_start;
+			source->header = malloc(source->header_size);
+			if(!source->header)
+			{
+				err = CHIAKI_ERR_MEMORY;
+				goto error_buf;
+			}
+			memcpy(source->header, buf + header_start, source->header_size);
+		}
+
+		pos = next;
+	}
+
+	if(!source->frames_count || !source->header)
+	{
+		CHIAKI_LOGE(log, "Emulator video file %s does not contain an H.264 Annex B stream with SPS and PPS", filename);
+		err = CHIAKI_ERR_INVALID_DATA;
+		goto error_buf;
+	}
+	// frames_push always leaves room for the end offset
+	source->frames[source->frames_count] = source->buf_size;
+
+	CHIAKI_LOGI(log, "Emulator loaded %llu frames from %s", (unsigned long long)source->frames_count, filename);
+	return CHIAKI_ERR_SUCCESS;
+
+error_buf:
+	free(source->header);
+	free(source->frames);
+	free(source->buf);
+error_file:
+	if(f)
+		fclose(f);
+	memset(source, 0, sizeof(*source));
+	return err;
+}
+
+ChiakiErrorCode chiaki_emu_video_source_init_synthetic(ChiakiEmuVideoSource *source, size_t frame_size)
+{
+	static const uint8_t header[] = {
+		0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1f, 0xac, // SPS stub
+		0, 0, 0, 1, 0x68, 0xee, 0x3c, 0xb0 // PPS stub
+	};
+
+	memset(source, 0, sizeof(*source));
+	if(frame_size < 8)
+		frame_size = 8;
+	source->loop = true;
+	source->buf_size = frame_size;
+	source->buf = malloc(frame_size);
+	source->frames = malloc(2 * sizeof(size_t));
+	source->header = malloc(sizeof(header));
+	if(!source->buf || !source->frames || !source->header)
+	{
+		chiaki_emu_video_source_fini(source);
+		return CHIAKI_ERR_MEMORY;
+	}
+	memcpy(source->header, header, sizeof(header));
+	source->header_size = sizeof(header);
+
+	// non-IDR slice NAL followed by a fixed pattern without start codes
+	source->buf[0] = 0;
+	source->buf[1] = 0;
+	source->buf[2] = 0;
+	source->buf[3] = 1;
+	source->buf[4] = 0x41;
+	for(size_t i=5; i<frame_size; i++)
+		source->buf[i] = (uint8_t)(i * 0x9d + 0x11) | 0x80;
+
+	source->frames[0] = 0;
+	source->frames[1] = frame_size;
+	source->frames_count = 1;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+void chiaki_emu_video_source_fini(ChiakiEmuVideoSource *source)
+{
+	free(source->header);
+	free(source->frames);
+	free(source->buf);
+	memset(source, 0, sizeof(*source));
+}
+
+bool chiaki_emu_video_source_next(ChiakiEmuVideoSource *source, const uint8_t **frame, size_t *frame_size)
+{
+	if(source->frame_cur >= source->frames_count)
+	{
+		if(!source->loop || !source->frames_count)
+			return false;
+		source->frame_cur = 0;
+	}
+	size_t start = source->frames[source->frame_cur];
+	*frame = source->buf + start;
+	*frame_size = source->frames[source->frame_cur + 1] - start;
+	source->frame_cur++;
+	return true;
+}
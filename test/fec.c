@@ -78,6 +78,38 @@ static MunitResult test_fec(const MunitParameter params[], void *test_user)
 	return test_fec_case(&fec_test_cases[test_case_id]);
 }
 
+static MunitResult test_fec_encode(const MunitParameter params[], void *test_user)
+{
+	const unsigned int k = 7;
+	const unsigned int m = 3;
+	const size_t unit_size = 0x51;
+	size_t frame_buffer_size = unit_size * (k + m);
+
+	uint8_t *frame_buffer_ref = malloc(frame_buffer_size);
+	munit_assert_not_null(frame_buffer_ref);
+	uint8_t *frame_buffer = malloc(frame_buffer_size);
+	munit_assert_not_null(frame_buffer);
+
+	munit_rand_memory(unit_size * k, frame_buffer_ref);
+	memset(frame_buffer_ref + unit_size * k, 0, unit_size * m);
+	ChiakiErrorCode err = chiaki_fec_encode(frame_buffer_ref, unit_size, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	memcpy(frame_buffer, frame_buffer_ref, frame_buffer_size);
+
+	const unsigned int erasures[] = { 0, 4, 8 };
+	for(size_t i=0; i<sizeof(erasures) / sizeof(erasures[0]); i++)
+		memset(frame_buffer + unit_size * erasures[i], 0x42, unit_size);
+
+	err = chiaki_fec_decode(frame_buffer, unit_size, k, m, erasures, sizeof(erasures) / sizeof(erasures[0]));
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert_memory_equal(k * unit_size, frame_buffer, frame_buffer_ref);
+
+	free(frame_buffer);
+	free(frame_buffer_ref);
+	return MUNIT_OK;
+}
+
 MunitTest tests_fec[] = {
 	{
 		"/fec",
@@ -87,5 +119,13 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/fec_encode",
+		test_fec_encode,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
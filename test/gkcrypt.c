@@ -20,6 +20,8 @@
 #include <chiaki/ecdh.h>
 #include <chiaki/gkcrypt.h>
 
+#include "test_log.h"
+
 static MunitResult test_ecdh(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0xfc, 0x5d, 0x4b, 0xa0, 0x3a, 0x35, 0x3a, 0xbb, 0x6a, 0x7f, 0xac, 0x79, 0x1b, 0x17, 0xbb, 0x34 };
@@ -74,10 +76,10 @@ static MunitResult test_key_stream(const MunitParameter params[], void *user)
 	static const uint8_t gkcrypt_iv[] = { 0x2a, 0xe1, 0xbb, 0x3d, 0x84, 0xdc, 0x9a, 0xa9, 0xc3, 0x52, 0xa4, 0xcf, 0x3f, 0xfb, 0x8b, 0x72 };
 	static const uint8_t key_stream[] = { 0xf, 0x6d, 0x89, 0x85, 0x5b, 0xa7, 0x86, 0x74, 0x5b, 0xa1, 0xfe, 0x5c, 0x81, 0x19, 0x6c, 0xd5, 0x54, 0xc4, 0x1c, 0xca, 0xf6, 0xe9, 0x34, 0xa4, 0x89, 0x26, 0x98, 0xb0, 0x62, 0x12, 0xb3, 0x1a };
 
-	ChiakiLog log;
+	ChiakiLog *log = get_test_log();
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 42, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, log, 0, NULL, 42, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -108,10 +110,10 @@ static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 	static const uint8_t clear_data[] = { 0x4e, 0x61, 0x9f, 0x94, 0x5d, 0x4b, 0x8e, 0xbd, 0x2a, 0x15, 0x4d, 0x3, 0x6a, 0xcd, 0x49, 0x56, 0x9c, 0xc7, 0x5c, 0xe3, 0xe7, 0x0, 0x17, 0x9a, 0x38, 0xd9, 0x69, 0x53, 0x45, 0xf9, 0xc, 0xb5, 0x8c, 0x5, 0x65, 0xf, 0x70 };
 	static const uint8_t enc_data[] = { 0x23, 0xf4, 0x8d, 0xd8, 0xaa, 0xf9, 0x58, 0x9b, 0xb1, 0x94, 0x4f, 0xad, 0x2b, 0x8d, 0xaa, 0x8d, 0x25, 0x88, 0xfa, 0xf8, 0xb6, 0xd4, 0x17, 0xf4, 0x5f, 0x78, 0xec, 0xf5, 0x4e, 0x37, 0x20, 0xb0, 0x76, 0x81, 0x7, 0x67, 0x9a };
 
-	ChiakiLog log;
+	ChiakiLog *log = get_test_log();
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 42, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, log, 0, NULL, 42, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -308,12 +310,22 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 	static const size_t key_pos = 0x6b1de0; // % CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS == 0
 	static const uint8_t gmac_expected[] = { 0x20, 0xcc, 0xa5, 0xf1 };
 
-	ChiakiLog log;
+	ChiakiLog *log = get_test_log();
 	ChiakiGKCrypt gkcrypt;
-	chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+	chiaki_gkcrypt_init(&gkcrypt, log, 0, NULL, crypt_index, handshake_key, ecdh_secret);
 
+	// without touching the cached key
+	uint8_t gmac_key[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	chiaki_gkcrypt_gen_tmp_gmac_key(&gkcrypt, chiaki_gkcrypt_gmac_key_index(key_pos), gmac_key);
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
-	ChiakiErrorCode err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, data, sizeof(data), gmac);
+	ChiakiErrorCode err = chiaki_gkcrypt_gmac_with_key(&gkcrypt, gmac_key, key_pos, data, sizeof(data), gmac);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+
+	munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+	munit_assert_uint64(gkcrypt.key_gmac_index_current, ==, 0);
+
+	err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, data, sizeof(data), gmac);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -0,0 +1,216 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <munit.h>
+
+#include <chiaki/h264.h>
+#include <chiaki/frameprocessor.h>
+
+#include <string.h>
+
+#include "test_log.h"
+
+// SPS, PPS and two slices of an IDR picture, the second slice with an emulation prevention byte in its header
+static const uint8_t frame_idr[] = {
+	0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x1f, 0xac,
+	0x00, 0x00, 0x00, 0x01, 0x68, 0xee, 0x3c, 0x80,
+	0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x00, 0x33, 0xff,
+	0x00, 0x00, 0x01, 0x65, 0x00, 0x00, 0x03, 0x01, 0xb8, 0x84, 0x00, 0x33
+};
+
+// P slice with nal_ref_idc 2
+static const uint8_t frame_ref[] = {
+	0x00, 0x00, 0x00, 0x01, 0x41, 0x9a, 0x02, 0x04, 0x11
+};
+
+// B slice with nal_ref_idc 0
+static const uint8_t frame_nonref[] = {
+	0x00, 0x00, 0x00, 0x01, 0x01, 0x9e, 0x02, 0x04, 0x11
+};
+
+static MunitResult test_inspect(const MunitParameter params[], void *user)
+{
+	ChiakiH264FrameInfo info;
+
+	chiaki_h264_frame_inspect(frame_idr, sizeof(frame_idr), &info);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_IDR);
+	munit_assert_int(info.slice_type, ==, CHIAKI_H264_SLICE_TYPE_I);
+	munit_assert_uint(info.slices, ==, 2);
+	munit_assert_true(info.has_sps);
+	munit_assert_true(info.has_pps);
+
+	chiaki_h264_frame_inspect(frame_ref, sizeof(frame_ref), &info);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_REF);
+	munit_assert_int(info.slice_type, ==, CHIAKI_H264_SLICE_TYPE_P);
+	munit_assert_uint(info.slices, ==, 1);
+	munit_assert_false(info.has_sps);
+	munit_assert_false(info.has_pps);
+
+	chiaki_h264_frame_inspect(frame_nonref, sizeof(frame_nonref), &info);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_NONREF);
+	munit_assert_int(info.slice_type, ==, CHIAKI_H264_SLICE_TYPE_B);
+	munit_assert_uint(info.slices, ==, 1);
+
+	// only parameter sets
+	chiaki_h264_frame_inspect(frame_idr, 17, &info);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_UNKNOWN);
+	munit_assert_uint(info.slices, ==, 0);
+	munit_assert_true(info.has_sps);
+	munit_assert_true(info.has_pps);
+
+	chiaki_h264_frame_inspect(NULL, 0, &info);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_UNKNOWN);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_trim_incomplete(const MunitParameter params[], void *user)
+{
+	// data missing only at the end still cuts off the last slice
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), sizeof(frame_idr)), ==, 26);
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, 26, 26), ==, 17);
+
+	// data missing in the second slice cuts off exactly that slice
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), 33), ==, 26);
+
+	// data missing in the first slice also cuts off everything after it
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), 23), ==, 17);
+
+	// neither does a start code directly after the missing data
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), 26), ==, 17);
+
+	// a start code that is cut off itself does not tell whether the slice before it is complete
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), 28), ==, 17);
+
+	// leading zero of a 4 byte start code is cut off too
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), 14), ==, 9);
+
+	munit_assert_size(chiaki_h264_trim_incomplete(frame_idr, sizeof(frame_idr), 0), ==, 0);
+
+	ChiakiH264FrameInfo info;
+	chiaki_h264_frame_inspect(frame_idr, 26, &info);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_IDR);
+	munit_assert_uint(info.slices, ==, 1);
+
+	return MUNIT_OK;
+}
+
+#define DROP_UNIT_PAYLOAD_SIZE 8
+
+/**
+ * Split frame_idr into units of a frame without FEC data, drop one and flush it
+ * like the video receiver does for a frame that could not be recovered.
+ */
+static void flush_dropped_unit(ChiakiFrameProcessor *frame_processor, unsigned int unit_dropped, size_t *intact_size, size_t *trimmed_size, ChiakiH264FrameInfo *info)
+{
+	const unsigned int units_source = (sizeof(frame_idr) + DROP_UNIT_PAYLOAD_SIZE - 1) / DROP_UNIT_PAYLOAD_SIZE;
+	bool allocated = false;
+	for(unsigned int i=0; i<units_source; i++)
+	{
+		if(i == unit_dropped)
+			continue;
+		// every unit starts with the 2 byte buf size extension, 0 because the first unit is the largest
+		uint8_t unit[2 + DROP_UNIT_PAYLOAD_SIZE] = { 0 };
+		size_t payload_size = sizeof(frame_idr) - i * DROP_UNIT_PAYLOAD_SIZE;
+		if(payload_size > DROP_UNIT_PAYLOAD_SIZE)
+			payload_size = DROP_UNIT_PAYLOAD_SIZE;
+		memcpy(unit + 2, frame_idr + i * DROP_UNIT_PAYLOAD_SIZE, payload_size);
+
+		ChiakiTakionAVPacket packet = { 0 };
+		packet.is_video = true;
+		packet.unit_index = (uint16_t)i;
+		packet.units_in_frame_total = (uint16_t)(units_source + 1);
+		packet.units_in_frame_fec = 1;
+		packet.data = unit;
+		packet.data_size = 2 + payload_size;
+		if(!allocated)
+		{
+			munit_assert_int(chiaki_frame_processor_alloc_frame(frame_processor, &packet), ==, CHIAKI_ERR_SUCCESS);
+			allocated = true;
+		}
+		munit_assert_int(chiaki_frame_processor_put_unit(frame_processor, &packet), ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	uint8_t *frame;
+	size_t frame_size;
+	munit_assert_int(chiaki_frame_processor_flush(frame_processor, &frame, &frame_size), ==, CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED);
+	*intact_size = frame_processor->flush_intact_size;
+	*trimmed_size = chiaki_h264_trim_incomplete(frame, frame_size, *intact_size);
+	munit_assert_memory_equal(*trimmed_size, frame, frame_idr);
+	chiaki_h264_frame_inspect(frame, *trimmed_size, info);
+}
+
+static MunitResult test_frame_processor_drop(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	size_t intact_size;
+	size_t trimmed_size;
+	ChiakiH264FrameInfo info;
+
+	// unit 3 holds the start code of the second slice
+	flush_dropped_unit(&frame_processor, 3, &intact_size, &trimmed_size, &info);
+	munit_assert_size(intact_size, ==, 24);
+	munit_assert_size(trimmed_size, ==, 17);
+	munit_assert_uint(info.slices, ==, 0);
+
+	// unit 4 holds the end of the second slice
+	flush_dropped_unit(&frame_processor, 4, &intact_size, &trimmed_size, &info);
+	munit_assert_size(intact_size, ==, 32);
+	munit_assert_size(trimmed_size, ==, 26);
+	munit_assert_int(info.type, ==, CHIAKI_H264_FRAME_TYPE_IDR);
+	munit_assert_uint(info.slices, ==, 1);
+
+	// only the parameter sets are intact
+	flush_dropped_unit(&frame_processor, 2, &intact_size, &trimmed_size, &info);
+	munit_assert_size(intact_size, ==, 16);
+	munit_assert_size(trimmed_size, ==, 9);
+	munit_assert_uint(info.slices, ==, 0);
+
+	chiaki_frame_processor_fini(&frame_processor);
+	return MUNIT_OK;
+}
+
+MunitTest tests_h264[] = {
+	{
+		"/inspect",
+		test_inspect,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/trim_incomplete",
+		test_trim_incomplete,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/frame_processor_drop",
+		test_frame_processor_drop,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,450 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <munit.h>
+
+#include <chiaki/impairment.h>
+#include <chiaki/frameprocessor.h>
+#include <chiaki/fec.h>
+
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "test_log.h"
+
+#define PACKETS_COUNT 2000
+
+/**
+ * Push packets containing their index and record the indices in the order they are delivered.
+ * @return number of delivered packets
+ */
+static size_t run_indices(const ChiakiImpairmentConfig *config, uint32_t *delivered, size_t delivered_max)
+{
+	ChiakiImpairment impairment;
+	chiaki_impairment_init(&impairment, config);
+	size_t delivered_count = 0;
+	for(uint32_t i=0; i<PACKETS_COUNT; i++)
+	{
+		ChiakiErrorCode err = chiaki_impairment_push(&impairment, (uint8_t *)&i, sizeof(i), i);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		uint32_t v;
+		size_t v_size = sizeof(v);
+		while(chiaki_impairment_pop(&impairment, i, (uint8_t *)&v, &v_size))
+		{
+			munit_assert_size(v_size, ==, sizeof(v));
+			munit_assert_size(delivered_count, <, delivered_max);
+			delivered[delivered_count++] = v;
+		}
+	}
+	chiaki_impairment_fini(&impairment);
+	return delivered_count;
+}
+
+static MunitResult test_passthrough(const MunitParameter params[], void *user)
+{
+	static uint32_t delivered[PACKETS_COUNT];
+	size_t count = run_indices(NULL, delivered, PACKETS_COUNT);
+	munit_assert_size(count, ==, PACKETS_COUNT);
+	for(uint32_t i=0; i<PACKETS_COUNT; i++)
+		munit_assert_uint32(delivered[i], ==, i);
+	return MUNIT_OK;
+}
+
+static MunitResult test_deterministic(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.seed = 1337;
+	config.loss = 0.05;
+	config.burst_loss_start = 0.01;
+	config.burst_loss_end = 0.25;
+	config.duplicate = 0.02;
+	config.reorder = 0.05;
+	config.reorder_depth = 3;
+
+	static uint32_t a[PACKETS_COUNT * 2];
+	static uint32_t b[PACKETS_COUNT * 2];
+	size_t a_count = run_indices(&config, a, PACKETS_COUNT * 2);
+	size_t b_count = run_indices(&config, b, PACKETS_COUNT * 2);
+	munit_assert_size(a_count, ==, b_count);
+	munit_assert_memory_equal(a_count * sizeof(uint32_t), a, b);
+
+	config.seed = 1338;
+	b_count = run_indices(&config, b, PACKETS_COUNT * 2);
+	munit_assert_false(a_count == b_count && memcmp(a, b, a_count * sizeof(uint32_t)) == 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_loss(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.seed = 42;
+	config.loss = 0.1;
+
+	ChiakiImpairment impairment;
+	chiaki_impairment_init(&impairment, &config);
+	uint8_t buf[0x10] = { 0 };
+	for(size_t i=0; i<PACKETS_COUNT; i++)
+		chiaki_impairment_push(&impairment, buf, sizeof(buf), 0);
+	size_t delivered = 0;
+	size_t buf_size = sizeof(buf);
+	while(chiaki_impairment_pop(&impairment, 0, buf, &buf_size))
+		delivered++;
+
+	munit_assert_uint64(impairment.stats.packets, ==, PACKETS_COUNT);
+	munit_assert_uint64(impairment.stats.delivered, ==, delivered);
+	munit_assert_uint64(impairment.stats.lost_random + delivered, ==, PACKETS_COUNT);
+	// 10% of 2000, very generous bounds
+	munit_assert_uint64(impairment.stats.lost_random, >, 100);
+	munit_assert_uint64(impairment.stats.lost_random, <, 300);
+	chiaki_impairment_fini(&impairment);
+	return MUNIT_OK;
+}
+
+static MunitResult test_loss_first(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.loss_first = 3;
+
+	static uint32_t delivered[PACKETS_COUNT];
+	size_t count = run_indices(&config, delivered, PACKETS_COUNT);
+	munit_assert_size(count, ==, PACKETS_COUNT - 3);
+	for(uint32_t i=0; i<count; i++)
+		munit_assert_uint32(delivered[i], ==, i + 3);
+	return MUNIT_OK;
+}
+
+static MunitResult test_reorder(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.seed = 7;
+	config.reorder = 0.2;
+	config.reorder_depth = 4;
+
+	static uint32_t delivered[PACKETS_COUNT];
+	size_t count = run_indices(&config, delivered, PACKETS_COUNT);
+
+	// packets held back at the very end are not released before their hold time expires
+	munit_assert_size(count, <=, PACKETS_COUNT);
+	munit_assert_size(count, >=, PACKETS_COUNT - config.reorder_depth);
+
+	static uint8_t seen[PACKETS_COUNT];
+	memset(seen, 0, sizeof(seen));
+	size_t out_of_order = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		uint32_t v = delivered[i];
+		munit_assert_uint32(v, <, PACKETS_COUNT);
+		munit_assert_uint8(seen[v], ==, 0);
+		seen[v] = 1;
+		// a packet can be overtaken by at most reorder_depth packets
+		munit_assert_size(i, <=, v + config.reorder_depth);
+		if(i > 0 && v < delivered[i-1])
+			out_of_order++;
+	}
+	munit_assert_size(out_of_order, >, 0);
+	return MUNIT_OK;
+}
+
+static MunitResult test_reorder_hold(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.reorder = 1.0;
+	config.reorder_depth = 3;
+	config.reorder_hold_ms = 10;
+	config.delay_ms = 5;
+
+	ChiakiImpairment impairment;
+	chiaki_impairment_init(&impairment, &config);
+
+	uint32_t v = 1;
+	ChiakiErrorCode err = chiaki_impairment_push(&impairment, (uint8_t *)&v, sizeof(v), 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(chiaki_impairment_next_due_us(&impairment), ==, 10000);
+
+	// no packet follows, so it is only released once its hold time expired, then delayed as usual
+	size_t v_size = sizeof(v);
+	munit_assert_false(chiaki_impairment_pop(&impairment, 9999, (uint8_t *)&v, &v_size));
+	munit_assert_false(chiaki_impairment_pop(&impairment, 10000, (uint8_t *)&v, &v_size));
+	munit_assert_uint64(chiaki_impairment_next_due_us(&impairment), ==, 15000);
+	munit_assert_true(chiaki_impairment_pop(&impairment, 15000, (uint8_t *)&v, &v_size));
+	munit_assert_uint32(v, ==, 1);
+
+	// packets released after their hold time keep their order
+	v = 2;
+	err = chiaki_impairment_push(&impairment, (uint8_t *)&v, sizeof(v), 20000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	v = 3;
+	err = chiaki_impairment_push(&impairment, (uint8_t *)&v, sizeof(v), 25000);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_true(chiaki_impairment_pop(&impairment, 40000, (uint8_t *)&v, &v_size));
+	munit_assert_uint32(v, ==, 2);
+	munit_assert_true(chiaki_impairment_pop(&impairment, 40000, (uint8_t *)&v, &v_size));
+	munit_assert_uint32(v, ==, 3);
+	munit_assert_false(chiaki_impairment_pop(&impairment, 40000, (uint8_t *)&v, &v_size));
+	munit_assert_uint64(chiaki_impairment_next_due_us(&impairment), ==, UINT64_MAX);
+
+	chiaki_impairment_fini(&impairment);
+	return MUNIT_OK;
+}
+
+static MunitResult test_delay_bandwidth(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.delay_ms = 10;
+	config.bandwidth_kbps = 1000;
+	config.queue_ms = 15;
+
+	ChiakiImpairment impairment;
+	chiaki_impairment_init(&impairment, &config);
+
+	// 1250 bytes take 10ms at 1000kbit/s
+	uint8_t buf[1250] = { 0 };
+	for(size_t i=0; i<3; i++)
+	{
+		buf[0] = (uint8_t)i;
+		chiaki_impairment_push(&impairment, buf, sizeof(buf), 0);
+	}
+	munit_assert_uint64(impairment.stats.lost_queue, ==, 1);
+	munit_assert_uint64(chiaki_impairment_next_due_us(&impairment), ==, 20000);
+
+	size_t buf_size = sizeof(buf);
+	munit_assert_false(chiaki_impairment_pop(&impairment, 19999, buf, &buf_size));
+	munit_assert_true(chiaki_impairment_pop(&impairment, 20000, buf, &buf_size));
+	munit_assert_size(buf_size, ==, sizeof(buf));
+	munit_assert_uint8(buf[0], ==, 0);
+	munit_assert_uint64(chiaki_impairment_next_due_us(&impairment), ==, 30000);
+	buf_size = sizeof(buf);
+	munit_assert_true(chiaki_impairment_pop(&impairment, 30000, buf, &buf_size));
+	munit_assert_uint8(buf[0], ==, 1);
+	munit_assert_uint64(chiaki_impairment_next_due_us(&impairment), ==, UINT64_MAX);
+
+	chiaki_impairment_fini(&impairment);
+	return MUNIT_OK;
+}
+
+#define FEC_FRAMES_COUNT 200
+#define FEC_UNITS_SOURCE 20
+#define FEC_UNITS_FEC 4
+#define FEC_UNIT_SIZE 0x40
+
+typedef struct fec_report_t
+{
+	unsigned int frames_complete;
+	unsigned int frames_recovered;
+	unsigned int frames_lost;
+} FECReport;
+
+/**
+ * Send FEC protected frames over an impaired link into a frame processor.
+ */
+static void run_fec(const ChiakiImpairmentConfig *config, FECReport *report)
+{
+	memset(report, 0, sizeof(*report));
+	const size_t units_total = FEC_UNITS_SOURCE + FEC_UNITS_FEC;
+	const size_t packet_size = 2 + FEC_UNIT_SIZE; // unit index followed by the unit
+
+	uint8_t *frame_buf = malloc(units_total * FEC_UNIT_SIZE);
+	munit_assert_not_null(frame_buf);
+	uint8_t packet_buf[2 + FEC_UNIT_SIZE];
+
+	ChiakiImpairment impairment;
+	chiaki_impairment_init(&impairment, config);
+	ChiakiFrameProcessor frame_processor;
+	chiaki_frame_processor_init(&frame_processor, get_test_log());
+
+	for(unsigned int frame=0; frame<FEC_FRAMES_COUNT; frame++)
+	{
+		// source units only carry the padding size and a pattern depending on frame and unit
+		memset(frame_buf, 0, units_total * FEC_UNIT_SIZE);
+		for(size_t i=0; i<FEC_UNITS_SOURCE; i++)
+		{
+			uint8_t *unit = frame_buf + i * FEC_UNIT_SIZE;
+			for(size_t j=2; j<FEC_UNIT_SIZE; j++)
+				unit[j] = (uint8_t)(frame * 31 + i * 7 + j);
+		}
+		ChiakiErrorCode err = chiaki_fec_encode(frame_buf, FEC_UNIT_SIZE, FEC_UNITS_SOURCE, FEC_UNITS_FEC);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		for(size_t i=0; i<units_total; i++)
+		{
+			uint16_t unit_index = (uint16_t)i;
+			memcpy(packet_buf, &unit_index, sizeof(unit_index));
+			memcpy(packet_buf + 2, frame_buf + i * FEC_UNIT_SIZE, FEC_UNIT_SIZE);
+			err = chiaki_impairment_push(&impairment, packet_buf, packet_size, 0);
+			munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		}
+
+		bool allocated = false;
+		size_t buf_size = sizeof(packet_buf);
+		while(chiaki_impairment_pop(&impairment, 0, packet_buf, &buf_size))
+		{
+			munit_assert_size(buf_size, ==, packet_size);
+			ChiakiTakionAVPacket packet = { 0 };
+			packet.is_video = true;
+			packet.frame_index = (ChiakiSeqNum16)frame;
+			uint16_t unit_index;
+			memcpy(&unit_index, packet_buf, sizeof(unit_index));
+			packet.unit_index = unit_index;
+			packet.units_in_frame_total = (uint16_t)units_total;
+			packet.units_in_frame_fec = FEC_UNITS_FEC;
+			packet.data = packet_buf + 2;
+			packet.data_size = FEC_UNIT_SIZE;
+			if(!allocated)
+			{
+				err = chiaki_frame_processor_alloc_frame(&frame_processor, &packet);
+				munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+				allocated = true;
+			}
+			chiaki_frame_processor_put_unit(&frame_processor, &packet);
+			buf_size = sizeof(packet_buf);
+		}
+
+		if(!allocated)
+		{
+			report->frames_lost++;
+			continue;
+		}
+
+		uint8_t *frame_out;
+		size_t frame_out_size;
+		ChiakiFrameProcessorFlushResult result = chiaki_frame_processor_flush(&frame_processor, &frame_out, &frame_out_size);
+		switch(result)
+		{
+			case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS:
+			case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS:
+				munit_assert_size(frame_out_size, ==, FEC_UNITS_SOURCE * (FEC_UNIT_SIZE - 2));
+				for(size_t i=0; i<FEC_UNITS_SOURCE; i++)
+				{
+					for(size_t j=2; j<FEC_UNIT_SIZE; j++)
+						munit_assert_uint8(frame_out[i * (FEC_UNIT_SIZE - 2) + j - 2], ==, (uint8_t)(frame * 31 + i * 7 + j));
+				}
+				if(result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS)
+					report->frames_complete++;
+				else
+					report->frames_recovered++;
+				break;
+			default:
+				report->frames_lost++;
+				break;
+		}
+	}
+
+	chiaki_frame_processor_fini(&frame_processor);
+	chiaki_impairment_fini(&impairment);
+	free(frame_buf);
+}
+
+static MunitResult test_fec_recovery(const MunitParameter params[], void *user)
+{
+	ChiakiImpairmentConfig config = { 0 };
+	config.seed = 0xc4a1;
+	config.loss = 0.03;
+	config.burst_loss_start = 0.002;
+	config.burst_loss_end = 0.3;
+
+	FECReport report;
+	run_fec(&config, &report);
+	munit_logf(MUNIT_LOG_INFO, "frames complete: %u, recovered: %u, lost: %u",
+			report.frames_complete, report.frames_recovered, report.frames_lost);
+	munit_assert_uint(report.frames_complete + report.frames_recovered + report.frames_lost, ==, FEC_FRAMES_COUNT);
+	munit_assert_uint(report.frames_recovered, >, 0);
+
+	// same seed, same report
+	FECReport report2;
+	run_fec(&config, &report2);
+	munit_assert_memory_equal(sizeof(report), &report, &report2);
+
+	// without loss, nothing needs to be recovered
+	run_fec(NULL, &report);
+	munit_assert_uint(report.frames_complete, ==, FEC_FRAMES_COUNT);
+	return MUNIT_OK;
+}
+
+MunitTest tests_impairment[] = {
+	{
+		"/passthrough",
+		test_passthrough,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/deterministic",
+		test_deterministic,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss_first",
+		test_loss_first,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/reorder",
+		test_reorder,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/reorder_hold",
+		test_reorder_hold,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/delay_bandwidth",
+		test_delay_bandwidth,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_recovery",
+		test_fec_recovery,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
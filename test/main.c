@@ -25,6 +25,15 @@ extern MunitTest tests_gkcrypt[];
 extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
 extern MunitTest tests_regist[];
+extern MunitTest tests_async_log[];
+extern MunitTest tests_impairment[];
+extern MunitTest tests_recorder[];
+extern MunitTest tests_senkusha_cache[];
+extern MunitTest tests_datagram[];
+extern MunitTest tests_h264[];
+extern MunitTest tests_thread[];
+extern MunitTest tests_allocator[];
+extern MunitTest tests_discovery_service[];
 
 static MunitSuite suites[] = {
 	{
@@ -83,6 +92,69 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/async_log",
+		tests_async_log,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/impairment",
+		tests_impairment,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/recorder",
+		tests_recorder,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/senkusha_cache",
+		tests_senkusha_cache,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/datagram",
+		tests_datagram,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/h264",
+		tests_h264,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/thread",
+		tests_thread,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/allocator",
+		tests_allocator,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/discovery_service",
+		tests_discovery_service,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
 };
 
@@ -0,0 +1,317 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/recorder.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test_log.h"
+
+#define TEST_FILENAME "chiaki-test-recorder.mkv"
+
+static const uint8_t header_a[] = {
+	0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9, // SPS
+	0, 0, 0, 1, 0x68, 0xee, 0x3c, 0xb0, // PPS
+	0, 0, 0, 0, 0, 0 // padding as sent by the console
+};
+
+static const uint8_t header_b[] = {
+	0, 0, 0, 1, 0x67, 0x4d, 0x00, 0x28, 0xab, // SPS
+	0, 0, 1, 0x68, 0xce, 0x38, 0x80 // PPS
+};
+
+static const uint8_t frame_idr[] = { 0, 0, 0, 1, 0x65, 0x88, 0x84, 0x21, 0xa0, 0, 0, 1, 0x65, 0x01, 0x02 };
+static const uint8_t frame_p[] = { 0, 0, 0, 1, 0x41, 0x9a, 0x1c, 0x0d };
+static const uint8_t opus_frame[] = { 0xfc, 0xff, 0xfe, 0x01, 0x02 };
+
+typedef struct mkv_reader_t
+{
+	const uint8_t *buf;
+	size_t size;
+	size_t pos;
+} MkvReader;
+
+#define MKV_SIZE_UNKNOWN UINT64_MAX
+
+static bool mkv_read_vint(MkvReader *reader, uint64_t *v, bool keep_marker)
+{
+	if(reader->pos >= reader->size)
+		return false;
+	uint8_t first = reader->buf[reader->pos];
+	size_t len = 1;
+	while(len <= 8 && !(first & (0x80 >> (len - 1))))
+		len++;
+	if(len > 8 || reader->pos + len > reader->size)
+		return false;
+	uint64_t r = keep_marker ? first : first & (0xff >> len);
+	bool all_ones = r == (0xff >> len);
+	for(size_t i=1; i<len; i++)
+	{
+		uint8_t b = reader->buf[reader->pos + i];
+		all_ones = all_ones && b == 0xff;
+		r = (r << 8) | b;
+	}
+	reader->pos += len;
+	*v = !keep_marker && all_ones ? MKV_SIZE_UNKNOWN : r;
+	return true;
+}
+
+static bool mkv_read_element(MkvReader *reader, uint64_t *id, uint64_t *size)
+{
+	return mkv_read_vint(reader, id, true) && mkv_read_vint(reader, size, false);
+}
+
+static uint8_t *read_file(size_t *size)
+{
+	FILE *f = fopen(TEST_FILENAME, "rb");
+	munit_assert_not_null(f);
+	fseek(f, 0, SEEK_END);
+	*size = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf = malloc(*size);
+	munit_assert_not_null(buf);
+	munit_assert_size(fread(buf, 1, *size, f), ==, *size);
+	fclose(f);
+	remove(TEST_FILENAME);
+	return buf;
+}
+
+typedef struct mkv_summary_t
+{
+	bool doc_type_matroska;
+	size_t track_entries;
+	uint8_t video_codec_private[0x40];
+	size_t video_codec_private_size;
+	size_t blocks[3]; // per track
+	uint8_t blocks_flags[0x10];
+	uint8_t *block_payloads[0x10];
+	size_t block_payload_sizes[0x10];
+	size_t blocks_total;
+} MkvSummary;
+
+static void mkv_parse(MkvReader *reader, size_t end, MkvSummary *summary, uint64_t track_number)
+{
+	while(reader->pos < end)
+	{
+		uint64_t id, size;
+		munit_assert_true(mkv_read_element(reader, &id, &size));
+		size_t child_end = size == MKV_SIZE_UNKNOWN ? end : reader->pos + (size_t)size;
+		munit_assert_size(child_end, <=, end);
+		switch(id)
+		{
+			case 0x1a45dfa3: // EBML
+			case 0x18538067: // Segment
+			case 0x1654ae6b: // Tracks
+			case 0x1f43b675: // Cluster
+				// unknown sized clusters end at the next cluster, which works out with this recursion
+				mkv_parse(reader, child_end, summary, 0);
+				break;
+			case 0xae: // TrackEntry
+			{
+				summary->track_entries++;
+				size_t start = reader->pos;
+				uint64_t number = 0;
+				// find the track number first
+				while(reader->pos < child_end)
+				{
+					uint64_t cid, csize;
+					munit_assert_true(mkv_read_element(reader, &cid, &csize));
+					if(cid == 0xd7)
+						number = reader->buf[reader->pos];
+					reader->pos += (size_t)csize;
+				}
+				reader->pos = start;
+				mkv_parse(reader, child_end, summary, number);
+				break;
+			}
+			case 0x4282: // DocType
+				summary->doc_type_matroska = size == 8 && memcmp(reader->buf + reader->pos, "matroska", 8) == 0;
+				reader->pos = child_end;
+				break;
+			case 0x63a2: // CodecPrivate
+				if(track_number == 1)
+				{
+					munit_assert_size(size, <=, sizeof(summary->video_codec_private));
+					memcpy(summary->video_codec_private, reader->buf + reader->pos, (size_t)size);
+					summary->video_codec_private_size = (size_t)size;
+				}
+				reader->pos = child_end;
+				break;
+			case 0xa3: // SimpleBlock
+			{
+				uint64_t track;
+				munit_assert_true(mkv_read_vint(reader, &track, false));
+				munit_assert_uint64(track, >=, 1);
+				munit_assert_uint64(track, <=, 2);
+				summary->blocks[track]++;
+				reader->pos += 2; // timestamp
+				size_t i = summary->blocks_total++;
+				munit_assert_size(i, <, 0x10);
+				summary->blocks_flags[i] = reader->buf[reader->pos++] | (uint8_t)track;
+				summary->block_payloads[i] = (uint8_t *)reader->buf + reader->pos;
+				summary->block_payload_sizes[i] = child_end - reader->pos;
+				reader->pos = child_end;
+				break;
+			}
+			default:
+				reader->pos = child_end;
+				break;
+		}
+	}
+}
+
+static MunitResult test_mkv(const MunitParameter params[], void *user)
+{
+	ChiakiRecorder recorder;
+	ChiakiErrorCode err = chiaki_recorder_init(&recorder, get_test_log(), TEST_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiAudioHeader audio_header = { 0 };
+	audio_header.channels = 2;
+	audio_header.bits = 16;
+	audio_header.rate = 48000;
+	audio_header.frame_size = 480;
+	chiaki_recorder_audio_header(&recorder, &audio_header);
+
+	// audio before the first video frame can't be recorded
+	chiaki_recorder_audio_frame(&recorder, opus_frame, sizeof(opus_frame));
+
+	ChiakiVideoProfile profile = { 1280, 720, sizeof(header_a), (uint8_t *)header_a };
+	chiaki_recorder_video_profile(&recorder, &profile);
+	chiaki_recorder_video_frame(&recorder, frame_idr, sizeof(frame_idr));
+	chiaki_recorder_audio_frame(&recorder, opus_frame, sizeof(opus_frame));
+	chiaki_recorder_video_frame(&recorder, frame_p, sizeof(frame_p));
+	chiaki_recorder_audio_frame(&recorder, opus_frame, sizeof(opus_frame));
+	chiaki_recorder_video_frame(&recorder, frame_p, sizeof(frame_p));
+
+	ChiakiRecorderStats stats;
+	chiaki_recorder_get_stats(&recorder, &stats);
+	munit_assert_uint64(stats.video_frames, ==, 3);
+	munit_assert_uint64(stats.audio_frames, ==, 2);
+	munit_assert_uint64(stats.frames_dropped, ==, 0);
+
+	chiaki_recorder_fini(&recorder);
+
+	size_t size;
+	uint8_t *buf = read_file(&size);
+	MkvReader reader = { buf, size, 0 };
+	MkvSummary summary = { 0 };
+	mkv_parse(&reader, size, &summary, 0);
+
+	munit_assert_true(summary.doc_type_matroska);
+	munit_assert_size(summary.track_entries, ==, 2);
+
+	static const uint8_t avcc_expected[] = {
+		1, 0x64, 0x00, 0x1f, 0xff, 0xe1,
+		0, 6, 0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9,
+		1, 0, 4, 0x68, 0xee, 0x3c, 0xb0
+	};
+	munit_assert_size(summary.video_codec_private_size, ==, sizeof(avcc_expected));
+	munit_assert_memory_equal(sizeof(avcc_expected), summary.video_codec_private, avcc_expected);
+
+	munit_assert_size(summary.blocks[1], ==, 3);
+	munit_assert_size(summary.blocks[2], ==, 2);
+	munit_assert_size(summary.blocks_total, ==, 5);
+
+	// keyframe flag | track number
+	munit_assert_uint8(summary.blocks_flags[0], ==, 0x81);
+	munit_assert_uint8(summary.blocks_flags[1], ==, 0x82);
+	munit_assert_uint8(summary.blocks_flags[2], ==, 0x01);
+
+	static const uint8_t idr_expected[] = {
+		0, 0, 0, 5, 0x65, 0x88, 0x84, 0x21, 0xa0,
+		0, 0, 0, 3, 0x65, 0x01, 0x02
+	};
+	munit_assert_size(summary.block_payload_sizes[0], ==, sizeof(idr_expected));
+	munit_assert_memory_equal(sizeof(idr_expected), summary.block_payloads[0], idr_expected);
+	munit_assert_size(summary.block_payload_sizes[1], ==, sizeof(opus_frame));
+	munit_assert_memory_equal(sizeof(opus_frame), summary.block_payloads[1], opus_frame);
+
+	free(buf);
+	return MUNIT_OK;
+}
+
+static MunitResult test_profile_switch(const MunitParameter params[], void *user)
+{
+	ChiakiRecorder recorder;
+	ChiakiErrorCode err = chiaki_recorder_init(&recorder, get_test_log(), TEST_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiVideoProfile profile = { 1280, 720, sizeof(header_a), (uint8_t *)header_a };
+	chiaki_recorder_video_profile(&recorder, &profile);
+	chiaki_recorder_video_frame(&recorder, frame_idr, sizeof(frame_idr));
+
+	// the new parameter sets are expected in-band with the next frame
+	profile.width = 640;
+	profile.height = 360;
+	profile.header = (uint8_t *)header_b;
+	profile.header_sz = sizeof(header_b);
+	chiaki_recorder_video_profile(&recorder, &profile);
+	chiaki_recorder_video_frame(&recorder, frame_idr, sizeof(frame_idr));
+	chiaki_recorder_video_frame(&recorder, frame_p, sizeof(frame_p));
+	chiaki_recorder_fini(&recorder);
+
+	size_t size;
+	uint8_t *buf = read_file(&size);
+	MkvReader reader = { buf, size, 0 };
+	MkvSummary summary = { 0 };
+	mkv_parse(&reader, size, &summary, 0);
+
+	munit_assert_size(summary.track_entries, ==, 1);
+	munit_assert_size(summary.blocks[1], ==, 3);
+	munit_assert_size(summary.blocks[2], ==, 0);
+
+	static const uint8_t switch_expected[] = {
+		0, 0, 0, 5, 0x67, 0x4d, 0x00, 0x28, 0xab,
+		0, 0, 0, 4, 0x68, 0xce, 0x38, 0x80,
+		0, 0, 0, 5, 0x65, 0x88, 0x84, 0x21, 0xa0,
+		0, 0, 0, 3, 0x65, 0x01, 0x02
+	};
+	munit_assert_size(summary.block_payload_sizes[1], ==, sizeof(switch_expected));
+	munit_assert_memory_equal(sizeof(switch_expected), summary.block_payloads[1], switch_expected);
+
+	static const uint8_t p_expected[] = { 0, 0, 0, 4, 0x41, 0x9a, 0x1c, 0x0d };
+	munit_assert_size(summary.block_payload_sizes[2], ==, sizeof(p_expected));
+	munit_assert_memory_equal(sizeof(p_expected), summary.block_payloads[2], p_expected);
+
+	free(buf);
+	return MUNIT_OK;
+}
+
+MunitTest tests_recorder[] = {
+	{
+		"/mkv",
+		test_mkv,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/profile_switch",
+		test_profile_switch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,174 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/senkushacache.h>
+
+#include <stdio.h>
+#include <time.h>
+
+#define TEST_FILENAME "chiaki-test-senkusha-cache.txt"
+
+static MunitResult test_lookup(const MunitParameter params[], void *user)
+{
+	ChiakiSenkushaCache cache;
+	ChiakiErrorCode err = chiaki_senkusha_cache_init(&cache);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiSenkushaCacheEntry entry;
+	munit_assert_false(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+
+	chiaki_senkusha_cache_store(&cache, "192.168.1.2", "192.168.1.10", 1454, 1400, 2500);
+	chiaki_senkusha_cache_store(&cache, "192.168.1.2", "10.0.0.5", 1300, 1280, 40000);
+
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+	munit_assert_uint32(entry.mtu_in, ==, 1454);
+	munit_assert_uint32(entry.mtu_out, ==, 1400);
+	munit_assert_uint64(entry.rtt_us, ==, 2500);
+
+	// a different interface is a different network path
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "10.0.0.5", &entry));
+	munit_assert_uint32(entry.mtu_in, ==, 1300);
+	munit_assert_false(chiaki_senkusha_cache_lookup(&cache, "192.168.1.3", "192.168.1.10", &entry));
+
+	// refresh
+	chiaki_senkusha_cache_store(&cache, "192.168.1.2", "192.168.1.10", 1454, 1454, 2000);
+	munit_assert_size(cache.entries_count, ==, 2);
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+	munit_assert_uint32(entry.mtu_out, ==, 1454);
+
+	chiaki_senkusha_cache_invalidate(&cache, "192.168.1.2", "192.168.1.10");
+	munit_assert_false(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "10.0.0.5", &entry));
+
+	chiaki_senkusha_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_expiry(const MunitParameter params[], void *user)
+{
+	ChiakiSenkushaCache cache;
+	ChiakiErrorCode err = chiaki_senkusha_cache_init(&cache);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_senkusha_cache_store(&cache, "192.168.1.2", "192.168.1.10", 1454, 1400, 2500);
+	munit_assert_size(cache.entries_count, ==, 1);
+
+	ChiakiSenkushaCacheEntry entry;
+	cache.entries[0].timestamp -= cache.validity_sec - 10;
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+
+	cache.entries[0].timestamp -= 20;
+	munit_assert_false(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+
+	// full cache replaces the oldest entry
+	for(size_t i=0; i<CHIAKI_SENKUSHA_CACHE_ENTRIES_MAX; i++)
+	{
+		char host[CHIAKI_SENKUSHA_CACHE_ADDR_SIZE];
+		snprintf(host, sizeof(host), "10.0.1.%u", (unsigned int)i);
+		chiaki_senkusha_cache_store(&cache, host, "10.0.0.5", 1454, 1454, 1000);
+	}
+	munit_assert_size(cache.entries_count, ==, CHIAKI_SENKUSHA_CACHE_ENTRIES_MAX);
+	munit_assert_false(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "10.0.1.0", "10.0.0.5", &entry));
+
+	chiaki_senkusha_cache_fini(&cache);
+	return MUNIT_OK;
+}
+
+static MunitResult test_persist(const MunitParameter params[], void *user)
+{
+	remove(TEST_FILENAME);
+
+	ChiakiSenkushaCache cache;
+	ChiakiErrorCode err = chiaki_senkusha_cache_init(&cache);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// not existing yet is fine
+	err = chiaki_senkusha_cache_load(&cache, TEST_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(cache.entries_count, ==, 0);
+
+	chiaki_senkusha_cache_store(&cache, "192.168.1.2", "192.168.1.10", 1454, 1400, 2500);
+	chiaki_senkusha_cache_store(&cache, "fe80::1", "fe80::2", 1280, 1280, 900);
+	chiaki_senkusha_cache_store(&cache, "192.168.1.3", "192.168.1.10", 1454, 1454, 1000);
+	cache.entries[2].timestamp = 0; // expired, not saved
+
+	err = chiaki_senkusha_cache_save(&cache, TEST_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_senkusha_cache_fini(&cache);
+
+	err = chiaki_senkusha_cache_init(&cache);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_senkusha_cache_load(&cache, TEST_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(cache.entries_count, ==, 2);
+
+	ChiakiSenkushaCacheEntry entry;
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "192.168.1.2", "192.168.1.10", &entry));
+	munit_assert_uint32(entry.mtu_in, ==, 1454);
+	munit_assert_uint32(entry.mtu_out, ==, 1400);
+	munit_assert_uint64(entry.rtt_us, ==, 2500);
+	munit_assert_true(chiaki_senkusha_cache_lookup(&cache, "fe80::1", "fe80::2", &entry));
+	munit_assert_uint32(entry.mtu_in, ==, 1280);
+	munit_assert_false(chiaki_senkusha_cache_lookup(&cache, "192.168.1.3", "192.168.1.10", &entry));
+	chiaki_senkusha_cache_fini(&cache);
+
+	FILE *f = fopen(TEST_FILENAME, "w");
+	munit_assert_not_null(f);
+	fputs("something else\n", f);
+	fclose(f);
+
+	err = chiaki_senkusha_cache_init(&cache);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_senkusha_cache_load(&cache, TEST_FILENAME);
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+	munit_assert_size(cache.entries_count, ==, 0);
+	chiaki_senkusha_cache_fini(&cache);
+
+	remove(TEST_FILENAME);
+	return MUNIT_OK;
+}
+
+MunitTest tests_senkusha_cache[] = {
+	{
+		"/lookup",
+		test_lookup,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/expiry",
+		test_expiry,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/persist",
+		test_persist,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -136,6 +136,49 @@ static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32
 	}
 }
 
+static MunitResult test_av_packet_format_header(const MunitParameter params[], void *user)
+{
+	for(int video=0; video<2; video++)
+	{
+		ChiakiTakionAVPacket packet = { 0 };
+		packet.is_video = video;
+		packet.packet_index = 1337;
+		packet.frame_index = 42;
+		packet.unit_index = video ? 0x123 : 0x12;
+		packet.units_in_frame_total = video ? 0x200 : 0x20;
+		packet.units_in_frame_fec = video ? 0x56 : 0x5011;
+		packet.codec = video ? 3 : 5;
+		packet.word_at_0x18 = video ? 0x367 : 0;
+		packet.adaptive_stream_index = video ? 2 : 0;
+		packet.key_pos = 0x12345678;
+
+		uint8_t buf[0x40];
+		size_t header_size;
+		ChiakiErrorCode err = chiaki_takion_v9_av_packet_format_header(buf, sizeof(buf), &header_size, &packet);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		memset(buf + header_size, 0xab, sizeof(buf) - header_size);
+
+		ChiakiTakionAVPacket parsed;
+		err = chiaki_takion_v9_av_packet_parse(&parsed, buf, sizeof(buf));
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		munit_assert(parsed.is_video == packet.is_video);
+		munit_assert_uint16(parsed.packet_index, ==, packet.packet_index);
+		munit_assert_uint16(parsed.frame_index, ==, packet.frame_index);
+		munit_assert_uint16(parsed.unit_index, ==, packet.unit_index);
+		munit_assert_uint16(parsed.units_in_frame_total, ==, packet.units_in_frame_total);
+		munit_assert_uint16(parsed.units_in_frame_fec, ==, packet.units_in_frame_fec);
+		munit_assert_uint8(parsed.codec, ==, packet.codec);
+		munit_assert_uint16(parsed.word_at_0x18, ==, packet.word_at_0x18);
+		munit_assert_uint8(parsed.adaptive_stream_index, ==, packet.adaptive_stream_index);
+		munit_assert_uint32(parsed.key_pos, ==, packet.key_pos);
+		munit_assert_ptr_equal(parsed.data, buf + header_size);
+		munit_assert_size(parsed.data_size, ==, sizeof(buf) - header_size);
+	}
+
+	return MUNIT_OK;
+}
+
 static MunitResult test_takion_send_buffer(const MunitParameter params[], void *user)
 {
 #define nums_count 0x30
@@ -149,11 +192,11 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 
 	for(size_t i=0; i<nums_count; i++)
 	{
-		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], malloc(8), 8);
+		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], chiaki_malloc(8), 8);
 		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	}
 
-	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], malloc(8), 8);
+	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], chiaki_malloc(8), 8);
 	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
 
 	size_t nums_count_cur = nums_count;
@@ -172,6 +215,52 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 #undef nums_count
 }
 
+static MunitResult test_kernel_drops(const MunitParameter params[], void *user)
+{
+	uint64_t total = 0;
+	uint32_t last = 0;
+
+	munit_assert_uint32(chiaki_takion_kernel_drops_accumulate(&total, &last, 0), ==, 0);
+	munit_assert_uint64(total, ==, 0);
+	munit_assert_uint32(chiaki_takion_kernel_drops_accumulate(&total, &last, 10), ==, 10);
+	munit_assert_uint32(chiaki_takion_kernel_drops_accumulate(&total, &last, 10), ==, 0);
+	munit_assert_uint64(total, ==, 10);
+
+	// 32-bit counter of the kernel wraps around
+	munit_assert_uint32(chiaki_takion_kernel_drops_accumulate(&total, &last, 0xfffffff0), ==, 0xfffffff0 - 10);
+	munit_assert_uint32(chiaki_takion_kernel_drops_accumulate(&total, &last, 5), ==, 0x15);
+	munit_assert_uint32(last, ==, 5);
+	munit_assert_uint64(total, ==, 0x100000005ULL);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_rcvbuf_grow(const MunitParameter params[], void *user)
+{
+	int requested = 0x19000;
+	munit_assert_true(chiaki_takion_rcvbuf_grow(&requested));
+	munit_assert_int(requested, ==, 0x32000);
+
+	unsigned int grows = 1;
+	while(chiaki_takion_rcvbuf_grow(&requested))
+	{
+		munit_assert_int(requested, <, CHIAKI_TAKION_RCVBUF_MAX);
+		grows++;
+	}
+	grows++;
+	munit_assert_int(requested, ==, CHIAKI_TAKION_RCVBUF_MAX);
+	munit_assert_uint(grows, ==, 7);
+
+	// never beyond the max, also if the initial size was already larger
+	munit_assert_false(chiaki_takion_rcvbuf_grow(&requested));
+	munit_assert_int(requested, ==, CHIAKI_TAKION_RCVBUF_MAX);
+	requested = CHIAKI_TAKION_RCVBUF_MAX + 1;
+	munit_assert_false(chiaki_takion_rcvbuf_grow(&requested));
+	munit_assert_int(requested, ==, CHIAKI_TAKION_RCVBUF_MAX);
+
+	return MUNIT_OK;
+}
+
 
 
 MunitTest tests_takion[] = {
@@ -191,6 +280,14 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/av_packet_format_header",
+		test_av_packet_format_header,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{
 		"/send_buffer",
 		test_takion_send_buffer,
@@ -199,5 +296,21 @@ MunitTest tests_takion[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/kernel_drops",
+		test_kernel_drops,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/rcvbuf_grow",
+		test_rcvbuf_grow,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
@@ -0,0 +1,237 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <munit.h>
+
+#include <chiaki/thread.h>
+
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+static MunitResult test_attr_parse(const MunitParameter params[], void *user)
+{
+	ChiakiThreadAttr attr;
+
+	ChiakiErrorCode err = chiaki_thread_attr_parse(&attr, "default");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(chiaki_thread_attr_is_default(&attr));
+
+	err = chiaki_thread_attr_parse(&attr, "high:4-7");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(attr.priority, ==, CHIAKI_THREAD_PRIORITY_HIGH);
+	munit_assert_int(attr.realtime_priority, ==, 0);
+	munit_assert_uint64(attr.cpu_affinity, ==, 0xf0);
+
+	err = chiaki_thread_attr_parse(&attr, "realtime=20:2,3,63");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(attr.priority, ==, CHIAKI_THREAD_PRIORITY_REALTIME);
+	munit_assert_int(attr.realtime_priority, ==, 20);
+	munit_assert_uint64(attr.cpu_affinity, ==, 0x800000000000000cull);
+
+	err = chiaki_thread_attr_parse(&attr, "low");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(attr.priority, ==, CHIAKI_THREAD_PRIORITY_LOW);
+	munit_assert_uint64(attr.cpu_affinity, ==, 0);
+
+	static const char * const invalid[] = {
+		"", "highest", "high=20", "realtime=", "realtime=100", "low:", "low:3-1", "low:64", "low:1,", "low:1;2"
+	};
+	for(size_t i=0; i<sizeof(invalid) / sizeof(invalid[0]); i++)
+	{
+		err = chiaki_thread_attr_parse(&attr, invalid[i]);
+		munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+	}
+
+	return MUNIT_OK;
+}
+
+#ifdef __linux__
+typedef struct attr_result_t
+{
+	int nice;
+	int cpu;
+	bool cpu_allowed_only;
+} AttrResult;
+
+static void *attr_thread_func(void *user)
+{
+	AttrResult *result = user;
+	result->nice = getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid));
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	result->cpu_allowed_only = sched_getaffinity(0, sizeof(set), &set) == 0
+		&& CPU_COUNT(&set) == 1 && CPU_ISSET(result->cpu, &set);
+	return NULL;
+}
+#endif
+
+static MunitResult test_create_attr(const MunitParameter params[], void *user)
+{
+#ifdef __linux__
+	// lowering the priority and restricting to an allowed cpu is always permitted
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(sched_getaffinity(0, sizeof(set), &set) != 0)
+		return MUNIT_SKIP;
+	int cpu = -1;
+	for(int i=0; i<64; i++)
+	{
+		if(CPU_ISSET(i, &set))
+		{
+			cpu = i;
+			break;
+		}
+	}
+	if(cpu < 0)
+		return MUNIT_SKIP;
+	int nice_before = getpriority(PRIO_PROCESS, 0);
+	if(nice_before >= 10) // already lower than CHIAKI_THREAD_PRIORITY_LOW
+		return MUNIT_SKIP;
+
+	ChiakiThreadAttr attr = { 0 };
+	attr.priority = CHIAKI_THREAD_PRIORITY_LOW;
+	attr.cpu_affinity = 1ull << cpu;
+
+	AttrResult result = { 0 };
+	result.cpu = cpu;
+	ChiakiThread thread;
+	ChiakiErrorCode err = chiaki_thread_create_attr(&thread, attr_thread_func, &result, &attr, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_thread_join(&thread, NULL);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	munit_assert(result.cpu_allowed_only);
+	munit_assert_int(result.nice, >, nice_before);
+
+	// the creating thread is untouched
+	munit_assert_int(getpriority(PRIO_PROCESS, 0), ==, nice_before);
+	return MUNIT_OK;
+#else
+	return MUNIT_SKIP;
+#endif
+}
+
+static void *lock_thread_func(void *user)
+{
+	ChiakiMutex *mutex = user;
+	chiaki_mutex_lock(mutex);
+	chiaki_mutex_unlock(mutex);
+	return NULL;
+}
+
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+static const ChiakiMutexProfileStats *find_profile_stats(const ChiakiMutexProfileStats *stats, size_t count, const char *name)
+{
+	for(size_t i=0; i<count; i++)
+	{
+		if(strcmp(stats[i].name, name) == 0)
+			return &stats[i];
+	}
+	return NULL;
+}
+#endif
+
+static MunitResult test_mutex_profile(const MunitParameter params[], void *user)
+{
+	chiaki_mutex_profile_reset();
+
+	ChiakiMutex mutex;
+	ChiakiErrorCode err = chiaki_mutex_init(&mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_set_name(&mutex, "test_contended");
+
+	ChiakiMutex sleep_mutex;
+	err = chiaki_mutex_init(&sleep_mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_set_name(&sleep_mutex, "test_sleep");
+	ChiakiCond sleep_cond;
+	err = chiaki_cond_init(&sleep_cond);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// hold mutex for 100ms while another thread tries to lock it
+	chiaki_mutex_lock(&mutex);
+	ChiakiThread thread;
+	err = chiaki_thread_create(&thread, lock_thread_func, &mutex);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_lock(&sleep_mutex);
+	chiaki_cond_timedwait(&sleep_cond, &sleep_mutex, 100);
+	chiaki_mutex_unlock(&sleep_mutex);
+	chiaki_mutex_unlock(&mutex);
+	chiaki_thread_join(&thread, NULL);
+
+	ChiakiMutexProfileStats stats[CHIAKI_MUTEX_PROFILE_NAMES_MAX + 1];
+	size_t count = chiaki_mutex_profile_get(stats, CHIAKI_MUTEX_PROFILE_NAMES_MAX + 1);
+#if CHIAKI_LIB_ENABLE_MUTEX_PROFILING
+	const ChiakiMutexProfileStats *contended = find_profile_stats(stats, count, "test_contended");
+	munit_assert_not_null(contended);
+	munit_assert_uint64(contended->acquisitions, ==, 2);
+	munit_assert_uint64(contended->contended, ==, 1);
+	munit_assert_uint64(contended->wait_ns, >, 0);
+	munit_assert_uint64(contended->hold_max_ns, >=, 90 * 1000000);
+
+	// the time in the condition wait does not count as held
+	const ChiakiMutexProfileStats *sleep = find_profile_stats(stats, count, "test_sleep");
+	munit_assert_not_null(sleep);
+	munit_assert_uint64(sleep->acquisitions, ==, 2);
+	munit_assert_uint64(sleep->contended, ==, 0);
+	munit_assert_uint64(sleep->hold_max_ns, <, 50 * 1000000);
+#else
+	munit_assert_size(count, ==, 0);
+#endif
+
+	chiaki_cond_fini(&sleep_cond);
+	chiaki_mutex_fini(&sleep_mutex);
+	chiaki_mutex_fini(&mutex);
+	return MUNIT_OK;
+}
+
+MunitTest tests_thread[] = {
+	{
+		"/attr_parse",
+		test_attr_parse,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/create_attr",
+		test_create_attr,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/mutex_profile",
+		test_mutex_profile,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};